@@ -0,0 +1,803 @@
+#include <stdlib.h>
+#include <string.h>
+#include "cluster.h"
+#include "point_cluster.h"
+#include "spatial_index.h"
+#include "sql.h"
+#include "strbuf.h"
+
+#define N NULL_VALUE
+
+#define CLUSTER_PHASE_ORDER 0
+#define CLUSTER_PHASE_COPY 1
+
+static column_info_t udbx_cluster_state_columns[] = {
+  {"table_name", "TEXT", N, SQL_NOT_NULL | SQL_PRIMARY_KEY, NULL},
+  {"column_name", "TEXT", N, SQL_NOT_NULL, NULL},
+  {"id_column_name", "TEXT", N, SQL_NOT_NULL, NULL},
+  {"phase", "INTEGER", N, SQL_NOT_NULL, NULL},
+  {"last_key", "INTEGER", N, SQL_NOT_NULL, NULL},
+  {"last_id", "INTEGER", N, SQL_NOT_NULL, NULL},
+  {"copied", "INTEGER", N, SQL_NOT_NULL, NULL},
+  {"min_x", "DOUBLE", N, SQL_NOT_NULL, NULL},
+  {"min_y", "DOUBLE", N, SQL_NOT_NULL, NULL},
+  {"max_x", "DOUBLE", N, SQL_NOT_NULL, NULL},
+  {"max_y", "DOUBLE", N, SQL_NOT_NULL, NULL},
+  {NULL, NULL, N, 0, NULL}
+};
+static table_info_t udbx_cluster_state = {
+  "udbx_cluster_state",
+  udbx_cluster_state_columns,
+  NULL, 0
+};
+
+static column_info_t udbx_cluster_map_columns[] = {
+  {"table_name", "TEXT", N, SQL_NOT_NULL | SQL_PRIMARY_KEY, NULL},
+  {"old_id", "INTEGER", N, SQL_NOT_NULL | SQL_PRIMARY_KEY, NULL},
+  {"new_id", "INTEGER", N, SQL_NOT_NULL, NULL},
+  {NULL, NULL, N, 0, NULL}
+};
+static table_info_t udbx_cluster_map = {
+  "udbx_cluster_map",
+  udbx_cluster_map_columns,
+  NULL, 0
+};
+
+typedef struct {
+  int found;
+  char *column_name;
+  char *id_column_name;
+  int phase;
+  sqlite3_int64 last_key;
+  sqlite3_int64 last_id;
+  sqlite3_int64 copied;
+  double extent[4];
+} cluster_state_t;
+
+typedef struct {
+  int pk_count;
+  char *id_column_name;
+  strbuf_t columns;
+} cluster_columns_t;
+
+typedef struct {
+  int count;
+  int capacity;
+  char **items;
+} string_list_t;
+
+static int string_list_add(string_list_t *list, const char *value) {
+  char *copy;
+
+  if (list->count == list->capacity) {
+    int capacity = list->capacity == 0 ? 8 : list->capacity * 2;
+    char **items = (char **)sqlite3_realloc(list->items, capacity * (int)sizeof(char *));
+    if (items == NULL) {
+      return SQLITE_NOMEM;
+    }
+    list->items = items;
+    list->capacity = capacity;
+  }
+
+  copy = sqlite3_mprintf("%s", value == NULL ? "" : value);
+  if (copy == NULL) {
+    return SQLITE_NOMEM;
+  }
+  list->items[list->count++] = copy;
+  return SQLITE_OK;
+}
+
+static void string_list_destroy(string_list_t *list) {
+  int i;
+  for (i = 0; i < list->count; i++) {
+    sqlite3_free(list->items[i]);
+  }
+  sqlite3_free(list->items);
+  memset(list, 0, sizeof(string_list_t));
+}
+
+static int read_state_row(sqlite3 *db, sqlite3_stmt *stmt, void *data) {
+  cluster_state_t *state = (cluster_state_t *)data;
+  int i;
+
+  state->column_name = sqlite3_mprintf("%s", sqlite3_column_text(stmt, 0));
+  state->id_column_name = sqlite3_mprintf("%s", sqlite3_column_text(stmt, 1));
+  if (state->column_name == NULL || state->id_column_name == NULL) {
+    return SQLITE_NOMEM;
+  }
+  state->phase = sqlite3_column_int(stmt, 2);
+  state->last_key = sqlite3_column_int64(stmt, 3);
+  state->last_id = sqlite3_column_int64(stmt, 4);
+  state->copied = sqlite3_column_int64(stmt, 5);
+  for (i = 0; i < 4; i++) {
+    state->extent[i] = sqlite3_column_double(stmt, 6 + i);
+  }
+  state->found = 1;
+  return SQLITE_ABORT;
+}
+
+static int read_extent_row(sqlite3 *db, sqlite3_stmt *stmt, void *data) {
+  cluster_state_t *state = (cluster_state_t *)data;
+  int i;
+  for (i = 0; i < 4; i++) {
+    state->extent[i] = sqlite3_column_type(stmt, i) == SQLITE_NULL ? 0.0 : sqlite3_column_double(stmt, i);
+  }
+  return SQLITE_ABORT;
+}
+
+static int read_column_row(sqlite3 *db, sqlite3_stmt *stmt, void *data) {
+  cluster_columns_t *columns = (cluster_columns_t *)data;
+  const char *name = (const char *)sqlite3_column_text(stmt, 1);
+  const char *type = (const char *)sqlite3_column_text(stmt, 2);
+
+  if (sqlite3_column_int(stmt, 5) > 0) {
+    columns->pk_count++;
+    if (type != NULL && sqlite3_stricmp(type, "INTEGER") == 0) {
+      sqlite3_free(columns->id_column_name);
+      columns->id_column_name = sqlite3_mprintf("%s", name);
+      return columns->id_column_name == NULL ? SQLITE_NOMEM : SQLITE_OK;
+    }
+  }
+
+  return strbuf_append(&columns->columns, ", \"%w\"", name);
+}
+
+static int read_string_row(sqlite3 *db, sqlite3_stmt *stmt, void *data) {
+  return string_list_add((string_list_t *)data, (const char *)sqlite3_column_text(stmt, 0));
+}
+
+static int read_string_pair_row(sqlite3 *db, sqlite3_stmt *stmt, void *data) {
+  string_list_t *list = (string_list_t *)data;
+  int result = string_list_add(list, (const char *)sqlite3_column_text(stmt, 0));
+  if (result == SQLITE_OK) {
+    result = string_list_add(list, (const char *)sqlite3_column_text(stmt, 1));
+  }
+  return result;
+}
+
+typedef struct {
+  const char *table_name;
+  int found;
+} cluster_reference_t;
+
+static int read_foreign_key_row(sqlite3 *db, sqlite3_stmt *stmt, void *data) {
+  cluster_reference_t *reference = (cluster_reference_t *)data;
+  const char *parent = (const char *)sqlite3_column_text(stmt, 2);
+  if (parent != NULL && sqlite3_stricmp(parent, reference->table_name) == 0) {
+    reference->found = 1;
+    return SQLITE_ABORT;
+  }
+  return SQLITE_OK;
+}
+
+/*
+ * Clustering renumbers the primary keys, which silently breaks anything that stores them. Reports an error when the
+ * keys are referenced by a declared foreign key, by row level metadata in gpkg_metadata_reference or by a related
+ * tables mapping in gpkgext_relations. References kept by applications without a declared foreign key can not be
+ * detected; they have to be updated from udbx_cluster_map.
+ */
+static int cluster_check_references(sqlite3 *db, const char *db_name, const char *table_name, errorstream_t *error) {
+  int result = SQLITE_OK;
+  string_list_t tables;
+  cluster_reference_t reference;
+  int exists = 0;
+  int count = 0;
+  int i;
+
+  memset(&tables, 0, sizeof(string_list_t));
+  reference.table_name = table_name;
+  reference.found = 0;
+
+  result = sql_exec_stmt(db, read_string_row, NULL, &tables, "SELECT name FROM \"%w\".sqlite_master WHERE type = 'table'", db_name);
+  for (i = 0; result == SQLITE_OK && i < tables.count; i++) {
+    result = sql_exec_stmt(db, read_foreign_key_row, NULL, &reference, "PRAGMA \"%w\".foreign_key_list(\"%w\")", db_name, tables.items[i]);
+    if (result == SQLITE_OK && reference.found) {
+      error_append(error, "Table %s.%s can not be clustered: its primary keys would be renumbered and table %s has a foreign key to it", db_name, table_name, tables.items[i]);
+      goto exit;
+    }
+  }
+  if (result != SQLITE_OK) {
+    error_append(error, "Could not read foreign keys of %s: %s", db_name, sqlite3_errmsg(db));
+    goto exit;
+  }
+
+  result = sql_check_table_exists(db, db_name, "gpkg_metadata_reference", &exists);
+  if (result == SQLITE_OK && exists) {
+    result = sql_exec_for_int(
+               db, &count,
+               "SELECT count(*) FROM \"%w\".gpkg_metadata_reference WHERE table_name = %Q COLLATE NOCASE AND row_id_value IS NOT NULL",
+               db_name, table_name
+             );
+  }
+  if (result != SQLITE_OK) {
+    error_append(error, "Could not read %s.gpkg_metadata_reference: %s", db_name, sqlite3_errmsg(db));
+    goto exit;
+  }
+  if (count > 0) {
+    error_append(error, "Table %s.%s can not be clustered: its primary keys would be renumbered and gpkg_metadata_reference refers to %d of its rows", db_name, table_name, count);
+    goto exit;
+  }
+
+  result = sql_check_table_exists(db, db_name, "gpkgext_relations", &exists);
+  if (result == SQLITE_OK && exists) {
+    result = sql_exec_for_int(
+               db, &count,
+               "SELECT count(*) FROM \"%w\".gpkgext_relations WHERE base_table_name = %Q COLLATE NOCASE OR related_table_name = %Q COLLATE NOCASE",
+               db_name, table_name, table_name
+             );
+  }
+  if (result != SQLITE_OK) {
+    error_append(error, "Could not read %s.gpkgext_relations: %s", db_name, sqlite3_errmsg(db));
+    goto exit;
+  }
+  if (count > 0) {
+    error_append(error, "Table %s.%s can not be clustered: its primary keys would be renumbered and it is part of a related tables mapping", db_name, table_name);
+  }
+
+exit:
+  string_list_destroy(&tables);
+  return result;
+}
+
+static int cluster_save_state(sqlite3 *db, const char *db_name, const char *table_name, const cluster_state_t *state) {
+  return sql_exec(
+           db,
+           "UPDATE \"%w\".\"%w\" SET phase = %d, last_key = %lld, last_id = %lld, copied = %lld WHERE table_name = %Q",
+           db_name, udbx_cluster_state.name, state->phase, state->last_key, state->last_id, state->copied, table_name
+         );
+}
+
+static int cluster_read_columns(sqlite3 *db, const char *db_name, const char *table_name, cluster_columns_t *columns, errorstream_t *error) {
+  int result = sql_exec_stmt(db, read_column_row, NULL, columns, "PRAGMA \"%w\".table_info(\"%w\")", db_name, table_name);
+  if (result != SQLITE_OK) {
+    error_append(error, "Could not read columns of %s.%s: %s", db_name, table_name, sqlite3_errmsg(db));
+    return result;
+  }
+
+  if (columns->pk_count != 1 || columns->id_column_name == NULL) {
+    error_append(error, "Table %s.%s must have a single INTEGER PRIMARY KEY column to be clustered", db_name, table_name);
+  }
+  return result;
+}
+
+/*
+ * Records the clustering state and creates the work tables: udbx_cluster_<table> holds (key, id) pairs in curve order
+ * and udbx_cluster_<table>_data receives the rewritten rows. Keys start at -1 for empty geometries so -2 lies before
+ * every key.
+ */
+static int cluster_init(sqlite3 *db, const char *db_name, const char *table_name, const char *column_name, cluster_state_t *state, errorstream_t *error) {
+  int result = SQLITE_OK;
+  cluster_columns_t columns;
+  char *table_sql = NULL;
+  const char *body;
+  int exists = 0;
+  int mapped = 0;
+
+  memset(&columns, 0, sizeof(cluster_columns_t));
+  result = strbuf_init(&columns.columns, 256);
+  if (result != SQLITE_OK) {
+    goto exit;
+  }
+
+  result = sql_check_column_exists(db, db_name, table_name, column_name, &exists);
+  if (result != SQLITE_OK) {
+    error_append(error, "Could not check if column %s.%s.%s exists: %s", db_name, table_name, column_name, sqlite3_errmsg(db));
+    goto exit;
+  }
+
+  if (!exists) {
+    error_append(error, "Column %s.%s.%s does not exist", db_name, table_name, column_name);
+    goto exit;
+  }
+
+  result = cluster_read_columns(db, db_name, table_name, &columns, error);
+  if (result != SQLITE_OK || error_count(error) > 0) {
+    goto exit;
+  }
+
+  result = cluster_check_references(db, db_name, table_name, error);
+  if (result != SQLITE_OK || error_count(error) > 0) {
+    goto exit;
+  }
+
+  // The map keys on the old ids, so a second run would mix up the keys of both runs
+  result = sql_exec_for_int(db, &mapped, "SELECT count(*) FROM \"%w\".\"%w\" WHERE table_name = %Q", db_name, udbx_cluster_map.name, table_name);
+  if (result != SQLITE_OK) {
+    error_append(error, "Could not read %s.%s: %s", db_name, udbx_cluster_map.name, sqlite3_errmsg(db));
+    goto exit;
+  }
+  if (mapped > 0) {
+    error_append(error, "Table %s.%s has already been clustered; delete its rows from %s once the old primary keys are no longer needed to cluster it again", db_name, table_name, udbx_cluster_map.name);
+    goto exit;
+  }
+
+  result = sql_exec_for_string(db, &table_sql, "SELECT sql FROM \"%w\".sqlite_master WHERE type = 'table' AND tbl_name = %Q", db_name, table_name);
+  if (result != SQLITE_OK) {
+    error_append(error, "Could not read definition of %s.%s: %s", db_name, table_name, sqlite3_errmsg(db));
+    goto exit;
+  }
+
+  body = table_sql == NULL ? NULL : strchr(table_sql, '(');
+  if (body == NULL) {
+    error_append(error, "Could not parse definition of %s.%s", db_name, table_name);
+    goto exit;
+  }
+
+  result = sql_exec_stmt(
+             db, read_extent_row, NULL, state,
+             "SELECT min(ST_MinX(\"%w\")), min(ST_MinY(\"%w\")), max(ST_MaxX(\"%w\")), max(ST_MaxY(\"%w\")) FROM \"%w\".\"%w\"",
+             column_name, column_name, column_name, column_name, db_name, table_name
+           );
+  if (result != SQLITE_OK) {
+    error_append(error, "Could not compute extent of %s.%s.%s: %s", db_name, table_name, column_name, sqlite3_errmsg(db));
+    goto exit;
+  }
+
+  result = sql_exec(
+             db,
+             "INSERT INTO \"%w\".\"%w\" (table_name, column_name, id_column_name, phase, last_key, last_id, copied, min_x, min_y, max_x, max_y)"
+             " VALUES (%Q, %Q, %Q, %d, -2, 0, 0, %!.17g, %!.17g, %!.17g, %!.17g)",
+             db_name, udbx_cluster_state.name, table_name, column_name, columns.id_column_name, CLUSTER_PHASE_ORDER,
+             state->extent[0], state->extent[1], state->extent[2], state->extent[3]
+           );
+  if (result != SQLITE_OK) {
+    error_append(error, "Could not record clustering state: %s", sqlite3_errmsg(db));
+    goto exit;
+  }
+
+  result = sql_exec(db, "CREATE TABLE \"%w\".\"udbx_cluster_%w\" (key INTEGER NOT NULL, id INTEGER NOT NULL, PRIMARY KEY (key, id)) WITHOUT ROWID", db_name, table_name);
+  if (result == SQLITE_OK) {
+    result = sql_exec(db, "CREATE TABLE \"%w\".\"udbx_cluster_%w_data\" %s", db_name, table_name, body);
+  }
+  if (result != SQLITE_OK) {
+    error_append(error, "Could not create clustering work tables for %s.%s: %s", db_name, table_name, sqlite3_errmsg(db));
+    goto exit;
+  }
+
+  // Rows written while the copy is in progress would be lost by the final swap
+  result = sql_exec(
+             db,
+             "CREATE TRIGGER \"%w\".\"udbx_cluster_%w_guard_insert\" BEFORE INSERT ON \"%w\"\n"
+             "BEGIN\n"
+             "  SELECT RAISE(ABORT, 'table is being clustered');\n"
+             "END;",
+             db_name, table_name, table_name
+           );
+  if (result == SQLITE_OK) {
+    result = sql_exec(
+               db,
+               "CREATE TRIGGER \"%w\".\"udbx_cluster_%w_guard_update\" BEFORE UPDATE ON \"%w\"\n"
+               "BEGIN\n"
+               "  SELECT RAISE(ABORT, 'table is being clustered');\n"
+               "END;",
+               db_name, table_name, table_name
+             );
+  }
+  if (result == SQLITE_OK) {
+    result = sql_exec(
+               db,
+               "CREATE TRIGGER \"%w\".\"udbx_cluster_%w_guard_delete\" BEFORE DELETE ON \"%w\"\n"
+               "BEGIN\n"
+               "  SELECT RAISE(ABORT, 'table is being clustered');\n"
+               "END;",
+               db_name, table_name, table_name
+             );
+  }
+  if (result != SQLITE_OK) {
+    error_append(error, "Could not create clustering guard triggers for %s.%s: %s", db_name, table_name, sqlite3_errmsg(db));
+    goto exit;
+  }
+
+exit:
+  sqlite3_free(table_sql);
+  sqlite3_free(columns.id_column_name);
+  strbuf_destroy(&columns.columns);
+  return result;
+}
+
+static int cluster_order_step(sqlite3 *db, const char *db_name, const char *table_name, cluster_state_t *state, int batch_size, errorstream_t *error) {
+  int result = SQLITE_OK;
+  sqlite3_int64 upper = 0;
+  char *upper_sql = NULL;
+
+  // Ids are walked in rowid order so each batch is a cheap range scan of the table b-tree
+  upper_sql = sqlite3_mprintf(
+                "SELECT max(\"%w\") FROM (SELECT \"%w\" FROM \"%w\".\"%w\" WHERE \"%w\" > %lld ORDER BY \"%w\" LIMIT %d)",
+                state->id_column_name, state->id_column_name, db_name, table_name, state->id_column_name, state->last_id, state->id_column_name, batch_size
+              );
+  if (upper_sql == NULL) {
+    result = SQLITE_NOMEM;
+    goto exit;
+  } else {
+    sqlite3_stmt *stmt = NULL;
+    result = sql_init_stmt(&stmt, db, upper_sql);
+    if (result == SQLITE_OK) {
+      result = sqlite3_step(stmt);
+      if (result == SQLITE_ROW) {
+        if (sqlite3_column_type(stmt, 0) == SQLITE_NULL) {
+          state->phase = CLUSTER_PHASE_COPY;
+        } else {
+          upper = sqlite3_column_int64(stmt, 0);
+        }
+        result = SQLITE_OK;
+      }
+      sqlite3_finalize(stmt);
+    }
+  }
+  if (result != SQLITE_OK) {
+    error_append(error, "Could not read ids of %s.%s: %s", db_name, table_name, sqlite3_errmsg(db));
+    goto exit;
+  }
+
+  if (state->phase == CLUSTER_PHASE_ORDER) {
+    result = sql_exec(
+               db,
+               "INSERT INTO \"%w\".\"udbx_cluster_%w\" (key, id)"
+               " SELECT IFNULL(ST_HilbertKey(\"%w\", %!.17g, %!.17g, %!.17g, %!.17g), -1), \"%w\" FROM \"%w\".\"%w\" WHERE \"%w\" > %lld AND \"%w\" <= %lld",
+               db_name, table_name,
+               state->column_name, state->extent[0], state->extent[1], state->extent[2], state->extent[3], state->id_column_name,
+               db_name, table_name, state->id_column_name, state->last_id, state->id_column_name, upper
+             );
+    if (result != SQLITE_OK) {
+      error_append(error, "Could not compute curve keys of %s.%s: %s", db_name, table_name, sqlite3_errmsg(db));
+      goto exit;
+    }
+    state->last_id = upper;
+  } else {
+    state->last_id = 0;
+  }
+
+  result = cluster_save_state(db, db_name, table_name, state);
+  if (result != SQLITE_OK) {
+    error_append(error, "Could not record clustering state: %s", sqlite3_errmsg(db));
+  }
+
+exit:
+  sqlite3_free(upper_sql);
+  return result;
+}
+
+static int cluster_copy_step(sqlite3 *db, const char *db_name, const char *table_name, cluster_state_t *state, int batch_size, int *copied, errorstream_t *error) {
+  int result = SQLITE_OK;
+  cluster_columns_t columns;
+  char *sql = NULL;
+  sqlite3_stmt *order_stmt = NULL;
+  sqlite3_stmt *copy_stmt = NULL;
+  sqlite3_stmt *map_stmt = NULL;
+
+  *copied = 0;
+  memset(&columns, 0, sizeof(cluster_columns_t));
+  result = strbuf_init(&columns.columns, 256);
+  if (result != SQLITE_OK) {
+    goto exit;
+  }
+
+  result = cluster_read_columns(db, db_name, table_name, &columns, error);
+  if (result != SQLITE_OK || error_count(error) > 0) {
+    goto exit;
+  }
+
+  sql = sqlite3_mprintf(
+          "SELECT key, id FROM \"%w\".\"udbx_cluster_%w\" WHERE key >= ?1 AND NOT (key = ?1 AND id <= ?2) ORDER BY key, id LIMIT ?3",
+          db_name, table_name
+        );
+  if (sql == NULL) {
+    result = SQLITE_NOMEM;
+    goto exit;
+  }
+  result = sql_init_stmt(&order_stmt, db, sql);
+  sqlite3_free(sql);
+  if (result != SQLITE_OK) {
+    goto exit;
+  }
+
+  sql = sqlite3_mprintf(
+          "INSERT INTO \"%w\".\"udbx_cluster_%w_data\" (\"%w\"%s) SELECT ?1%s FROM \"%w\".\"%w\" WHERE \"%w\" = ?2",
+          db_name, table_name, columns.id_column_name, strbuf_data_pointer(&columns.columns), strbuf_data_pointer(&columns.columns),
+          db_name, table_name, columns.id_column_name
+        );
+  if (sql == NULL) {
+    result = SQLITE_NOMEM;
+    goto exit;
+  }
+  result = sql_init_stmt(&copy_stmt, db, sql);
+  sqlite3_free(sql);
+  if (result != SQLITE_OK) {
+    goto exit;
+  }
+
+  sql = sqlite3_mprintf("INSERT OR REPLACE INTO \"%w\".\"%w\" (table_name, old_id, new_id) VALUES (?1, ?2, ?3)", db_name, udbx_cluster_map.name);
+  if (sql == NULL) {
+    result = SQLITE_NOMEM;
+    goto exit;
+  }
+  result = sql_init_stmt(&map_stmt, db, sql);
+  sqlite3_free(sql);
+  if (result != SQLITE_OK) {
+    goto exit;
+  }
+
+  sqlite3_bind_int64(order_stmt, 1, state->last_key);
+  sqlite3_bind_int64(order_stmt, 2, state->last_id);
+  sqlite3_bind_int(order_stmt, 3, batch_size);
+  sqlite3_bind_text(map_stmt, 1, table_name, -1, SQLITE_STATIC);
+
+  while ((result = sqlite3_step(order_stmt)) == SQLITE_ROW) {
+    sqlite3_int64 key = sqlite3_column_int64(order_stmt, 0);
+    sqlite3_int64 id = sqlite3_column_int64(order_stmt, 1);
+    sqlite3_int64 new_id = state->copied + 1;
+
+    sqlite3_bind_int64(copy_stmt, 1, new_id);
+    sqlite3_bind_int64(copy_stmt, 2, id);
+    result = sqlite3_step(copy_stmt);
+    sqlite3_reset(copy_stmt);
+    if (result != SQLITE_DONE) {
+      break;
+    }
+
+    sqlite3_bind_int64(map_stmt, 2, id);
+    sqlite3_bind_int64(map_stmt, 3, new_id);
+    result = sqlite3_step(map_stmt);
+    sqlite3_reset(map_stmt);
+    if (result != SQLITE_DONE) {
+      break;
+    }
+
+    state->last_key = key;
+    state->last_id = id;
+    state->copied = new_id;
+    (*copied)++;
+  }
+
+  if (result != SQLITE_DONE) {
+    error_append(error, "Could not copy rows of %s.%s: %s", db_name, table_name, sqlite3_errmsg(db));
+    goto exit;
+  }
+
+  result = cluster_save_state(db, db_name, table_name, state);
+  if (result != SQLITE_OK) {
+    error_append(error, "Could not record clustering state: %s", sqlite3_errmsg(db));
+  }
+
+exit:
+  sqlite3_finalize(order_stmt);
+  sqlite3_finalize(copy_stmt);
+  sqlite3_finalize(map_stmt);
+  sqlite3_free(columns.id_column_name);
+  strbuf_destroy(&columns.columns);
+  return result;
+}
+
+static int is_rtree_extension(const char *extension_name) {
+  return strcmp(extension_name, "gpkg_rtree_index") == 0 || strcmp(extension_name, "udbx_rtree_index_zm") == 0;
+}
+
+/*
+ * Replaces the table with its rewritten copy. The spatial indexes store the old ids, so they are dropped and rebuilt,
+ * and the cluster indexes, whose unclustered features also hold old ids, are marked stale. The remaining indexes and
+ * triggers of the table are recreated from their original SQL.
+ */
+static int cluster_swap(sqlite3 *db, const spatialdb_t *spatialdb, const char *db_name, const char *table_name, const cluster_state_t *state, errorstream_t *error) {
+  int result = SQLITE_OK;
+  string_list_t indexes;
+  string_list_t schema;
+  int *index_flags = NULL;
+  double *index_extents = NULL;
+  int legacy_alter_table = 0;
+  int exists = 0;
+  int i;
+
+  memset(&indexes, 0, sizeof(string_list_t));
+  memset(&schema, 0, sizeof(string_list_t));
+
+  // Other tables are not locked while the copy is in progress, so references may have been added since the start
+  result = cluster_check_references(db, db_name, table_name, error);
+  if (result != SQLITE_OK || error_count(error) > 0) {
+    goto exit;
+  }
+
+  result = sql_exec_stmt(
+             db, read_string_pair_row, NULL, &indexes,
+             "SELECT column_name, extension_name FROM \"%w\".gpkg_extensions WHERE table_name = %Q"
+             " AND extension_name IN ('gpkg_rtree_index', 'udbx_rtree_index_zm', 'udbx_sfc_index') ORDER BY column_name, extension_name",
+             db_name, table_name
+           );
+  if (result != SQLITE_OK) {
+    error_append(error, "Could not read spatial indexes of %s.%s: %s", db_name, table_name, sqlite3_errmsg(db));
+    goto exit;
+  }
+
+  if (indexes.count > 0) {
+    index_flags = (int *)sqlite3_malloc(indexes.count / 2 * (int)sizeof(int));
+    index_extents = (double *)sqlite3_malloc(indexes.count / 2 * 4 * (int)sizeof(double));
+    if (index_flags == NULL || index_extents == NULL) {
+      result = SQLITE_NOMEM;
+      goto exit;
+    }
+  }
+
+  for (i = 0; i < indexes.count; i += 2) {
+    const char *column_name = indexes.items[i];
+    const char *extension_name = indexes.items[i + 1];
+    int *flags = &index_flags[i / 2];
+    double *extent = &index_extents[i / 2 * 4];
+    char *index_table_name = NULL;
+
+    *flags = 0;
+    if (is_rtree_extension(extension_name)) {
+      index_table_name = sqlite3_mprintf("rtree_%s_%s", table_name, column_name);
+      if (index_table_name == NULL) {
+        result = SQLITE_NOMEM;
+        goto exit;
+      }
+      result = sql_check_column_exists(db, db_name, index_table_name, "minz", &exists);
+      if (result == SQLITE_OK && exists) {
+        *flags |= SPATIAL_INDEX_Z;
+      }
+      if (result == SQLITE_OK) {
+        result = sql_check_column_exists(db, db_name, index_table_name, "minm", &exists);
+      }
+      if (result == SQLITE_OK && exists) {
+        *flags |= SPATIAL_INDEX_M;
+      }
+      sqlite3_free(index_table_name);
+      if (result != SQLITE_OK) {
+        error_append(error, "Could not read spatial index of %s.%s.%s: %s", db_name, table_name, column_name, sqlite3_errmsg(db));
+        goto exit;
+      }
+
+      result = spatialdb->drop_spatial_index(db, db_name, table_name, column_name, error);
+    } else {
+      result = spatial_key_index_extent(db, db_name, table_name, column_name, extent, &exists);
+      if (result != SQLITE_OK) {
+        error_append(error, "Could not read spatial index of %s.%s.%s: %s", db_name, table_name, column_name, sqlite3_errmsg(db));
+        goto exit;
+      }
+      result = spatial_key_index_drop(db, db_name, table_name, column_name, error);
+    }
+    if (result != SQLITE_OK || error_count(error) > 0) {
+      goto exit;
+    }
+  }
+
+  result = sql_exec_stmt(
+             db, read_string_row, NULL, &schema,
+             "SELECT sql FROM \"%w\".sqlite_master WHERE tbl_name = %Q AND type IN ('index', 'trigger') AND sql NOTNULL"
+             " AND substr(name, 1, length(%Q)) <> %Q ORDER BY type, rowid",
+             db_name, table_name, "udbx_cluster_", "udbx_cluster_"
+           );
+  if (result != SQLITE_OK) {
+    error_append(error, "Could not read indexes and triggers of %s.%s: %s", db_name, table_name, sqlite3_errmsg(db));
+    goto exit;
+  }
+
+  // Since SQLite 3.26 a rename rechecks every view and trigger, which fails while the original table is gone
+  result = sql_exec_for_int(db, &legacy_alter_table, "PRAGMA legacy_alter_table");
+  if (result == SQLITE_OK) {
+    result = sql_exec(db, "DROP TABLE \"%w\".\"%w\"", db_name, table_name);
+  }
+  if (result == SQLITE_OK) {
+    result = sql_exec(db, "PRAGMA legacy_alter_table = ON");
+  }
+  if (result == SQLITE_OK) {
+    result = sql_exec(db, "ALTER TABLE \"%w\".\"udbx_cluster_%w_data\" RENAME TO \"%w\"", db_name, table_name, table_name);
+    sql_exec(db, "PRAGMA legacy_alter_table = %d", legacy_alter_table);
+  }
+  if (result != SQLITE_OK) {
+    error_append(error, "Could not replace %s.%s with its clustered copy: %s", db_name, table_name, sqlite3_errmsg(db));
+    goto exit;
+  }
+
+  for (i = 0; i < schema.count; i++) {
+    result = sql_exec(db, "%s", schema.items[i]);
+    if (result != SQLITE_OK) {
+      error_append(error, "Could not recreate %s: %s", schema.items[i], sqlite3_errmsg(db));
+      goto exit;
+    }
+  }
+
+  for (i = 0; i < indexes.count; i += 2) {
+    const char *column_name = indexes.items[i];
+    if (is_rtree_extension(indexes.items[i + 1])) {
+      result = spatialdb->create_spatial_index(db, db_name, table_name, column_name, state->id_column_name, index_flags[i / 2], error);
+    } else {
+      result = spatial_key_index_create(db, db_name, table_name, column_name, state->id_column_name, &index_extents[i / 2 * 4], error);
+    }
+    if (result != SQLITE_OK || error_count(error) > 0) {
+      goto exit;
+    }
+  }
+
+  result = point_cluster_index_invalidate(db, db_name, table_name, error);
+  if (result != SQLITE_OK) {
+    goto exit;
+  }
+
+  result = sql_exec(db, "DROP TABLE \"%w\".\"udbx_cluster_%w\"", db_name, table_name);
+  if (result == SQLITE_OK) {
+    result = sql_exec(db, "DELETE FROM \"%w\".\"%w\" WHERE table_name = %Q", db_name, udbx_cluster_state.name, table_name);
+  }
+  if (result != SQLITE_OK) {
+    error_append(error, "Could not remove clustering work tables of %s.%s: %s", db_name, table_name, sqlite3_errmsg(db));
+  }
+
+exit:
+  string_list_destroy(&indexes);
+  string_list_destroy(&schema);
+  sqlite3_free(index_flags);
+  sqlite3_free(index_extents);
+  return result;
+}
+
+int cluster_table_step(sqlite3 *db, const spatialdb_t *spatialdb, const char *db_name, const char *table_name, const char *column_name, int batch_size, int *done, errorstream_t *error) {
+  int result = SQLITE_OK;
+  cluster_state_t state;
+  int copied = 0;
+
+  *done = 0;
+  memset(&state, 0, sizeof(cluster_state_t));
+
+  if (spatialdb != spatialdb_geopackage_schema()) {
+    error_append(error, "Table clustering is not supported in %s mode", spatialdb->name);
+    goto exit;
+  }
+
+  if (batch_size <= 0) {
+    error_append(error, "Batch size must be positive");
+    goto exit;
+  }
+
+  result = sql_init_table(db, db_name, &udbx_cluster_state, error);
+  if (result == SQLITE_OK) {
+    result = sql_init_table(db, db_name, &udbx_cluster_map, error);
+  }
+  if (result != SQLITE_OK) {
+    goto exit;
+  }
+
+  result = sql_exec_stmt(
+             db, read_state_row, NULL, &state,
+             "SELECT column_name, id_column_name, phase, last_key, last_id, copied, min_x, min_y, max_x, max_y FROM \"%w\".\"%w\" WHERE table_name = %Q",
+             db_name, udbx_cluster_state.name, table_name
+           );
+  if (result == SQLITE_OK && !state.found) {
+    result = cluster_init(db, db_name, table_name, column_name, &state, error);
+    if (result != SQLITE_OK || error_count(error) > 0) {
+      goto exit;
+    }
+    result = sql_exec_stmt(
+               db, read_state_row, NULL, &state,
+               "SELECT column_name, id_column_name, phase, last_key, last_id, copied, min_x, min_y, max_x, max_y FROM \"%w\".\"%w\" WHERE table_name = %Q",
+               db_name, udbx_cluster_state.name, table_name
+             );
+  }
+  if (result != SQLITE_OK) {
+    error_append(error, "Could not read clustering state of %s.%s: %s", db_name, table_name, sqlite3_errmsg(db));
+    goto exit;
+  }
+
+  if (sqlite3_stricmp(state.column_name, column_name) != 0) {
+    error_append(error, "Table %s.%s is already being clustered on column %s", db_name, table_name, state.column_name);
+    goto exit;
+  }
+
+  if (state.phase == CLUSTER_PHASE_ORDER) {
+    result = cluster_order_step(db, db_name, table_name, &state, batch_size, error);
+    goto exit;
+  }
+
+  result = cluster_copy_step(db, db_name, table_name, &state, batch_size, &copied, error);
+  if (result != SQLITE_OK || error_count(error) > 0 || copied > 0) {
+    goto exit;
+  }
+
+  result = cluster_swap(db, spatialdb, db_name, table_name, &state, error);
+  if (result == SQLITE_OK && error_count(error) == 0) {
+    *done = 1;
+  }
+
+exit:
+  sqlite3_free(state.column_name);
+  sqlite3_free(state.id_column_name);
+  return result;
+}
@@ -0,0 +1,39 @@
+#ifndef UDBX_CLUSTER_H
+#define UDBX_CLUSTER_H
+
+#include "spatialdb.h"
+
+/**
+ * \addtogroup cluster Table clustering
+ * @{
+ */
+
+/**
+ * Performs one bounded step of rewriting a feature table so that its rows are stored in Hilbert order of their
+ * envelope centers. Progress is kept in udbx_cluster_state, so an interrupted run resumes where it left off when
+ * this function is called again.
+ *
+ * Clustering renumbers the primary keys. SQLite stores a rowid table in primary key order, so the rows get new keys
+ * 1 to n in curve order and the original keys are not preserved. The old to new key mapping is recorded in
+ * udbx_cluster_map. A table that already has a mapping is refused until its rows are deleted from udbx_cluster_map,
+ * since a second run would mix up the keys of both runs. To keep references from breaking silently, an error is
+ * reported when the keys are referenced by a declared foreign key, by row level metadata in gpkg_metadata_reference
+ * or by a related tables mapping in gpkgext_relations; this is checked in the first and in the final step. The table
+ * is read-only while clustering is in progress. In the final step the spatial indexes of the table are rebuilt and
+ * its cluster indexes are marked stale.
+ *
+ * @param db the database handle
+ * @param spatialdb the spatial database schema
+ * @param db_name the database name
+ * @param table_name the feature table
+ * @param column_name the geometry column whose envelopes define the order
+ * @param batch_size the maximum number of rows to process in this step
+ * @param[out] done set to 1 once the table has been rewritten, 0 if more steps are needed
+ * @param error the error stream to report errors to
+ * @return SQLITE_OK on success, an error code otherwise
+ */
+int cluster_table_step(sqlite3 *db, const spatialdb_t *spatialdb, const char *db_name, const char *table_name, const char *column_name, int batch_size, int *done, errorstream_t *error);
+
+/** @} */
+
+#endif
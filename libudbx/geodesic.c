@@ -0,0 +1,363 @@
+#include <math.h>
+#include <string.h>
+#include "geodesic.h"
+#include "sqlite.h"
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+#define GEODESIC_NONE 0
+#define GEODESIC_LINE 1
+#define GEODESIC_RING 2
+
+#define GEODESIC_RADIANS (M_PI / 180.0)
+
+/*
+ * Vincenty's iteration converges to this precision in the longitude on the auxiliary sphere, well below a millimetre,
+ * within a handful of steps except for nearly antipodal points.
+ */
+#define GEODESIC_VINCENTY_EPSILON 1e-12
+#define GEODESIC_VINCENTY_ITERATIONS 100
+
+const geodesic_ellipsoid_t geodesic_wgs84 = {6378137.0, 1.0 / 298.257223563};
+
+static const geodesic_ellipsoid_t geodesic_cgcs2000 = {6378137.0, 1.0 / 298.257222101};
+static const geodesic_ellipsoid_t geodesic_krassowsky = {6378245.0, 1.0 / 298.3};
+static const geodesic_ellipsoid_t geodesic_iag75 = {6378140.0, 1.0 / 298.257};
+
+const geodesic_ellipsoid_t *geodesic_ellipsoid(int32_t srid) {
+  switch (srid) {
+    case 4326:
+      return &geodesic_wgs84;
+    case 4490:
+      return &geodesic_cgcs2000;
+    case 4214:
+      return &geodesic_krassowsky;
+    case 4610:
+      return &geodesic_iag75;
+    default:
+      return NULL;
+  }
+}
+
+double geodesic_mean_radius(const geodesic_ellipsoid_t *ellipsoid) {
+  return ellipsoid->a * (1.0 - ellipsoid->f / 3.0);
+}
+
+/*
+ * Returns a longitude difference in radians normalised to [-pi, pi] so segments crossing the antimeridian take the
+ * short way round.
+ */
+static double geodesic_lon_delta(double from, double to) {
+  double d = to - from;
+  if (d > M_PI) {
+    d -= 2.0 * M_PI;
+  } else if (d < -M_PI) {
+    d += 2.0 * M_PI;
+  }
+  return d;
+}
+
+static double geodesic_haversine(double radius, const geodesic_vertex_t *p, const geodesic_vertex_t *q) {
+  double s_lat = sin((q->lat - p->lat) * 0.5);
+  double s_lon = sin(geodesic_lon_delta(p->lon, q->lon) * 0.5);
+  double h = s_lat * s_lat + p->cos_lat * q->cos_lat * s_lon * s_lon;
+  return 2.0 * radius * asin(h < 1.0 ? sqrt(h) : 1.0);
+}
+
+/*
+ * Vincenty's inverse formula on vertices that carry the sine and cosine of their reduced latitude.
+ * @return 0 if the iteration did not converge
+ */
+static int geodesic_vincenty(const geodesic_ellipsoid_t *e, const geodesic_vertex_t *p, const geodesic_vertex_t *q, double *distance) {
+  double b = e->a * (1.0 - e->f);
+  double L = geodesic_lon_delta(p->lon, q->lon);
+  double lambda = L;
+  double sin_sigma, cos_sigma, sigma, cos2_alpha, cos_2sigma_m;
+  double u2, A, B, delta_sigma;
+  int i;
+
+  for (i = 0; i < GEODESIC_VINCENTY_ITERATIONS; i++) {
+    double sin_lambda = sin(lambda);
+    double cos_lambda = cos(lambda);
+    double t1 = q->cos_lat * sin_lambda;
+    double t2 = p->cos_lat * q->sin_lat - p->sin_lat * q->cos_lat * cos_lambda;
+    double sin_alpha, C, previous;
+
+    sin_sigma = sqrt(t1 * t1 + t2 * t2);
+    if (sin_sigma == 0.0) {
+      *distance = 0.0;
+      return 1;
+    }
+    cos_sigma = p->sin_lat * q->sin_lat + p->cos_lat * q->cos_lat * cos_lambda;
+    sigma = atan2(sin_sigma, cos_sigma);
+    sin_alpha = p->cos_lat * q->cos_lat * sin_lambda / sin_sigma;
+    cos2_alpha = 1.0 - sin_alpha * sin_alpha;
+    // On the equator cos2_alpha is 0 and the term vanishes
+    cos_2sigma_m = cos2_alpha != 0.0 ? cos_sigma - 2.0 * p->sin_lat * q->sin_lat / cos2_alpha : 0.0;
+    C = e->f / 16.0 * cos2_alpha * (4.0 + e->f * (4.0 - 3.0 * cos2_alpha));
+    previous = lambda;
+    lambda = L + (1.0 - C) * e->f * sin_alpha
+             * (sigma + C * sin_sigma * (cos_2sigma_m + C * cos_sigma * (-1.0 + 2.0 * cos_2sigma_m * cos_2sigma_m)));
+    if (fabs(lambda - previous) < GEODESIC_VINCENTY_EPSILON) {
+      break;
+    }
+  }
+  if (i == GEODESIC_VINCENTY_ITERATIONS) {
+    return 0;
+  }
+
+  u2 = cos2_alpha * (e->a * e->a - b * b) / (b * b);
+  A = 1.0 + u2 / 16384.0 * (4096.0 + u2 * (-768.0 + u2 * (320.0 - 175.0 * u2)));
+  B = u2 / 1024.0 * (256.0 + u2 * (-128.0 + u2 * (74.0 - 47.0 * u2)));
+  delta_sigma = B * sin_sigma * (cos_2sigma_m + B / 4.0 * (cos_sigma * (-1.0 + 2.0 * cos_2sigma_m * cos_2sigma_m)
+                - B / 6.0 * cos_2sigma_m * (-3.0 + 4.0 * sin_sigma * sin_sigma) * (-3.0 + 4.0 * cos_2sigma_m * cos_2sigma_m)));
+  *distance = b * A * (sigma - delta_sigma);
+  return 1;
+}
+
+static void geodesic_vertex_sphere(geodesic_vertex_t *v, const double *coords) {
+  v->lon = coords[0] * GEODESIC_RADIANS;
+  v->lat = coords[1] * GEODESIC_RADIANS;
+  v->sin_lat = sin(v->lat);
+  v->cos_lat = cos(v->lat);
+  v->sin_area = v->sin_lat;
+}
+
+static void geodesic_vertex_reduced(geodesic_vertex_t *v, const geodesic_ellipsoid_t *e, const double *coords) {
+  double u;
+  v->lon = coords[0] * GEODESIC_RADIANS;
+  v->lat = coords[1] * GEODESIC_RADIANS;
+  u = atan((1.0 - e->f) * tan(v->lat));
+  v->sin_lat = sin(u);
+  v->cos_lat = cos(u);
+  v->sin_area = 0.0;
+}
+
+double geodesic_distance_sphere(double radius, const double *p, const double *q) {
+  geodesic_vertex_t vp, vq;
+  geodesic_vertex_sphere(&vp, p);
+  geodesic_vertex_sphere(&vq, q);
+  return geodesic_haversine(radius, &vp, &vq);
+}
+
+double geodesic_distance_spheroid(const geodesic_ellipsoid_t *ellipsoid, const double *p, const double *q) {
+  geodesic_vertex_t vp, vq;
+  double distance;
+
+  geodesic_vertex_reduced(&vp, ellipsoid, p);
+  geodesic_vertex_reduced(&vq, ellipsoid, q);
+  if (geodesic_vincenty(ellipsoid, &vp, &vq, &distance)) {
+    return distance;
+  }
+  return geodesic_distance_sphere(geodesic_mean_radius(ellipsoid), p, q);
+}
+
+/*
+ * Area is the spherical excess, summed per ring as (lambda2 - lambda1) * (2 + sin(phi1) + sin(phi2)) / 2 over its
+ * edges, which is exact for edges along parallels and meridians and accurate for the short edges of real data. On the
+ * ellipsoid the latitudes are replaced by authalic latitudes and the radius by the authalic radius, which maps the
+ * ellipsoid onto a sphere of the same total area while preserving the area of every region.
+ */
+static double geodesic_q(const geom_geodesic_t *g, double sin_lat) {
+  double es = g->e * sin_lat;
+  return (1.0 - g->e * g->e) * (sin_lat / (1.0 - es * es) - log((1.0 - es) / (1.0 + es)) / (2.0 * g->e));
+}
+
+static void geodesic_vertex(const geom_geodesic_t *g, geodesic_vertex_t *v, const double *coords) {
+  if (g->spheroid) {
+    geodesic_vertex_reduced(v, g->ellipsoid, coords);
+    v->sin_area = g->e > 0.0 ? geodesic_q(g, sin(v->lat)) / g->qp : sin(v->lat);
+  } else {
+    geodesic_vertex_sphere(v, coords);
+  }
+}
+
+static double geodesic_segment_length(const geom_geodesic_t *g, const geodesic_vertex_t *p, const geodesic_vertex_t *q) {
+  double distance;
+
+  if (!g->spheroid) {
+    return geodesic_haversine(g->radius, p, q);
+  }
+  if (geodesic_vincenty(g->ellipsoid, p, q, &distance)) {
+    return distance;
+  }
+  {
+    double sp[2], sq[2];
+    sp[0] = p->lon / GEODESIC_RADIANS;
+    sp[1] = p->lat / GEODESIC_RADIANS;
+    sq[0] = q->lon / GEODESIC_RADIANS;
+    sq[1] = q->lat / GEODESIC_RADIANS;
+    return geodesic_distance_sphere(geodesic_mean_radius(g->ellipsoid), sp, sq);
+  }
+}
+
+static void geodesic_add_length(geom_geodesic_t *g, double length, double area) {
+  if (g->part_kind == GEODESIC_RING) {
+    g->perimeter += length;
+    g->ring_sum += area;
+  } else {
+    g->length += length;
+  }
+}
+
+/*
+ * Adds the segments from the previous point through n points with the given stride. Each vertex is converted once
+ * and its trigonometric terms are shared by the two segments that meet at it. The stride is a compile time constant
+ * at every call site so the loop is specialised for XY, XYZ and XYZM input.
+ */
+static void geodesic_segments(geom_geodesic_t *g, const double *coords, size_t n, size_t stride) {
+  geodesic_vertex_t a = g->prev;
+  geodesic_vertex_t b;
+  double length = 0.0, area = 0.0;
+  size_t i;
+
+  for (i = 0; i < n; i++) {
+    geodesic_vertex(g, &b, coords + i * stride);
+    length += geodesic_segment_length(g, &a, &b);
+    area += geodesic_lon_delta(a.lon, b.lon) * (2.0 + a.sin_area + b.sin_area);
+    a = b;
+  }
+
+  g->prev = a;
+  geodesic_add_length(g, length, area);
+}
+
+static int geodesic_begin(const geom_consumer_t *consumer, errorstream_t *error) {
+  geom_geodesic_t *g = (geom_geodesic_t *)consumer;
+  g->depth = 0;
+  g->part_depth = -1;
+  g->part_kind = GEODESIC_NONE;
+  return SQLITE_OK;
+}
+
+static int geodesic_end(const geom_consumer_t *consumer, errorstream_t *error) {
+  return SQLITE_OK;
+}
+
+static void geodesic_open(geom_geodesic_t *g, int kind) {
+  g->part_depth = g->depth;
+  g->part_kind = kind;
+  g->has_prev = 0;
+  g->compound_members = 0;
+  g->skip_joint = 0;
+  g->ring_sum = 0.0;
+}
+
+static int geodesic_begin_geometry(const geom_consumer_t *consumer, const geom_header_t *header, errorstream_t *error) {
+  geom_geodesic_t *g = (geom_geodesic_t *)consumer;
+  geom_type_t parent = g->depth > 0 ? g->stack[g->depth - 1] : GEOM_GEOMETRY;
+
+  if (g->depth >= GEOM_MAX_DEPTH) {
+    return SQLITE_IOERR;
+  }
+  g->stack[g->depth++] = header->geom_type;
+
+  if (g->part_depth >= 0) {
+    // A member of a compound curve; its first point repeats the last point of the previous member
+    g->compound_members++;
+    g->skip_joint = g->compound_members > 1;
+    return SQLITE_OK;
+  }
+
+  switch (header->geom_type) {
+    case GEOM_POLYGON:
+    case GEOM_CURVEPOLYGON:
+    case GEOM_PARAMETRICPOLYGON:
+      g->ring_index = 0;
+      break;
+    case GEOM_LINESTRING:
+    case GEOM_CIRCULARSTRING:
+    case GEOM_COMPOUNDCURVE:
+    case GEOM_PARAMETRICLINESTRING:
+    case GEOM_LINEARRING:
+      geodesic_open(g, (parent == GEOM_POLYGON || parent == GEOM_CURVEPOLYGON || parent == GEOM_PARAMETRICPOLYGON) ? GEODESIC_RING : GEODESIC_LINE);
+      break;
+    default:
+      break;
+  }
+  return SQLITE_OK;
+}
+
+static int geodesic_end_geometry(const geom_consumer_t *consumer, const geom_header_t *header, errorstream_t *error) {
+  geom_geodesic_t *g = (geom_geodesic_t *)consumer;
+
+  if (g->depth == g->part_depth) {
+    if (g->part_kind == GEODESIC_RING && g->has_prev) {
+      double area;
+
+      // Rings that are not explicitly closed, such as parametric rings, are closed here
+      if (g->prev.lon != g->first.lon || g->prev.lat != g->first.lat) {
+        geodesic_add_length(g, geodesic_segment_length(g, &g->prev, &g->first),
+                            geodesic_lon_delta(g->prev.lon, g->first.lon) * (2.0 + g->prev.sin_area + g->first.sin_area));
+      }
+
+      // The exterior ring adds to the area and the interior rings subtract from it, whatever their orientation
+      area = fabs(g->ring_sum) * 0.5 * g->radius * g->radius;
+      g->area += g->ring_index > 0 ? -area : area;
+      g->ring_index++;
+    }
+    g->part_depth = -1;
+    g->part_kind = GEODESIC_NONE;
+  }
+  g->depth--;
+  return SQLITE_OK;
+}
+
+static int geodesic_coordinates(const geom_consumer_t *consumer, const geom_header_t *header, size_t point_count, const double *coords, int skip_coords, errorstream_t *error) {
+  geom_geodesic_t *g = (geom_geodesic_t *)consumer;
+  size_t stride = header->coord_size;
+  size_t i = (size_t)skip_coords / stride;
+
+  if (g->part_kind == GEODESIC_NONE || i >= point_count) {
+    return SQLITE_OK;
+  }
+
+  if (g->skip_joint) {
+    g->skip_joint = 0;
+    i++;
+  }
+  if (i < point_count && !g->has_prev) {
+    geodesic_vertex(g, &g->first, coords + i * stride);
+    g->prev = g->first;
+    g->has_prev = 1;
+    i++;
+  }
+  if (i >= point_count) {
+    return SQLITE_OK;
+  }
+
+  switch (stride) {
+    case 2:
+      geodesic_segments(g, coords + i * 2, point_count - i, 2);
+      break;
+    case 3:
+      geodesic_segments(g, coords + i * 3, point_count - i, 3);
+      break;
+    default:
+      geodesic_segments(g, coords + i * 4, point_count - i, 4);
+      break;
+  }
+  return SQLITE_OK;
+}
+
+void geom_geodesic_init(geom_geodesic_t *geodesic, const geodesic_ellipsoid_t *ellipsoid, int spheroid) {
+  memset(geodesic, 0, sizeof(geom_geodesic_t));
+  geom_consumer_init(&geodesic->consumer, geodesic_begin, geodesic_end, geodesic_begin_geometry, geodesic_end_geometry, geodesic_coordinates, NULL);
+  geodesic->part_depth = -1;
+  geodesic->ellipsoid = ellipsoid;
+  geodesic->spheroid = spheroid;
+  geodesic->radius = geodesic_mean_radius(ellipsoid);
+
+  if (spheroid && ellipsoid->f > 0.0) {
+    // The authalic sphere has the surface area of the ellipsoid
+    geodesic->e = sqrt(ellipsoid->f * (2.0 - ellipsoid->f));
+    geodesic->qp = geodesic_q(geodesic, 1.0);
+    geodesic->radius = ellipsoid->a * sqrt(geodesic->qp / 2.0);
+  }
+}
+
+geom_consumer_t *geom_geodesic_consumer(geom_geodesic_t *geodesic) {
+  return &geodesic->consumer;
+}
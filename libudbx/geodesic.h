@@ -0,0 +1,139 @@
+#ifndef UDBX_GEODESIC_H
+#define UDBX_GEODESIC_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "geomio.h"
+
+/**
+ * \addtogroup geodesic Geodesic measures
+ * @{
+ */
+
+/**
+ * A reference ellipsoid given by its semi-major axis in metres and its flattening.
+ */
+typedef struct {
+  double a;
+  double f;
+} geodesic_ellipsoid_t;
+
+/**
+ * The WGS 84 ellipsoid.
+ */
+extern const geodesic_ellipsoid_t geodesic_wgs84;
+
+/**
+ * Returns the ellipsoid of a geographic SRID with longitude, latitude coordinates in degrees, or NULL if the SRID is
+ * not known to be geographic. WGS 84 (4326), CGCS2000 (4490), Beijing 1954 (4214) and Xian 1980 (4610) are known.
+ */
+const geodesic_ellipsoid_t *geodesic_ellipsoid(int32_t srid);
+
+/**
+ * Returns the radius in metres of the sphere used for the spherical approximation of an ellipsoid: the mean radius
+ * (2a + b) / 3.
+ */
+double geodesic_mean_radius(const geodesic_ellipsoid_t *ellipsoid);
+
+/**
+ * Computes the great circle distance in metres between two longitude, latitude points in degrees on a sphere using
+ * the haversine formula.
+ */
+double geodesic_distance_sphere(double radius, const double *p, const double *q);
+
+/**
+ * Computes the geodesic distance in metres between two longitude, latitude points in degrees on an ellipsoid using
+ * Vincenty's inverse formula. Nearly antipodal points for which the iteration does not converge fall back to the
+ * spherical distance on the mean radius.
+ */
+double geodesic_distance_spheroid(const geodesic_ellipsoid_t *ellipsoid, const double *p, const double *q);
+
+/**
+ * A vertex with the trigonometric terms shared by the two segments that meet at it.
+ * @private
+ */
+typedef struct {
+  /** The longitude in radians. */
+  double lon;
+  /** The latitude in radians. */
+  double lat;
+  /** The sine and cosine of the latitude on a sphere, of the reduced latitude on an ellipsoid. */
+  double sin_lat;
+  double cos_lat;
+  /** The sine of the latitude on a sphere, of the authalic latitude on an ellipsoid. */
+  double sin_area;
+} geodesic_vertex_t;
+
+/**
+ * A geometry consumer that computes the geodesic measures, in metres and square metres, of longitude, latitude
+ * geometries in degrees while the coordinates stream by. Like geom_measure_t, polygons have an area and a perimeter
+ * and lines have a length; Z and M are ignored. Circular strings are measured along their control points.
+ *
+ * In spherical mode segment lengths use the haversine formula and areas the spherical excess on the mean radius. In
+ * ellipsoidal mode segment lengths use Vincenty's formula and areas the spherical excess on the authalic sphere, with
+ * latitudes mapped to authalic latitudes so that areas are preserved.
+ */
+typedef struct {
+  geom_consumer_t consumer;
+  /**
+   * The area of all polygons. Exterior rings add their area and interior rings subtract theirs, whatever their
+   * orientation.
+   */
+  double area;
+  /**
+   * The length of all lines.
+   */
+  double length;
+  /**
+   * The length of all polygon rings.
+   */
+  double perimeter;
+  /** @private */
+  const geodesic_ellipsoid_t *ellipsoid;
+  /** @private */
+  int spheroid;
+  /** @private */
+  double radius;
+  /** @private */
+  double e;
+  /** @private */
+  double qp;
+  /** @private */
+  geom_type_t stack[GEOM_MAX_DEPTH];
+  /** @private */
+  int depth;
+  /** @private */
+  int part_depth;
+  /** @private */
+  int part_kind;
+  /** @private */
+  int ring_index;
+  /** @private */
+  int has_prev;
+  /** @private */
+  geodesic_vertex_t first;
+  /** @private */
+  geodesic_vertex_t prev;
+  /** @private */
+  int compound_members;
+  /** @private */
+  int skip_joint;
+  /** @private */
+  double ring_sum;
+} geom_geodesic_t;
+
+/**
+ * Initialises the measures to 0.
+ * @param ellipsoid the ellipsoid of the coordinates
+ * @param spheroid 1 to measure on the ellipsoid, 0 to measure on a sphere of its mean radius
+ */
+void geom_geodesic_init(geom_geodesic_t *geodesic, const geodesic_ellipsoid_t *ellipsoid, int spheroid);
+
+/**
+ * Returns the geometry consumer that adds the geometries it receives to the measures.
+ */
+geom_consumer_t *geom_geodesic_consumer(geom_geodesic_t *geodesic);
+
+/** @} */
+
+#endif
@@ -0,0 +1,512 @@
+#include <math.h>
+#include <string.h>
+#include "geom_clip.h"
+#include "fp.h"
+#include "sqlite.h"
+
+/*
+ * The chord deviation of linearized arcs, as a fraction of the size of the clip box.
+ */
+#define CLIP_ARC_TOLERANCE 1e-6
+
+static int clip_is_polygon(geom_type_t geom_type) {
+  return geom_type == GEOM_POLYGON || geom_type == GEOM_CURVEPOLYGON || geom_type == GEOM_PARAMETRICPOLYGON;
+}
+
+static int clip_reserve(void **buffer, size_t *capacity, size_t count, size_t size) {
+  size_t grown;
+  void *data;
+
+  if (count <= *capacity) {
+    return SQLITE_OK;
+  }
+  grown = *capacity == 0 ? 256 : *capacity;
+  while (grown < count) {
+    grown *= 2;
+  }
+  data = sqlite3_realloc(*buffer, (int)(grown * size));
+  if (data == NULL) {
+    return SQLITE_NOMEM;
+  }
+  *buffer = data;
+  *capacity = grown;
+  return SQLITE_OK;
+}
+
+static int clip_part_inside(const geom_clip_t *c) {
+  return c->part_min[0] >= c->box[0] && c->part_max[0] <= c->box[2] && c->part_min[1] >= c->box[1] && c->part_max[1] <= c->box[3];
+}
+
+static int clip_part_outside(const geom_clip_t *c) {
+  return c->part_max[0] < c->box[0] || c->part_min[0] > c->box[2] || c->part_max[1] < c->box[1] || c->part_min[1] > c->box[3];
+}
+
+/*
+ * Clips the segment a b to the box with Liang-Barsky. Returns 0 if no part of the segment of non zero length lies
+ * within the box, otherwise stores the parameters of the clipped segment in t.
+ */
+static int clip_segment(const double *box, const double *a, const double *b, double *t) {
+  double dx = b[0] - a[0];
+  double dy = b[1] - a[1];
+  double p[4];
+  double q[4];
+  int k;
+
+  p[0] = -dx;
+  q[0] = a[0] - box[0];
+  p[1] = dx;
+  q[1] = box[2] - a[0];
+  p[2] = -dy;
+  q[2] = a[1] - box[1];
+  p[3] = dy;
+  q[3] = box[3] - a[1];
+
+  t[0] = 0.0;
+  t[1] = 1.0;
+  for (k = 0; k < 4; k++) {
+    if (p[k] == 0.0) {
+      if (q[k] < 0.0) {
+        return 0;
+      }
+    } else {
+      double r = q[k] / p[k];
+      if (p[k] < 0.0) {
+        if (r > t[1]) return 0;
+        if (r > t[0]) t[0] = r;
+      } else {
+        if (r < t[0]) return 0;
+        if (r < t[1]) t[1] = r;
+      }
+    }
+  }
+  // Segments that only touch the box in a single point are left out
+  return t[0] < t[1] || (dx == 0.0 && dy == 0.0);
+}
+
+static void clip_interpolate(double *out, const double *a, const double *b, double t, size_t stride) {
+  size_t k;
+  if (t == 0.0) {
+    memcpy(out, a, stride * sizeof(double));
+  } else if (t == 1.0) {
+    memcpy(out, b, stride * sizeof(double));
+  } else {
+    for (k = 0; k < stride; k++) {
+      out[k] = a[k] + t * (b[k] - a[k]);
+    }
+  }
+}
+
+/*
+ * Clips the buffered line to the box. The pieces are written one after the other to the first work buffer; their
+ * start indices, followed by the end index of the last piece, are written to the piece buffer.
+ */
+static int clip_line(geom_clip_t *c, size_t stride, size_t *piece_count, size_t *point_count) {
+  size_t n = c->point_count;
+  size_t pieces = 0;
+  size_t out = 0;
+  int open = 0;
+  double *dst;
+  size_t i;
+  int result;
+
+  *piece_count = 0;
+  *point_count = 0;
+  if (n < 2) {
+    return SQLITE_OK;
+  }
+  result = clip_reserve((void **)&c->work[0], &c->work_capacity[0], 2 * (n - 1) * stride, sizeof(double));
+  if (result == SQLITE_OK) {
+    result = clip_reserve((void **)&c->pieces, &c->piece_capacity, n, sizeof(size_t));
+  }
+  if (result != SQLITE_OK) {
+    return result;
+  }
+
+  dst = c->work[0];
+  for (i = 0; i + 1 < n; i++) {
+    const double *a = c->coords + i * stride;
+    const double *b = a + stride;
+    double t[2];
+
+    if (!clip_segment(c->box, a, b, t)) {
+      open = 0;
+      continue;
+    }
+    if (!open || t[0] > 0.0) {
+      c->pieces[pieces++] = out;
+      clip_interpolate(dst + out * stride, a, b, t[0], stride);
+      out++;
+      open = 1;
+    }
+    clip_interpolate(dst + out * stride, a, b, t[1], stride);
+    out++;
+    if (t[1] < 1.0) {
+      open = 0;
+    }
+  }
+  c->pieces[pieces] = out;
+  *piece_count = pieces;
+  *point_count = out;
+  return SQLITE_OK;
+}
+
+/*
+ * One Sutherland-Hodgman pass: clips the open ring src of m points to the half plane where ordinate axis is at least
+ * (keep_greater) or at most bound. Returns the number of points written to dst, at most 2 * m.
+ */
+static size_t clip_ring_edge(const double *src, size_t m, double *dst, size_t stride, int axis, double bound, int keep_greater) {
+  const double *prev = src + (m - 1) * stride;
+  int prev_inside = keep_greater ? prev[axis] >= bound : prev[axis] <= bound;
+  size_t out = 0;
+  size_t i;
+
+  for (i = 0; i < m; i++) {
+    const double *cur = src + i * stride;
+    int cur_inside = keep_greater ? cur[axis] >= bound : cur[axis] <= bound;
+
+    if (cur_inside != prev_inside) {
+      double *p = dst + out * stride;
+      clip_interpolate(p, prev, cur, (bound - prev[axis]) / (cur[axis] - prev[axis]), stride);
+      p[axis] = bound;
+      out++;
+    }
+    if (cur_inside) {
+      memcpy(dst + out * stride, cur, stride * sizeof(double));
+      out++;
+    }
+    prev = cur;
+    prev_inside = cur_inside;
+  }
+  return out;
+}
+
+/*
+ * Clips the buffered ring to the box. Edges of the box that do not cross the envelope of the ring are skipped.
+ * The closed result is returned in ring and point_count; point_count is 0 if the ring collapsed.
+ */
+static int clip_ring(geom_clip_t *c, size_t stride, double **ring, size_t *point_count) {
+  double *src = c->coords;
+  size_t m = c->point_count;
+  double area = 0.0;
+  int w = 0;
+  int edge;
+  size_t i, kept;
+
+  *point_count = 0;
+  if (m > 1 && src[0] == src[(m - 1) * stride] && src[1] == src[(m - 1) * stride + 1]) {
+    m--;
+  }
+
+  for (edge = 0; edge < 4 && m >= 3; edge++) {
+    int axis = edge & 1;
+    int keep_greater = edge < 2;
+    double bound = c->box[edge];
+    int result;
+
+    if (keep_greater ? c->part_min[axis] >= bound : c->part_max[axis] <= bound) {
+      continue;
+    }
+    result = clip_reserve((void **)&c->work[w], &c->work_capacity[w], (2 * m + 1) * stride, sizeof(double));
+    if (result != SQLITE_OK) {
+      return result;
+    }
+    m = clip_ring_edge(src, m, c->work[w], stride, axis, bound, keep_greater);
+    src = c->work[w];
+    w ^= 1;
+  }
+  if (m < 3) {
+    return SQLITE_OK;
+  }
+
+  // Vertices on the boundary of the box may repeat
+  kept = 1;
+  for (i = 1; i < m; i++) {
+    const double *last = src + (kept - 1) * stride;
+    const double *p = src + i * stride;
+    if (p[0] != last[0] || p[1] != last[1]) {
+      if (kept != i) {
+        memmove(src + kept * stride, p, stride * sizeof(double));
+      }
+      kept++;
+    }
+  }
+  while (kept > 1 && src[(kept - 1) * stride] == src[0] && src[(kept - 1) * stride + 1] == src[1]) {
+    kept--;
+  }
+  if (kept < 3) {
+    return SQLITE_OK;
+  }
+
+  for (i = 0; i < kept; i++) {
+    const double *a = src + i * stride;
+    const double *b = src + ((i + 1) % kept) * stride;
+    area += a[0] * b[1] - b[0] * a[1];
+  }
+  if (area == 0.0) {
+    return SQLITE_OK;
+  }
+
+  memcpy(src + kept * stride, src, stride * sizeof(double));
+  *ring = src;
+  *point_count = kept + 1;
+  return SQLITE_OK;
+}
+
+/*
+ * Polygons below the root are only passed on once they have a ring, so a polygon whose exterior ring is clipped away
+ * disappears from its multi polygon or collection.
+ */
+static int clip_flush_polygon(geom_clip_t *c, errorstream_t *error) {
+  int result = SQLITE_OK;
+  if (c->pending_polygon) {
+    c->pending_polygon = 0;
+    result = c->target->begin_geometry(c->target, &c->polygon_header, error);
+  }
+  return result;
+}
+
+static int clip_emit(geom_clip_t *c, const geom_header_t *header, const double *coords, size_t point_count, errorstream_t *error) {
+  int result = clip_flush_polygon(c, error);
+  if (result == SQLITE_OK) {
+    result = c->target->begin_geometry(c->target, header, error);
+  }
+  if (result == SQLITE_OK && point_count > 0) {
+    result = c->target->coordinates(c->target, header, point_count, coords, 0, error);
+  }
+  if (result == SQLITE_OK) {
+    result = c->target->end_geometry(c->target, header, error);
+  }
+  return result;
+}
+
+static int clip_part(geom_clip_t *c, errorstream_t *error) {
+  const geom_header_t *header = &c->part_header;
+  size_t stride = header->coord_size;
+  size_t n = c->point_count;
+  int root = c->depth == 1;
+  size_t piece_count, point_count, i;
+  double *ring;
+  int result;
+
+  if (header->geom_type == GEOM_POINT) {
+    if (n == 0 || fp_isnan(c->coords[0]) || clip_part_inside(c)) {
+      return clip_emit(c, header, c->coords, n, error);
+    }
+    if (root) {
+      // An empty point is written with NaN coordinates
+      for (i = 0; i < stride; i++) {
+        c->coords[i] = fp_nan();
+      }
+      return clip_emit(c, header, c->coords, 1, error);
+    }
+    return SQLITE_OK;
+  }
+
+  if (c->part_ring) {
+    int index = c->ring_index++;
+    point_count = 0;
+    if (n > 0 && clip_part_inside(c)) {
+      ring = c->coords;
+      point_count = n;
+    } else if (n > 0 && !clip_part_outside(c)) {
+      result = clip_ring(c, stride, &ring, &point_count);
+      if (result != SQLITE_OK) {
+        return result;
+      }
+    }
+    if (point_count == 0) {
+      if (index == 0) {
+        c->drop_rings = 1;
+      }
+      return SQLITE_OK;
+    }
+    return clip_emit(c, header, ring, point_count, error);
+  }
+
+  if (n == 0 || clip_part_inside(c)) {
+    return clip_emit(c, header, c->coords, n, error);
+  }
+  piece_count = 0;
+  if (!clip_part_outside(c)) {
+    result = clip_line(c, stride, &piece_count, &point_count);
+    if (result != SQLITE_OK) {
+      return result;
+    }
+  }
+
+  if (piece_count == 0) {
+    return root ? clip_emit(c, header, NULL, 0, error) : SQLITE_OK;
+  }
+  if (piece_count == 1) {
+    return clip_emit(c, header, c->work[0], point_count, error);
+  }
+
+  if (root) {
+    geom_header_t multi = *header;
+    geom_header_t line = *header;
+    multi.geom_type = GEOM_MULTILINESTRING;
+    line.geom_type = GEOM_LINESTRING;
+    result = c->target->begin_geometry(c->target, &multi, error);
+    for (i = 0; i < piece_count && result == SQLITE_OK; i++) {
+      result = clip_emit(c, &line, c->work[0] + c->pieces[i] * stride, c->pieces[i + 1] - c->pieces[i], error);
+    }
+    if (result == SQLITE_OK) {
+      result = c->target->end_geometry(c->target, &multi, error);
+    }
+    return result;
+  }
+
+  result = SQLITE_OK;
+  for (i = 0; i < piece_count && result == SQLITE_OK; i++) {
+    result = clip_emit(c, header, c->work[0] + c->pieces[i] * stride, c->pieces[i + 1] - c->pieces[i], error);
+  }
+  return result;
+}
+
+static void clip_start_part(geom_clip_t *c, const geom_header_t *header, int ring) {
+  c->part_depth = c->depth;
+  c->part_header = *header;
+  c->part_ring = ring;
+  c->point_count = 0;
+  c->part_min[0] = c->part_min[1] = HUGE_VAL;
+  c->part_max[0] = c->part_max[1] = -HUGE_VAL;
+}
+
+static int clip_begin(const geom_consumer_t *consumer, errorstream_t *error) {
+  geom_clip_t *c = (geom_clip_t *)consumer;
+  c->depth = 0;
+  c->part_depth = -1;
+  c->skip_depth = -1;
+  c->pending_polygon = 0;
+  return c->target->begin(c->target, error);
+}
+
+static int clip_end(const geom_consumer_t *consumer, errorstream_t *error) {
+  geom_clip_t *c = (geom_clip_t *)consumer;
+  return c->target->end(c->target, error);
+}
+
+static int clip_begin_geometry(const geom_consumer_t *consumer, const geom_header_t *header, errorstream_t *error) {
+  geom_clip_t *c = (geom_clip_t *)consumer;
+  geom_type_t parent = c->depth > 0 ? c->stack[c->depth - 1] : GEOM_GEOMETRY;
+  int linear = header->geom_type == GEOM_LINESTRING || header->geom_type == GEOM_LINEARRING;
+  int result;
+
+  if (c->depth >= GEOM_MAX_DEPTH) {
+    return SQLITE_IOERR;
+  }
+  c->stack[c->depth++] = header->geom_type;
+
+  if (c->skip_depth >= 0) {
+    return SQLITE_OK;
+  }
+
+  if (clip_is_polygon(parent)) {
+    if (c->drop_rings) {
+      // The exterior ring was clipped away
+      c->skip_depth = c->depth;
+      return SQLITE_OK;
+    }
+    // Curved rings have been linearized in front of the clipper
+    clip_start_part(c, header, 1);
+    return SQLITE_OK;
+  } else if (linear || header->geom_type == GEOM_POINT) {
+    clip_start_part(c, header, 0);
+    return SQLITE_OK;
+  } else if (clip_is_polygon(header->geom_type)) {
+    c->ring_index = 0;
+    c->drop_rings = 0;
+    if (c->depth > 1) {
+      c->pending_polygon = 1;
+      c->polygon_header = *header;
+      return SQLITE_OK;
+    }
+  }
+
+  result = clip_flush_polygon(c, error);
+  if (result == SQLITE_OK) {
+    result = c->target->begin_geometry(c->target, header, error);
+  }
+  return result;
+}
+
+static int clip_end_geometry(const geom_consumer_t *consumer, const geom_header_t *header, errorstream_t *error) {
+  geom_clip_t *c = (geom_clip_t *)consumer;
+  int result = SQLITE_OK;
+
+  if (c->skip_depth >= 0) {
+    if (c->depth == c->skip_depth) {
+      c->skip_depth = -1;
+    }
+  } else if (c->depth == c->part_depth) {
+    c->part_depth = -1;
+    result = clip_part(c, error);
+  } else if (clip_is_polygon(header->geom_type) && c->pending_polygon) {
+    // Every ring was clipped away; the polygon is left out
+    c->pending_polygon = 0;
+  } else {
+    result = c->target->end_geometry(c->target, header, error);
+  }
+  c->depth--;
+  return result;
+}
+
+static int clip_coordinates(const geom_consumer_t *consumer, const geom_header_t *header, size_t point_count, const double *coords, int skip_coords, errorstream_t *error) {
+  geom_clip_t *c = (geom_clip_t *)consumer;
+  size_t stride = header->coord_size;
+  size_t skip = (size_t)skip_coords / stride;
+  double *dst;
+  size_t i;
+  int result;
+
+  if (c->skip_depth >= 0) {
+    return SQLITE_OK;
+  }
+  if (c->depth != c->part_depth) {
+    return c->target->coordinates(c->target, header, point_count, coords, skip_coords, error);
+  }
+  if (skip >= point_count) {
+    return SQLITE_OK;
+  }
+
+  // One spare point for closing a clipped ring in place
+  result = clip_reserve((void **)&c->coords, &c->capacity, (c->point_count + point_count - skip + 1) * stride, sizeof(double));
+  if (result != SQLITE_OK) {
+    return result;
+  }
+  dst = c->coords + c->point_count * stride;
+  memcpy(dst, coords + skip * stride, (point_count - skip) * stride * sizeof(double));
+  for (i = 0; i < point_count - skip; i++, dst += stride) {
+    if (dst[0] < c->part_min[0]) c->part_min[0] = dst[0];
+    if (dst[0] > c->part_max[0]) c->part_max[0] = dst[0];
+    if (dst[1] < c->part_min[1]) c->part_min[1] = dst[1];
+    if (dst[1] > c->part_max[1]) c->part_max[1] = dst[1];
+  }
+  c->point_count += point_count - skip;
+  return SQLITE_OK;
+}
+
+void geom_clip_init(geom_clip_t *clip) {
+  memset(clip, 0, sizeof(geom_clip_t));
+  geom_consumer_init(&clip->consumer, clip_begin, clip_end, clip_begin_geometry, clip_end_geometry, clip_coordinates, NULL);
+  geom_linearize_init(&clip->linearize);
+  clip->part_depth = -1;
+  clip->skip_depth = -1;
+}
+
+void geom_clip_destroy(geom_clip_t *clip) {
+  sqlite3_free(clip->coords);
+  sqlite3_free(clip->work[0]);
+  sqlite3_free(clip->work[1]);
+  sqlite3_free(clip->pieces);
+  geom_linearize_destroy(&clip->linearize);
+  memset(clip, 0, sizeof(geom_clip_t));
+}
+
+geom_consumer_t *geom_clip_consumer(geom_clip_t *clip, geom_consumer_t *target, const double *box) {
+  double size = box[2] - box[0] > box[3] - box[1] ? box[2] - box[0] : box[3] - box[1];
+  clip->target = target;
+  memcpy(clip->box, box, sizeof(clip->box));
+  // A degenerate box still needs a positive tolerance
+  return geom_linearize_consumer(&clip->linearize, &clip->consumer, size > 0.0 ? size * CLIP_ARC_TOLERANCE : CLIP_ARC_TOLERANCE);
+}
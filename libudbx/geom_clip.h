@@ -0,0 +1,95 @@
+#ifndef UDBX_GEOM_CLIP_H
+#define UDBX_GEOM_CLIP_H
+
+#include <stddef.h>
+#include "geomio.h"
+#include "geom_linearize.h"
+
+/**
+ * \addtogroup geom_clip Rectangle clipping
+ * @{
+ */
+
+/**
+ * A geometry consumer that clips the geometries it receives to an axis aligned box and passes the result on to a
+ * target consumer, typically a geometry blob writer or another filter such as a simplifier.
+ *
+ * Points outside the box are removed. Line strings are clipped with Liang-Barsky; a line that leaves and re-enters
+ * the box is split into several line strings, and a root line string that is split becomes a multi line string.
+ * Rings are clipped with Sutherland-Hodgman, so parts of a ring outside the box are replaced by the box boundary.
+ * Rings that collapse are dropped, together with the interior rings of a dropped exterior ring. Parts whose envelope
+ * lies inside the box are passed on unchanged and parts whose envelope lies outside are dropped without clipping.
+ * Arcs are first linearized to within a millionth of the box size, so curves are clipped like any other part and come
+ * out as line strings, rings and polygons. Z and M values are interpolated. Root geometries that are clipped away
+ * entirely become empty geometries of the same type.
+ *
+ * The buffers are kept when the consumer is reused, so clipping many geometries does not allocate once the buffers
+ * have grown to the largest part.
+ */
+typedef struct {
+  geom_consumer_t consumer;
+  /** @private */
+  geom_linearize_t linearize;
+  /** @private */
+  geom_consumer_t *target;
+  /** @private */
+  double box[4];
+  /** @private */
+  geom_type_t stack[GEOM_MAX_DEPTH];
+  /** @private */
+  int depth;
+  /** @private */
+  int part_depth;
+  /** @private */
+  int skip_depth;
+  /** @private */
+  geom_header_t part_header;
+  /** @private */
+  int part_ring;
+  /** @private */
+  double part_min[2];
+  /** @private */
+  double part_max[2];
+  /** @private */
+  int ring_index;
+  /** @private */
+  int drop_rings;
+  /** @private */
+  int pending_polygon;
+  /** @private */
+  geom_header_t polygon_header;
+  /** @private */
+  double *coords;
+  /** @private */
+  size_t point_count;
+  /** @private */
+  size_t capacity;
+  /** @private */
+  double *work[2];
+  /** @private */
+  size_t work_capacity[2];
+  /** @private */
+  size_t *pieces;
+  /** @private */
+  size_t piece_capacity;
+} geom_clip_t;
+
+/**
+ * Initialises a clipper without buffers.
+ */
+void geom_clip_init(geom_clip_t *clip);
+
+/**
+ * Frees the buffers of a clipper.
+ */
+void geom_clip_destroy(geom_clip_t *clip);
+
+/**
+ * Returns the geometry consumer that linearizes the geometries it receives, clips them to box (xmin, ymin, xmax, ymax)
+ * and passes them on to target.
+ */
+geom_consumer_t *geom_clip_consumer(geom_clip_t *clip, geom_consumer_t *target, const double *box);
+
+/** @} */
+
+#endif
@@ -0,0 +1,279 @@
+#include <stdlib.h>
+#include <string.h>
+#include "geom_hull.h"
+#include "sqlite.h"
+
+/*
+ * The number of candidate points buffered before the buffer is first reduced to its hull.
+ */
+#define HULL_BUFFER_POINTS 65536
+
+static double hull_cross(const double *o, const double *a, const double *b) {
+  return (a[0] - o[0]) * (b[1] - o[1]) - (a[1] - o[1]) * (b[0] - o[0]);
+}
+
+static int hull_compare(const void *a, const void *b) {
+  const double *p = (const double *)a;
+  const double *q = (const double *)b;
+  if (p[0] != q[0]) {
+    return p[0] < q[0] ? -1 : 1;
+  }
+  return p[1] < q[1] ? -1 : p[1] > q[1] ? 1 : 0;
+}
+
+static int hull_reserve(double **buffer, size_t *capacity, size_t count) {
+  size_t grown;
+  double *data;
+
+  if (count <= *capacity) {
+    return SQLITE_OK;
+  }
+  grown = *capacity == 0 ? 1024 : *capacity;
+  while (grown < count) {
+    grown *= 2;
+  }
+  data = (double *)sqlite3_realloc(*buffer, (int)(2 * grown * sizeof(double)));
+  if (data == NULL) {
+    return SQLITE_NOMEM;
+  }
+  *buffer = data;
+  *capacity = grown;
+  return SQLITE_OK;
+}
+
+/*
+ * Rebuilds the octagon from the extreme points, dropping repeated vertices. The extremes are stored in
+ * counterclockwise order, so the octagon is too.
+ */
+static void hull_build_octagon(geom_hull_t *h) {
+  int n = 0;
+  int i;
+
+  for (i = 0; i < 8; i++) {
+    if (n == 0 || h->extremes[i][0] != h->octagon[n - 1][0] || h->extremes[i][1] != h->octagon[n - 1][1]) {
+      h->octagon[n][0] = h->extremes[i][0];
+      h->octagon[n][1] = h->extremes[i][1];
+      n++;
+    }
+  }
+  while (n > 1 && h->octagon[n - 1][0] == h->octagon[0][0] && h->octagon[n - 1][1] == h->octagon[0][1]) {
+    n--;
+  }
+  h->octagon_size = n;
+  h->octagon_dirty = 0;
+}
+
+static int hull_inside_octagon(const geom_hull_t *h, const double *p) {
+  int n = h->octagon_size;
+  int i;
+
+  if (n < 3) {
+    return 0;
+  }
+  for (i = 0; i < n; i++) {
+    if (hull_cross(h->octagon[i], h->octagon[i + 1 < n ? i + 1 : 0], p) <= 0.0) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/*
+ * The directions in which the extreme points are the farthest, in counterclockwise order.
+ */
+static const double hull_directions[8][2] = {
+  {-1.0, 0.0}, {-1.0, -1.0}, {0.0, -1.0}, {1.0, -1.0}, {1.0, 0.0}, {1.0, 1.0}, {0.0, 1.0}, {-1.0, 1.0}
+};
+
+/*
+ * Updates the extreme points with p. Returns 1 if p became one of them.
+ */
+static int hull_update_extremes(geom_hull_t *h, const double *p) {
+  int updated = 0;
+  int i;
+
+  for (i = 0; i < 8; i++) {
+    const double *d = hull_directions[i];
+    if (d[0] * p[0] + d[1] * p[1] > d[0] * h->extremes[i][0] + d[1] * h->extremes[i][1]) {
+      h->extremes[i][0] = p[0];
+      h->extremes[i][1] = p[1];
+      updated = 1;
+    }
+  }
+  if (updated) {
+    h->octagon_dirty = 1;
+  }
+  return updated;
+}
+
+static int hull_add(geom_hull_t *h, const double *p) {
+  int result;
+
+  if (!h->has_points) {
+    int i;
+    for (i = 0; i < 8; i++) {
+      h->extremes[i][0] = p[0];
+      h->extremes[i][1] = p[1];
+    }
+    h->octagon_dirty = 1;
+    h->has_points = 1;
+  } else if (!hull_update_extremes(h, p)) {
+    if (h->octagon_dirty) {
+      hull_build_octagon(h);
+    }
+    if (hull_inside_octagon(h, p)) {
+      return SQLITE_OK;
+    }
+  }
+
+  if (h->point_count == h->limit) {
+    result = geom_hull_compute(h);
+    if (result != SQLITE_OK) {
+      return result;
+    }
+    // A hull that fills most of the buffer needs more room before the next reduction
+    if (h->point_count > h->limit / 2) {
+      h->limit *= 2;
+    }
+  }
+  if (h->point_count == h->capacity) {
+    result = hull_reserve(&h->xy, &h->capacity, h->point_count + 1);
+    if (result != SQLITE_OK) {
+      return result;
+    }
+  }
+  h->xy[2 * h->point_count] = p[0];
+  h->xy[2 * h->point_count + 1] = p[1];
+  h->point_count++;
+  return SQLITE_OK;
+}
+
+static int hull_coordinates(const geom_consumer_t *consumer, const geom_header_t *header, size_t point_count, const double *coords, int skip_coords, errorstream_t *error) {
+  geom_hull_t *h = (geom_hull_t *)consumer;
+  size_t stride = header->coord_size;
+  size_t i = (size_t)skip_coords / stride;
+  int result = SQLITE_OK;
+
+  for (; i < point_count && result == SQLITE_OK; i++) {
+    const double *p = coords + i * stride;
+    // Empty points have NaN coordinates
+    if (p[0] == p[0] && p[1] == p[1]) {
+      result = hull_add(h, p);
+    }
+  }
+  return result;
+}
+
+int geom_hull_compute(geom_hull_t *hull) {
+  double *xy = hull->xy;
+  double *out = NULL;
+  size_t out_capacity = 0;
+  size_t n = 0;
+  size_t i, k, lower;
+  int result;
+
+  if (hull->point_count < 2) {
+    return SQLITE_OK;
+  }
+  qsort(xy, hull->point_count, 2 * sizeof(double), hull_compare);
+  for (i = 0; i < hull->point_count; i++) {
+    if (n == 0 || xy[2 * i] != xy[2 * n - 2] || xy[2 * i + 1] != xy[2 * n - 1]) {
+      xy[2 * n] = xy[2 * i];
+      xy[2 * n + 1] = xy[2 * i + 1];
+      n++;
+    }
+  }
+  hull->point_count = n;
+  if (n < 3) {
+    return SQLITE_OK;
+  }
+
+  result = hull_reserve(&out, &out_capacity, 2 * n);
+  if (result != SQLITE_OK) {
+    return result;
+  }
+
+  // Andrew's monotone chain: the lower hull from left to right, then the upper hull back to the first point.
+  // Collinear points are dropped, so collinear input leaves its two end points.
+  k = 0;
+  for (i = 0; i < n; i++) {
+    while (k >= 2 && hull_cross(out + 2 * (k - 2), out + 2 * (k - 1), xy + 2 * i) <= 0.0) {
+      k--;
+    }
+    out[2 * k] = xy[2 * i];
+    out[2 * k + 1] = xy[2 * i + 1];
+    k++;
+  }
+  lower = k + 1;
+  for (i = n - 1; i-- > 0;) {
+    while (k >= lower && hull_cross(out + 2 * (k - 2), out + 2 * (k - 1), xy + 2 * i) <= 0.0) {
+      k--;
+    }
+    out[2 * k] = xy[2 * i];
+    out[2 * k + 1] = xy[2 * i + 1];
+    k++;
+  }
+
+  // The last point repeats the first one
+  memcpy(xy, out, 2 * (k - 1) * sizeof(double));
+  hull->point_count = k - 1;
+  sqlite3_free(out);
+  return SQLITE_OK;
+}
+
+int geom_hull_write(const geom_hull_t *hull, const geom_consumer_t *target, errorstream_t *error) {
+  geom_header_t header;
+  geom_header_t ring;
+  size_t n = hull->point_count;
+  int result;
+
+  header.coord_type = GEOM_XY;
+  header.coord_size = 2;
+  header.geom_type = n == 0 ? GEOM_GEOMETRYCOLLECTION : n == 1 ? GEOM_POINT : n == 2 ? GEOM_LINESTRING : GEOM_POLYGON;
+  ring = header;
+  ring.geom_type = GEOM_LINEARRING;
+
+  result = target->begin(target, error);
+  if (result == SQLITE_OK) {
+    result = target->begin_geometry(target, &header, error);
+  }
+  if (result == SQLITE_OK && n > 0 && n < 3) {
+    result = target->coordinates(target, &header, n, hull->xy, 0, error);
+  }
+  if (result == SQLITE_OK && n >= 3) {
+    result = target->begin_geometry(target, &ring, error);
+    if (result == SQLITE_OK) {
+      result = target->coordinates(target, &ring, n, hull->xy, 0, error);
+    }
+    if (result == SQLITE_OK) {
+      result = target->coordinates(target, &ring, 1, hull->xy, 0, error);
+    }
+    if (result == SQLITE_OK) {
+      result = target->end_geometry(target, &ring, error);
+    }
+  }
+  if (result == SQLITE_OK) {
+    result = target->end_geometry(target, &header, error);
+  }
+  if (result == SQLITE_OK) {
+    result = target->end(target, error);
+  }
+  return result;
+}
+
+void geom_hull_init(geom_hull_t *hull) {
+  memset(hull, 0, sizeof(geom_hull_t));
+  geom_consumer_init(&hull->consumer, NULL, NULL, NULL, NULL, hull_coordinates, NULL);
+  hull->limit = HULL_BUFFER_POINTS;
+}
+
+void geom_hull_destroy(geom_hull_t *hull) {
+  sqlite3_free(hull->xy);
+  hull->xy = NULL;
+  hull->capacity = 0;
+  hull->point_count = 0;
+}
+
+geom_consumer_t *geom_hull_consumer(geom_hull_t *hull) {
+  return &hull->consumer;
+}
@@ -0,0 +1,79 @@
+#ifndef UDBX_GEOM_HULL_H
+#define UDBX_GEOM_HULL_H
+
+#include <stddef.h>
+#include "geomio.h"
+
+/**
+ * \addtogroup geom_hull Convex hull
+ * @{
+ */
+
+/**
+ * A geometry consumer that accumulates the convex hull of all the coordinates it receives, over any number of
+ * geometries.
+ *
+ * Candidate points are filtered as they arrive with the Akl-Toussaint heuristic: the points that are extreme in x, y,
+ * x + y and x - y span an octagon, and points strictly inside it can not be hull vertices and are discarded. When the
+ * candidate buffer fills up it is replaced by its own hull, computed with Andrew's monotone chain, so memory stays
+ * proportional to the size of the hull rather than to the number of points. Only X and Y are used; empty points are
+ * ignored and circular strings contribute their control points.
+ */
+typedef struct {
+  geom_consumer_t consumer;
+  /**
+   * After geom_hull_compute(), the hull vertices in counterclockwise order as x, y pairs, without repeating the
+   * first vertex.
+   */
+  double *xy;
+  /**
+   * The number of points in xy.
+   */
+  size_t point_count;
+  /** @private */
+  size_t capacity;
+  /** @private */
+  size_t limit;
+  /** @private */
+  int has_points;
+  /** @private */
+  double extremes[8][2];
+  /** @private */
+  double octagon[8][2];
+  /** @private */
+  int octagon_size;
+  /** @private */
+  int octagon_dirty;
+} geom_hull_t;
+
+/**
+ * Initialises an empty convex hull.
+ */
+void geom_hull_init(geom_hull_t *hull);
+
+/**
+ * Frees the buffers of a convex hull.
+ */
+void geom_hull_destroy(geom_hull_t *hull);
+
+/**
+ * Returns the geometry consumer that adds the coordinates of the geometries it receives to the hull.
+ */
+geom_consumer_t *geom_hull_consumer(geom_hull_t *hull);
+
+/**
+ * Reduces the accumulated points to the vertices of their convex hull. More geometries may still be added afterwards.
+ * @return SQLITE_OK on success, SQLITE_NOMEM if the work buffer could not be allocated
+ */
+int geom_hull_compute(geom_hull_t *hull);
+
+/**
+ * Writes the hull computed by geom_hull_compute() to a consumer as a root geometry: a polygon, a line string when all
+ * points are collinear, a point when there is a single distinct point and an empty geometry collection when there
+ * are no points.
+ */
+int geom_hull_write(const geom_hull_t *hull, const geom_consumer_t *target, errorstream_t *error);
+
+/** @} */
+
+#endif
@@ -0,0 +1,271 @@
+#include <math.h>
+#include <string.h>
+#include "geom_linearize.h"
+#include "sqlite.h"
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+#define LINEARIZE_MAX_SEGMENTS 65536
+
+static int linearize_is_curve(geom_type_t geom_type) {
+  return geom_type == GEOM_CIRCULARSTRING || geom_type == GEOM_COMPOUNDCURVE;
+}
+
+/*
+ * Returns the linear type that replaces geom_type as a child of an output geometry of type parent.
+ */
+static geom_type_t linearize_type(geom_type_t geom_type, geom_type_t parent) {
+  switch (geom_type) {
+    case GEOM_LINESTRING:
+    case GEOM_CIRCULARSTRING:
+    case GEOM_COMPOUNDCURVE:
+      return parent == GEOM_POLYGON ? GEOM_LINEARRING : GEOM_LINESTRING;
+    case GEOM_CURVEPOLYGON:
+      return GEOM_POLYGON;
+    case GEOM_MULTICURVE:
+      return GEOM_MULTILINESTRING;
+    case GEOM_MULTISURFACE:
+      return GEOM_MULTIPOLYGON;
+    default:
+      return geom_type;
+  }
+}
+
+static int linearize_reserve(geom_linearize_t *l, size_t count) {
+  size_t capacity;
+  double *coords;
+
+  if (count <= l->capacity) {
+    return SQLITE_OK;
+  }
+  capacity = l->capacity == 0 ? 1024 : l->capacity;
+  while (capacity < count) {
+    capacity *= 2;
+  }
+  coords = (double *)sqlite3_realloc(l->coords, (int)(capacity * sizeof(double)));
+  if (coords == NULL) {
+    return SQLITE_NOMEM;
+  }
+  l->coords = coords;
+  l->capacity = capacity;
+  return SQLITE_OK;
+}
+
+static void linearize_lerp(double *out, const double *a, const double *b, double t, size_t stride) {
+  size_t k;
+  for (k = 2; k < stride; k++) {
+    out[k] = a[k] + t * (b[k] - a[k]);
+  }
+}
+
+/*
+ * Appends the chords of the arc from a through mid to end at *n, excluding a and ending exactly at end.
+ */
+static int linearize_arc(geom_linearize_t *l, const double *a, const double *mid, const double *end, size_t stride, size_t *n) {
+  // The circle is computed relative to a to keep the precision of projected coordinates
+  double bx = mid[0] - a[0];
+  double by = mid[1] - a[1];
+  double ex = end[0] - a[0];
+  double ey = end[1] - a[1];
+  double scale = fabs(bx) + fabs(by) + fabs(ex) + fabs(ey);
+  double d = 2.0 * (bx * ey - by * ex);
+  double cx, cy, r, t0, theta, theta_mid, step, fm;
+  size_t segments, k;
+  double *out;
+  int result;
+
+  if (ex == 0.0 && ey == 0.0) {
+    if (bx == 0.0 && by == 0.0) {
+      return SQLITE_OK;
+    }
+    // A full circle with mid diametrically opposite a
+    cx = bx * 0.5;
+    cy = by * 0.5;
+    theta = 2.0 * M_PI;
+    fm = 0.5;
+  } else if (fabs(d) <= 1e-12 * scale * scale) {
+    // Collinear control points
+    result = linearize_reserve(l, (*n + 2) * stride);
+    if (result != SQLITE_OK) {
+      return result;
+    }
+    memcpy(l->coords + *n * stride, mid, stride * sizeof(double));
+    memcpy(l->coords + (*n + 1) * stride, end, stride * sizeof(double));
+    *n += 2;
+    return SQLITE_OK;
+  } else {
+    double b2 = bx * bx + by * by;
+    double e2 = ex * ex + ey * ey;
+    cx = (b2 * ey - e2 * by) / d;
+    cy = (e2 * bx - b2 * ex) / d;
+    t0 = atan2(-cy, -cx);
+    theta = atan2(ey - cy, ex - cx) - t0;
+    theta_mid = atan2(by - cy, bx - cx) - t0;
+    // d is positive for a counterclockwise turn a -> mid -> end
+    if (d > 0.0) {
+      while (theta <= 0.0) theta += 2.0 * M_PI;
+      while (theta_mid <= 0.0) theta_mid += 2.0 * M_PI;
+    } else {
+      while (theta >= 0.0) theta -= 2.0 * M_PI;
+      while (theta_mid >= 0.0) theta_mid -= 2.0 * M_PI;
+    }
+    fm = theta_mid / theta;
+  }
+
+  r = sqrt(cx * cx + cy * cy);
+  t0 = atan2(-cy, -cx);
+  // A chord spanning angle phi deviates r * (1 - cos(phi / 2)) from the arc
+  step = l->tolerance < r ? 2.0 * acos(1.0 - l->tolerance / r) : M_PI;
+  segments = step > 0.0 ? (size_t)ceil(fabs(theta) / step - 1e-9) : LINEARIZE_MAX_SEGMENTS;
+  segments = segments < 2 ? 2 : segments > LINEARIZE_MAX_SEGMENTS ? LINEARIZE_MAX_SEGMENTS : segments;
+
+  result = linearize_reserve(l, (*n + segments) * stride);
+  if (result != SQLITE_OK) {
+    return result;
+  }
+  out = l->coords + *n * stride;
+  for (k = 1; k < segments; k++, out += stride) {
+    double f = (double)k / (double)segments;
+    double angle = t0 + theta * f;
+    out[0] = a[0] + cx + r * cos(angle);
+    out[1] = a[1] + cy + r * sin(angle);
+    if (stride > 2) {
+      if (f <= fm) {
+        linearize_lerp(out, a, mid, f / fm, stride);
+      } else {
+        linearize_lerp(out, mid, end, (f - fm) / (1.0 - fm), stride);
+      }
+    }
+  }
+  memcpy(out, end, stride * sizeof(double));
+  *n += segments;
+  return SQLITE_OK;
+}
+
+static int linearize_begin(const geom_consumer_t *consumer, errorstream_t *error) {
+  geom_linearize_t *l = (geom_linearize_t *)consumer;
+  l->depth = 0;
+  l->part_depth = -1;
+  return l->target->begin(l->target, error);
+}
+
+static int linearize_end(const geom_consumer_t *consumer, errorstream_t *error) {
+  geom_linearize_t *l = (geom_linearize_t *)consumer;
+  return l->target->end(l->target, error);
+}
+
+static int linearize_begin_geometry(const geom_consumer_t *consumer, const geom_header_t *header, errorstream_t *error) {
+  geom_linearize_t *l = (geom_linearize_t *)consumer;
+  geom_type_t parent = l->depth > 0 ? l->types[l->depth - 1] : GEOM_GEOMETRY;
+  geom_header_t linear = *header;
+
+  if (l->depth >= GEOM_MAX_DEPTH) {
+    return SQLITE_IOERR;
+  }
+  l->types[l->depth] = linearize_type(header->geom_type, parent);
+  l->depth++;
+
+  if (l->part_depth >= 0) {
+    // A member of a compound curve; its first point repeats the last point of the previous member
+    l->members++;
+    l->skip_joint = l->members > 1;
+    l->arc = header->geom_type == GEOM_CIRCULARSTRING;
+    l->has_mid = 0;
+    return SQLITE_OK;
+  }
+
+  linear.geom_type = l->types[l->depth - 1];
+  if (linearize_is_curve(header->geom_type)) {
+    l->part_depth = l->depth;
+    l->part_header = linear;
+    l->arc = header->geom_type == GEOM_CIRCULARSTRING;
+    l->members = 0;
+    l->skip_joint = 0;
+    l->has_prev = 0;
+    l->has_mid = 0;
+  }
+  return l->target->begin_geometry(l->target, &linear, error);
+}
+
+static int linearize_end_geometry(const geom_consumer_t *consumer, const geom_header_t *header, errorstream_t *error) {
+  geom_linearize_t *l = (geom_linearize_t *)consumer;
+  geom_header_t linear = *header;
+
+  if (l->part_depth >= 0 && l->depth > l->part_depth) {
+    l->depth--;
+    return SQLITE_OK;
+  }
+  if (l->depth == l->part_depth) {
+    l->part_depth = -1;
+  }
+  linear.geom_type = l->types[--l->depth];
+  return l->target->end_geometry(l->target, &linear, error);
+}
+
+static int linearize_coordinates(const geom_consumer_t *consumer, const geom_header_t *header, size_t point_count, const double *coords, int skip_coords, errorstream_t *error) {
+  geom_linearize_t *l = (geom_linearize_t *)consumer;
+  size_t stride = header->coord_size;
+  size_t i = (size_t)skip_coords / stride;
+  size_t n = 0;
+  int result;
+
+  if (l->part_depth < 0) {
+    return l->target->coordinates(l->target, header, point_count, coords, skip_coords, error);
+  }
+
+  if (l->skip_joint && i < point_count) {
+    l->skip_joint = 0;
+    if (l->has_prev) {
+      i++;
+    }
+  }
+
+  for (; i < point_count; i++) {
+    const double *p = coords + i * stride;
+    if (!l->has_prev || !l->arc) {
+      result = linearize_reserve(l, (n + 1) * stride);
+      if (result != SQLITE_OK) {
+        return result;
+      }
+      memcpy(l->coords + n * stride, p, stride * sizeof(double));
+      n++;
+      l->has_prev = 1;
+    } else if (!l->has_mid) {
+      memcpy(l->mid, p, stride * sizeof(double));
+      l->has_mid = 1;
+      continue;
+    } else {
+      result = linearize_arc(l, l->prev, l->mid, p, stride, &n);
+      if (result != SQLITE_OK) {
+        return result;
+      }
+      l->has_mid = 0;
+    }
+    memcpy(l->prev, p, stride * sizeof(double));
+  }
+
+  if (n == 0) {
+    return SQLITE_OK;
+  }
+  return l->target->coordinates(l->target, &l->part_header, n, l->coords, 0, error);
+}
+
+void geom_linearize_init(geom_linearize_t *linearize) {
+  memset(linearize, 0, sizeof(geom_linearize_t));
+  geom_consumer_init(&linearize->consumer, linearize_begin, linearize_end, linearize_begin_geometry, linearize_end_geometry, linearize_coordinates, NULL);
+  linearize->part_depth = -1;
+}
+
+void geom_linearize_destroy(geom_linearize_t *linearize) {
+  sqlite3_free(linearize->coords);
+  linearize->coords = NULL;
+  linearize->capacity = 0;
+}
+
+geom_consumer_t *geom_linearize_consumer(geom_linearize_t *linearize, geom_consumer_t *target, double tolerance) {
+  linearize->target = target;
+  linearize->tolerance = tolerance;
+  return &linearize->consumer;
+}
@@ -0,0 +1,77 @@
+#ifndef UDBX_GEOM_LINEARIZE_H
+#define UDBX_GEOM_LINEARIZE_H
+
+#include <stddef.h>
+#include "geomio.h"
+
+/**
+ * \addtogroup geom_linearize Curve linearization
+ * @{
+ */
+
+/**
+ * A geometry consumer that replaces the curves of the geometries it receives by line strings and passes the result on
+ * to a target consumer.
+ *
+ * Each circular arc is replaced by the smallest number of equal angle chords that stay within the tolerance of the
+ * arc, with at least two chords per arc and at most 65536. Circular strings and compound curves become line strings,
+ * or linear rings inside a polygon; curve polygons become polygons, multi curves multi line strings and multi surfaces
+ * multi polygons. Z and M values are interpolated between the control points. Linear geometries are passed on
+ * unchanged.
+ *
+ * The buffer is kept when the consumer is reused, so linearizing many geometries does not allocate once it has grown to
+ * the largest batch of coordinates.
+ */
+typedef struct {
+  geom_consumer_t consumer;
+  /** @private */
+  geom_consumer_t *target;
+  /** @private */
+  double tolerance;
+  /** @private */
+  geom_type_t types[GEOM_MAX_DEPTH];
+  /** @private */
+  int depth;
+  /** @private */
+  int part_depth;
+  /** @private */
+  geom_header_t part_header;
+  /** @private */
+  int arc;
+  /** @private */
+  int members;
+  /** @private */
+  int skip_joint;
+  /** @private */
+  int has_prev;
+  /** @private */
+  double prev[GEOM_MAX_COORD_SIZE];
+  /** @private */
+  int has_mid;
+  /** @private */
+  double mid[GEOM_MAX_COORD_SIZE];
+  /** @private */
+  double *coords;
+  /** @private */
+  size_t capacity;
+} geom_linearize_t;
+
+/**
+ * Initialises a linearizer without buffers.
+ */
+void geom_linearize_init(geom_linearize_t *linearize);
+
+/**
+ * Frees the buffers of a linearizer.
+ */
+void geom_linearize_destroy(geom_linearize_t *linearize);
+
+/**
+ * Returns the geometry consumer that replaces arcs by chords that deviate at most tolerance from the arc and passes
+ * the geometries on to target. tolerance must be positive.
+ */
+geom_consumer_t *geom_linearize_consumer(geom_linearize_t *linearize, geom_consumer_t *target, double tolerance);
+
+/** @} */
+
+#endif
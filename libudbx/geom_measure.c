@@ -0,0 +1,343 @@
+#include <math.h>
+#include <string.h>
+#include "geom_measure.h"
+#include "sqlite.h"
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+#define MEASURE_NONE 0
+#define MEASURE_POINTS 1
+#define MEASURE_LINE 2
+#define MEASURE_RING 3
+
+/*
+ * All sums are taken relative to the first coordinate of the geometry so large coordinates do not cancel out.
+ *
+ * Area and area moments follow from Green's theorem: the signed area of a ring is the integral of (x dy - y dx) / 2
+ * along it and its first moments are the integrals of x^2 / 2 dy and -y^2 / 2 dx. The integrals have closed forms for
+ * both straight segments and circular arcs, so arcs need no linearization.
+ */
+static void measure_add_moment(geom_moment_t *moment, double weight, double x, double y) {
+  moment->weight += weight;
+  moment->x += x;
+  moment->y += y;
+}
+
+static void measure_add_length(geom_measure_t *m, double length, double mx, double my) {
+  if (m->part_kind == MEASURE_RING) {
+    m->perimeter += length;
+    measure_add_moment(&m->ring_moment, length, mx, my);
+  } else {
+    m->length += length;
+    measure_add_moment(&m->line_moment, length, mx, my);
+  }
+}
+
+/*
+ * Adds the straight segments from the previous point through n points with the given stride. The stride is a
+ * compile time constant at every call site so the loop is specialised for XY, XYZ and XYZM input.
+ */
+static void measure_segments(geom_measure_t *m, const double *coords, size_t n, size_t stride) {
+  double ax = m->prev[0];
+  double ay = m->prev[1];
+  double area = 0.0, mx = 0.0, my = 0.0;
+  double length = 0.0, lx = 0.0, ly = 0.0;
+  double vx = 0.0, vy = 0.0;
+  size_t i;
+
+  for (i = 0; i < n; i++) {
+    double bx = coords[i * stride] - m->origin[0];
+    double by = coords[i * stride + 1] - m->origin[1];
+    double dx = bx - ax;
+    double dy = by - ay;
+    double d = sqrt(dx * dx + dy * dy);
+
+    area += ax * by - bx * ay;
+    mx += (ax * ax + ax * bx + bx * bx) * dy;
+    my -= (ay * ay + ay * by + by * by) * dx;
+    length += d;
+    lx += d * (ax + bx);
+    ly += d * (ay + by);
+    vx += bx;
+    vy += by;
+    ax = bx;
+    ay = by;
+  }
+
+  m->prev[0] = ax;
+  m->prev[1] = ay;
+  m->ring_area += area * 0.5;
+  m->ring_mx += mx / 6.0;
+  m->ring_my += my / 6.0;
+  measure_add_length(m, length, lx * 0.5, ly * 0.5);
+  measure_add_moment(&m->vertex_moment, (double)n, vx, vy);
+}
+
+/*
+ * Adds a single straight segment from the previous point to b, which is relative to the origin.
+ */
+static void measure_segment(geom_measure_t *m, const double *b) {
+  double point[2];
+  point[0] = b[0] + m->origin[0];
+  point[1] = b[1] + m->origin[1];
+  measure_segments(m, point, 1, 2);
+}
+
+/*
+ * Adds the circular arc from the previous point through mid to end. Collinear points are a straight segment; an arc
+ * that ends where it starts is the full circle through mid.
+ */
+static void measure_arc(geom_measure_t *m, const double *mid, const double *end) {
+  const double *a = m->prev;
+  double cx, cy, r, t0, t2, theta, s;
+  double d = 2.0 * (a[0] * (mid[1] - end[1]) + mid[0] * (end[1] - a[1]) + end[0] * (a[1] - mid[1]));
+  double a2 = a[0] * a[0] + a[1] * a[1];
+  double m2 = mid[0] * mid[0] + mid[1] * mid[1];
+  double e2 = end[0] * end[0] + end[1] * end[1];
+  double scale = fabs(mid[0] - a[0]) + fabs(mid[1] - a[1]) + fabs(end[0] - mid[0]) + fabs(end[1] - mid[1]);
+
+  if (a[0] == end[0] && a[1] == end[1]) {
+    if (mid[0] == a[0] && mid[1] == a[1]) {
+      return;
+    }
+    cx = (a[0] + mid[0]) * 0.5;
+    cy = (a[1] + mid[1]) * 0.5;
+    theta = 2.0 * M_PI;
+  } else if (fabs(d) <= 1e-12 * scale * scale) {
+    measure_segment(m, end);
+    return;
+  } else {
+    cx = (a2 * (mid[1] - end[1]) + m2 * (end[1] - a[1]) + e2 * (a[1] - mid[1])) / d;
+    cy = (a2 * (end[0] - mid[0]) + m2 * (a[0] - end[0]) + e2 * (mid[0] - a[0])) / d;
+    t0 = atan2(a[1] - cy, a[0] - cx);
+    t2 = atan2(end[1] - cy, end[0] - cx);
+    theta = t2 - t0;
+    // d is positive for a counterclockwise turn a -> mid -> end
+    if (d > 0.0) {
+      while (theta <= 0.0) theta += 2.0 * M_PI;
+    } else {
+      while (theta >= 0.0) theta -= 2.0 * M_PI;
+    }
+  }
+
+  r = sqrt((a[0] - cx) * (a[0] - cx) + (a[1] - cy) * (a[1] - cy));
+  t0 = atan2(a[1] - cy, a[0] - cx);
+  t2 = t0 + theta;
+  s = theta < 0.0 ? -1.0 : 1.0;
+
+  {
+    double s0 = sin(t0), c0 = cos(t0), s2 = sin(t2), c2 = cos(t2);
+    double sin2 = sin(2.0 * t2) - sin(2.0 * t0);
+
+    m->ring_area += 0.5 * (r * r * theta + cx * (end[1] - a[1]) - cy * (end[0] - a[0]));
+    m->ring_mx += 0.5 * (cx * cx * r * (s2 - s0)
+                         + 2.0 * cx * r * r * (theta / 2.0 + sin2 / 4.0)
+                         + r * r * r * ((s2 - s2 * s2 * s2 / 3.0) - (s0 - s0 * s0 * s0 / 3.0)));
+    m->ring_my += 0.5 * (cy * cy * r * (c0 - c2)
+                         + 2.0 * cy * r * r * (theta / 2.0 - sin2 / 4.0)
+                         + r * r * r * ((c2 * c2 * c2 / 3.0 - c2) - (c0 * c0 * c0 / 3.0 - c0)));
+    measure_add_length(m, r * fabs(theta), s * (cx * r * theta + r * r * (s2 - s0)), s * (cy * r * theta - r * r * (c2 - c0)));
+  }
+
+  measure_add_moment(&m->vertex_moment, 2.0, mid[0] + end[0], mid[1] + end[1]);
+  m->prev[0] = end[0];
+  m->prev[1] = end[1];
+}
+
+static int measure_begin(const geom_consumer_t *consumer, errorstream_t *error) {
+  geom_measure_t *m = (geom_measure_t *)consumer;
+  m->depth = 0;
+  m->part_depth = -1;
+  m->part_kind = MEASURE_NONE;
+  return SQLITE_OK;
+}
+
+static int measure_end(const geom_consumer_t *consumer, errorstream_t *error) {
+  return SQLITE_OK;
+}
+
+static void measure_open(geom_measure_t *m, int kind, geom_type_t geom_type) {
+  m->part_depth = m->depth;
+  m->part_kind = kind;
+  m->has_prev = 0;
+  m->arc = geom_type == GEOM_CIRCULARSTRING;
+  m->arc_mid = 0;
+  m->compound_members = 0;
+  m->skip_joint = 0;
+  m->ring_area = 0.0;
+  m->ring_mx = 0.0;
+  m->ring_my = 0.0;
+}
+
+static int measure_begin_geometry(const geom_consumer_t *consumer, const geom_header_t *header, errorstream_t *error) {
+  geom_measure_t *m = (geom_measure_t *)consumer;
+  geom_type_t parent = m->depth > 0 ? m->stack[m->depth - 1] : GEOM_GEOMETRY;
+
+  if (m->depth >= GEOM_MAX_DEPTH) {
+    return SQLITE_IOERR;
+  }
+  m->stack[m->depth++] = header->geom_type;
+
+  if (m->part_depth >= 0) {
+    // A member of a compound curve; its first point repeats the last point of the previous member
+    m->compound_members++;
+    m->skip_joint = m->compound_members > 1;
+    m->arc = header->geom_type == GEOM_CIRCULARSTRING;
+    m->arc_mid = 0;
+    return SQLITE_OK;
+  }
+
+  switch (header->geom_type) {
+    case GEOM_POLYGON:
+    case GEOM_CURVEPOLYGON:
+    case GEOM_PARAMETRICPOLYGON:
+      m->ring_index = 0;
+      break;
+    case GEOM_POINT:
+    case GEOM_ANNOTATION:
+    case GEOM_PARAMETRICPOINT:
+    case GEOM_PARAMETRICANNOTATION:
+      measure_open(m, MEASURE_POINTS, header->geom_type);
+      break;
+    case GEOM_LINESTRING:
+    case GEOM_CIRCULARSTRING:
+    case GEOM_COMPOUNDCURVE:
+    case GEOM_PARAMETRICLINESTRING:
+    case GEOM_LINEARRING:
+      measure_open(m, (parent == GEOM_POLYGON || parent == GEOM_CURVEPOLYGON || parent == GEOM_PARAMETRICPOLYGON) ? MEASURE_RING : MEASURE_LINE, header->geom_type);
+      break;
+    default:
+      break;
+  }
+  return SQLITE_OK;
+}
+
+static int measure_end_geometry(const geom_consumer_t *consumer, const geom_header_t *header, errorstream_t *error) {
+  geom_measure_t *m = (geom_measure_t *)consumer;
+
+  if (m->depth == m->part_depth) {
+    if (m->part_kind == MEASURE_RING && m->has_prev) {
+      double sign;
+
+      // Rings that are not explicitly closed, such as parametric rings, are closed here
+      if (m->prev[0] != m->first[0] || m->prev[1] != m->first[1]) {
+        m->vertex_moment.weight -= 1.0;
+        m->vertex_moment.x -= m->first[0];
+        m->vertex_moment.y -= m->first[1];
+        measure_segment(m, m->first);
+      }
+
+      // The exterior ring adds to the area and the interior rings subtract from it, whatever their orientation
+      sign = (m->ring_area < 0.0) != (m->ring_index > 0) ? -1.0 : 1.0;
+      m->area += sign * m->ring_area;
+      measure_add_moment(&m->area_moment, sign * m->ring_area, sign * m->ring_mx, sign * m->ring_my);
+      m->ring_index++;
+    }
+    m->part_depth = -1;
+    m->part_kind = MEASURE_NONE;
+  }
+  m->depth--;
+  return SQLITE_OK;
+}
+
+static int measure_coordinates(const geom_consumer_t *consumer, const geom_header_t *header, size_t point_count, const double *coords, int skip_coords, errorstream_t *error) {
+  geom_measure_t *m = (geom_measure_t *)consumer;
+  size_t stride = header->coord_size;
+  size_t i = (size_t)skip_coords / stride;
+
+  if (m->part_kind == MEASURE_NONE || i >= point_count) {
+    return SQLITE_OK;
+  }
+
+  if (!m->has_origin) {
+    m->origin[0] = coords[i * stride];
+    m->origin[1] = coords[i * stride + 1];
+    m->has_origin = 1;
+  }
+
+  if (m->part_kind == MEASURE_POINTS) {
+    for (; i < point_count; i++) {
+      double x = coords[i * stride] - m->origin[0];
+      double y = coords[i * stride + 1] - m->origin[1];
+      measure_add_moment(&m->point_moment, 1.0, x, y);
+      measure_add_moment(&m->vertex_moment, 1.0, x, y);
+    }
+    return SQLITE_OK;
+  }
+
+  if (m->skip_joint) {
+    m->skip_joint = 0;
+    i++;
+  }
+  if (i < point_count && !m->has_prev) {
+    m->first[0] = m->prev[0] = coords[i * stride] - m->origin[0];
+    m->first[1] = m->prev[1] = coords[i * stride + 1] - m->origin[1];
+    m->has_prev = 1;
+    measure_add_moment(&m->vertex_moment, 1.0, m->prev[0], m->prev[1]);
+    i++;
+  }
+  if (i >= point_count) {
+    return SQLITE_OK;
+  }
+
+  if (m->arc) {
+    for (; i < point_count; i++) {
+      double p[2];
+      p[0] = coords[i * stride] - m->origin[0];
+      p[1] = coords[i * stride + 1] - m->origin[1];
+      if (!m->arc_mid) {
+        m->mid[0] = p[0];
+        m->mid[1] = p[1];
+        m->arc_mid = 1;
+      } else {
+        measure_arc(m, m->mid, p);
+        m->arc_mid = 0;
+      }
+    }
+    return SQLITE_OK;
+  }
+
+  switch (stride) {
+    case 2:
+      measure_segments(m, coords + i * 2, point_count - i, 2);
+      break;
+    case 3:
+      measure_segments(m, coords + i * 3, point_count - i, 3);
+      break;
+    default:
+      measure_segments(m, coords + i * 4, point_count - i, 4);
+      break;
+  }
+  return SQLITE_OK;
+}
+
+void geom_measure_init(geom_measure_t *measure) {
+  memset(measure, 0, sizeof(geom_measure_t));
+  geom_consumer_init(&measure->consumer, measure_begin, measure_end, measure_begin_geometry, measure_end_geometry, measure_coordinates, NULL);
+  measure->part_depth = -1;
+}
+
+geom_consumer_t *geom_measure_consumer(geom_measure_t *measure) {
+  return &measure->consumer;
+}
+
+int geom_measure_centroid(const geom_measure_t *measure, double *x, double *y) {
+  const geom_moment_t *moments[5];
+  int i;
+
+  moments[0] = &measure->area_moment;
+  moments[1] = &measure->line_moment;
+  moments[2] = &measure->ring_moment;
+  moments[3] = &measure->point_moment;
+  moments[4] = &measure->vertex_moment;
+  for (i = 0; i < 5; i++) {
+    if (moments[i]->weight != 0.0) {
+      *x = moments[i]->x / moments[i]->weight + measure->origin[0];
+      *y = moments[i]->y / moments[i]->weight + measure->origin[1];
+      return 1;
+    }
+  }
+  return 0;
+}
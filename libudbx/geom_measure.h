@@ -0,0 +1,109 @@
+#ifndef UDBX_GEOM_MEASURE_H
+#define UDBX_GEOM_MEASURE_H
+
+#include "geomio.h"
+
+/**
+ * \addtogroup geom_measure Planar measures
+ * @{
+ */
+
+/**
+ * Running sums of a centroid: the total weight and the weighted sums of x and y.
+ */
+typedef struct {
+  double weight;
+  double x;
+  double y;
+} geom_moment_t;
+
+/**
+ * A geometry consumer that computes planar measures of the geometries it receives while the coordinates stream by.
+ * Polygons (including curve and parametric polygons) have an area and a perimeter; lines (including circular
+ * strings, compound curves and parametric line strings) have a length; points and annotations have neither.
+ * Circular arcs are measured exactly rather than through a linearization. Z and M are ignored.
+ */
+typedef struct {
+  geom_consumer_t consumer;
+  /**
+   * The area of all polygons. Exterior rings add their area and interior rings subtract theirs, whatever their
+   * orientation.
+   */
+  double area;
+  /**
+   * The length of all lines.
+   */
+  double length;
+  /**
+   * The length of all polygon rings.
+   */
+  double perimeter;
+  /** @private */
+  geom_moment_t area_moment;
+  /** @private */
+  geom_moment_t line_moment;
+  /** @private */
+  geom_moment_t ring_moment;
+  /** @private */
+  geom_moment_t point_moment;
+  /** @private */
+  geom_moment_t vertex_moment;
+  /** @private */
+  int has_origin;
+  /** @private */
+  double origin[2];
+  /** @private */
+  geom_type_t stack[GEOM_MAX_DEPTH];
+  /** @private */
+  int depth;
+  /** @private */
+  int part_depth;
+  /** @private */
+  int part_kind;
+  /** @private */
+  int ring_index;
+  /** @private */
+  int has_prev;
+  /** @private */
+  double first[2];
+  /** @private */
+  double prev[2];
+  /** @private */
+  int arc;
+  /** @private */
+  int arc_mid;
+  /** @private */
+  double mid[2];
+  /** @private */
+  int compound_members;
+  /** @private */
+  int skip_joint;
+  /** @private */
+  double ring_area;
+  /** @private */
+  double ring_mx;
+  /** @private */
+  double ring_my;
+} geom_measure_t;
+
+/**
+ * Initialises the measures to 0.
+ */
+void geom_measure_init(geom_measure_t *measure);
+
+/**
+ * Returns the geometry consumer that adds the geometries it receives to the measures.
+ */
+geom_consumer_t *geom_measure_consumer(geom_measure_t *measure);
+
+/**
+ * Computes the centroid of the geometries received so far from the components of the highest dimension: the area
+ * centroid of the polygons, otherwise the length weighted centroid of the lines, otherwise the mean of the points.
+ * Components that degenerate to a lower dimension fall back to the next rule.
+ * @return 1 if the centroid is defined, 0 if no coordinates were received
+ */
+int geom_measure_centroid(const geom_measure_t *measure, double *x, double *y);
+
+/** @} */
+
+#endif
@@ -0,0 +1,707 @@
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include "geom_parts.h"
+#include "sqlite.h"
+
+/*
+ * Parts are opened by the geometry that owns their coordinates. The members of a compound curve continue the part of
+ * the compound curve; each member repeats the last point of the previous one, which is skipped.
+ */
+static int geom_parts_is_polygon(geom_type_t geom_type) {
+  return geom_type == GEOM_POLYGON || geom_type == GEOM_CURVEPOLYGON || geom_type == GEOM_PARAMETRICPOLYGON;
+}
+
+static int geom_parts_reserve_points(geom_parts_t *parts, size_t count) {
+  size_t capacity;
+  double *xy;
+
+  if (parts->point_count + count <= parts->point_capacity) {
+    return SQLITE_OK;
+  }
+
+  capacity = parts->point_capacity * 2;
+  if (capacity < parts->point_count + count) {
+    capacity = parts->point_count + count;
+  }
+  if (parts->xy == parts->inline_xy) {
+    xy = (double *)sqlite3_malloc((int)(capacity * 2 * sizeof(double)));
+    if (xy != NULL) {
+      memcpy(xy, parts->inline_xy, parts->point_count * 2 * sizeof(double));
+    }
+  } else {
+    xy = (double *)sqlite3_realloc(parts->xy, (int)(capacity * 2 * sizeof(double)));
+  }
+  if (xy == NULL) {
+    return SQLITE_NOMEM;
+  }
+  parts->xy = xy;
+  parts->point_capacity = capacity;
+  return SQLITE_OK;
+}
+
+static int geom_parts_open(geom_parts_t *parts, geom_part_kind_t kind) {
+  geom_part_t *part;
+
+  if (parts->part_count == parts->part_capacity) {
+    size_t capacity = parts->part_capacity * 2;
+    geom_part_t *list;
+    if (parts->parts == parts->inline_parts) {
+      list = (geom_part_t *)sqlite3_malloc((int)(capacity * sizeof(geom_part_t)));
+      if (list != NULL) {
+        memcpy(list, parts->inline_parts, parts->part_count * sizeof(geom_part_t));
+      }
+    } else {
+      list = (geom_part_t *)sqlite3_realloc(parts->parts, (int)(capacity * sizeof(geom_part_t)));
+    }
+    if (list == NULL) {
+      return SQLITE_NOMEM;
+    }
+    parts->parts = list;
+    parts->part_capacity = capacity;
+  }
+
+  part = &parts->parts[parts->part_count++];
+  part->kind = kind;
+  part->polygon = kind == GEOM_PART_RING ? parts->polygon_count - 1 : -1;
+  part->start = parts->point_count;
+  part->count = 0;
+  parts->part_depth = parts->depth;
+  parts->compound_members = 0;
+  parts->skip_joint = 0;
+  return SQLITE_OK;
+}
+
+static int geom_parts_begin(const geom_consumer_t *consumer, errorstream_t *error) {
+  geom_parts_t *parts = (geom_parts_t *)consumer;
+  parts->depth = 0;
+  parts->part_depth = -1;
+  return SQLITE_OK;
+}
+
+static int geom_parts_end(const geom_consumer_t *consumer, errorstream_t *error) {
+  return SQLITE_OK;
+}
+
+static int geom_parts_begin_geometry(const geom_consumer_t *consumer, const geom_header_t *header, errorstream_t *error) {
+  geom_parts_t *parts = (geom_parts_t *)consumer;
+  geom_type_t parent = parts->depth > 0 ? parts->stack[parts->depth - 1] : GEOM_GEOMETRY;
+
+  if (parts->depth >= GEOM_MAX_DEPTH) {
+    return SQLITE_IOERR;
+  }
+  parts->stack[parts->depth++] = header->geom_type;
+
+  if (parts->part_depth >= 0) {
+    parts->compound_members++;
+    parts->skip_joint = parts->compound_members > 1;
+    return SQLITE_OK;
+  }
+
+  switch (header->geom_type) {
+    case GEOM_POLYGON:
+    case GEOM_CURVEPOLYGON:
+    case GEOM_PARAMETRICPOLYGON:
+      parts->polygon_count++;
+      return SQLITE_OK;
+    case GEOM_POINT:
+    case GEOM_ANNOTATION:
+    case GEOM_PARAMETRICPOINT:
+    case GEOM_PARAMETRICANNOTATION:
+      return geom_parts_open(parts, GEOM_PART_POINTS);
+    case GEOM_LINESTRING:
+    case GEOM_CIRCULARSTRING:
+    case GEOM_COMPOUNDCURVE:
+    case GEOM_PARAMETRICLINESTRING:
+    case GEOM_LINEARRING:
+      return geom_parts_open(parts, geom_parts_is_polygon(parent) ? GEOM_PART_RING : GEOM_PART_LINE);
+    default:
+      return SQLITE_OK;
+  }
+}
+
+static int geom_parts_end_geometry(const geom_consumer_t *consumer, const geom_header_t *header, errorstream_t *error) {
+  geom_parts_t *parts = (geom_parts_t *)consumer;
+
+  if (parts->depth == parts->part_depth) {
+    if (parts->parts[parts->part_count - 1].count == 0) {
+      parts->part_count--;
+    }
+    parts->part_depth = -1;
+  }
+  parts->depth--;
+  return SQLITE_OK;
+}
+
+static int geom_parts_coordinates(const geom_consumer_t *consumer, const geom_header_t *header, size_t point_count, const double *coords, int skip_coords, errorstream_t *error) {
+  geom_parts_t *parts = (geom_parts_t *)consumer;
+  geom_part_t *part;
+  size_t first = (size_t)skip_coords / header->coord_size;
+  size_t i;
+  double *out;
+  int result;
+
+  if (parts->part_depth < 0) {
+    return SQLITE_OK;
+  }
+  part = &parts->parts[parts->part_count - 1];
+
+  // The first point of a compound curve member repeats the last point of the part
+  if (parts->skip_joint && first < point_count) {
+    parts->skip_joint = 0;
+    first++;
+  }
+  if (first >= point_count) {
+    return SQLITE_OK;
+  }
+
+  result = geom_parts_reserve_points(parts, point_count - first);
+  if (result != SQLITE_OK) {
+    return result;
+  }
+  out = parts->xy + 2 * parts->point_count;
+  for (i = first; i < point_count; i++) {
+    *out++ = coords[i * header->coord_size];
+    *out++ = coords[i * header->coord_size + 1];
+  }
+  parts->point_count += point_count - first;
+  part->count += point_count - first;
+  return SQLITE_OK;
+}
+
+void geom_parts_init(geom_parts_t *parts) {
+  geom_consumer_init(&parts->consumer, geom_parts_begin, geom_parts_end, geom_parts_begin_geometry, geom_parts_end_geometry, geom_parts_coordinates, NULL);
+  parts->xy = parts->inline_xy;
+  parts->point_capacity = GEOM_PARTS_INLINE_POINTS;
+  parts->parts = parts->inline_parts;
+  parts->part_capacity = GEOM_PARTS_INLINE_PARTS;
+  geom_parts_reset(parts);
+}
+
+void geom_parts_reset(geom_parts_t *parts) {
+  parts->point_count = 0;
+  parts->part_count = 0;
+  parts->polygon_count = 0;
+  parts->depth = 0;
+  parts->part_depth = -1;
+  parts->compound_members = 0;
+  parts->skip_joint = 0;
+}
+
+void geom_parts_destroy(geom_parts_t *parts) {
+  if (parts->xy != parts->inline_xy) {
+    sqlite3_free(parts->xy);
+  }
+  if (parts->parts != parts->inline_parts) {
+    sqlite3_free(parts->parts);
+  }
+  parts->xy = parts->inline_xy;
+  parts->parts = parts->inline_parts;
+  parts->point_capacity = GEOM_PARTS_INLINE_POINTS;
+  parts->part_capacity = GEOM_PARTS_INLINE_PARTS;
+  geom_parts_reset(parts);
+}
+
+geom_consumer_t *geom_parts_consumer(geom_parts_t *parts) {
+  return &parts->consumer;
+}
+
+static int geom_part_is_closed(const geom_parts_t *parts, const geom_part_t *part) {
+  const double *first = parts->xy + 2 * part->start;
+  const double *last = parts->xy + 2 * (part->start + part->count - 1);
+  return first[0] == last[0] && first[1] == last[1];
+}
+
+size_t geom_part_segment_count(const geom_parts_t *parts, const geom_part_t *part) {
+  if (part->kind == GEOM_PART_POINTS || part->count < 2) {
+    return 0;
+  }
+  if (part->kind == GEOM_PART_RING && !geom_part_is_closed(parts, part)) {
+    return part->count;
+  }
+  return part->count - 1;
+}
+
+double geom_orient(const double *a, const double *b, const double *c) {
+  return (b[0] - a[0]) * (c[1] - a[1]) - (b[1] - a[1]) * (c[0] - a[0]);
+}
+
+/*
+ * Determines if c, which is collinear with a b, lies within the bounding box of a b.
+ */
+static int geom_on_segment(const double *a, const double *b, const double *c) {
+  return (a[0] <= b[0] ? c[0] >= a[0] && c[0] <= b[0] : c[0] >= b[0] && c[0] <= a[0])
+         && (a[1] <= b[1] ? c[1] >= a[1] && c[1] <= b[1] : c[1] >= b[1] && c[1] <= a[1]);
+}
+
+static int geom_sign(double value) {
+  return (value > 0.0) - (value < 0.0);
+}
+
+int geom_segments_intersect(const double *p1, const double *p2, const double *q1, const double *q2) {
+  int o1 = geom_sign(geom_orient(p1, p2, q1));
+  int o2 = geom_sign(geom_orient(p1, p2, q2));
+  int o3 = geom_sign(geom_orient(q1, q2, p1));
+  int o4 = geom_sign(geom_orient(q1, q2, p2));
+
+  if (o1 * o2 < 0 && o3 * o4 < 0) {
+    return 1;
+  }
+  return (o1 == 0 && geom_on_segment(p1, p2, q1))
+         || (o2 == 0 && geom_on_segment(p1, p2, q2))
+         || (o3 == 0 && geom_on_segment(q1, q2, p1))
+         || (o4 == 0 && geom_on_segment(q1, q2, p2));
+}
+
+/*
+ * Returns 1 if a horizontal ray from point to +x crosses the ring an odd number of times.
+ */
+static int geom_ring_crossings(const geom_parts_t *parts, const geom_part_t *part, const double *point) {
+  const double *xy = parts->xy + 2 * part->start;
+  size_t n = part->count;
+  size_t i, j;
+  int inside = 0;
+
+  for (i = 0, j = n - 1; i < n; j = i++) {
+    const double *a = xy + 2 * i;
+    const double *b = xy + 2 * j;
+    if ((a[1] > point[1]) != (b[1] > point[1])
+        && point[0] < (b[0] - a[0]) * (point[1] - a[1]) / (b[1] - a[1]) + a[0]) {
+      inside = !inside;
+    }
+  }
+  return inside;
+}
+
+int geom_parts_contains_point(const geom_parts_t *parts, const double *point) {
+  size_t i;
+  int polygon = -1;
+  int inside = 0;
+
+  for (i = 0; i < parts->part_count; i++) {
+    const geom_part_t *part = &parts->parts[i];
+    if (part->kind != GEOM_PART_RING || part->count < 3) {
+      continue;
+    }
+    if (part->polygon != polygon) {
+      if (inside) {
+        return 1;
+      }
+      polygon = part->polygon;
+      inside = 0;
+    }
+    inside ^= geom_ring_crossings(parts, part, point);
+  }
+  return inside;
+}
+
+typedef struct {
+  double min_x;
+  double max_x;
+  double min_y;
+  double max_y;
+  const double *p;
+  const double *q;
+} geom_segment_t;
+
+static int geom_segment_cmp(const void *a, const void *b) {
+  double da = ((const geom_segment_t *)a)->min_x;
+  double db = ((const geom_segment_t *)b)->min_x;
+  return (da > db) - (da < db);
+}
+
+static void geom_segment_set(geom_segment_t *segment, const double *p, const double *q) {
+  segment->p = p;
+  segment->q = q;
+  segment->min_x = p[0] < q[0] ? p[0] : q[0];
+  segment->max_x = p[0] < q[0] ? q[0] : p[0];
+  segment->min_y = p[1] < q[1] ? p[1] : q[1];
+  segment->max_y = p[1] < q[1] ? q[1] : p[1];
+}
+
+static int geom_segment_overlaps(const geom_segment_t *segment, const double *bounds) {
+  return segment->max_x >= bounds[0] && segment->min_x <= bounds[2] && segment->max_y >= bounds[1] && segment->min_y <= bounds[3];
+}
+
+static void geom_parts_bounds(const geom_parts_t *parts, double *bounds) {
+  size_t i;
+  bounds[0] = bounds[1] = HUGE_VAL;
+  bounds[2] = bounds[3] = -HUGE_VAL;
+  for (i = 0; i < parts->point_count; i++) {
+    const double *p = parts->xy + 2 * i;
+    if (p[0] < bounds[0]) bounds[0] = p[0];
+    if (p[1] < bounds[1]) bounds[1] = p[1];
+    if (p[0] > bounds[2]) bounds[2] = p[0];
+    if (p[1] > bounds[3]) bounds[3] = p[1];
+  }
+}
+
+/*
+ * Lists the segments of a flattened geometry that overlap bounds. Points and single point lines become degenerate
+ * segments so they are tested by the same code.
+ */
+static int geom_parts_segments(const geom_parts_t *parts, const double *bounds, geom_segment_t **segments, size_t *count) {
+  geom_segment_t *list;
+  size_t n = 0;
+  size_t i, j;
+
+  list = (geom_segment_t *)sqlite3_malloc((int)((parts->point_count + parts->part_count) * sizeof(geom_segment_t)));
+  if (list == NULL) {
+    return SQLITE_NOMEM;
+  }
+
+  for (i = 0; i < parts->part_count; i++) {
+    const geom_part_t *part = &parts->parts[i];
+    const double *xy = parts->xy + 2 * part->start;
+    size_t segment_count = geom_part_segment_count(parts, part);
+
+    if (segment_count == 0) {
+      for (j = 0; j < part->count; j++) {
+        geom_segment_set(&list[n], xy + 2 * j, xy + 2 * j);
+        n += geom_segment_overlaps(&list[n], bounds);
+      }
+      continue;
+    }
+    for (j = 0; j < segment_count; j++) {
+      geom_segment_set(&list[n], xy + 2 * j, xy + 2 * ((j + 1) % part->count));
+      n += geom_segment_overlaps(&list[n], bounds);
+    }
+  }
+
+  *segments = list;
+  *count = n;
+  return SQLITE_OK;
+}
+
+static int geom_segment_pair_intersects(const geom_segment_t *s, const geom_segment_t *t) {
+  return s->max_y >= t->min_y && s->min_y <= t->max_y && s->max_x >= t->min_x && s->min_x <= t->max_x
+         && geom_segments_intersect(s->p, s->q, t->p, t->q);
+}
+
+/*
+ * Below this number of candidate pairs every pair is tested; above it the segments are swept in order of their
+ * minimum x, only testing pairs whose x ranges overlap.
+ */
+#define GEOM_PARTS_BRUTE_FORCE_PAIRS 4096
+
+static int geom_segments_sweep(geom_segment_t *a, size_t na, geom_segment_t *b, size_t nb, int *intersects) {
+  size_t *active[2];
+  size_t active_count[2] = {0, 0};
+  geom_segment_t *lists[2];
+  size_t i[2] = {0, 0};
+  size_t n[2];
+  int result = SQLITE_OK;
+
+  *intersects = 0;
+  lists[0] = a;
+  lists[1] = b;
+  n[0] = na;
+  n[1] = nb;
+
+  if (na * nb <= GEOM_PARTS_BRUTE_FORCE_PAIRS) {
+    size_t k, l;
+    for (k = 0; k < na; k++) {
+      for (l = 0; l < nb; l++) {
+        if (geom_segment_pair_intersects(&a[k], &b[l])) {
+          *intersects = 1;
+          return SQLITE_OK;
+        }
+      }
+    }
+    return SQLITE_OK;
+  }
+
+  qsort(a, na, sizeof(geom_segment_t), geom_segment_cmp);
+  qsort(b, nb, sizeof(geom_segment_t), geom_segment_cmp);
+  active[0] = (size_t *)sqlite3_malloc((int)((na + nb) * sizeof(size_t)));
+  if (active[0] == NULL) {
+    return SQLITE_NOMEM;
+  }
+  active[1] = active[0] + na;
+
+  while (i[0] < n[0] || i[1] < n[1]) {
+    int side = (i[1] >= n[1] || (i[0] < n[0] && lists[0][i[0]].min_x <= lists[1][i[1]].min_x)) ? 0 : 1;
+    int other = 1 - side;
+    const geom_segment_t *s = &lists[side][i[side]];
+    size_t k, kept = 0;
+
+    // Segments of the other side that end before this one starts can not intersect anything that follows
+    for (k = 0; k < active_count[other]; k++) {
+      const geom_segment_t *t = &lists[other][active[other][k]];
+      if (t->max_x < s->min_x) {
+        continue;
+      }
+      active[other][kept++] = active[other][k];
+      if (geom_segment_pair_intersects(s, t)) {
+        *intersects = 1;
+        goto exit;
+      }
+    }
+    active_count[other] = kept;
+    active[side][active_count[side]++] = i[side]++;
+  }
+
+exit:
+  sqlite3_free(active[0]);
+  return result;
+}
+
+/*
+ * Determines if a component of a lies inside the area of b. Without boundary contact every component of a lies
+ * either entirely inside or entirely outside of b, so one point per line or ring suffices; every isolated point is
+ * its own component.
+ */
+static int geom_parts_component_inside(const geom_parts_t *a, const geom_parts_t *b, const double *b_bounds) {
+  size_t i, j;
+
+  if (b->polygon_count == 0) {
+    return 0;
+  }
+  for (i = 0; i < a->part_count; i++) {
+    const geom_part_t *part = &a->parts[i];
+    size_t count = part->kind == GEOM_PART_POINTS ? part->count : 1;
+    for (j = 0; j < count; j++) {
+      const double *p = a->xy + 2 * (part->start + j);
+      if (p[0] >= b_bounds[0] && p[0] <= b_bounds[2] && p[1] >= b_bounds[1] && p[1] <= b_bounds[3]
+          && geom_parts_contains_point(b, p)) {
+        return 1;
+      }
+    }
+  }
+  return 0;
+}
+
+int geom_parts_intersects(const geom_parts_t *a, const geom_parts_t *b, int *intersects) {
+  geom_segment_t *sa = NULL;
+  geom_segment_t *sb = NULL;
+  size_t na = 0, nb = 0;
+  double a_bounds[4];
+  double b_bounds[4];
+  int result;
+
+  *intersects = 0;
+  if (a->point_count == 0 || b->point_count == 0) {
+    return SQLITE_OK;
+  }
+
+  geom_parts_bounds(a, a_bounds);
+  geom_parts_bounds(b, b_bounds);
+  if (a_bounds[2] < b_bounds[0] || a_bounds[0] > b_bounds[2] || a_bounds[3] < b_bounds[1] || a_bounds[1] > b_bounds[3]) {
+    return SQLITE_OK;
+  }
+
+  // Containment is the cheap test for the common point in polygon case, so it goes before the segment tests
+  if (geom_parts_component_inside(a, b, b_bounds) || geom_parts_component_inside(b, a, a_bounds)) {
+    *intersects = 1;
+    return SQLITE_OK;
+  }
+
+  result = geom_parts_segments(a, b_bounds, &sa, &na);
+  if (result == SQLITE_OK) {
+    result = geom_parts_segments(b, a_bounds, &sb, &nb);
+  }
+  if (result == SQLITE_OK) {
+    result = geom_segments_sweep(sa, na, sb, nb, intersects);
+  }
+
+  sqlite3_free(sa);
+  sqlite3_free(sb);
+  return result;
+}
+
+/*
+ * Returns the squared distance from c to the closed segment a b.
+ */
+static double geom_point_segment_distance_sq(const double *a, const double *b, const double *c) {
+  double dx = b[0] - a[0];
+  double dy = b[1] - a[1];
+  double length_sq = dx * dx + dy * dy;
+  double t = 0.0;
+  double px, py;
+
+  if (length_sq > 0.0) {
+    t = ((c[0] - a[0]) * dx + (c[1] - a[1]) * dy) / length_sq;
+    t = t < 0.0 ? 0.0 : t > 1.0 ? 1.0 : t;
+  }
+  px = a[0] + t * dx - c[0];
+  py = a[1] + t * dy - c[1];
+  return px * px + py * py;
+}
+
+/*
+ * Returns the squared distance between two segments: 0 if they intersect, otherwise the smallest distance from an
+ * end point of one segment to the other segment.
+ */
+static double geom_segment_pair_distance_sq(const geom_segment_t *s, const geom_segment_t *t) {
+  double d, min;
+
+  if (geom_segment_pair_intersects(s, t)) {
+    return 0.0;
+  }
+  min = geom_point_segment_distance_sq(s->p, s->q, t->p);
+  d = geom_point_segment_distance_sq(s->p, s->q, t->q);
+  if (d < min) min = d;
+  d = geom_point_segment_distance_sq(t->p, t->q, s->p);
+  if (d < min) min = d;
+  d = geom_point_segment_distance_sq(t->p, t->q, s->q);
+  if (d < min) min = d;
+  return min;
+}
+
+/*
+ * Returns the distance between the bounding boxes of two segments along x and y.
+ */
+static void geom_segment_gap(const geom_segment_t *s, const geom_segment_t *t, double *dx, double *dy) {
+  *dx = t->min_x > s->max_x ? t->min_x - s->max_x : s->min_x > t->max_x ? s->min_x - t->max_x : 0.0;
+  *dy = t->min_y > s->max_y ? t->min_y - s->max_y : s->min_y > t->max_y ? s->min_y - t->max_y : 0.0;
+}
+
+/*
+ * Lowers *best to the distance between s and t if that is smaller. Pairs whose boxes are further apart than *best
+ * are skipped without computing the segment distance.
+ * @return 1 if the search can stop because s and t are no further apart than stop
+ */
+static int geom_segment_pair_closer(const geom_segment_t *s, const geom_segment_t *t, double stop, double *best) {
+  double dx, dy, d;
+
+  geom_segment_gap(s, t, &dx, &dy);
+  if (dx > *best || dy > *best || dx * dx + dy * dy > *best * *best) {
+    return 0;
+  }
+  d = geom_segment_pair_distance_sq(s, t);
+  if (d < *best * *best) {
+    *best = sqrt(d);
+  }
+  return d <= stop * stop;
+}
+
+/*
+ * Finds the smallest distance between a segment of a and a segment of b that is smaller than *best. Like
+ * geom_segments_sweep, large inputs are swept in order of minimum x; a segment leaves the active list once its
+ * maximum x is more than *best to the left of the sweep line, and *best only shrinks, so it is never needed again.
+ */
+static int geom_segments_distance_sweep(geom_segment_t *a, size_t na, geom_segment_t *b, size_t nb, double stop, double *best, int *stopped) {
+  size_t *active[2];
+  size_t active_count[2] = {0, 0};
+  geom_segment_t *lists[2];
+  size_t i[2] = {0, 0};
+  size_t n[2];
+
+  *stopped = 0;
+  lists[0] = a;
+  lists[1] = b;
+  n[0] = na;
+  n[1] = nb;
+
+  if (na * nb <= GEOM_PARTS_BRUTE_FORCE_PAIRS) {
+    size_t k, l;
+    for (k = 0; k < na; k++) {
+      for (l = 0; l < nb; l++) {
+        if (geom_segment_pair_closer(&a[k], &b[l], stop, best)) {
+          *stopped = 1;
+          return SQLITE_OK;
+        }
+      }
+    }
+    return SQLITE_OK;
+  }
+
+  qsort(a, na, sizeof(geom_segment_t), geom_segment_cmp);
+  qsort(b, nb, sizeof(geom_segment_t), geom_segment_cmp);
+  active[0] = (size_t *)sqlite3_malloc((int)((na + nb) * sizeof(size_t)));
+  if (active[0] == NULL) {
+    return SQLITE_NOMEM;
+  }
+  active[1] = active[0] + na;
+
+  while (i[0] < n[0] || i[1] < n[1]) {
+    int side = (i[1] >= n[1] || (i[0] < n[0] && lists[0][i[0]].min_x <= lists[1][i[1]].min_x)) ? 0 : 1;
+    int other = 1 - side;
+    const geom_segment_t *s = &lists[side][i[side]];
+    size_t k, kept = 0;
+
+    for (k = 0; k < active_count[other]; k++) {
+      const geom_segment_t *t = &lists[other][active[other][k]];
+      if (t->max_x < s->min_x - *best) {
+        continue;
+      }
+      active[other][kept++] = active[other][k];
+      if (geom_segment_pair_closer(s, t, stop, best)) {
+        *stopped = 1;
+        goto exit;
+      }
+    }
+    active_count[other] = kept;
+    active[side][active_count[side]++] = i[side]++;
+  }
+
+exit:
+  sqlite3_free(active[0]);
+  return SQLITE_OK;
+}
+
+int geom_parts_distance(const geom_parts_t *a, const geom_parts_t *b, double limit, double *distance) {
+  geom_segment_t *sa = NULL;
+  geom_segment_t *sb = NULL;
+  size_t na = 0, nb = 0;
+  double a_bounds[4];
+  double b_bounds[4];
+  double best, dx, dy;
+  int result;
+
+  *distance = HUGE_VAL;
+  if (a->point_count == 0 || b->point_count == 0) {
+    return SQLITE_OK;
+  }
+
+  geom_parts_bounds(a, a_bounds);
+  geom_parts_bounds(b, b_bounds);
+  if (limit >= 0.0) {
+    // Only pairs within the limit matter, so the limit is the initial bound
+    best = limit;
+  }
+  else {
+    // Any pair of vertices bounds the distance from above
+    dx = a->xy[0] - b->xy[0];
+    dy = a->xy[1] - b->xy[1];
+    best = sqrt(dx * dx + dy * dy);
+  }
+
+  dx = b_bounds[0] > a_bounds[2] ? b_bounds[0] - a_bounds[2] : a_bounds[0] > b_bounds[2] ? a_bounds[0] - b_bounds[2] : 0.0;
+  dy = b_bounds[1] > a_bounds[3] ? b_bounds[1] - a_bounds[3] : a_bounds[1] > b_bounds[3] ? a_bounds[1] - b_bounds[3] : 0.0;
+  if (dx * dx + dy * dy > best * best) {
+    return SQLITE_OK;
+  }
+
+  if (dx == 0.0 && dy == 0.0
+      && (geom_parts_component_inside(a, b, b_bounds) || geom_parts_component_inside(b, a, a_bounds))) {
+    *distance = 0.0;
+    return SQLITE_OK;
+  }
+
+  // Segments further than best from the bounds of the other geometry can not be closer than best
+  a_bounds[0] -= best;
+  a_bounds[1] -= best;
+  a_bounds[2] += best;
+  a_bounds[3] += best;
+  b_bounds[0] -= best;
+  b_bounds[1] -= best;
+  b_bounds[2] += best;
+  b_bounds[3] += best;
+
+  result = geom_parts_segments(a, b_bounds, &sa, &na);
+  if (result == SQLITE_OK) {
+    result = geom_parts_segments(b, a_bounds, &sb, &nb);
+  }
+  if (result == SQLITE_OK && na > 0 && nb > 0) {
+    int stopped;
+    result = geom_segments_distance_sweep(sa, na, sb, nb, limit >= 0.0 ? limit : 0.0, &best, &stopped);
+    if (limit < 0.0 || stopped) {
+      *distance = best;
+    }
+  }
+
+  sqlite3_free(sa);
+  sqlite3_free(sb);
+  return result;
+}
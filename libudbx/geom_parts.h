@@ -0,0 +1,160 @@
+#ifndef UDBX_GEOM_PARTS_H
+#define UDBX_GEOM_PARTS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "geomio.h"
+
+/**
+ * \addtogroup geom_parts Flattened geometries
+ * @{
+ */
+
+/**
+ * The kind of a geometry part.
+ */
+typedef enum {
+  /**
+   * A set of isolated points: the coordinates of a point, multi point or annotation.
+   */
+  GEOM_PART_POINTS,
+  /**
+   * A line: a line string, circular string, compound curve or parametric line string.
+   */
+  GEOM_PART_LINE,
+  /**
+   * A ring bounding the area of a polygon. The first ring of a polygon is its exterior ring.
+   */
+  GEOM_PART_RING
+} geom_part_kind_t;
+
+/**
+ * A run of coordinates of a flattened geometry.
+ */
+typedef struct {
+  geom_part_kind_t kind;
+  /**
+   * The index of the polygon a ring belongs to, -1 for points and lines.
+   */
+  int polygon;
+  /**
+   * The index of the first point of the part in geom_parts_t.xy.
+   */
+  size_t start;
+  /**
+   * The number of points of the part.
+   */
+  size_t count;
+} geom_part_t;
+
+/**
+ * The number of points and parts stored inside geom_parts_t itself before heap buffers are allocated.
+ */
+#define GEOM_PARTS_INLINE_POINTS 256
+#define GEOM_PARTS_INLINE_PARTS 16
+
+/**
+ * A geometry flattened into an array of XY coordinates split into parts. Collections are flattened recursively;
+ * Z and M are dropped. Circular strings contribute their control points. Small geometries are stored inline so
+ * decoding them does not allocate.
+ */
+typedef struct {
+  geom_consumer_t consumer;
+  /**
+   * The coordinates of all parts as x, y pairs.
+   */
+  double *xy;
+  size_t point_count;
+  geom_part_t *parts;
+  size_t part_count;
+  /**
+   * The number of polygons; rings refer to them by index.
+   */
+  int polygon_count;
+  /** @private */
+  size_t point_capacity;
+  /** @private */
+  size_t part_capacity;
+  /** @private */
+  geom_type_t stack[GEOM_MAX_DEPTH];
+  /** @private */
+  int depth;
+  /** @private */
+  int part_depth;
+  /** @private */
+  int compound_members;
+  /** @private */
+  int skip_joint;
+  /** @private */
+  double inline_xy[2 * GEOM_PARTS_INLINE_POINTS];
+  /** @private */
+  geom_part_t inline_parts[GEOM_PARTS_INLINE_PARTS];
+} geom_parts_t;
+
+/**
+ * Initialises an empty flattened geometry.
+ */
+void geom_parts_init(geom_parts_t *parts);
+
+/**
+ * Removes all parts while keeping the allocated buffers for the next geometry.
+ */
+void geom_parts_reset(geom_parts_t *parts);
+
+/**
+ * Frees the buffers of a flattened geometry.
+ */
+void geom_parts_destroy(geom_parts_t *parts);
+
+/**
+ * Returns the geometry consumer that appends the geometries it receives to the flattened geometry.
+ */
+geom_consumer_t *geom_parts_consumer(geom_parts_t *parts);
+
+/**
+ * Returns the number of segments of a part. Points have no segments; rings that are not explicitly closed get a
+ * closing segment.
+ */
+size_t geom_part_segment_count(const geom_parts_t *parts, const geom_part_t *part);
+
+/**
+ * Returns the orientation of the point c relative to the line through a and b: positive if c lies to the left,
+ * negative if it lies to the right and 0 if it is on the line.
+ */
+double geom_orient(const double *a, const double *b, const double *c);
+
+/**
+ * Determines if the closed segments p1 p2 and q1 q2 have at least one point in common. Segments may be degenerate.
+ */
+int geom_segments_intersect(const double *p1, const double *p2, const double *q1, const double *q2);
+
+/**
+ * Determines if a point lies in the interior of the area of the polygons of a flattened geometry using the even-odd
+ * rule per polygon. Points on a ring may be reported either way.
+ */
+int geom_parts_contains_point(const geom_parts_t *parts, const double *point);
+
+/**
+ * Determines if two flattened geometries have at least one point in common. Points, lines and polygon areas are all
+ * taken into account. Segment pairs are found with a plane sweep over x once the inputs are large.
+ * @param[out] intersects set to 1 if the geometries intersect, 0 otherwise
+ * @return SQLITE_OK on success, SQLITE_NOMEM on allocation failure
+ */
+int geom_parts_intersects(const geom_parts_t *a, const geom_parts_t *b, int *intersects);
+
+/**
+ * Computes the smallest distance between two flattened geometries. The distance is 0 when they intersect, including
+ * when one lies inside the area of the other. Segment pairs whose bounding boxes are further apart than the closest
+ * pair found so far are skipped, and large inputs are swept over x as in geom_parts_intersects.
+ * @param limit a negative value to compute the exact distance. Otherwise the search stops at the first pair of
+ *        segments that are no further apart than limit, and segments further than limit from the other geometry are
+ *        never looked at; the distance is then only meaningful compared to limit.
+ * @param[out] distance the distance, or HUGE_VAL if either geometry is empty or, with a limit, the geometries are
+ *        further apart than limit
+ * @return SQLITE_OK on success, SQLITE_NOMEM on allocation failure
+ */
+int geom_parts_distance(const geom_parts_t *a, const geom_parts_t *b, double limit, double *distance);
+
+/** @} */
+
+#endif
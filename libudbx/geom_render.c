@@ -0,0 +1,252 @@
+#include <math.h>
+#include <string.h>
+#include "geom_render.h"
+#include "sqlite.h"
+
+#define RENDER_NONE -1
+
+/*
+ * Pixel coordinates are clamped to this magnitude so that deltas between them always fit in 32 bits.
+ */
+#define RENDER_MAX_PIXEL 1073741823.0
+
+static int render_is_polygon(geom_type_t geom_type) {
+  return geom_type == GEOM_POLYGON || geom_type == GEOM_CURVEPOLYGON || geom_type == GEOM_PARAMETRICPOLYGON;
+}
+
+static int render_is_point(geom_type_t geom_type) {
+  return geom_type == GEOM_POINT || geom_type == GEOM_ANNOTATION || geom_type == GEOM_PARAMETRICPOINT || geom_type == GEOM_PARAMETRICANNOTATION;
+}
+
+static int render_write_varint(binstream_t *stream, uint32_t value) {
+  uint8_t bytes[5];
+  size_t n = 0;
+
+  while (value >= 0x80) {
+    bytes[n++] = (uint8_t)(value | 0x80);
+    value >>= 7;
+  }
+  bytes[n++] = (uint8_t)value;
+  return binstream_write_nu8(stream, bytes, n);
+}
+
+static uint32_t render_zigzag(int32_t value) {
+  return ((uint32_t)value << 1) ^ (uint32_t)(value >> 31);
+}
+
+/*
+ * Writes the buffered pixels as a part unless it collapsed.
+ */
+static int render_flush(geom_render_t *r) {
+  size_t n = r->pixel_count;
+  int kind = r->part_kind;
+  int result = SQLITE_OK;
+  size_t i;
+
+  r->pixel_count = 0;
+  r->part_kind = RENDER_NONE;
+
+  if (kind == GEOM_RENDER_EXTERIOR_RING || kind == GEOM_RENDER_INTERIOR_RING) {
+    // The closing pixel repeats the first one
+    if (n > 1 && r->pixels[0] == r->pixels[2 * (n - 1)] && r->pixels[1] == r->pixels[2 * (n - 1) + 1]) {
+      n--;
+    }
+    if (n < 3 || r->drop_rings) {
+      if (kind == GEOM_RENDER_EXTERIOR_RING) {
+        r->drop_rings = 1;
+      }
+      return SQLITE_OK;
+    }
+  } else if (n == 0 || (kind == GEOM_RENDER_LINE && n < 2)) {
+    return SQLITE_OK;
+  }
+
+  result = render_write_varint(&r->stream, (uint32_t)(n << 2) | (uint32_t)kind);
+  for (i = 0; i < n && result == SQLITE_OK; i++) {
+    int32_t col = r->pixels[2 * i];
+    int32_t row = r->pixels[2 * i + 1];
+    result = render_write_varint(&r->stream, render_zigzag(col - r->cursor[0]));
+    if (result == SQLITE_OK) {
+      result = render_write_varint(&r->stream, render_zigzag(row - r->cursor[1]));
+    }
+    r->cursor[0] = col;
+    r->cursor[1] = row;
+  }
+  return result;
+}
+
+/*
+ * Starts a part of the given kind. Points continue an open points part.
+ */
+static int render_open(geom_render_t *r, int kind) {
+  int result = SQLITE_OK;
+  if (r->part_kind != RENDER_NONE && (kind != GEOM_RENDER_POINTS || r->part_kind != GEOM_RENDER_POINTS)) {
+    result = render_flush(r);
+  }
+  r->part_kind = kind;
+  r->part_depth = r->depth;
+  return result;
+}
+
+static int render_reserve(geom_render_t *r, size_t count) {
+  size_t capacity;
+  int32_t *pixels;
+
+  if (count <= r->capacity) {
+    return SQLITE_OK;
+  }
+  capacity = r->capacity == 0 ? 256 : r->capacity;
+  while (capacity < count) {
+    capacity *= 2;
+  }
+  pixels = (int32_t *)sqlite3_realloc(r->pixels, (int)(2 * capacity * sizeof(int32_t)));
+  if (pixels == NULL) {
+    return SQLITE_NOMEM;
+  }
+  r->pixels = pixels;
+  r->capacity = capacity;
+  return SQLITE_OK;
+}
+
+static int render_begin(const geom_consumer_t *consumer, errorstream_t *error) {
+  geom_render_t *r = (geom_render_t *)consumer;
+  r->depth = 0;
+  r->part_depth = -1;
+  r->part_kind = RENDER_NONE;
+  r->pixel_count = 0;
+  r->cursor[0] = r->cursor[1] = 0;
+  binstream_reset(&r->stream);
+  return SQLITE_OK;
+}
+
+static int render_end(const geom_consumer_t *consumer, errorstream_t *error) {
+  geom_render_t *r = (geom_render_t *)consumer;
+  int result = render_flush(r);
+  binstream_flip(&r->stream);
+  return result;
+}
+
+static int render_begin_geometry(const geom_consumer_t *consumer, const geom_header_t *header, errorstream_t *error) {
+  geom_render_t *r = (geom_render_t *)consumer;
+  geom_type_t parent = r->depth > 0 ? r->stack[r->depth - 1] : GEOM_GEOMETRY;
+
+  if (r->depth >= GEOM_MAX_DEPTH) {
+    return SQLITE_IOERR;
+  }
+  r->stack[r->depth++] = header->geom_type;
+
+  if (r->part_depth >= 0 && r->part_kind != GEOM_RENDER_POINTS) {
+    // A member of a compound curve; the repeated joint point merges with the previous pixel
+    return SQLITE_OK;
+  }
+
+  if (render_is_polygon(header->geom_type)) {
+    r->ring_index = 0;
+    r->drop_rings = 0;
+    return SQLITE_OK;
+  }
+  if (render_is_point(header->geom_type)) {
+    return render_open(r, GEOM_RENDER_POINTS);
+  }
+  switch (header->geom_type) {
+    case GEOM_LINESTRING:
+    case GEOM_CIRCULARSTRING:
+    case GEOM_COMPOUNDCURVE:
+    case GEOM_PARAMETRICLINESTRING:
+    case GEOM_LINEARRING:
+      if (render_is_polygon(parent)) {
+        return render_open(r, r->ring_index++ == 0 ? GEOM_RENDER_EXTERIOR_RING : GEOM_RENDER_INTERIOR_RING);
+      }
+      return render_open(r, GEOM_RENDER_LINE);
+    default:
+      return SQLITE_OK;
+  }
+}
+
+static int render_end_geometry(const geom_consumer_t *consumer, const geom_header_t *header, errorstream_t *error) {
+  geom_render_t *r = (geom_render_t *)consumer;
+  int result = SQLITE_OK;
+
+  if (r->depth == r->part_depth) {
+    r->part_depth = -1;
+    // Points stay open so consecutive points share a part
+    if (r->part_kind != GEOM_RENDER_POINTS) {
+      result = render_flush(r);
+    }
+  }
+  r->depth--;
+  return result;
+}
+
+static int render_coordinates(const geom_consumer_t *consumer, const geom_header_t *header, size_t point_count, const double *coords, int skip_coords, errorstream_t *error) {
+  geom_render_t *r = (geom_render_t *)consumer;
+  size_t stride = header->coord_size;
+  size_t i = (size_t)skip_coords / stride;
+  int32_t *pixels;
+  size_t n;
+  int result;
+
+  if (r->part_kind == RENDER_NONE || i >= point_count) {
+    return SQLITE_OK;
+  }
+  result = render_reserve(r, r->pixel_count + point_count - i);
+  if (result != SQLITE_OK) {
+    return result;
+  }
+
+  pixels = r->pixels;
+  n = r->pixel_count;
+  for (; i < point_count; i++) {
+    double col = floor((coords[i * stride] - r->origin[0]) * r->scale[0]);
+    double row = floor((r->origin[1] - coords[i * stride + 1]) * r->scale[1]);
+    int32_t c, w;
+
+    if (col != col || row != row) {
+      // Empty points have NaN coordinates
+      continue;
+    }
+    c = (int32_t)(col < -RENDER_MAX_PIXEL ? -RENDER_MAX_PIXEL : col > RENDER_MAX_PIXEL ? RENDER_MAX_PIXEL : col);
+    w = (int32_t)(row < -RENDER_MAX_PIXEL ? -RENDER_MAX_PIXEL : row > RENDER_MAX_PIXEL ? RENDER_MAX_PIXEL : row);
+    if (n > 0 && pixels[2 * n - 2] == c && pixels[2 * n - 1] == w) {
+      continue;
+    }
+    pixels[2 * n] = c;
+    pixels[2 * n + 1] = w;
+    n++;
+  }
+  r->pixel_count = n;
+  return SQLITE_OK;
+}
+
+int geom_render_init(geom_render_t *render) {
+  memset(render, 0, sizeof(geom_render_t));
+  geom_consumer_init(&render->consumer, render_begin, render_end, render_begin_geometry, render_end_geometry, render_coordinates, NULL);
+  render->part_depth = -1;
+  render->part_kind = RENDER_NONE;
+  geom_linearize_init(&render->linearize);
+  return binstream_init_growable(&render->stream, 256);
+}
+
+void geom_render_destroy(geom_render_t *render) {
+  binstream_destroy(&render->stream, 1);
+  geom_linearize_destroy(&render->linearize);
+  sqlite3_free(render->pixels);
+  render->pixels = NULL;
+  render->capacity = 0;
+}
+
+geom_consumer_t *geom_render_consumer(geom_render_t *render, const double *box, int width, int height) {
+  render->origin[0] = box[0];
+  render->origin[1] = box[3];
+  render->scale[0] = width / (box[2] - box[0]);
+  render->scale[1] = height / (box[3] - box[1]);
+  return geom_linearize_consumer(&render->linearize, &render->consumer, 0.5 / (render->scale[0] > render->scale[1] ? render->scale[0] : render->scale[1]));
+}
+
+const uint8_t *geom_render_data(geom_render_t *render) {
+  return binstream_data(&render->stream);
+}
+
+size_t geom_render_length(geom_render_t *render) {
+  return binstream_available(&render->stream);
+}
@@ -0,0 +1,100 @@
+#ifndef UDBX_GEOM_RENDER_H
+#define UDBX_GEOM_RENDER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "binstream.h"
+#include "geomio.h"
+#include "geom_linearize.h"
+
+/**
+ * \addtogroup geom_render Render binary
+ * @{
+ */
+
+/**
+ * The kinds of the parts of a render binary.
+ */
+#define GEOM_RENDER_POINTS 0
+#define GEOM_RENDER_LINE 1
+#define GEOM_RENDER_EXTERIOR_RING 2
+#define GEOM_RENDER_INTERIOR_RING 3
+
+/**
+ * A geometry consumer that quantizes the geometries it receives to the pixel grid of an image and writes them as a
+ * compact render binary in a single pass.
+ *
+ * Coordinates are mapped to the integer column floor((x - xmin) / (xmax - xmin) * width) and row
+ * floor((ymax - y) / (ymax - ymin) * height), so rows grow downwards; coordinates outside the box map outside the
+ * image. Consecutive points that fall on the same pixel are merged. Lines left with fewer than 2 pixels and rings
+ * left with fewer than 3 are dropped, together with the interior rings of a dropped exterior ring. Circular arcs are
+ * linearized to within half a pixel first.
+ *
+ * The binary is a sequence of parts. Each part starts with the unsigned LEB128 varint (pixel_count << 2) | kind,
+ * with kind one of GEOM_RENDER_POINTS, GEOM_RENDER_LINE, GEOM_RENDER_EXTERIOR_RING or GEOM_RENDER_INTERIOR_RING,
+ * followed by pixel_count pairs of zigzag encoded varints holding the column and row difference from the previous
+ * pixel of the binary, starting from (0, 0). Rings are not explicitly closed. Consecutive points and multi point
+ * members are written as a single points part.
+ */
+typedef struct {
+  geom_consumer_t consumer;
+  /** @private */
+  geom_linearize_t linearize;
+  /** @private */
+  binstream_t stream;
+  /** @private */
+  double origin[2];
+  /** @private */
+  double scale[2];
+  /** @private */
+  int32_t cursor[2];
+  /** @private */
+  geom_type_t stack[GEOM_MAX_DEPTH];
+  /** @private */
+  int depth;
+  /** @private */
+  int part_depth;
+  /** @private */
+  int part_kind;
+  /** @private */
+  int ring_index;
+  /** @private */
+  int drop_rings;
+  /** @private */
+  int32_t *pixels;
+  /** @private */
+  size_t pixel_count;
+  /** @private */
+  size_t capacity;
+} geom_render_t;
+
+/**
+ * Initialises a render binary writer.
+ * @return SQLITE_OK on success, SQLITE_NOMEM if the output buffer could not be allocated
+ */
+int geom_render_init(geom_render_t *render);
+
+/**
+ * Frees the buffers of a render binary writer.
+ */
+void geom_render_destroy(geom_render_t *render);
+
+/**
+ * Returns the geometry consumer that writes the geometries it receives as a render binary for an image of width by
+ * height pixels covering box (xmin, ymin, xmax, ymax). The previous output is discarded; the buffers are reused.
+ */
+geom_consumer_t *geom_render_consumer(geom_render_t *render, const double *box, int width, int height);
+
+/**
+ * Returns the render binary written so far.
+ */
+const uint8_t *geom_render_data(geom_render_t *render);
+
+/**
+ * Returns the length in bytes of the render binary written so far.
+ */
+size_t geom_render_length(geom_render_t *render);
+
+/** @} */
+
+#endif
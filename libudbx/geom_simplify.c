@@ -0,0 +1,426 @@
+#include <math.h>
+#include <string.h>
+#include "geom_simplify.h"
+#include "sqlite.h"
+
+static int simplify_is_polygon(geom_type_t geom_type) {
+  return geom_type == GEOM_POLYGON || geom_type == GEOM_CURVEPOLYGON || geom_type == GEOM_PARAMETRICPOLYGON;
+}
+
+static int simplify_reserve(geom_simplify_t *s, size_t count) {
+  size_t capacity;
+  double *coords;
+  unsigned char *keep;
+  size_t *indices;
+  double *areas;
+
+  if (count <= s->capacity) {
+    return SQLITE_OK;
+  }
+  capacity = s->capacity == 0 ? 256 : s->capacity;
+  while (capacity < count) {
+    capacity *= 2;
+  }
+
+  coords = (double *)sqlite3_realloc(s->coords, (int)(capacity * GEOM_MAX_COORD_SIZE * sizeof(double)));
+  if (coords == NULL) {
+    return SQLITE_NOMEM;
+  }
+  s->coords = coords;
+  keep = (unsigned char *)sqlite3_realloc(s->keep, (int)capacity);
+  if (keep == NULL) {
+    return SQLITE_NOMEM;
+  }
+  s->keep = keep;
+  indices = (size_t *)sqlite3_realloc(s->indices, (int)(4 * capacity * sizeof(size_t)));
+  if (indices == NULL) {
+    return SQLITE_NOMEM;
+  }
+  s->indices = indices;
+  areas = (double *)sqlite3_realloc(s->areas, (int)(capacity * sizeof(double)));
+  if (areas == NULL) {
+    return SQLITE_NOMEM;
+  }
+  s->areas = areas;
+  s->capacity = capacity;
+  return SQLITE_OK;
+}
+
+static double simplify_distance_sq(const double *a, const double *b) {
+  double dx = b[0] - a[0];
+  double dy = b[1] - a[1];
+  return dx * dx + dy * dy;
+}
+
+/*
+ * Returns the squared distance from c to the segment a b.
+ */
+static double simplify_segment_distance_sq(const double *a, const double *b, const double *c) {
+  double dx = b[0] - a[0];
+  double dy = b[1] - a[1];
+  double length_sq = dx * dx + dy * dy;
+  double t = 0.0;
+  double px, py;
+
+  if (length_sq > 0.0) {
+    t = ((c[0] - a[0]) * dx + (c[1] - a[1]) * dy) / length_sq;
+    t = t < 0.0 ? 0.0 : t > 1.0 ? 1.0 : t;
+  }
+  px = a[0] + t * dx - c[0];
+  py = a[1] + t * dy - c[1];
+  return px * px + py * py;
+}
+
+static double simplify_triangle_area(const double *a, const double *b, const double *c) {
+  return fabs((b[0] - a[0]) * (c[1] - a[1]) - (b[1] - a[1]) * (c[0] - a[0])) * 0.5;
+}
+
+/*
+ * Removes the points that lie within the tolerance of the previous remaining point. The last point is always kept.
+ * This is linear and removes most of the points of densely sampled lines before the more expensive passes.
+ */
+static size_t simplify_radial(geom_simplify_t *s, size_t n, size_t stride) {
+  double tolerance_sq = s->tolerance * s->tolerance;
+  double *coords = s->coords;
+  size_t last = 0;
+  size_t kept = 1;
+  size_t i;
+
+  for (i = 1; i < n - 1; i++) {
+    if (simplify_distance_sq(coords + last * stride, coords + i * stride) > tolerance_sq) {
+      if (kept != i) {
+        memcpy(coords + kept * stride, coords + i * stride, stride * sizeof(double));
+      }
+      last = kept++;
+    }
+  }
+  if (kept != n - 1) {
+    memcpy(coords + kept * stride, coords + (n - 1) * stride, stride * sizeof(double));
+  }
+  return kept + 1;
+}
+
+/*
+ * Marks the points kept by Douglas-Peucker. Ranges still to be split are kept on an explicit stack rather than
+ * through recursion, so deep lines can not overflow the call stack.
+ */
+static void simplify_douglas_peucker(geom_simplify_t *s, size_t n, size_t stride) {
+  double tolerance_sq = s->tolerance * s->tolerance;
+  const double *coords = s->coords;
+  size_t *stack = s->indices;
+  size_t top = 0;
+
+  memset(s->keep, 0, n);
+  s->keep[0] = 1;
+  s->keep[n - 1] = 1;
+  stack[top++] = 0;
+  stack[top++] = n - 1;
+
+  while (top > 0) {
+    size_t last = stack[--top];
+    size_t first = stack[--top];
+    const double *a = coords + first * stride;
+    const double *b = coords + last * stride;
+    double max_sq = -1.0;
+    size_t index = first;
+    size_t i;
+
+    for (i = first + 1; i < last; i++) {
+      double d = simplify_segment_distance_sq(a, b, coords + i * stride);
+      if (d > max_sq) {
+        max_sq = d;
+        index = i;
+      }
+    }
+
+    if (max_sq > tolerance_sq) {
+      s->keep[index] = 1;
+      if (index - first > 1) {
+        stack[top++] = first;
+        stack[top++] = index;
+      }
+      if (last - index > 1) {
+        stack[top++] = index;
+        stack[top++] = last;
+      }
+    }
+  }
+}
+
+/*
+ * A binary min heap of point indices ordered by the effective area of the points.
+ */
+static int simplify_heap_less(const geom_simplify_t *s, const size_t *heap, size_t i, size_t j) {
+  return s->areas[heap[i]] < s->areas[heap[j]];
+}
+
+static void simplify_heap_swap(size_t *heap, size_t *pos, size_t i, size_t j) {
+  size_t t = heap[i];
+  heap[i] = heap[j];
+  heap[j] = t;
+  pos[heap[i]] = i;
+  pos[heap[j]] = j;
+}
+
+static void simplify_heap_up(const geom_simplify_t *s, size_t *heap, size_t *pos, size_t i) {
+  while (i > 0 && simplify_heap_less(s, heap, i, (i - 1) / 2)) {
+    simplify_heap_swap(heap, pos, i, (i - 1) / 2);
+    i = (i - 1) / 2;
+  }
+}
+
+static void simplify_heap_down(const geom_simplify_t *s, size_t *heap, size_t *pos, size_t size, size_t i) {
+  for (;;) {
+    size_t smallest = i;
+    size_t l = 2 * i + 1;
+    size_t r = l + 1;
+    if (l < size && simplify_heap_less(s, heap, l, smallest)) smallest = l;
+    if (r < size && simplify_heap_less(s, heap, r, smallest)) smallest = r;
+    if (smallest == i) {
+      return;
+    }
+    simplify_heap_swap(heap, pos, i, smallest);
+    i = smallest;
+  }
+}
+
+/*
+ * Marks the points kept by Visvalingam-Whyatt. The remaining points form a doubly linked list; when a point is removed
+ * the areas of its neighbours are recomputed, but never drop below the area of the removed point so that points are
+ * removed in order of significance.
+ */
+static void simplify_visvalingam(geom_simplify_t *s, size_t n, size_t stride) {
+  const double *coords = s->coords;
+  size_t *prev = s->indices;
+  size_t *next = prev + s->capacity;
+  size_t *heap = next + s->capacity;
+  size_t *pos = heap + s->capacity;
+  size_t size = 0;
+  size_t i;
+
+  memset(s->keep, 1, n);
+  for (i = 1; i < n - 1; i++) {
+    prev[i] = i - 1;
+    next[i] = i + 1;
+    s->areas[i] = simplify_triangle_area(coords + (i - 1) * stride, coords + i * stride, coords + (i + 1) * stride);
+    heap[size] = i;
+    pos[i] = size;
+    size++;
+    simplify_heap_up(s, heap, pos, size - 1);
+  }
+  next[0] = 1;
+  prev[n - 1] = n - 2;
+
+  while (size > 0) {
+    size_t point = heap[0];
+    double area = s->areas[point];
+    size_t neighbours[2];
+    int k;
+
+    if (area >= s->tolerance) {
+      break;
+    }
+    simplify_heap_swap(heap, pos, 0, --size);
+    simplify_heap_down(s, heap, pos, size, 0);
+    s->keep[point] = 0;
+
+    next[prev[point]] = next[point];
+    prev[next[point]] = prev[point];
+    neighbours[0] = prev[point];
+    neighbours[1] = next[point];
+    for (k = 0; k < 2; k++) {
+      size_t p = neighbours[k];
+      double updated;
+      if (p == 0 || p == n - 1) {
+        continue;
+      }
+      updated = simplify_triangle_area(coords + prev[p] * stride, coords + p * stride, coords + next[p] * stride);
+      s->areas[p] = updated < area ? area : updated;
+      simplify_heap_up(s, heap, pos, pos[p]);
+      simplify_heap_down(s, heap, pos, size, pos[p]);
+    }
+  }
+}
+
+/*
+ * Moves the kept points to the front of the buffer and returns their number.
+ */
+static size_t simplify_compact(geom_simplify_t *s, size_t n, size_t stride) {
+  size_t kept = 0;
+  size_t i;
+
+  for (i = 0; i < n; i++) {
+    if (s->keep[i]) {
+      if (kept != i) {
+        memcpy(s->coords + kept * stride, s->coords + i * stride, stride * sizeof(double));
+      }
+      kept++;
+    }
+  }
+  return kept;
+}
+
+/*
+ * Polygons below the root are only passed on once they have a ring, so a polygon whose exterior ring collapses
+ * disappears from its multi polygon or collection.
+ */
+static int simplify_flush_polygon(geom_simplify_t *s, errorstream_t *error) {
+  int result = SQLITE_OK;
+  if (s->pending_polygon) {
+    s->pending_polygon = 0;
+    result = s->target->begin_geometry(s->target, &s->polygon_header, error);
+  }
+  return result;
+}
+
+static int simplify_part(geom_simplify_t *s, errorstream_t *error) {
+  const geom_header_t *header = &s->part_header;
+  size_t stride = header->coord_size;
+  size_t n = s->point_count;
+  int result;
+
+  if (n > 2) {
+    if (s->method == GEOM_SIMPLIFY_VISVALINGAM) {
+      simplify_visvalingam(s, n, stride);
+    } else {
+      n = simplify_radial(s, n, stride);
+      simplify_douglas_peucker(s, n, stride);
+    }
+    n = simplify_compact(s, n, stride);
+  }
+
+  if (s->part_ring) {
+    int collapsed = s->drop_rings || (n < 4 && s->point_count >= 4);
+    if (collapsed && s->ring_index == 0) {
+      s->drop_rings = 1;
+    }
+    s->ring_index++;
+    if (collapsed) {
+      return SQLITE_OK;
+    }
+  }
+
+  result = simplify_flush_polygon(s, error);
+  if (result == SQLITE_OK) {
+    result = s->target->begin_geometry(s->target, header, error);
+  }
+  if (result == SQLITE_OK && n > 0) {
+    result = s->target->coordinates(s->target, header, n, s->coords, 0, error);
+  }
+  if (result == SQLITE_OK) {
+    result = s->target->end_geometry(s->target, header, error);
+  }
+  return result;
+}
+
+static int simplify_begin(const geom_consumer_t *consumer, errorstream_t *error) {
+  geom_simplify_t *s = (geom_simplify_t *)consumer;
+  s->depth = 0;
+  s->part_depth = -1;
+  s->pending_polygon = 0;
+  return s->target->begin(s->target, error);
+}
+
+static int simplify_end(const geom_consumer_t *consumer, errorstream_t *error) {
+  geom_simplify_t *s = (geom_simplify_t *)consumer;
+  return s->target->end(s->target, error);
+}
+
+static int simplify_begin_geometry(const geom_consumer_t *consumer, const geom_header_t *header, errorstream_t *error) {
+  geom_simplify_t *s = (geom_simplify_t *)consumer;
+  geom_type_t parent = s->depth > 0 ? s->stack[s->depth - 1] : GEOM_GEOMETRY;
+  int result;
+
+  if (s->depth >= GEOM_MAX_DEPTH) {
+    return SQLITE_IOERR;
+  }
+  s->stack[s->depth++] = header->geom_type;
+
+  if ((header->geom_type == GEOM_LINESTRING || header->geom_type == GEOM_LINEARRING) && parent != GEOM_COMPOUNDCURVE) {
+    s->part_depth = s->depth;
+    s->part_header = *header;
+    s->part_ring = simplify_is_polygon(parent);
+    s->point_count = 0;
+    return SQLITE_OK;
+  }
+
+  if (simplify_is_polygon(header->geom_type)) {
+    s->ring_index = 0;
+    s->drop_rings = 0;
+    if (s->depth > 1) {
+      s->pending_polygon = 1;
+      s->polygon_header = *header;
+      return SQLITE_OK;
+    }
+  }
+
+  result = simplify_flush_polygon(s, error);
+  if (result == SQLITE_OK) {
+    result = s->target->begin_geometry(s->target, header, error);
+  }
+  return result;
+}
+
+static int simplify_end_geometry(const geom_consumer_t *consumer, const geom_header_t *header, errorstream_t *error) {
+  geom_simplify_t *s = (geom_simplify_t *)consumer;
+  int result = SQLITE_OK;
+
+  if (s->depth == s->part_depth) {
+    s->part_depth = -1;
+    result = simplify_part(s, error);
+  } else if (simplify_is_polygon(header->geom_type) && s->pending_polygon) {
+    // Every ring collapsed; the polygon is left out
+    s->pending_polygon = 0;
+  } else {
+    result = s->target->end_geometry(s->target, header, error);
+  }
+  s->depth--;
+  return result;
+}
+
+static int simplify_coordinates(const geom_consumer_t *consumer, const geom_header_t *header, size_t point_count, const double *coords, int skip_coords, errorstream_t *error) {
+  geom_simplify_t *s = (geom_simplify_t *)consumer;
+  size_t stride = header->coord_size;
+  size_t skip = (size_t)skip_coords / stride;
+  int result;
+
+  if (s->depth != s->part_depth) {
+    return s->target->coordinates(s->target, header, point_count, coords, skip_coords, error);
+  }
+  if (skip >= point_count) {
+    return SQLITE_OK;
+  }
+
+  result = simplify_reserve(s, s->point_count + point_count - skip);
+  if (result != SQLITE_OK) {
+    return result;
+  }
+  memcpy(s->coords + s->point_count * stride, coords + skip * stride, (point_count - skip) * stride * sizeof(double));
+  s->point_count += point_count - skip;
+  return SQLITE_OK;
+}
+
+void geom_simplify_init(geom_simplify_t *simplify) {
+  memset(simplify, 0, sizeof(geom_simplify_t));
+  geom_consumer_init(&simplify->consumer, simplify_begin, simplify_end, simplify_begin_geometry, simplify_end_geometry, simplify_coordinates, NULL);
+  simplify->part_depth = -1;
+}
+
+void geom_simplify_destroy(geom_simplify_t *simplify) {
+  sqlite3_free(simplify->coords);
+  sqlite3_free(simplify->keep);
+  sqlite3_free(simplify->indices);
+  sqlite3_free(simplify->areas);
+  simplify->coords = NULL;
+  simplify->keep = NULL;
+  simplify->indices = NULL;
+  simplify->areas = NULL;
+  simplify->capacity = 0;
+}
+
+geom_consumer_t *geom_simplify_consumer(geom_simplify_t *simplify, geom_consumer_t *target, geom_simplify_method_t method, double tolerance) {
+  simplify->target = target;
+  simplify->method = method;
+  simplify->tolerance = tolerance;
+  return &simplify->consumer;
+}
@@ -0,0 +1,96 @@
+#ifndef UDBX_GEOM_SIMPLIFY_H
+#define UDBX_GEOM_SIMPLIFY_H
+
+#include <stddef.h>
+#include "geomio.h"
+
+/**
+ * \addtogroup geom_simplify Line simplification
+ * @{
+ */
+
+/**
+ * The simplification algorithm.
+ */
+typedef enum {
+  /**
+   * Douglas-Peucker with a radial distance prefilter. The tolerance is a distance: every removed vertex lies within
+   * the tolerance of the simplified line.
+   */
+  GEOM_SIMPLIFY_DOUGLAS_PEUCKER,
+  /**
+   * Visvalingam-Whyatt. The tolerance is an area: vertices are removed in order of the area of the triangle they
+   * form with their neighbours while that area is smaller than the tolerance.
+   */
+  GEOM_SIMPLIFY_VISVALINGAM
+} geom_simplify_method_t;
+
+/**
+ * A geometry consumer that simplifies the line strings and linear rings of the geometries it receives and passes the
+ * result on to a target consumer, typically a geometry blob writer. Each line or ring is buffered until it ends, then
+ * only its remaining vertices are forwarded. Lines keep their end points. Rings that collapse to fewer than four
+ * points are dropped, together with the interior rings of a dropped exterior ring. Points, curves and the members of
+ * compound curves are passed on unchanged.
+ *
+ * The buffers are kept when the consumer is reused, so simplifying many geometries does not allocate once the buffers
+ * have grown to the largest line.
+ */
+typedef struct {
+  geom_consumer_t consumer;
+  /** @private */
+  geom_consumer_t *target;
+  /** @private */
+  geom_simplify_method_t method;
+  /** @private */
+  double tolerance;
+  /** @private */
+  geom_type_t stack[GEOM_MAX_DEPTH];
+  /** @private */
+  int depth;
+  /** @private */
+  int part_depth;
+  /** @private */
+  geom_header_t part_header;
+  /** @private */
+  int part_ring;
+  /** @private */
+  int ring_index;
+  /** @private */
+  int drop_rings;
+  /** @private */
+  int pending_polygon;
+  /** @private */
+  geom_header_t polygon_header;
+  /** @private */
+  double *coords;
+  /** @private */
+  size_t point_count;
+  /** @private */
+  size_t capacity;
+  /** @private */
+  unsigned char *keep;
+  /** @private */
+  size_t *indices;
+  /** @private */
+  double *areas;
+} geom_simplify_t;
+
+/**
+ * Initialises a simplifier without buffers.
+ */
+void geom_simplify_init(geom_simplify_t *simplify);
+
+/**
+ * Frees the buffers of a simplifier.
+ */
+void geom_simplify_destroy(geom_simplify_t *simplify);
+
+/**
+ * Returns the geometry consumer that simplifies the geometries it receives with the given method and tolerance and
+ * passes them on to target.
+ */
+geom_consumer_t *geom_simplify_consumer(geom_simplify_t *simplify, geom_consumer_t *target, geom_simplify_method_t method, double tolerance);
+
+/** @} */
+
+#endif
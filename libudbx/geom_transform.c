@@ -0,0 +1,359 @@
+#include <math.h>
+#include <string.h>
+#include "geom_transform.h"
+#include "sqlite.h"
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+#define TRANSFORM_AFFINE 0
+#define TRANSFORM_TO_MERCATOR 1
+#define TRANSFORM_FROM_MERCATOR 2
+#define TRANSFORM_TO_UTM 3
+#define TRANSFORM_FROM_UTM 4
+
+#define TRANSFORM_RADIANS (M_PI / 180.0)
+
+#define WGS84_A 6378137.0
+#define WGS84_F (1.0 / 298.257223563)
+
+/*
+ * Web Mercator is a square; latitudes beyond this one are clamped to its edge.
+ */
+#define MERCATOR_MAX_LAT 85.0511287798066
+
+#define UTM_K0 0.9996
+#define UTM_FALSE_EASTING 500000.0
+#define UTM_FALSE_NORTHING_SOUTH 10000000.0
+
+/*
+ * Parameters of the UTM steps.
+ */
+#define UTM_LON0 0
+#define UTM_FALSE_NORTHING 1
+#define UTM_SERIES 2
+#define UTM_SCALE 8
+#define UTM_E 9
+
+static void transform_affine(const double *m, double *coords, size_t n, size_t stride, int has_z) {
+  size_t i;
+
+  if (has_z) {
+    for (i = 0; i < n; i++) {
+      double *c = coords + i * stride;
+      double x = c[0], y = c[1], z = c[2];
+      c[0] = m[0] * x + m[1] * y + m[2] * z + m[9];
+      c[1] = m[3] * x + m[4] * y + m[5] * z + m[10];
+      c[2] = m[6] * x + m[7] * y + m[8] * z + m[11];
+    }
+  } else {
+    for (i = 0; i < n; i++) {
+      double *c = coords + i * stride;
+      double x = c[0], y = c[1];
+      c[0] = m[0] * x + m[1] * y + m[9];
+      c[1] = m[3] * x + m[4] * y + m[10];
+    }
+  }
+}
+
+static void transform_to_mercator(double *coords, size_t n, size_t stride) {
+  size_t i;
+
+  for (i = 0; i < n; i++) {
+    double *c = coords + i * stride;
+    double lat = c[1];
+    if (lat > MERCATOR_MAX_LAT) {
+      lat = MERCATOR_MAX_LAT;
+    } else if (lat < -MERCATOR_MAX_LAT) {
+      lat = -MERCATOR_MAX_LAT;
+    }
+    c[0] = WGS84_A * c[0] * TRANSFORM_RADIANS;
+    c[1] = WGS84_A * log(tan(M_PI / 4.0 + lat * TRANSFORM_RADIANS / 2.0));
+  }
+}
+
+static void transform_from_mercator(double *coords, size_t n, size_t stride) {
+  size_t i;
+
+  for (i = 0; i < n; i++) {
+    double *c = coords + i * stride;
+    c[0] = c[0] / WGS84_A / TRANSFORM_RADIANS;
+    c[1] = (2.0 * atan(exp(c[1] / WGS84_A)) - M_PI / 2.0) / TRANSFORM_RADIANS;
+  }
+}
+
+/*
+ * UTM uses the Krueger series for the transverse Mercator projection to sixth order in the third flattening n, as
+ * given by Karney, "Transverse Mercator with an accuracy of a few nanometers" (2011). The forward series maps the
+ * conformal sphere onto the plane; latitudes are converted to conformal latitudes and back through tau = tan(phi).
+ */
+static double transform_conformal_tau(double tau, double e) {
+  double tau1 = sqrt(1.0 + tau * tau);
+  double sig = sinh(e * atanh(e * tau / tau1));
+  return sqrt(1.0 + sig * sig) * tau - sig * tau1;
+}
+
+static double transform_geographic_tau(double taup, double e) {
+  double e2m = 1.0 - e * e;
+  double tau = taup;
+  int i;
+
+  // Newton's method converges in two or three iterations
+  for (i = 0; i < 5; i++) {
+    double taupa = transform_conformal_tau(tau, e);
+    double dtau = (taup - taupa) * (1.0 + e2m * tau * tau) / (e2m * sqrt(1.0 + tau * tau) * sqrt(1.0 + taupa * taupa));
+    tau += dtau;
+    if (fabs(dtau) < 1e-14 * (1.0 > fabs(tau) ? 1.0 : fabs(tau))) {
+      break;
+    }
+  }
+  return tau;
+}
+
+static void transform_to_utm(const double *p, double *coords, size_t n, size_t stride) {
+  const double *alpha = p + UTM_SERIES;
+  size_t i;
+  int j;
+
+  for (i = 0; i < n; i++) {
+    double *c = coords + i * stride;
+    double lam = c[0] * TRANSFORM_RADIANS - p[UTM_LON0];
+    double taup = transform_conformal_tau(tan(c[1] * TRANSFORM_RADIANS), p[UTM_E]);
+    double xip = atan2(taup, cos(lam));
+    double etap = asinh(sin(lam) / sqrt(taup * taup + cos(lam) * cos(lam)));
+    double xi = xip;
+    double eta = etap;
+
+    for (j = 1; j <= 6; j++) {
+      xi += alpha[j - 1] * sin(2.0 * j * xip) * cosh(2.0 * j * etap);
+      eta += alpha[j - 1] * cos(2.0 * j * xip) * sinh(2.0 * j * etap);
+    }
+    c[0] = UTM_FALSE_EASTING + p[UTM_SCALE] * eta;
+    c[1] = p[UTM_FALSE_NORTHING] + p[UTM_SCALE] * xi;
+  }
+}
+
+static void transform_from_utm(const double *p, double *coords, size_t n, size_t stride) {
+  const double *beta = p + UTM_SERIES;
+  size_t i;
+  int j;
+
+  for (i = 0; i < n; i++) {
+    double *c = coords + i * stride;
+    double xi = (c[1] - p[UTM_FALSE_NORTHING]) / p[UTM_SCALE];
+    double eta = (c[0] - UTM_FALSE_EASTING) / p[UTM_SCALE];
+    double xip = xi;
+    double etap = eta;
+    double s, r, taup;
+
+    for (j = 1; j <= 6; j++) {
+      xip -= beta[j - 1] * sin(2.0 * j * xi) * cosh(2.0 * j * eta);
+      etap -= beta[j - 1] * cos(2.0 * j * xi) * sinh(2.0 * j * eta);
+    }
+    s = sinh(etap);
+    r = hypot(s, cos(xip));
+    taup = sin(xip) / r;
+    c[0] = (p[UTM_LON0] + atan2(s, cos(xip))) / TRANSFORM_RADIANS;
+    c[1] = atan(transform_geographic_tau(taup, p[UTM_E])) / TRANSFORM_RADIANS;
+  }
+}
+
+static void transform_step(const geom_transform_step_t *step, double *coords, size_t n, size_t stride, int has_z) {
+  switch (step->kind) {
+    case TRANSFORM_AFFINE:
+      transform_affine(step->params, coords, n, stride, has_z);
+      break;
+    case TRANSFORM_TO_MERCATOR:
+      transform_to_mercator(coords, n, stride);
+      break;
+    case TRANSFORM_FROM_MERCATOR:
+      transform_from_mercator(coords, n, stride);
+      break;
+    case TRANSFORM_TO_UTM:
+      transform_to_utm(step->params, coords, n, stride);
+      break;
+    default:
+      transform_from_utm(step->params, coords, n, stride);
+      break;
+  }
+}
+
+static int transform_begin(const geom_consumer_t *consumer, errorstream_t *error) {
+  geom_transform_t *t = (geom_transform_t *)consumer;
+  return t->target->begin(t->target, error);
+}
+
+static int transform_end(const geom_consumer_t *consumer, errorstream_t *error) {
+  geom_transform_t *t = (geom_transform_t *)consumer;
+  return t->target->end(t->target, error);
+}
+
+static int transform_begin_geometry(const geom_consumer_t *consumer, const geom_header_t *header, errorstream_t *error) {
+  geom_transform_t *t = (geom_transform_t *)consumer;
+  return t->target->begin_geometry(t->target, header, error);
+}
+
+static int transform_end_geometry(const geom_consumer_t *consumer, const geom_header_t *header, errorstream_t *error) {
+  geom_transform_t *t = (geom_transform_t *)consumer;
+  return t->target->end_geometry(t->target, header, error);
+}
+
+static int transform_coordinates(const geom_consumer_t *consumer, const geom_header_t *header, size_t point_count, const double *coords, int skip_coords, errorstream_t *error) {
+  geom_transform_t *t = (geom_transform_t *)consumer;
+  size_t stride = header->coord_size;
+  size_t length = point_count * stride;
+  int has_z = header->coord_type == GEOM_XYZ || header->coord_type == GEOM_XYZM;
+  int i;
+
+  if (length > t->capacity) {
+    double *buffer = (double *)sqlite3_malloc((int)(length * sizeof(double)));
+    if (buffer == NULL) {
+      return SQLITE_NOMEM;
+    }
+    if (t->coords != t->inline_coords) {
+      sqlite3_free(t->coords);
+    }
+    t->coords = buffer;
+    t->capacity = length;
+  }
+
+  // The skipped coordinates repeat an earlier point; transforming them again gives the same result
+  memcpy(t->coords, coords, length * sizeof(double));
+  for (i = 0; i < t->step_count; i++) {
+    switch (stride) {
+      case 2:
+        transform_step(&t->steps[i], t->coords, point_count, 2, 0);
+        break;
+      case 3:
+        transform_step(&t->steps[i], t->coords, point_count, 3, has_z);
+        break;
+      default:
+        transform_step(&t->steps[i], t->coords, point_count, 4, has_z);
+        break;
+    }
+  }
+  return t->target->coordinates(t->target, header, point_count, t->coords, skip_coords, error);
+}
+
+void geom_transform_init(geom_transform_t *transform, geom_consumer_t *target) {
+  geom_consumer_init(&transform->consumer, transform_begin, transform_end, transform_begin_geometry, transform_end_geometry, transform_coordinates, NULL);
+  transform->target = target;
+  transform->step_count = 0;
+  transform->coords = transform->inline_coords;
+  transform->capacity = GEOM_MAX_COORD_SIZE * GEOM_TRANSFORM_INLINE_POINTS;
+}
+
+void geom_transform_destroy(geom_transform_t *transform) {
+  if (transform->coords != transform->inline_coords) {
+    sqlite3_free(transform->coords);
+  }
+  transform->coords = transform->inline_coords;
+  transform->capacity = GEOM_MAX_COORD_SIZE * GEOM_TRANSFORM_INLINE_POINTS;
+}
+
+geom_consumer_t *geom_transform_consumer(geom_transform_t *transform) {
+  return &transform->consumer;
+}
+
+static geom_transform_step_t *transform_add_step(geom_transform_t *transform, int kind, errorstream_t *error) {
+  geom_transform_step_t *step;
+
+  if (transform->step_count >= GEOM_TRANSFORM_MAX_STEPS) {
+    if (error) {
+      error_append(error, "Too many transformation steps");
+    }
+    return NULL;
+  }
+  step = &transform->steps[transform->step_count++];
+  memset(step, 0, sizeof(geom_transform_step_t));
+  step->kind = kind;
+  return step;
+}
+
+int geom_transform_add_affine(geom_transform_t *transform, const double *matrix, errorstream_t *error) {
+  geom_transform_step_t *step = transform_add_step(transform, TRANSFORM_AFFINE, error);
+  if (step == NULL) {
+    return SQLITE_ERROR;
+  }
+  memcpy(step->params, matrix, 12 * sizeof(double));
+  return SQLITE_OK;
+}
+
+/*
+ * Returns the UTM zone of a SRID, negative for southern zones, or 0 if it is not a WGS 84 UTM zone.
+ */
+static int transform_utm_zone(int32_t srid) {
+  if (srid >= 32601 && srid <= 32660) {
+    return srid - 32600;
+  }
+  if (srid >= 32701 && srid <= 32760) {
+    return -(srid - 32700);
+  }
+  return 0;
+}
+
+static int transform_add_utm(geom_transform_t *transform, int zone, int forward, errorstream_t *error) {
+  geom_transform_step_t *step = transform_add_step(transform, forward ? TRANSFORM_TO_UTM : TRANSFORM_FROM_UTM, error);
+  double n = WGS84_F / (2.0 - WGS84_F);
+  double n2 = n * n, n3 = n2 * n, n4 = n3 * n, n5 = n4 * n, n6 = n5 * n;
+  double *p;
+
+  if (step == NULL) {
+    return SQLITE_ERROR;
+  }
+  p = step->params;
+  p[UTM_LON0] = ((zone < 0 ? -zone : zone) * 6 - 183) * TRANSFORM_RADIANS;
+  p[UTM_FALSE_NORTHING] = zone < 0 ? UTM_FALSE_NORTHING_SOUTH : 0.0;
+  p[UTM_SCALE] = UTM_K0 * WGS84_A / (1.0 + n) * (1.0 + n2 / 4.0 + n4 / 64.0 + n6 / 256.0);
+  p[UTM_E] = sqrt(WGS84_F * (2.0 - WGS84_F));
+
+  if (forward) {
+    p[UTM_SERIES + 0] = n / 2.0 - 2.0 * n2 / 3.0 + 5.0 * n3 / 16.0 + 41.0 * n4 / 180.0 - 127.0 * n5 / 288.0 + 7891.0 * n6 / 37800.0;
+    p[UTM_SERIES + 1] = 13.0 * n2 / 48.0 - 3.0 * n3 / 5.0 + 557.0 * n4 / 1440.0 + 281.0 * n5 / 630.0 - 1983433.0 * n6 / 1935360.0;
+    p[UTM_SERIES + 2] = 61.0 * n3 / 240.0 - 103.0 * n4 / 140.0 + 15061.0 * n5 / 26880.0 + 167603.0 * n6 / 181440.0;
+    p[UTM_SERIES + 3] = 49561.0 * n4 / 161280.0 - 179.0 * n5 / 168.0 + 6601661.0 * n6 / 7257600.0;
+    p[UTM_SERIES + 4] = 34729.0 * n5 / 80640.0 - 3418889.0 * n6 / 1995840.0;
+    p[UTM_SERIES + 5] = 212378941.0 * n6 / 319334400.0;
+  } else {
+    p[UTM_SERIES + 0] = n / 2.0 - 2.0 * n2 / 3.0 + 37.0 * n3 / 96.0 - n4 / 360.0 - 81.0 * n5 / 512.0 + 96199.0 * n6 / 604800.0;
+    p[UTM_SERIES + 1] = n2 / 48.0 + n3 / 15.0 - 437.0 * n4 / 1440.0 + 46.0 * n5 / 105.0 - 1118711.0 * n6 / 3870720.0;
+    p[UTM_SERIES + 2] = 17.0 * n3 / 480.0 - 37.0 * n4 / 840.0 - 209.0 * n5 / 4480.0 + 5569.0 * n6 / 90720.0;
+    p[UTM_SERIES + 3] = 4397.0 * n4 / 161280.0 - 11.0 * n5 / 504.0 - 830251.0 * n6 / 7257600.0;
+    p[UTM_SERIES + 4] = 4583.0 * n5 / 161280.0 - 108847.0 * n6 / 3991680.0;
+    p[UTM_SERIES + 5] = 20648693.0 * n6 / 638668800.0;
+  }
+  return SQLITE_OK;
+}
+
+int geom_transform_add_srid(geom_transform_t *transform, int32_t from_srid, int32_t to_srid, errorstream_t *error) {
+  int from_zone = transform_utm_zone(from_srid);
+  int to_zone = transform_utm_zone(to_srid);
+  int result = SQLITE_OK;
+
+  if ((from_srid != 4326 && from_srid != 3857 && from_zone == 0) || (to_srid != 4326 && to_srid != 3857 && to_zone == 0)) {
+    if (error) {
+      error_append(error, "Unsupported transformation from SRID %d to SRID %d", from_srid, to_srid);
+    }
+    return SQLITE_ERROR;
+  }
+  if (from_srid == to_srid) {
+    return SQLITE_OK;
+  }
+
+  if (from_srid == 3857) {
+    result = transform_add_step(transform, TRANSFORM_FROM_MERCATOR, error) != NULL ? SQLITE_OK : SQLITE_ERROR;
+  } else if (from_zone != 0) {
+    result = transform_add_utm(transform, from_zone, 0, error);
+  }
+  if (result != SQLITE_OK) {
+    return result;
+  }
+
+  if (to_srid == 3857) {
+    result = transform_add_step(transform, TRANSFORM_TO_MERCATOR, error) != NULL ? SQLITE_OK : SQLITE_ERROR;
+  } else if (to_zone != 0) {
+    result = transform_add_utm(transform, to_zone, 1, error);
+  }
+  return result;
+}
@@ -0,0 +1,93 @@
+#ifndef UDBX_GEOM_TRANSFORM_H
+#define UDBX_GEOM_TRANSFORM_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "geomio.h"
+#include "error.h"
+
+/**
+ * \addtogroup geom_transform Coordinate transformation
+ * @{
+ */
+
+/**
+ * The maximum number of steps of a transformation, such as Web Mercator to geographic to UTM.
+ */
+#define GEOM_TRANSFORM_MAX_STEPS 4
+
+/**
+ * The number of points of a coordinate batch that are transformed without allocating.
+ */
+#define GEOM_TRANSFORM_INLINE_POINTS 32
+
+/**
+ * A step of a transformation.
+ * @private
+ */
+typedef struct {
+  int kind;
+  /**
+   * The 3x3 matrix in row major order followed by the offsets for affine steps, the central meridian, false
+   * northing and series coefficients for UTM steps.
+   */
+  double params[20];
+} geom_transform_step_t;
+
+/**
+ * A geometry consumer that transforms the coordinates of the geometries it receives and passes the geometries on to
+ * a target consumer, typically a geometry blob writer, so a geometry is transformed in a single pass over its blob.
+ * Each coordinate batch is copied to a buffer, transformed in place and forwarded; the structure of the geometry is
+ * forwarded unchanged. Circular strings keep their control points, which is exact for affine transformations that
+ * preserve angles and an approximation otherwise.
+ */
+typedef struct {
+  geom_consumer_t consumer;
+  /** @private */
+  geom_consumer_t *target;
+  /** @private */
+  geom_transform_step_t steps[GEOM_TRANSFORM_MAX_STEPS];
+  /** @private */
+  int step_count;
+  /** @private */
+  double *coords;
+  /** @private */
+  size_t capacity;
+  /** @private */
+  double inline_coords[GEOM_MAX_COORD_SIZE * GEOM_TRANSFORM_INLINE_POINTS];
+} geom_transform_t;
+
+/**
+ * Initialises an identity transformation that passes geometries on to target.
+ */
+void geom_transform_init(geom_transform_t *transform, geom_consumer_t *target);
+
+/**
+ * Frees the coordinate buffer of a transformation.
+ */
+void geom_transform_destroy(geom_transform_t *transform);
+
+/**
+ * Returns the geometry consumer that transforms the geometries it receives.
+ */
+geom_consumer_t *geom_transform_consumer(geom_transform_t *transform);
+
+/**
+ * Appends an affine step to the transformation: x' = m[0] x + m[1] y + m[2] z + m[9], y' = m[3] x + m[4] y + m[5] z +
+ * m[10] and z' = m[6] x + m[7] y + m[8] z + m[11]. Coordinates without Z are transformed as if z were 0. M is never
+ * changed.
+ * @return SQLITE_OK on success, SQLITE_ERROR if the transformation already has the maximum number of steps
+ */
+int geom_transform_add_affine(geom_transform_t *transform, const double *matrix, errorstream_t *error);
+
+/**
+ * Appends the steps converting coordinates from one SRID to another. Geographic WGS 84 (4326), Web Mercator (3857)
+ * and the WGS 84 UTM zones (32601 to 32660 and 32701 to 32760) are supported; conversions between projections go
+ * through geographic coordinates.
+ * @return SQLITE_OK on success, SQLITE_ERROR if a SRID is not supported
+ */
+int geom_transform_add_srid(geom_transform_t *transform, int32_t from_srid, int32_t to_srid, errorstream_t *error);
+
+/** @} */
+
+#endif
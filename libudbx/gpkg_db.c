@@ -13,8 +13,11 @@
  * See the License for the specific language governing permissions and
  * limitations under the License.
  */
+#include <limits.h>
+#include <string.h>
 #include "spatialdb_internal.h"
 #include "gpkg_geom.h"
+#include "spatial_index.h"
 #include "sql.h"
 #include "sqlite.h"
 
@@ -606,10 +609,85 @@ static int create_tiles_table(sqlite3 *db, const char *db_name, const char *tabl
   return SQLITE_OK;
 }
 
-static int create_spatial_index(sqlite3 *db, const char *db_name, const char *table_name, const char *geometry_column_name, const char *id_column_name, errorstream_t *error) {
+static column_info_t udbx_spatial_index_build_columns[] = {
+  {"table_name", "TEXT", N, SQL_NOT_NULL | SQL_PRIMARY_KEY, NULL},
+  {"column_name", "TEXT", N, SQL_NOT_NULL | SQL_PRIMARY_KEY, NULL},
+  {"id_column_name", "TEXT", N, SQL_NOT_NULL, NULL},
+  {"index_flags", "INTEGER", N, SQL_NOT_NULL, NULL},
+  {"last_id", "INTEGER", N, SQL_NOT_NULL, NULL},
+  {"indexed", "INTEGER", N, SQL_NOT_NULL, NULL},
+  {"total", "INTEGER", N, SQL_NOT_NULL, NULL},
+  {NULL, NULL, N, 0, NULL}
+};
+static table_info_t udbx_spatial_index_build = {
+  "udbx_spatial_index_build",
+  udbx_spatial_index_build_columns,
+  NULL, 0
+};
+
+static const char *rtree_columns(int index_flags) {
+  switch (index_flags & (SPATIAL_INDEX_Z | SPATIAL_INDEX_M)) {
+    case SPATIAL_INDEX_Z:
+      return "id, minx, maxx, miny, maxy, minz, maxz";
+    case SPATIAL_INDEX_M:
+      return "id, minx, maxx, miny, maxy, minm, maxm";
+    case SPATIAL_INDEX_Z | SPATIAL_INDEX_M:
+      return "id, minx, maxx, miny, maxy, minz, maxz, minm, maxm";
+    default:
+      return "id, minx, maxx, miny, maxy";
+  }
+}
+
+/*
+ * Builds the comma separated list of envelope expressions matching rtree_columns (minus the id). Geometries without
+ * Z or M values are indexed with an unbounded range in that dimension so the index never excludes them.
+ */
+static char *rtree_bounds(const char *prefix, const char *geometry_column_name, int index_flags) {
+  char *bounds = NULL;
+  char *extended = NULL;
+
+  bounds = sqlite3_mprintf(
+             "ST_MinX(%s\"%w\"), ST_MaxX(%s\"%w\"),\n"
+             "    ST_MinY(%s\"%w\"), ST_MaxY(%s\"%w\")",
+             prefix, geometry_column_name, prefix, geometry_column_name,
+             prefix, geometry_column_name, prefix, geometry_column_name
+           );
+
+  if (bounds != NULL && (index_flags & SPATIAL_INDEX_Z) != 0) {
+    extended = sqlite3_mprintf(
+                 "%s,\n"
+                 "    IFNULL(ST_MinZ(%s\"%w\"), -3.4e38), IFNULL(ST_MaxZ(%s\"%w\"), 3.4e38)",
+                 bounds, prefix, geometry_column_name, prefix, geometry_column_name
+               );
+    sqlite3_free(bounds);
+    bounds = extended;
+  }
+
+  if (bounds != NULL && (index_flags & SPATIAL_INDEX_M) != 0) {
+    extended = sqlite3_mprintf(
+                 "%s,\n"
+                 "    IFNULL(ST_MinM(%s\"%w\"), -3.4e38), IFNULL(ST_MaxM(%s\"%w\"), 3.4e38)",
+                 bounds, prefix, geometry_column_name, prefix, geometry_column_name
+               );
+    sqlite3_free(bounds);
+    bounds = extended;
+  }
+
+  return bounds;
+}
+
+/*
+ * Creates the rtree table and its triggers. created is set to 0 if the index already exists.
+ */
+static int create_rtree(sqlite3 *db, const char *db_name, const char *table_name, const char *geometry_column_name, const char *id_column_name, int index_flags, int *created, errorstream_t *error) {
   int result = SQLITE_OK;
   char *index_table_name = NULL;
+  char *new_bounds = NULL;
   int exists = 0;
+  int has_z = 0;
+  int has_m = 0;
+
+  *created = 0;
 
   index_table_name = sqlite3_mprintf("rtree_%s_%s", table_name, geometry_column_name);
   if (index_table_name == NULL) {
@@ -626,7 +704,20 @@ static int create_spatial_index(sqlite3 *db, const char *db_name, const char *ta
   }
 
   if (exists) {
-    result = SQLITE_OK;
+    // An existing index is only reused if it covers the same dimensions
+    result = sql_check_column_exists(db, db_name, index_table_name, "minz", &has_z);
+    if (result == SQLITE_OK) {
+      result = sql_check_column_exists(db, db_name, index_table_name, "minm", &has_m);
+    }
+    if (result != SQLITE_OK) {
+      error_append(error, "Could not check dimensions of index table %s.%s: %s", db_name, index_table_name, sqlite3_errmsg(db));
+      goto exit;
+    }
+
+    if (has_z != ((index_flags & SPATIAL_INDEX_Z) != 0) || has_m != ((index_flags & SPATIAL_INDEX_M) != 0)) {
+      error_append(error, "Index table %s.%s already exists with different dimensions", db_name, index_table_name);
+      result = SQLITE_ERROR;
+    }
     goto exit;
   }
 
@@ -655,7 +746,13 @@ static int create_spatial_index(sqlite3 *db, const char *db_name, const char *ta
     goto exit;
   }
 
-  result = sql_exec(db, "CREATE VIRTUAL TABLE \"%w\".\"%w\" USING rtree(id, minx, maxx, miny, maxy)", db_name, index_table_name);
+  new_bounds = rtree_bounds("NEW.", geometry_column_name, index_flags);
+  if (new_bounds == NULL) {
+    result = SQLITE_NOMEM;
+    goto exit;
+  }
+
+  result = sql_exec(db, "CREATE VIRTUAL TABLE \"%w\".\"%w\" USING rtree(%s)", db_name, index_table_name, rtree_columns(index_flags));
   if (result != SQLITE_OK) {
     error_append(error, "Could not create rtree table %s.%s: %s", db_name, index_table_name, sqlite3_errmsg(db));
     goto exit;
@@ -668,16 +765,14 @@ static int create_spatial_index(sqlite3 *db, const char *db_name, const char *ta
              "BEGIN\n"
              "  INSERT OR REPLACE INTO \"%w\" VALUES (\n"
              "    NEW.\"%w\",\n"
-             "    ST_MinX(NEW.\"%w\"), ST_MaxX(NEW.\"%w\"),\n"
-             "    ST_MinY(NEW.\"%w\"), ST_MaxY(NEW.\"%w\")\n"
+             "    %s\n"
              "  );\n"
              "END;",
              db_name, table_name, geometry_column_name, table_name,
              geometry_column_name, geometry_column_name,
              index_table_name,
              id_column_name,
-             geometry_column_name, geometry_column_name,
-             geometry_column_name, geometry_column_name
+             new_bounds
            );
   if (result != SQLITE_OK) {
     error_append(error, "Could not create rtree insert trigger: %s", sqlite3_errmsg(db));
@@ -692,8 +787,7 @@ static int create_spatial_index(sqlite3 *db, const char *db_name, const char *ta
              "BEGIN\n"
              "  INSERT OR REPLACE INTO \"%w\" VALUES (\n"
              "    NEW.\"%w\",\n"
-             "    ST_MinX(NEW.\"%w\"), ST_MaxX(NEW.\"%w\"),\n"
-             "    ST_MinY(NEW.\"%w\"), ST_MaxY(NEW.\"%w\")\n"
+             "    %s\n"
              "  );\n"
              "END;",
              db_name, table_name, geometry_column_name, geometry_column_name, table_name,
@@ -701,8 +795,7 @@ static int create_spatial_index(sqlite3 *db, const char *db_name, const char *ta
              geometry_column_name, geometry_column_name,
              index_table_name,
              id_column_name,
-             geometry_column_name, geometry_column_name,
-             geometry_column_name, geometry_column_name
+             new_bounds
            );
   if (result != SQLITE_OK) {
     error_append(error, "Could not create rtree update trigger 1: %s", sqlite3_errmsg(db));
@@ -736,8 +829,7 @@ static int create_spatial_index(sqlite3 *db, const char *db_name, const char *ta
              "  DELETE FROM \"%w\" WHERE id = OLD.\"%w\";\n"
              "  INSERT OR REPLACE INTO \"%w\" VALUES (\n"
              "    NEW.\"%w\",\n"
-             "    ST_MinX(NEW.\"%w\"), ST_MaxX(NEW.\"%w\"),\n"
-             "    ST_MinY(NEW.\"%w\"), ST_MaxY(NEW.\"%w\")\n"
+             "    %s\n"
              "  );\n"
              "END;",
              db_name, table_name, geometry_column_name, table_name,
@@ -746,8 +838,7 @@ static int create_spatial_index(sqlite3 *db, const char *db_name, const char *ta
              index_table_name, id_column_name,
              index_table_name,
              id_column_name,
-             geometry_column_name, geometry_column_name,
-             geometry_column_name, geometry_column_name
+             new_bounds
            );
   if (result != SQLITE_OK) {
     error_append(error, "Could not create rtree update trigger 3: %s", sqlite3_errmsg(db));
@@ -786,32 +877,287 @@ static int create_spatial_index(sqlite3 *db, const char *db_name, const char *ta
     goto exit;
   }
 
+  *created = 1;
+
+exit:
+  sqlite3_free(new_bounds);
+  sqlite3_free(index_table_name);
+  return result;
+}
+
+/*
+ * Indexes the rows of the table, optionally restricted by an additional condition on the id column.
+ */
+static int populate_rtree(sqlite3 *db, const char *db_name, const char *table_name, const char *geometry_column_name, const char *id_column_name, int index_flags, const char *id_range, errorstream_t *error) {
+  int result = SQLITE_OK;
+  char *bounds = NULL;
+
+  bounds = rtree_bounds("", geometry_column_name, index_flags);
+  if (bounds == NULL) {
+    return SQLITE_NOMEM;
+  }
+
   result = sql_exec(
              db,
-             "INSERT OR REPLACE INTO \"%w\".\"%w\" (id, minx, maxx, miny, maxy) "
-             "  SELECT \"%w\", ST_MinX(\"%w\"), ST_MaxX(\"%w\"), ST_MinY(\"%w\"), ST_MaxY(\"%w\") FROM \"%w\".\"%w\""
-             "  WHERE \"%w\" NOTNULL AND NOT ST_IsEmpty(\"%w\")",
-             db_name, index_table_name,
-             id_column_name, geometry_column_name, geometry_column_name, geometry_column_name, geometry_column_name, db_name, table_name,
-             geometry_column_name, geometry_column_name
+             "INSERT OR REPLACE INTO \"%w\".\"rtree_%w_%w\" (%s) "
+             "  SELECT \"%w\", %s FROM \"%w\".\"%w\""
+             "  WHERE \"%w\" NOTNULL AND NOT ST_IsEmpty(\"%w\")%s",
+             db_name, table_name, geometry_column_name, rtree_columns(index_flags),
+             id_column_name, bounds, db_name, table_name,
+             geometry_column_name, geometry_column_name, id_range
            );
+  if (result == SQLITE_OK) {
+    result = spatial_index_count_invalidate(db, db_name, table_name, geometry_column_name);
+  }
   if (result != SQLITE_OK) {
     error_append(error, "Could not populate rtree: %s", sqlite3_errmsg(db));
-    goto exit;
   }
 
-  result = sql_exec(
-             db,
-             "INSERT OR REPLACE INTO \"%w\".\"gpkg_extensions\" (table_name, column_name, extension_name, definition, scope) VALUES (\"%w\", \"%w\", \"%w\", \"%w\", \"%w\")",
-             db_name, table_name, geometry_column_name, "gpkg_rtree_index", "GeoPackage 1.0 Specification Annex L", "write-only"
-           );
+  sqlite3_free(bounds);
+  return result;
+}
+
+static int register_rtree(sqlite3 *db, const char *db_name, const char *table_name, const char *geometry_column_name, int index_flags, errorstream_t *error) {
+  int result;
+
+  // Only the two dimensional index matches Annex L; indexes with Z or M are registered as a UDBX extension
+  if (index_flags == 0) {
+    result = sql_exec(
+               db,
+               "INSERT OR REPLACE INTO \"%w\".\"gpkg_extensions\" (table_name, column_name, extension_name, definition, scope) VALUES (\"%w\", \"%w\", \"%w\", \"%w\", \"%w\")",
+               db_name, table_name, geometry_column_name, "gpkg_rtree_index", "GeoPackage 1.0 Specification Annex L", "write-only"
+             );
+  } else {
+    result = sql_exec(
+               db,
+               "INSERT OR REPLACE INTO \"%w\".\"gpkg_extensions\" (table_name, column_name, extension_name, definition, scope) VALUES (\"%w\", \"%w\", \"%w\", \"%w\", \"%w\")",
+               db_name, table_name, geometry_column_name, "udbx_rtree_index_zm", rtree_columns(index_flags), "write-only"
+             );
+  }
   if (result != SQLITE_OK) {
     error_append(error, "Could not register rtree usage in gpkg_extensions: %s", sqlite3_errmsg(db));
+  }
+  return result;
+}
+
+typedef struct {
+  int found;
+  char *id_column_name;
+  int index_flags;
+  sqlite3_int64 last_id;
+  sqlite3_int64 indexed;
+  sqlite3_int64 total;
+} rtree_build_t;
+
+static int read_rtree_build_row(sqlite3 *db, sqlite3_stmt *stmt, void *data) {
+  rtree_build_t *build = (rtree_build_t *)data;
+  sqlite3_free(build->id_column_name);
+  build->id_column_name = sqlite3_mprintf("%s", sqlite3_column_text(stmt, 0));
+  if (build->id_column_name == NULL) {
+    return SQLITE_NOMEM;
+  }
+  build->index_flags = sqlite3_column_int(stmt, 1);
+  build->last_id = sqlite3_column_int64(stmt, 2);
+  build->indexed = sqlite3_column_int64(stmt, 3);
+  build->total = sqlite3_column_int64(stmt, 4);
+  build->found = 1;
+  return SQLITE_ABORT;
+}
+
+static int read_rtree_build(sqlite3 *db, const char *db_name, const char *table_name, const char *geometry_column_name, rtree_build_t *build) {
+  int exists = 0;
+  int result = sql_check_table_exists(db, db_name, udbx_spatial_index_build.name, &exists);
+  build->found = 0;
+  if (result != SQLITE_OK || !exists) {
+    return result;
+  }
+
+  return sql_exec_stmt(
+           db, read_rtree_build_row, NULL, build,
+           "SELECT id_column_name, index_flags, last_id, indexed, total FROM \"%w\".\"%w\" WHERE table_name = %Q AND column_name = %Q",
+           db_name, udbx_spatial_index_build.name, table_name, geometry_column_name
+         );
+}
+
+static int read_rtree_batch_row(sqlite3 *db, sqlite3_stmt *stmt, void *data) {
+  sqlite3_int64 *batch = (sqlite3_int64 *)data;
+  batch[0] = sqlite3_column_int64(stmt, 0);
+  batch[1] = sqlite3_column_int64(stmt, 1);
+  return SQLITE_ABORT;
+}
+
+static int create_spatial_index_step(sqlite3 *db, const char *db_name, const char *table_name, const char *geometry_column_name, const char *id_column_name, int index_flags, int batch_size, double *progress, errorstream_t *error) {
+  int result = SQLITE_OK;
+  rtree_build_t build;
+  sqlite3_int64 batch[2] = {0, 0};
+  char *index_table_name = NULL;
+  char *id_range = NULL;
+  int created = 0;
+  int exists = 0;
+
+  memset(&build, 0, sizeof(rtree_build_t));
+  *progress = -1.0;
+
+  result = read_rtree_build(db, db_name, table_name, geometry_column_name, &build);
+  if (result != SQLITE_OK) {
+    error_append(error, "Could not read spatial index build state: %s", sqlite3_errmsg(db));
     goto exit;
   }
 
+  if (!build.found) {
+    if (batch_size <= 0) {
+      index_table_name = sqlite3_mprintf("rtree_%s_%s", table_name, geometry_column_name);
+      if (index_table_name == NULL) {
+        result = SQLITE_NOMEM;
+        goto exit;
+      }
+      result = sql_check_table_exists(db, db_name, index_table_name, &exists);
+      if (result != SQLITE_OK) {
+        error_append(error, "Could not check if index table %s.%s exists: %s", db_name, index_table_name, sqlite3_errmsg(db));
+        goto exit;
+      }
+      *progress = exists ? 1.0 : -1.0;
+      goto exit;
+    }
+
+    // The triggers go in first so rows written while the build is in progress are indexed by them
+    result = create_rtree(db, db_name, table_name, geometry_column_name, id_column_name, index_flags, &created, error);
+    if (result != SQLITE_OK || error_count(error) > 0) {
+      goto exit;
+    }
+
+    if (!created) {
+      *progress = 1.0;
+      goto exit;
+    }
+
+    result = sql_init_table(db, db_name, &udbx_spatial_index_build, error);
+    if (result != SQLITE_OK) {
+      goto exit;
+    }
+
+    result = sql_exec(
+               db,
+               "INSERT INTO \"%w\".\"%w\" (table_name, column_name, id_column_name, index_flags, last_id, indexed, total)"
+               " SELECT %Q, %Q, %Q, %d, IFNULL(min(\"%w\"), 1) - 1, 0, count(*) FROM \"%w\".\"%w\"",
+               db_name, udbx_spatial_index_build.name, table_name, geometry_column_name, id_column_name, index_flags,
+               id_column_name, db_name, table_name
+             );
+    if (result == SQLITE_OK) {
+      result = read_rtree_build(db, db_name, table_name, geometry_column_name, &build);
+    }
+    if (result != SQLITE_OK) {
+      error_append(error, "Could not record spatial index build state: %s", sqlite3_errmsg(db));
+      goto exit;
+    }
+  }
+
+  if (batch_size > 0) {
+    result = sql_exec_stmt(
+               db, read_rtree_batch_row, NULL, batch,
+               "SELECT max(\"%w\"), count(*) FROM (SELECT \"%w\" FROM \"%w\".\"%w\" WHERE \"%w\" > %lld ORDER BY \"%w\" LIMIT %d)",
+               build.id_column_name, build.id_column_name, db_name, table_name, build.id_column_name, build.last_id, build.id_column_name, batch_size
+             );
+    if (result != SQLITE_OK) {
+      error_append(error, "Could not read ids of %s.%s: %s", db_name, table_name, sqlite3_errmsg(db));
+      goto exit;
+    }
+
+    if (batch[1] > 0) {
+      id_range = sqlite3_mprintf(" AND \"%w\" > %lld AND \"%w\" <= %lld", build.id_column_name, build.last_id, build.id_column_name, batch[0]);
+      if (id_range == NULL) {
+        result = SQLITE_NOMEM;
+        goto exit;
+      }
+
+      result = populate_rtree(db, db_name, table_name, geometry_column_name, build.id_column_name, build.index_flags, id_range, error);
+      if (result != SQLITE_OK) {
+        goto exit;
+      }
+
+      build.last_id = batch[0];
+      build.indexed += batch[1];
+      result = sql_exec(
+                 db,
+                 "UPDATE \"%w\".\"%w\" SET last_id = %lld, indexed = %lld WHERE table_name = %Q AND column_name = %Q",
+                 db_name, udbx_spatial_index_build.name, build.last_id, build.indexed, table_name, geometry_column_name
+               );
+      if (result != SQLITE_OK) {
+        error_append(error, "Could not record spatial index build state: %s", sqlite3_errmsg(db));
+        goto exit;
+      }
+    }
+
+    // A short batch reached the end of the table; later rows are covered by the triggers
+    if (batch[1] < batch_size) {
+      result = register_rtree(db, db_name, table_name, geometry_column_name, build.index_flags, error);
+      if (result != SQLITE_OK) {
+        goto exit;
+      }
+
+      result = sql_exec(
+                 db,
+                 "DELETE FROM \"%w\".\"%w\" WHERE table_name = %Q AND column_name = %Q",
+                 db_name, udbx_spatial_index_build.name, table_name, geometry_column_name
+               );
+      if (result != SQLITE_OK) {
+        error_append(error, "Could not record spatial index build state: %s", sqlite3_errmsg(db));
+        goto exit;
+      }
+
+      *progress = 1.0;
+      goto exit;
+    }
+  }
+
+  // Rows inserted during the build can push the ratio past 1 before the build has reached the end of the table
+  *progress = build.total > 0 ? (double)build.indexed / (double)build.total : 0.0;
+  if (*progress > 0.99) {
+    *progress = 0.99;
+  }
+
 exit:
+  sqlite3_free(build.id_column_name);
   sqlite3_free(index_table_name);
+  sqlite3_free(id_range);
+  return result;
+}
+
+static int create_spatial_index(sqlite3 *db, const char *db_name, const char *table_name, const char *geometry_column_name, const char *id_column_name, int index_flags, errorstream_t *error) {
+  int result = SQLITE_OK;
+  rtree_build_t build;
+  double progress = 0.0;
+  int created = 0;
+
+  memset(&build, 0, sizeof(rtree_build_t));
+  result = read_rtree_build(db, db_name, table_name, geometry_column_name, &build);
+  if (result != SQLITE_OK) {
+    error_append(error, "Could not read spatial index build state: %s", sqlite3_errmsg(db));
+    goto exit;
+  }
+
+  // Finish an interrupted incremental build in one go
+  if (build.found) {
+    while (result == SQLITE_OK && error_count(error) == 0 && progress < 1.0) {
+      result = create_spatial_index_step(db, db_name, table_name, geometry_column_name, build.id_column_name, build.index_flags, INT_MAX, &progress, error);
+    }
+    goto exit;
+  }
+
+  result = create_rtree(db, db_name, table_name, geometry_column_name, id_column_name, index_flags, &created, error);
+  if (result != SQLITE_OK || !created) {
+    goto exit;
+  }
+
+  result = populate_rtree(db, db_name, table_name, geometry_column_name, id_column_name, index_flags, "", error);
+  if (result != SQLITE_OK) {
+    goto exit;
+  }
+
+  result = register_rtree(db, db_name, table_name, geometry_column_name, index_flags, error);
+
+exit:
+  sqlite3_free(build.id_column_name);
   return result;
 }
 
@@ -890,6 +1236,19 @@ static int drop_spatial_index(sqlite3 *db, const char *db_name, const char *tabl
 		}
 	}
 
+	// Forget an incremental build that had not finished yet
+	result = sql_check_table_exists(db, db_name, udbx_spatial_index_build.name, &exists);
+	if (result == SQLITE_OK && exists) {
+		result = sql_exec(db, "DELETE FROM \"%w\".\"%w\" WHERE table_name = %Q AND column_name = %Q", db_name, udbx_spatial_index_build.name, table_name, geometry_column_name);
+	}
+	if (result == SQLITE_OK) {
+		result = spatial_index_count_invalidate(db, db_name, table_name, geometry_column_name);
+	}
+	if (result != SQLITE_OK) {
+		error_append(error, "Could not clear spatial index build state: %s", sqlite3_errmsg(db));
+		goto exit;
+	}
+
 exit:
 	sqlite3_free(index_table_name);
 	return result;
@@ -912,7 +1271,8 @@ static const spatialdb_t GEOPACKAGE = {
   fill_envelope,
   read_geometry_header,
   read_geometry,
-  drop_spatial_index
+  drop_spatial_index,
+  create_spatial_index_step
 };
 
 const spatialdb_t *spatialdb_geopackage_schema() {
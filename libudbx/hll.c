@@ -0,0 +1,311 @@
+#include <math.h>
+#include <string.h>
+#include "hll.h"
+#include "sqlite.h"
+
+#define HLL_VERSION 1
+#define HLL_DENSE 0
+#define HLL_SPARSE 1
+
+int hll_init(hll_t *hll, int precision) {
+  size_t m;
+
+  if (precision < HLL_MIN_PRECISION) {
+    precision = HLL_MIN_PRECISION;
+  } else if (precision > HLL_MAX_PRECISION) {
+    precision = HLL_MAX_PRECISION;
+  }
+
+  m = (size_t)1 << precision;
+  hll->precision = precision;
+  hll->registers = (uint8_t *)sqlite3_malloc((int)m);
+  if (hll->registers == NULL) {
+    return SQLITE_NOMEM;
+  }
+  memset(hll->registers, 0, m);
+  return SQLITE_OK;
+}
+
+void hll_destroy(hll_t *hll) {
+  if (hll == NULL) {
+    return;
+  }
+  sqlite3_free(hll->registers);
+  hll->registers = NULL;
+}
+
+static uint64_t hll_load64(const uint8_t *p) {
+  return (uint64_t)p[0] | ((uint64_t)p[1] << 8) | ((uint64_t)p[2] << 16) | ((uint64_t)p[3] << 24)
+         | ((uint64_t)p[4] << 32) | ((uint64_t)p[5] << 40) | ((uint64_t)p[6] << 48) | ((uint64_t)p[7] << 56);
+}
+
+/*
+ * MurmurHash64A with byte order independent loads, so sketches written on one platform merge with sketches from
+ * another.
+ */
+uint64_t hll_hash(const void *data, size_t length, uint64_t seed) {
+  const uint64_t mul = 0xC6A4A7935BD1E995ULL;
+  const uint8_t *p = (const uint8_t *)data;
+  const uint8_t *end = p + (length & ~(size_t)7);
+  uint64_t h = seed ^ (length * mul);
+
+  while (p != end) {
+    uint64_t k = hll_load64(p);
+    p += 8;
+    k *= mul;
+    k ^= k >> 47;
+    k *= mul;
+    h ^= k;
+    h *= mul;
+  }
+
+  switch (length & 7) {
+    case 7: h ^= (uint64_t)p[6] << 48; /* fall through */
+    case 6: h ^= (uint64_t)p[5] << 40; /* fall through */
+    case 5: h ^= (uint64_t)p[4] << 32; /* fall through */
+    case 4: h ^= (uint64_t)p[3] << 24; /* fall through */
+    case 3: h ^= (uint64_t)p[2] << 16; /* fall through */
+    case 2: h ^= (uint64_t)p[1] << 8; /* fall through */
+    case 1: h ^= (uint64_t)p[0];
+      h *= mul;
+  }
+
+  h ^= h >> 47;
+  h *= mul;
+  h ^= h >> 47;
+  return h;
+}
+
+/*
+ * Returns the number of leading zeros of the low bits bits of value plus one, capped at bits + 1.
+ */
+static uint8_t hll_rank(uint64_t value, int bits) {
+  uint8_t rank = 1;
+  uint64_t top = (uint64_t)1 << (bits - 1);
+
+  while (rank <= bits && (value & top) == 0) {
+    rank++;
+    value <<= 1;
+  }
+  return rank;
+}
+
+void hll_add(hll_t *hll, uint64_t hash) {
+  int q = 64 - hll->precision;
+  size_t index = (size_t)(hash >> q);
+  uint8_t rank = hll_rank(hash & (((uint64_t)1 << q) - 1), q);
+
+  if (rank > hll->registers[index]) {
+    hll->registers[index] = rank;
+  }
+}
+
+static double hll_sigma(double x) {
+  double y = 1.0;
+  double z = x;
+  double z_old;
+
+  if (x == 1.0) {
+    return HUGE_VAL;
+  }
+  do {
+    x *= x;
+    z_old = z;
+    z += x * y;
+    y += y;
+  } while (z != z_old);
+  return z;
+}
+
+static double hll_tau(double x) {
+  double y = 1.0;
+  double z;
+  double z_old;
+
+  if (x == 0.0 || x == 1.0) {
+    return 0.0;
+  }
+  z = 1.0 - x;
+  do {
+    x = sqrt(x);
+    z_old = z;
+    y *= 0.5;
+    z -= (1.0 - x) * (1.0 - x) * y;
+  } while (z != z_old);
+  return z / 3.0;
+}
+
+double hll_estimate(const hll_t *hll) {
+  int q = 64 - hll->precision;
+  size_t m = (size_t)1 << hll->precision;
+  double counts[66];
+  double z;
+  size_t i;
+  int k;
+
+  memset(counts, 0, sizeof(counts));
+  for (i = 0; i < m; i++) {
+    counts[hll->registers[i]] += 1.0;
+  }
+
+  if (counts[0] == (double)m) {
+    return 0.0;
+  }
+
+  z = (double)m * hll_tau(1.0 - counts[q + 1] / (double)m);
+  for (k = q; k >= 1; k--) {
+    z = 0.5 * (z + counts[k]);
+  }
+  z += (double)m * hll_sigma(counts[0] / (double)m);
+  return (double)m * (double)m / (2.0 * log(2.0)) / z;
+}
+
+/*
+ * Reduces registers from precision from to precision to. The index bits that are dropped become the leading bits of
+ * the remaining hash, so the rank becomes their leading zero count when they are not all zero.
+ */
+static void hll_fold(const uint8_t *registers, int from, uint8_t *out, int to) {
+  int shift = from - to;
+  size_t m = (size_t)1 << from;
+  size_t i;
+
+  for (i = 0; i < m; i++) {
+    uint8_t rank;
+    uint64_t dropped = i & (((uint64_t)1 << shift) - 1);
+
+    if (registers[i] == 0) {
+      continue;
+    }
+    if (shift == 0) {
+      rank = registers[i];
+    } else if (dropped != 0) {
+      rank = hll_rank(dropped, shift);
+    } else {
+      rank = (uint8_t)(shift + registers[i]);
+    }
+    if (rank > out[i >> shift]) {
+      out[i >> shift] = rank;
+    }
+  }
+}
+
+int hll_write(const hll_t *hll, binstream_t *stream) {
+  size_t m = (size_t)1 << hll->precision;
+  uint32_t nonzero = 0;
+  size_t i;
+  int result;
+
+  for (i = 0; i < m; i++) {
+    nonzero += hll->registers[i] != 0;
+  }
+
+  binstream_set_endianness(stream, LITTLE);
+  result = binstream_write_u8(stream, 'H');
+  if (result == SQLITE_OK) {
+    result = binstream_write_u8(stream, 'L');
+  }
+  if (result == SQLITE_OK) {
+    result = binstream_write_u8(stream, HLL_VERSION);
+  }
+  if (result == SQLITE_OK) {
+    result = binstream_write_u8(stream, (uint8_t)hll->precision);
+  }
+
+  // A sparse entry takes 4 bytes (index << 8 | rank) against 1 byte per register for the dense form
+  if ((size_t)nonzero * 4 + 4 < m) {
+    if (result == SQLITE_OK) {
+      result = binstream_write_u8(stream, HLL_SPARSE);
+    }
+    if (result == SQLITE_OK) {
+      result = binstream_write_u32(stream, nonzero);
+    }
+    for (i = 0; i < m && result == SQLITE_OK; i++) {
+      if (hll->registers[i] != 0) {
+        result = binstream_write_u32(stream, (uint32_t)(i << 8) | hll->registers[i]);
+      }
+    }
+  } else {
+    if (result == SQLITE_OK) {
+      result = binstream_write_u8(stream, HLL_DENSE);
+    }
+    if (result == SQLITE_OK) {
+      result = binstream_write_nu8(stream, hll->registers, m);
+    }
+  }
+  return result;
+}
+
+int hll_read(hll_t *hll, binstream_t *stream, int init) {
+  uint8_t header[5];
+  uint8_t *registers = NULL;
+  int precision;
+  size_t m, i;
+  int result = SQLITE_OK;
+
+  binstream_set_endianness(stream, LITTLE);
+  if (binstream_nread_u8(stream, header, 5) != SQLITE_OK
+      || header[0] != 'H' || header[1] != 'L' || header[2] != HLL_VERSION
+      || header[3] < HLL_MIN_PRECISION || header[3] > HLL_MAX_PRECISION
+      || (header[4] != HLL_DENSE && header[4] != HLL_SPARSE)) {
+    return SQLITE_IOERR;
+  }
+  precision = header[3];
+  m = (size_t)1 << precision;
+
+  registers = (uint8_t *)sqlite3_malloc((int)m);
+  if (registers == NULL) {
+    return SQLITE_NOMEM;
+  }
+  memset(registers, 0, m);
+
+  if (header[4] == HLL_DENSE) {
+    if (binstream_nread_u8(stream, registers, m) != SQLITE_OK) {
+      result = SQLITE_IOERR;
+    }
+  } else {
+    uint32_t count, entry;
+    if (binstream_read_u32(stream, &count) != SQLITE_OK || binstream_available(stream) / 4 < count) {
+      result = SQLITE_IOERR;
+    }
+    for (i = 0; i < count && result == SQLITE_OK; i++) {
+      if (binstream_read_u32(stream, &entry) != SQLITE_OK || (entry >> 8) >= m) {
+        result = SQLITE_IOERR;
+      } else {
+        registers[entry >> 8] = (uint8_t)entry;
+      }
+    }
+  }
+  for (i = 0; i < m && result == SQLITE_OK; i++) {
+    if (registers[i] > 64 - precision + 1) {
+      result = SQLITE_IOERR;
+    }
+  }
+  if (result != SQLITE_OK) {
+    goto exit;
+  }
+
+  if (init) {
+    result = hll_init(hll, precision);
+    if (result != SQLITE_OK) {
+      goto exit;
+    }
+  } else if (precision < hll->precision) {
+    // Lower the precision of the existing sketch to that of the incoming one
+    uint8_t *folded = (uint8_t *)sqlite3_malloc((int)m);
+    if (folded == NULL) {
+      result = SQLITE_NOMEM;
+      goto exit;
+    }
+    memset(folded, 0, m);
+    hll_fold(hll->registers, hll->precision, folded, precision);
+    sqlite3_free(hll->registers);
+    hll->registers = folded;
+    hll->precision = precision;
+  }
+
+  hll_fold(registers, precision, hll->registers, hll->precision);
+
+exit:
+  sqlite3_free(registers);
+  return result;
+}
@@ -0,0 +1,83 @@
+#ifndef UDBX_HLL_H
+#define UDBX_HLL_H
+
+#include <stdint.h>
+#include "binstream.h"
+
+/**
+ * \addtogroup hll Distinct counting
+ * @{
+ */
+
+/**
+ * The default precision. A sketch has 2^precision registers and a relative standard error of about
+ * 1.04 / sqrt(2^precision), 0.8% for the default.
+ */
+#define HLL_DEFAULT_PRECISION 14
+
+/**
+ * The smallest accepted precision.
+ */
+#define HLL_MIN_PRECISION 4
+
+/**
+ * The largest accepted precision.
+ */
+#define HLL_MAX_PRECISION 18
+
+/**
+ * A HyperLogLog sketch over 64-bit hashes with one byte per register.
+ */
+typedef struct {
+  /** @private */
+  int precision;
+  /** @private */
+  uint8_t *registers;
+} hll_t;
+
+/**
+ * Initialises an empty sketch.
+ * @return SQLITE_OK on success, SQLITE_NOMEM if the registers could not be allocated
+ */
+int hll_init(hll_t *hll, int precision);
+
+/**
+ * Frees the memory held by a sketch.
+ */
+void hll_destroy(hll_t *hll);
+
+/**
+ * Computes the 64-bit hash of a byte sequence. The seed distinguishes values of different types that share the same
+ * bytes.
+ */
+uint64_t hll_hash(const void *data, size_t length, uint64_t seed);
+
+/**
+ * Adds a hashed value to the sketch.
+ */
+void hll_add(hll_t *hll, uint64_t hash);
+
+/**
+ * Estimates the number of distinct values added to the sketch. Uses the improved raw estimator by Ertl, which needs
+ * no empirical bias correction and is accurate from small to very large cardinalities.
+ */
+double hll_estimate(const hll_t *hll);
+
+/**
+ * Writes the sketch in a portable format that can be read back with hll_read. Sketches with few non-empty registers
+ * are written sparsely.
+ */
+int hll_write(const hll_t *hll, binstream_t *stream);
+
+/**
+ * Reads a sketch written by hll_write and merges it into a sketch by taking the maximum of each register. Sketches
+ * of different precision are merged at the lower precision.
+ * @param hll an initialised sketch, or an uninitialised one when init is non-zero
+ * @param init non-zero to initialise the sketch with the precision of the serialized one
+ * @return SQLITE_OK on success, SQLITE_IOERR if the data is not a valid sketch, SQLITE_NOMEM on allocation failure
+ */
+int hll_read(hll_t *hll, binstream_t *stream, int init);
+
+/** @} */
+
+#endif
@@ -0,0 +1,932 @@
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include "point_cluster.h"
+#include "geodesic.h"
+#include "spatial_index.h"
+#include "sql.h"
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+#define N NULL_VALUE
+
+#define POINT_CLUSTER_MERCATOR_HALF_WIDTH 20037508.342789244
+#define POINT_CLUSTER_MAX_LATITUDE 85.0511287798066
+
+static column_info_t udbx_cluster_index_columns[] = {
+  {"table_name", "TEXT", N, SQL_NOT_NULL | SQL_PRIMARY_KEY, NULL},
+  {"column_name", "TEXT", N, SQL_NOT_NULL | SQL_PRIMARY_KEY, NULL},
+  {"radius", "DOUBLE", N, SQL_NOT_NULL, NULL},
+  {"max_zoom", "INTEGER", N, SQL_NOT_NULL, NULL},
+  {"stale", "INTEGER", N, SQL_NOT_NULL, NULL},
+  {NULL, NULL, N, 0, NULL}
+};
+static table_info_t udbx_cluster_index = {
+  "udbx_cluster_index",
+  udbx_cluster_index_columns,
+  NULL, 0
+};
+
+/*
+ * Clustering works in world coordinates: the unit square covered by zoom level 0. Longitude/latitude data is projected
+ * with web mercator, other data is taken to be web mercator metres.
+ */
+static void point_cluster_project(int geographic, double x, double y, double *wx, double *wy) {
+  if (geographic) {
+    double lat = y > POINT_CLUSTER_MAX_LATITUDE ? POINT_CLUSTER_MAX_LATITUDE : (y < -POINT_CLUSTER_MAX_LATITUDE ? -POINT_CLUSTER_MAX_LATITUDE : y);
+    double s = sin(lat * M_PI / 180.0);
+    *wx = x / 360.0 + 0.5;
+    *wy = 0.5 + log((1.0 + s) / (1.0 - s)) / (4.0 * M_PI);
+  } else {
+    *wx = (x + POINT_CLUSTER_MERCATOR_HALF_WIDTH) / (2.0 * POINT_CLUSTER_MERCATOR_HALF_WIDTH);
+    *wy = (y + POINT_CLUSTER_MERCATOR_HALF_WIDTH) / (2.0 * POINT_CLUSTER_MERCATOR_HALF_WIDTH);
+  }
+}
+
+static void point_cluster_unproject(int geographic, double wx, double wy, double *x, double *y) {
+  if (geographic) {
+    *x = (wx - 0.5) * 360.0;
+    *y = atan(sinh((2.0 * wy - 1.0) * M_PI)) * 180.0 / M_PI;
+  } else {
+    *x = wx * 2.0 * POINT_CLUSTER_MERCATOR_HALF_WIDTH - POINT_CLUSTER_MERCATOR_HALF_WIDTH;
+    *y = wy * 2.0 * POINT_CLUSTER_MERCATOR_HALF_WIDTH - POINT_CLUSTER_MERCATOR_HALF_WIDTH;
+  }
+}
+
+static double point_cluster_world_radius(double radius, int zoom) {
+  return radius / (POINT_CLUSTER_TILE_SIZE * ldexp(1.0, zoom));
+}
+
+typedef struct {
+  int64_t cx;
+  int64_t cy;
+  size_t index;
+} point_cluster_entry_t;
+
+typedef struct {
+  int64_t cx;
+  int64_t cy;
+  size_t live;
+  size_t end;
+} point_cluster_cell_t;
+
+static int point_cluster_entry_cmp(const void *a, const void *b) {
+  const point_cluster_entry_t *ea = (const point_cluster_entry_t *)a;
+  const point_cluster_entry_t *eb = (const point_cluster_entry_t *)b;
+  if (ea->cx != eb->cx) {
+    return ea->cx < eb->cx ? -1 : 1;
+  }
+  if (ea->cy != eb->cy) {
+    return ea->cy < eb->cy ? -1 : 1;
+  }
+  return ea->index < eb->index ? -1 : (ea->index > eb->index ? 1 : 0);
+}
+
+static uint32_t point_cluster_cell_hash(int64_t cx, int64_t cy) {
+  uint64_t h = (uint64_t)cx * 0x9E3779B97F4A7C15ULL ^ (uint64_t)cy * 0xC2B2AE3D27D4EB4FULL;
+  return (uint32_t)(h ^ (h >> 29));
+}
+
+static int point_cluster_cell_find(const point_cluster_cell_t *cells, const int *slots, uint32_t mask, int64_t cx, int64_t cy) {
+  uint32_t slot = point_cluster_cell_hash(cx, cy) & mask;
+  while (slots[slot] != 0) {
+    const point_cluster_cell_t *cell = &cells[slots[slot] - 1];
+    if (cell->cx == cx && cell->cy == cy) {
+      return slots[slot] - 1;
+    }
+    slot = (slot + 1) & mask;
+  }
+  return -1;
+}
+
+int point_cluster_run(const point_cluster_t *points, size_t count, double radius, point_cluster_t **clusters, size_t *cluster_count) {
+  point_cluster_entry_t *entries = NULL;
+  point_cluster_cell_t *cells = NULL;
+  size_t *cell_of = NULL;
+  int *slots = NULL;
+  uint8_t *taken = NULL;
+  point_cluster_t *out = NULL;
+  size_t cell_count = 0;
+  size_t out_count = 0;
+  uint32_t slot_count = 16;
+  size_t i, k;
+  int result = SQLITE_OK;
+
+  *clusters = NULL;
+  *cluster_count = 0;
+  if (count == 0) {
+    return SQLITE_OK;
+  }
+
+  entries = (point_cluster_entry_t *)sqlite3_malloc((int)(count * sizeof(point_cluster_entry_t)));
+  cells = (point_cluster_cell_t *)sqlite3_malloc((int)(count * sizeof(point_cluster_cell_t)));
+  cell_of = (size_t *)sqlite3_malloc((int)(count * sizeof(size_t)));
+  taken = (uint8_t *)sqlite3_malloc((int)count);
+  out = (point_cluster_t *)sqlite3_malloc((int)(count * sizeof(point_cluster_t)));
+  while (slot_count < count * 2 && slot_count < 0x10000000u) {
+    slot_count <<= 1;
+  }
+  slots = (int *)sqlite3_malloc((int)(slot_count * sizeof(int)));
+  if (entries == NULL || cells == NULL || cell_of == NULL || taken == NULL || out == NULL || slots == NULL) {
+    result = SQLITE_NOMEM;
+    goto exit;
+  }
+  memset(taken, 0, count);
+  memset(slots, 0, slot_count * sizeof(int));
+
+  for (i = 0; i < count; i++) {
+    entries[i].cx = (int64_t)floor(points[i].x / radius);
+    entries[i].cy = (int64_t)floor(points[i].y / radius);
+    entries[i].index = i;
+  }
+  qsort(entries, count, sizeof(point_cluster_entry_t), point_cluster_entry_cmp);
+
+  // Each cell is a run of the sorted entries; entries before live have been taken by a cluster
+  for (i = 0; i < count; i++) {
+    if (cell_count == 0 || cells[cell_count - 1].cx != entries[i].cx || cells[cell_count - 1].cy != entries[i].cy) {
+      uint32_t slot = point_cluster_cell_hash(entries[i].cx, entries[i].cy) & (slot_count - 1);
+      while (slots[slot] != 0) {
+        slot = (slot + 1) & (slot_count - 1);
+      }
+      slots[slot] = (int)cell_count + 1;
+      cells[cell_count].cx = entries[i].cx;
+      cells[cell_count].cy = entries[i].cy;
+      cells[cell_count].live = i;
+      cell_count++;
+    }
+    cells[cell_count - 1].end = i + 1;
+    cell_of[entries[i].index] = cell_count - 1;
+  }
+
+  for (i = 0; i < count; i++) {
+    const point_cluster_t *seed = &points[i];
+    point_cluster_t *cluster;
+    double sum_x = 0.0, sum_y = 0.0;
+    int64_t total = 0;
+    int64_t members = 0;
+    int dx, dy;
+
+    if (taken[i]) {
+      continue;
+    }
+
+    cluster = &out[out_count++];
+    *cluster = *seed;
+    for (dy = -1; dy <= 1; dy++) {
+      for (dx = -1; dx <= 1; dx++) {
+        int c = point_cluster_cell_find(cells, slots, slot_count - 1, cells[cell_of[i]].cx + dx, cells[cell_of[i]].cy + dy);
+        point_cluster_cell_t *cell;
+        if (c < 0) {
+          continue;
+        }
+        cell = &cells[c];
+        for (k = cell->live; k < cell->end; k++) {
+          const point_cluster_t *p = &points[entries[k].index];
+          double ddx = p->x - seed->x;
+          double ddy = p->y - seed->y;
+          if (ddx * ddx + ddy * ddy <= radius * radius) {
+            point_cluster_entry_t t = entries[k];
+            entries[k] = entries[cell->live];
+            entries[cell->live] = t;
+            cell->live++;
+            taken[t.index] = 1;
+            sum_x += p->x * (double)p->count;
+            sum_y += p->y * (double)p->count;
+            total += p->count;
+            members++;
+          }
+        }
+      }
+    }
+
+    if (members > 1) {
+      cluster->x = sum_x / (double)total;
+      cluster->y = sum_y / (double)total;
+      cluster->count = total;
+      cluster->id = -1;
+    }
+  }
+
+  *clusters = out;
+  *cluster_count = out_count;
+  out = NULL;
+
+exit:
+  sqlite3_free(entries);
+  sqlite3_free(cells);
+  sqlite3_free(cell_of);
+  sqlite3_free(slots);
+  sqlite3_free(taken);
+  sqlite3_free(out);
+  return result;
+}
+
+typedef struct {
+  point_cluster_t *points;
+  size_t count;
+  size_t capacity;
+} point_cluster_list_t;
+
+static int point_cluster_list_add(point_cluster_list_t *list, const point_cluster_t *point) {
+  if (list->count == list->capacity) {
+    size_t capacity = list->capacity == 0 ? 256 : list->capacity * 2;
+    point_cluster_t *points = (point_cluster_t *)sqlite3_realloc(list->points, (int)(capacity * sizeof(point_cluster_t)));
+    if (points == NULL) {
+      return SQLITE_NOMEM;
+    }
+    list->points = points;
+    list->capacity = capacity;
+  }
+  list->points[list->count++] = *point;
+  return SQLITE_OK;
+}
+
+/*
+ * Reads the envelope centers of the index entries intersecting a box, in world coordinates.
+ */
+static int point_cluster_read_index(sqlite3 *db, const char *db_name, const char *table_name, const char *column_name, int geographic, const double *box, point_cluster_list_t *list) {
+  sqlite3_stmt *stmt = NULL;
+  char *sql;
+  int result;
+
+  sql = sqlite3_mprintf(
+          "SELECT id, minx, maxx, miny, maxy FROM \"%w\".\"rtree_%w_%w\"%s",
+          db_name, table_name, column_name, box != NULL ? " WHERE maxx >= ?1 AND minx <= ?3 AND maxy >= ?2 AND miny <= ?4" : ""
+        );
+  if (sql == NULL) {
+    return SQLITE_NOMEM;
+  }
+  result = sql_init_stmt(&stmt, db, sql);
+  sqlite3_free(sql);
+  if (result != SQLITE_OK) {
+    return result;
+  }
+  if (box != NULL) {
+    int i;
+    for (i = 0; i < 4; i++) {
+      sqlite3_bind_double(stmt, i + 1, box[i]);
+    }
+  }
+
+  while ((result = sqlite3_step(stmt)) == SQLITE_ROW) {
+    point_cluster_t point;
+    point_cluster_project(
+      geographic,
+      (sqlite3_column_double(stmt, 1) + sqlite3_column_double(stmt, 2)) / 2.0,
+      (sqlite3_column_double(stmt, 3) + sqlite3_column_double(stmt, 4)) / 2.0,
+      &point.x, &point.y
+    );
+    point.count = 1;
+    point.id = sqlite3_column_int64(stmt, 0);
+    result = point_cluster_list_add(list, &point);
+    if (result != SQLITE_OK) {
+      break;
+    }
+  }
+  if (result == SQLITE_DONE) {
+    result = SQLITE_OK;
+  }
+
+  sqlite3_finalize(stmt);
+  return result;
+}
+
+/*
+ * Decides from the SRS metadata whether the coordinates of a column are longitude, latitude degrees, which are
+ * clustered in Web Mercator, or planar coordinates, which are clustered as is. The SRS of the column is geographic
+ * when it is one of the ellipsoids known to geodesic_ellipsoid, the undefined geographic SRS 0 or an SRS whose WKT
+ * definition in gpkg_spatial_ref_sys is a geographic one.
+ */
+static int point_cluster_is_geographic(sqlite3 *db, const char *db_name, const char *table_name, const char *column_name, int *geographic, errorstream_t *error) {
+  double extent[4];
+  int32_t srid = 0;
+  int registered = 0;
+  int exists = 0;
+  int empty = 1;
+  int result;
+
+  *geographic = 0;
+  result = spatial_index_extent(db, db_name, table_name, column_name, extent, &exists, &empty, error);
+  if (result != SQLITE_OK) {
+    return result;
+  }
+  if (!exists) {
+    error_append(error, "No complete spatial index on %s.%s.%s", db_name, table_name, column_name);
+    return SQLITE_OK;
+  }
+
+  result = spatial_index_srid(db, db_name, table_name, column_name, &srid, &registered, error);
+  if (result != SQLITE_OK) {
+    return result;
+  }
+  if (!registered) {
+    error_append(error, "Column %s.%s.%s is not registered in gpkg_geometry_columns", db_name, table_name, column_name);
+    return SQLITE_OK;
+  }
+  if (srid == 0 || geodesic_ellipsoid(srid) != NULL) {
+    *geographic = 1;
+    return SQLITE_OK;
+  }
+
+  result = sql_exec_for_int(
+             db, geographic,
+             "SELECT ltrim(definition) LIKE 'GEOGCS%%' OR ltrim(definition) LIKE 'GEOGCRS%%' OR ltrim(definition) LIKE 'GEOGRAPHICCRS%%' FROM \"%w\".gpkg_spatial_ref_sys WHERE srs_id = %d",
+             db_name, srid
+           );
+  if (result != SQLITE_OK) {
+    error_append(error, "Could not read SRS %d: %s", srid, sqlite3_errmsg(db));
+  }
+  return result;
+}
+
+typedef struct {
+  int found;
+  double radius;
+  int max_zoom;
+  int stale;
+} point_cluster_index_t;
+
+static int read_cluster_index_row(sqlite3 *db, sqlite3_stmt *stmt, void *data) {
+  point_cluster_index_t *index = (point_cluster_index_t *)data;
+  index->found = 1;
+  index->radius = sqlite3_column_double(stmt, 0);
+  index->max_zoom = sqlite3_column_int(stmt, 1);
+  index->stale = sqlite3_column_int(stmt, 2);
+  return SQLITE_ABORT;
+}
+
+static int point_cluster_index_lookup(sqlite3 *db, const char *db_name, const char *table_name, const char *column_name, point_cluster_index_t *index) {
+  int exists = 0;
+  int result;
+
+  memset(index, 0, sizeof(point_cluster_index_t));
+  result = sql_check_table_exists(db, db_name, udbx_cluster_index.name, &exists);
+  if (result != SQLITE_OK || !exists) {
+    return result;
+  }
+  return sql_exec_stmt(
+           db, read_cluster_index_row, NULL, index,
+           "SELECT radius, max_zoom, stale FROM \"%w\".\"%w\" WHERE table_name = %Q AND column_name = %Q",
+           db_name, udbx_cluster_index.name, table_name, column_name
+         );
+}
+
+/*
+ * Clusters the features around a box on the fly. Features up to one radius outside the box are included so clusters
+ * near the border are the same as in neighbouring boxes.
+ */
+static int point_cluster_query(sqlite3 *db, const char *db_name, const char *table_name, const char *column_name, const double *bbox, int zoom, double radius, point_cluster_list_t *out, errorstream_t *error) {
+  point_cluster_list_t points;
+  point_cluster_t *clusters = NULL;
+  size_t cluster_count = 0;
+  double world[4], box[4], r;
+  int geographic = 0;
+  size_t i;
+  int result;
+
+  memset(&points, 0, sizeof(point_cluster_list_t));
+  result = point_cluster_is_geographic(db, db_name, table_name, column_name, &geographic, error);
+  if (result != SQLITE_OK || error_count(error) > 0) {
+    return result;
+  }
+
+  r = point_cluster_world_radius(radius, zoom);
+  point_cluster_project(geographic, bbox[0], bbox[1], &world[0], &world[1]);
+  point_cluster_project(geographic, bbox[2], bbox[3], &world[2], &world[3]);
+  point_cluster_unproject(geographic, world[0] - r, world[1] - r, &box[0], &box[1]);
+  point_cluster_unproject(geographic, world[2] + r, world[3] + r, &box[2], &box[3]);
+  if (geographic && bbox[1] <= -POINT_CLUSTER_MAX_LATITUDE) {
+    box[1] = -90.0;
+  }
+  if (geographic && bbox[3] >= POINT_CLUSTER_MAX_LATITUDE) {
+    box[3] = 90.0;
+  }
+
+  result = point_cluster_read_index(db, db_name, table_name, column_name, geographic, box, &points);
+  if (result == SQLITE_OK) {
+    result = point_cluster_run(points.points, points.count, r, &clusters, &cluster_count);
+  }
+  if (result != SQLITE_OK) {
+    error_append(error, "Could not cluster %s.%s.%s: %s", db_name, table_name, column_name, sqlite3_errstr(result));
+    goto exit;
+  }
+
+  for (i = 0; i < cluster_count && result == SQLITE_OK; i++) {
+    point_cluster_t cluster = clusters[i];
+    point_cluster_unproject(geographic, cluster.x, cluster.y, &cluster.x, &cluster.y);
+    if (cluster.x >= bbox[0] && cluster.x <= bbox[2] && cluster.y >= bbox[1] && cluster.y <= bbox[3]) {
+      result = point_cluster_list_add(out, &cluster);
+    }
+  }
+
+exit:
+  sqlite3_free(points.points);
+  sqlite3_free(clusters);
+  return result;
+}
+
+static int point_cluster_query_index(sqlite3 *db, const char *db_name, const char *table_name, const char *column_name, const double *bbox, int zoom, point_cluster_list_t *out, errorstream_t *error) {
+  sqlite3_stmt *stmt = NULL;
+  char *sql;
+  int result;
+  int i;
+
+  sql = sqlite3_mprintf(
+          "SELECT x, y, count, feature_id FROM \"%w\".\"cluster_%w_%w\" WHERE zoom = ?1 AND x >= ?2 AND x <= ?4 AND y >= ?3 AND y <= ?5",
+          db_name, table_name, column_name
+        );
+  if (sql == NULL) {
+    return SQLITE_NOMEM;
+  }
+  result = sql_init_stmt(&stmt, db, sql);
+  sqlite3_free(sql);
+  if (result != SQLITE_OK) {
+    error_append(error, "Could not read cluster index of %s.%s.%s: %s", db_name, table_name, column_name, sqlite3_errmsg(db));
+    return result;
+  }
+
+  sqlite3_bind_int(stmt, 1, zoom);
+  for (i = 0; i < 4; i++) {
+    sqlite3_bind_double(stmt, i + 2, bbox[i]);
+  }
+  while ((result = sqlite3_step(stmt)) == SQLITE_ROW) {
+    point_cluster_t cluster;
+    cluster.x = sqlite3_column_double(stmt, 0);
+    cluster.y = sqlite3_column_double(stmt, 1);
+    cluster.count = sqlite3_column_int64(stmt, 2);
+    cluster.id = sqlite3_column_type(stmt, 3) == SQLITE_NULL ? -1 : sqlite3_column_int64(stmt, 3);
+    result = point_cluster_list_add(out, &cluster);
+    if (result != SQLITE_OK) {
+      break;
+    }
+  }
+  if (result == SQLITE_DONE) {
+    result = SQLITE_OK;
+  } else {
+    error_append(error, "Could not read cluster index of %s.%s.%s: %s", db_name, table_name, column_name, sqlite3_errstr(result));
+  }
+
+  sqlite3_finalize(stmt);
+  return result;
+}
+
+#define CLUSTER_COL_X 0
+#define CLUSTER_COL_Y 1
+#define CLUSTER_COL_COUNT 2
+#define CLUSTER_COL_ID 3
+#define CLUSTER_COL_TABLE 4
+#define CLUSTER_COL_DB 12
+#define CLUSTER_ARG_COUNT (CLUSTER_COL_DB - CLUSTER_COL_TABLE + 1)
+
+typedef struct {
+  sqlite3_vtab base;
+  sqlite3 *db;
+} cluster_vtab;
+
+typedef struct {
+  sqlite3_vtab_cursor base;
+  point_cluster_list_t clusters;
+  size_t index;
+} cluster_cursor;
+
+static int cluster_connect(sqlite3 *db, void *aux, int argc, const char *const *argv, sqlite3_vtab **vtab, char **err) {
+  cluster_vtab *query_vtab;
+  int result;
+
+  result = sqlite3_declare_vtab(
+             db,
+             "CREATE TABLE x(x REAL, y REAL, count INTEGER, id INTEGER, "
+             "table_name HIDDEN, column_name HIDDEN, xmin HIDDEN, ymin HIDDEN, xmax HIDDEN, ymax HIDDEN, zoom HIDDEN, "
+             "radius HIDDEN, db_name HIDDEN)"
+           );
+  if (result != SQLITE_OK) {
+    return result;
+  }
+
+  query_vtab = (cluster_vtab *)sqlite3_malloc(sizeof(cluster_vtab));
+  if (query_vtab == NULL) {
+    return SQLITE_NOMEM;
+  }
+  memset(query_vtab, 0, sizeof(cluster_vtab));
+  query_vtab->db = db;
+
+  *vtab = &query_vtab->base;
+  return SQLITE_OK;
+}
+
+static int cluster_disconnect(sqlite3_vtab *vtab) {
+  sqlite3_free(vtab);
+  return SQLITE_OK;
+}
+
+static int cluster_best_index(sqlite3_vtab *vtab, sqlite3_index_info *info) {
+  int constraint[CLUSTER_ARG_COUNT];
+  int i;
+  int arg = 0;
+  int mask = 0;
+
+  for (i = 0; i < CLUSTER_ARG_COUNT; i++) {
+    constraint[i] = -1;
+  }
+
+  for (i = 0; i < info->nConstraint; i++) {
+    const struct sqlite3_index_constraint *c = &info->aConstraint[i];
+    if (c->usable && c->op == SQLITE_INDEX_CONSTRAINT_EQ && c->iColumn >= CLUSTER_COL_TABLE) {
+      constraint[c->iColumn - CLUSTER_COL_TABLE] = i;
+    }
+  }
+
+  for (i = 0; i < CLUSTER_ARG_COUNT; i++) {
+    if (constraint[i] >= 0) {
+      info->aConstraintUsage[constraint[i]].argvIndex = ++arg;
+      info->aConstraintUsage[constraint[i]].omit = 1;
+      mask |= 1 << i;
+    }
+  }
+
+  // Everything but the database name is required
+  info->idxNum = mask;
+  if ((mask & 0xFF) == 0xFF) {
+    info->estimatedCost = 1000.0;
+  } else {
+    info->estimatedCost = 1e99;
+  }
+  return SQLITE_OK;
+}
+
+static int cluster_open(sqlite3_vtab *vtab, sqlite3_vtab_cursor **cursor) {
+  cluster_cursor *query_cursor = (cluster_cursor *)sqlite3_malloc(sizeof(cluster_cursor));
+  if (query_cursor == NULL) {
+    return SQLITE_NOMEM;
+  }
+  memset(query_cursor, 0, sizeof(cluster_cursor));
+  *cursor = &query_cursor->base;
+  return SQLITE_OK;
+}
+
+static int cluster_close(sqlite3_vtab_cursor *cursor) {
+  sqlite3_free(((cluster_cursor *)cursor)->clusters.points);
+  sqlite3_free(cursor);
+  return SQLITE_OK;
+}
+
+static int cluster_filter(sqlite3_vtab_cursor *cursor, int idxNum, const char *idxStr, int argc, sqlite3_value **argv) {
+  cluster_cursor *query_cursor = (cluster_cursor *)cursor;
+  sqlite3 *db = ((cluster_vtab *)cursor->pVtab)->db;
+  sqlite3_value *args[CLUSTER_ARG_COUNT];
+  const char *table_name;
+  const char *column_name;
+  const char *db_name = "main";
+  point_cluster_index_t index;
+  errorstream_t error;
+  double bbox[4];
+  double radius;
+  int zoom;
+  int i;
+  int arg = 0;
+  int result = SQLITE_OK;
+
+  query_cursor->clusters.count = 0;
+  query_cursor->index = 0;
+
+  for (i = 0; i < CLUSTER_ARG_COUNT; i++) {
+    args[i] = (idxNum & (1 << i)) != 0 && arg < argc ? argv[arg++] : NULL;
+  }
+  for (i = 0; i < CLUSTER_ARG_COUNT - 1; i++) {
+    if (args[i] == NULL || sqlite3_value_type(args[i]) == SQLITE_NULL) {
+      cursor->pVtab->zErrMsg = sqlite3_mprintf("udbx_cluster requires a table, geometry column, bounding box, zoom and radius");
+      return SQLITE_ERROR;
+    }
+  }
+  table_name = (const char *)sqlite3_value_text(args[0]);
+  column_name = (const char *)sqlite3_value_text(args[1]);
+  if (args[CLUSTER_ARG_COUNT - 1] != NULL && sqlite3_value_type(args[CLUSTER_ARG_COUNT - 1]) != SQLITE_NULL) {
+    db_name = (const char *)sqlite3_value_text(args[CLUSTER_ARG_COUNT - 1]);
+  }
+  for (i = 0; i < 4; i++) {
+    bbox[i] = sqlite3_value_double(args[2 + i]);
+  }
+  zoom = sqlite3_value_int(args[6]);
+  radius = sqlite3_value_double(args[7]);
+
+  if (zoom < 0 || zoom > POINT_CLUSTER_MAX_ZOOM || !(radius > 0.0 && radius < HUGE_VAL)) {
+    cursor->pVtab->zErrMsg = sqlite3_mprintf("udbx_cluster requires a zoom between 0 and %d and a positive radius", POINT_CLUSTER_MAX_ZOOM);
+    return SQLITE_ERROR;
+  }
+  if (!(bbox[2] >= bbox[0]) || !(bbox[3] >= bbox[1])) {
+    return SQLITE_OK;
+  }
+
+  if (error_init(&error) != SQLITE_OK) {
+    return SQLITE_NOMEM;
+  }
+
+  result = point_cluster_index_lookup(db, db_name, table_name, column_name, &index);
+  if (result != SQLITE_OK) {
+    error_append(&error, "Could not read %s.%s: %s", db_name, udbx_cluster_index.name, sqlite3_errmsg(db));
+  } else if (index.found && !index.stale && index.radius == radius && zoom <= index.max_zoom) {
+    result = point_cluster_query_index(db, db_name, table_name, column_name, bbox, zoom, &query_cursor->clusters, &error);
+  } else {
+    result = point_cluster_query(db, db_name, table_name, column_name, bbox, zoom, radius, &query_cursor->clusters, &error);
+  }
+  if (result == SQLITE_OK && error_count(&error) > 0) {
+    result = SQLITE_ERROR;
+  }
+  if (result != SQLITE_OK) {
+    cursor->pVtab->zErrMsg = sqlite3_mprintf("%s", error_count(&error) > 0 ? error_message(&error) : sqlite3_errstr(result));
+    query_cursor->clusters.count = 0;
+  }
+
+  error_destroy(&error);
+  return result;
+}
+
+static int cluster_next(sqlite3_vtab_cursor *cursor) {
+  ((cluster_cursor *)cursor)->index++;
+  return SQLITE_OK;
+}
+
+static int cluster_eof(sqlite3_vtab_cursor *cursor) {
+  cluster_cursor *query_cursor = (cluster_cursor *)cursor;
+  return query_cursor->index >= query_cursor->clusters.count;
+}
+
+static int cluster_column(sqlite3_vtab_cursor *cursor, sqlite3_context *context, int column) {
+  cluster_cursor *query_cursor = (cluster_cursor *)cursor;
+  const point_cluster_t *cluster = &query_cursor->clusters.points[query_cursor->index];
+
+  switch (column) {
+    case CLUSTER_COL_X:
+      sqlite3_result_double(context, cluster->x);
+      break;
+    case CLUSTER_COL_Y:
+      sqlite3_result_double(context, cluster->y);
+      break;
+    case CLUSTER_COL_COUNT:
+      sqlite3_result_int64(context, cluster->count);
+      break;
+    case CLUSTER_COL_ID:
+      if (cluster->id >= 0) {
+        sqlite3_result_int64(context, cluster->id);
+      } else {
+        sqlite3_result_null(context);
+      }
+      break;
+    default:
+      sqlite3_result_null(context);
+      break;
+  }
+  return SQLITE_OK;
+}
+
+static int cluster_rowid(sqlite3_vtab_cursor *cursor, sqlite_int64 *rowid) {
+  *rowid = (sqlite_int64)((cluster_cursor *)cursor)->index;
+  return SQLITE_OK;
+}
+
+static sqlite3_module cluster_module = {
+  0,
+  cluster_connect,
+  cluster_connect,
+  cluster_best_index,
+  cluster_disconnect,
+  cluster_disconnect,
+  cluster_open,
+  cluster_close,
+  cluster_filter,
+  cluster_next,
+  cluster_eof,
+  cluster_column,
+  cluster_rowid,
+  NULL, /* xUpdate */
+  NULL, /* xBegin */
+  NULL, /* xSync */
+  NULL, /* xCommit */
+  NULL, /* xRollback */
+  NULL, /* xFindFunction */
+  NULL, /* xRename */
+  NULL, /* xSavepoint */
+  NULL, /* xRelease */
+  NULL  /* xRollbackTo */
+};
+
+int point_cluster_init(sqlite3 *db, errorstream_t *error) {
+  int result = sqlite3_create_module(db, "udbx_cluster", &cluster_module, NULL);
+  if (result != SQLITE_OK) {
+    error_append(error, "Error registering module udbx_cluster: %s", sqlite3_errmsg(db));
+  }
+  return result;
+}
+
+static int point_cluster_write_level(sqlite3_stmt *stmt, int geographic, int zoom, const point_cluster_t *clusters, size_t count) {
+  size_t i;
+  int result = SQLITE_OK;
+
+  for (i = 0; i < count && result == SQLITE_OK; i++) {
+    double x, y;
+    point_cluster_unproject(geographic, clusters[i].x, clusters[i].y, &x, &y);
+    sqlite3_bind_int(stmt, 1, zoom);
+    sqlite3_bind_double(stmt, 2, x);
+    sqlite3_bind_double(stmt, 3, y);
+    sqlite3_bind_int64(stmt, 4, clusters[i].count);
+    if (clusters[i].id >= 0) {
+      sqlite3_bind_int64(stmt, 5, clusters[i].id);
+    } else {
+      sqlite3_bind_null(stmt, 5);
+    }
+    result = sqlite3_step(stmt);
+    sqlite3_reset(stmt);
+    result = result == SQLITE_DONE ? SQLITE_OK : result;
+  }
+  return result;
+}
+
+int point_cluster_index_create(sqlite3 *db, const char *db_name, const char *table_name, const char *column_name, double radius, int max_zoom, errorstream_t *error) {
+  point_cluster_list_t points;
+  point_cluster_t *level = NULL;
+  size_t level_count = 0;
+  sqlite3_stmt *insert_stmt = NULL;
+  char *stale = NULL;
+  char *sql = NULL;
+  int geographic = 0;
+  int zoom;
+  int result;
+
+  memset(&points, 0, sizeof(point_cluster_list_t));
+
+  if (max_zoom < 0 || max_zoom > POINT_CLUSTER_MAX_ZOOM || !(radius > 0.0 && radius < HUGE_VAL)) {
+    error_append(error, "Cluster index requires a maximum zoom between 0 and %d and a positive radius", POINT_CLUSTER_MAX_ZOOM);
+    return SQLITE_OK;
+  }
+
+  result = point_cluster_is_geographic(db, db_name, table_name, column_name, &geographic, error);
+  if (result != SQLITE_OK || error_count(error) > 0) {
+    return result;
+  }
+
+  result = sql_init_table(db, db_name, &udbx_cluster_index, error);
+  if (result != SQLITE_OK) {
+    goto exit;
+  }
+
+  result = sql_exec(db, "DROP TABLE IF EXISTS \"%w\".\"cluster_%w_%w\"", db_name, table_name, column_name);
+  if (result == SQLITE_OK) {
+    result = sql_exec(
+               db,
+               "CREATE TABLE \"%w\".\"cluster_%w_%w\" (zoom INTEGER NOT NULL, x DOUBLE NOT NULL, y DOUBLE NOT NULL, count INTEGER NOT NULL, feature_id INTEGER)",
+               db_name, table_name, column_name
+             );
+  }
+  if (result == SQLITE_OK) {
+    result = sql_exec(
+               db,
+               "CREATE INDEX \"%w\".\"cluster_%w_%w_zoom_x\" ON \"cluster_%w_%w\" (zoom, x)",
+               db_name, table_name, column_name, table_name, column_name
+             );
+  }
+  if (result != SQLITE_OK) {
+    error_append(error, "Could not create cluster index table: %s", sqlite3_errmsg(db));
+    goto exit;
+  }
+
+  sql = sqlite3_mprintf(
+          "INSERT INTO \"%w\".\"cluster_%w_%w\" (zoom, x, y, count, feature_id) VALUES (?1, ?2, ?3, ?4, ?5)",
+          db_name, table_name, column_name
+        );
+  if (sql == NULL) {
+    result = SQLITE_NOMEM;
+    goto exit;
+  }
+  result = sql_init_stmt(&insert_stmt, db, sql);
+  if (result != SQLITE_OK) {
+    error_append(error, "Could not write cluster index: %s", sqlite3_errmsg(db));
+    goto exit;
+  }
+
+  result = point_cluster_read_index(db, db_name, table_name, column_name, geographic, NULL, &points);
+  if (result != SQLITE_OK) {
+    error_append(error, "Could not read spatial index of %s.%s.%s: %s", db_name, table_name, column_name, sqlite3_errmsg(db));
+    goto exit;
+  }
+
+  // Every level clusters the level above it, down to zoom 0
+  level = points.points;
+  level_count = points.count;
+  points.points = NULL;
+  for (zoom = max_zoom; zoom >= 0 && result == SQLITE_OK; zoom--) {
+    point_cluster_t *next = NULL;
+    size_t next_count = 0;
+
+    result = point_cluster_run(level, level_count, point_cluster_world_radius(radius, zoom), &next, &next_count);
+    if (result == SQLITE_OK) {
+      sqlite3_free(level);
+      level = next;
+      level_count = next_count;
+      result = point_cluster_write_level(insert_stmt, geographic, zoom, level, level_count);
+    }
+  }
+  if (result != SQLITE_OK) {
+    error_append(error, "Could not build cluster index of %s.%s.%s: %s", db_name, table_name, column_name, sqlite3_errstr(result));
+    goto exit;
+  }
+
+  result = sql_exec(
+             db,
+             "INSERT OR REPLACE INTO \"%w\".\"%w\" (table_name, column_name, radius, max_zoom, stale) VALUES (%Q, %Q, %!.17g, %d, 0)",
+             db_name, udbx_cluster_index.name, table_name, column_name, radius, max_zoom
+           );
+  if (result != SQLITE_OK) {
+    error_append(error, "Could not register cluster index: %s", sqlite3_errmsg(db));
+    goto exit;
+  }
+
+  stale = sqlite3_mprintf(
+            "UPDATE \"%w\" SET stale = 1 WHERE table_name = %Q AND column_name = %Q",
+            udbx_cluster_index.name, table_name, column_name
+          );
+  if (stale == NULL) {
+    result = SQLITE_NOMEM;
+    goto exit;
+  }
+  result = sql_exec(
+             db,
+             "CREATE TRIGGER IF NOT EXISTS \"%w\".\"cluster_%w_%w_insert\" AFTER INSERT ON \"%w\"\n"
+             "BEGIN\n"
+             "  %s;\n"
+             "END;",
+             db_name, table_name, column_name, table_name, stale
+           );
+  if (result == SQLITE_OK) {
+    result = sql_exec(
+               db,
+               "CREATE TRIGGER IF NOT EXISTS \"%w\".\"cluster_%w_%w_update\" AFTER UPDATE OF \"%w\" ON \"%w\"\n"
+               "BEGIN\n"
+               "  %s;\n"
+               "END;",
+               db_name, table_name, column_name, column_name, table_name, stale
+             );
+  }
+  if (result == SQLITE_OK) {
+    result = sql_exec(
+               db,
+               "CREATE TRIGGER IF NOT EXISTS \"%w\".\"cluster_%w_%w_delete\" AFTER DELETE ON \"%w\"\n"
+               "BEGIN\n"
+               "  %s;\n"
+               "END;",
+               db_name, table_name, column_name, table_name, stale
+             );
+  }
+  if (result != SQLITE_OK) {
+    error_append(error, "Could not create cluster index triggers: %s", sqlite3_errmsg(db));
+  }
+
+exit:
+  sqlite3_finalize(insert_stmt);
+  sqlite3_free(points.points);
+  sqlite3_free(level);
+  sqlite3_free(stale);
+  sqlite3_free(sql);
+  return result;
+}
+
+int point_cluster_index_drop(sqlite3 *db, const char *db_name, const char *table_name, const char *column_name, errorstream_t *error) {
+  int exists = 0;
+  int result;
+
+  result = sql_exec(db, "DROP TRIGGER IF EXISTS \"%w\".\"cluster_%w_%w_insert\"", db_name, table_name, column_name);
+  if (result == SQLITE_OK) {
+    result = sql_exec(db, "DROP TRIGGER IF EXISTS \"%w\".\"cluster_%w_%w_update\"", db_name, table_name, column_name);
+  }
+  if (result == SQLITE_OK) {
+    result = sql_exec(db, "DROP TRIGGER IF EXISTS \"%w\".\"cluster_%w_%w_delete\"", db_name, table_name, column_name);
+  }
+  if (result == SQLITE_OK) {
+    result = sql_exec(db, "DROP TABLE IF EXISTS \"%w\".\"cluster_%w_%w\"", db_name, table_name, column_name);
+  }
+  if (result == SQLITE_OK) {
+    result = sql_check_table_exists(db, db_name, udbx_cluster_index.name, &exists);
+  }
+  if (result == SQLITE_OK && exists) {
+    result = sql_exec(db, "DELETE FROM \"%w\".\"%w\" WHERE table_name = %Q AND column_name = %Q", db_name, udbx_cluster_index.name, table_name, column_name);
+  }
+  if (result != SQLITE_OK) {
+    error_append(error, "Could not drop cluster index: %s", sqlite3_errmsg(db));
+  }
+  return result;
+}
+
+int point_cluster_index_invalidate(sqlite3 *db, const char *db_name, const char *table_name, errorstream_t *error) {
+  int exists = 0;
+  int result;
+
+  result = sql_check_table_exists(db, db_name, udbx_cluster_index.name, &exists);
+  if (result == SQLITE_OK && exists) {
+    result = sql_exec(db, "UPDATE \"%w\".\"%w\" SET stale = 1 WHERE table_name = %Q", db_name, udbx_cluster_index.name, table_name);
+  }
+  if (result != SQLITE_OK) {
+    error_append(error, "Could not invalidate cluster index: %s", sqlite3_errmsg(db));
+  }
+  return result;
+}
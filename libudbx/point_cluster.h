@@ -0,0 +1,99 @@
+#ifndef UDBX_POINT_CLUSTER_H
+#define UDBX_POINT_CLUSTER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "sqlite.h"
+#include "error.h"
+
+/**
+ * \addtogroup point_cluster Point clustering
+ * @{
+ */
+
+/**
+ * The width and height in pixels of a map tile. Zoom level z spans 2^z tiles horizontally.
+ */
+#define POINT_CLUSTER_TILE_SIZE 256
+
+/**
+ * The largest supported zoom level.
+ */
+#define POINT_CLUSTER_MAX_ZOOM 24
+
+/**
+ * A weighted point: a single feature or a cluster of features.
+ */
+typedef struct {
+  double x;
+  double y;
+  /**
+   * The number of features represented by the point.
+   */
+  int64_t count;
+  /**
+   * The feature id if count is 1, -1 otherwise.
+   */
+  int64_t id;
+} point_cluster_t;
+
+/**
+ * Clusters weighted points greedily in the style of supercluster. Points are visited in array order; each point that
+ * is not yet part of a cluster starts a new cluster and takes in all free points within radius of it. The cluster is
+ * placed at the weighted mean of its members. Candidates are found through a hash grid with cells of size radius, so
+ * the cost is linear in the number of points for evenly spread data.
+ * @param points the points to cluster
+ * @param count the number of points
+ * @param radius the clustering radius, in the same unit as the coordinates
+ * @param[out] clusters receives an array allocated with sqlite3_malloc that must be freed with sqlite3_free
+ * @param[out] cluster_count receives the number of clusters
+ * @return SQLITE_OK on success, SQLITE_NOMEM on allocation failure
+ */
+int point_cluster_run(const point_cluster_t *points, size_t count, double radius, point_cluster_t **clusters, size_t *cluster_count);
+
+/**
+ * Registers the udbx_cluster table-valued function, which clusters the features of a layer inside a box for display
+ * at a zoom level:
+ *
+ *   SELECT x, y, count, id FROM udbx_cluster('table', 'geom', xmin, ymin, xmax, ymax, zoom, radius [, 'db'])
+ *
+ * Features are represented by the center of their rtree_<table>_<column> envelope. The radius is given in pixels of
+ * 256 pixel map tiles. Columns whose SRS in gpkg_geometry_columns is geographic are projected to web mercator; other
+ * columns are taken to be in metres. The id column holds the feature id of unclustered features and NULL for clusters.
+ * Results are read from the cluster index when one was created with a matching radius and it is up to date.
+ * @param db the database handle
+ * @param error the error stream to report errors to
+ * @return SQLITE_OK on success, an error code otherwise
+ */
+int point_cluster_init(sqlite3 *db, errorstream_t *error);
+
+/**
+ * Precomputes the clusters of zoom levels 0 to max_zoom into the table cluster_<table>_<column>. Each level clusters
+ * the clusters of the level above it, so a feature belongs to nested clusters across zoom levels. Triggers on the
+ * feature table mark the index stale on every change; udbx_cluster then computes clusters on the fly until the index
+ * is created again.
+ * @param db the database handle
+ * @param db_name the database name
+ * @param table_name the feature table
+ * @param column_name the geometry column, which must have a spatial index
+ * @param radius the clustering radius in pixels
+ * @param max_zoom the highest zoom level to precompute
+ * @param error the error stream to report errors to
+ * @return SQLITE_OK on success, an error code otherwise
+ */
+int point_cluster_index_create(sqlite3 *db, const char *db_name, const char *table_name, const char *column_name, double radius, int max_zoom, errorstream_t *error);
+
+/**
+ * Drops a cluster index created by point_cluster_index_create.
+ */
+int point_cluster_index_drop(sqlite3 *db, const char *db_name, const char *table_name, const char *column_name, errorstream_t *error);
+
+/**
+ * Marks the cluster indexes of all columns of a table stale. Must be called when the feature ids of the table change
+ * without going through its triggers.
+ */
+int point_cluster_index_invalidate(sqlite3 *db, const char *db_name, const char *table_name, errorstream_t *error);
+
+/** @} */
+
+#endif
@@ -0,0 +1,240 @@
+#include <math.h>
+#include <string.h>
+#include "sfc.h"
+#include "sqlite.h"
+
+static uint64_t sfc_spread(uint32_t v) {
+  uint64_t x = v;
+  x = (x | (x << 16)) & 0x0000FFFF0000FFFFULL;
+  x = (x | (x << 8)) & 0x00FF00FF00FF00FFULL;
+  x = (x | (x << 4)) & 0x0F0F0F0F0F0F0F0FULL;
+  x = (x | (x << 2)) & 0x3333333333333333ULL;
+  x = (x | (x << 1)) & 0x5555555555555555ULL;
+  return x;
+}
+
+static uint32_t sfc_compact(uint64_t x) {
+  x &= 0x5555555555555555ULL;
+  x = (x | (x >> 1)) & 0x3333333333333333ULL;
+  x = (x | (x >> 2)) & 0x0F0F0F0F0F0F0F0FULL;
+  x = (x | (x >> 4)) & 0x00FF00FF00FF00FFULL;
+  x = (x | (x >> 8)) & 0x0000FFFF0000FFFFULL;
+  x = (x | (x >> 16)) & 0x00000000FFFFFFFFULL;
+  return (uint32_t)x;
+}
+
+uint32_t sfc_quantize(double value, double min, double max) {
+  double t;
+
+  if (!(max > min)) {
+    return 0;
+  }
+
+  t = (value - min) / (max - min);
+  if (!(t > 0.0)) {
+    return 0;
+  }
+  if (t >= 1.0) {
+    return SFC_MAX_CELL;
+  }
+
+  t = floor(t * (double)(SFC_MAX_CELL + 1.0));
+  return t >= (double)SFC_MAX_CELL ? SFC_MAX_CELL : (uint32_t)t;
+}
+
+static void sfc_hilbert_rotate(uint32_t n, uint32_t *x, uint32_t *y, uint32_t rx, uint32_t ry) {
+  if (ry == 0) {
+    uint32_t t;
+    if (rx == 1) {
+      *x = n - 1 - *x;
+      *y = n - 1 - *y;
+    }
+    t = *x;
+    *x = *y;
+    *y = t;
+  }
+}
+
+static int64_t sfc_hilbert_key(uint32_t x, uint32_t y) {
+  uint64_t d = 0;
+  uint32_t s;
+  uint32_t rx, ry;
+
+  for (s = (uint32_t)1 << (SFC_ORDER - 1); s > 0; s >>= 1) {
+    rx = (x & s) > 0;
+    ry = (y & s) > 0;
+    d += (uint64_t)s * s * ((3 * rx) ^ ry);
+    sfc_hilbert_rotate(SFC_MAX_CELL + 1, &x, &y, rx, ry);
+  }
+  return (int64_t)d;
+}
+
+static void sfc_hilbert_cell(uint64_t d, uint32_t *x, uint32_t *y) {
+  uint32_t s;
+  uint32_t rx, ry;
+
+  *x = 0;
+  *y = 0;
+  for (s = 1; s <= SFC_MAX_CELL && s != 0; s <<= 1) {
+    rx = (uint32_t)(1 & (d >> 1));
+    ry = (uint32_t)(1 & (d ^ rx));
+    sfc_hilbert_rotate(s, x, y, rx, ry);
+    *x += s * rx;
+    *y += s * ry;
+    d >>= 2;
+  }
+}
+
+int64_t sfc_cell_key(sfc_curve_t curve, uint32_t x, uint32_t y) {
+  x &= SFC_MAX_CELL;
+  y &= SFC_MAX_CELL;
+  if (curve == SFC_HILBERT) {
+    return sfc_hilbert_key(x, y);
+  }
+  return (int64_t)(sfc_spread(x) | (sfc_spread(y) << 1));
+}
+
+void sfc_key_cell(sfc_curve_t curve, int64_t key, uint32_t *x, uint32_t *y) {
+  if (curve == SFC_HILBERT) {
+    sfc_hilbert_cell((uint64_t)key, x, y);
+    return;
+  }
+  *x = sfc_compact((uint64_t)key);
+  *y = sfc_compact((uint64_t)key >> 1);
+}
+
+int64_t sfc_key(sfc_curve_t curve, const sfc_extent_t *extent, double x, double y) {
+  return sfc_cell_key(
+           curve,
+           sfc_quantize(x, extent->min_x, extent->max_x),
+           sfc_quantize(y, extent->min_y, extent->max_y)
+         );
+}
+
+typedef struct {
+  sfc_curve_t curve;
+  uint32_t min_x;
+  uint32_t min_y;
+  uint32_t max_x;
+  uint32_t max_y;
+  int max_level;
+  sfc_range_t *ranges;
+  size_t count;
+  size_t capacity;
+} sfc_decomposition_t;
+
+static int sfc_emit(sfc_decomposition_t *d, int64_t start, int64_t end, int inside) {
+  if (d->count > 0) {
+    sfc_range_t *last = &d->ranges[d->count - 1];
+    if (last->end + 1 == start && last->inside == inside) {
+      last->end = end;
+      return SQLITE_OK;
+    }
+  }
+
+  if (d->count == d->capacity) {
+    size_t capacity = d->capacity == 0 ? 64 : d->capacity * 2;
+    sfc_range_t *ranges = (sfc_range_t *)sqlite3_realloc(d->ranges, (int)(capacity * sizeof(sfc_range_t)));
+    if (ranges == NULL) {
+      return SQLITE_NOMEM;
+    }
+    d->ranges = ranges;
+    d->capacity = capacity;
+  }
+
+  d->ranges[d->count].start = start;
+  d->ranges[d->count].end = end;
+  d->ranges[d->count].inside = inside;
+  d->count++;
+  return SQLITE_OK;
+}
+
+/*
+ * Every quadtree cell maps onto one contiguous key range, so the query box is covered by descending the quadtree and
+ * emitting cells that are either fully inside the box or at the maximum level. Children are visited in key order
+ * which keeps the emitted ranges sorted and lets adjacent ones merge.
+ */
+static int sfc_descend(sfc_decomposition_t *d, int level, uint32_t cx, uint32_t cy) {
+  int shift = SFC_ORDER - level;
+  uint32_t x0 = cx << shift;
+  uint32_t y0 = cy << shift;
+  uint32_t x1 = x0 + (uint32_t)(((uint64_t)1 << shift) - 1);
+  uint32_t y1 = y0 + (uint32_t)(((uint64_t)1 << shift) - 1);
+  int64_t mask = ((int64_t)1 << (2 * shift)) - 1;
+  int64_t start;
+  int inside;
+
+  if (x1 < d->min_x || x0 > d->max_x || y1 < d->min_y || y0 > d->max_y) {
+    return SQLITE_OK;
+  }
+
+  inside = x0 > d->min_x && x1 < d->max_x && y0 > d->min_y && y1 < d->max_y;
+  if (inside || level >= d->max_level) {
+    start = sfc_cell_key(d->curve, x0, y0) & ~mask;
+    return sfc_emit(d, start, start | mask, inside);
+  } else {
+    uint32_t child_x[4];
+    uint32_t child_y[4];
+    int64_t child_key[4];
+    int i, j;
+
+    for (i = 0; i < 4; i++) {
+      child_x[i] = (cx << 1) | (uint32_t)(i & 1);
+      child_y[i] = (cy << 1) | (uint32_t)(i >> 1);
+      child_key[i] = sfc_cell_key(d->curve, child_x[i] << (shift - 1), child_y[i] << (shift - 1));
+    }
+
+    for (i = 1; i < 4; i++) {
+      for (j = i; j > 0 && child_key[j - 1] > child_key[j]; j--) {
+        int64_t k = child_key[j]; child_key[j] = child_key[j - 1]; child_key[j - 1] = k;
+        uint32_t x = child_x[j]; child_x[j] = child_x[j - 1]; child_x[j - 1] = x;
+        uint32_t y = child_y[j]; child_y[j] = child_y[j - 1]; child_y[j - 1] = y;
+      }
+    }
+
+    for (i = 0; i < 4; i++) {
+      int result = sfc_descend(d, level + 1, child_x[i], child_y[i]);
+      if (result != SQLITE_OK) {
+        return result;
+      }
+    }
+    return SQLITE_OK;
+  }
+}
+
+int sfc_ranges(sfc_curve_t curve, const sfc_extent_t *extent, double min_x, double min_y, double max_x, double max_y, sfc_range_t **ranges, size_t *count) {
+  sfc_decomposition_t d;
+  uint64_t span;
+  int cell_bits = 0;
+  int result;
+
+  memset(&d, 0, sizeof(sfc_decomposition_t));
+  d.curve = curve;
+  d.min_x = sfc_quantize(min_x, extent->min_x, extent->max_x);
+  d.min_y = sfc_quantize(min_y, extent->min_y, extent->max_y);
+  d.max_x = sfc_quantize(max_x, extent->min_x, extent->max_x);
+  d.max_y = sfc_quantize(max_y, extent->min_y, extent->max_y);
+
+  *ranges = NULL;
+  *count = 0;
+  if (d.max_x < d.min_x || d.max_y < d.min_y) {
+    return SQLITE_OK;
+  }
+
+  // Stop descending once cells are about 1/8th of the query size; that bounds the number of border ranges
+  span = (uint64_t)(d.max_x - d.min_x > d.max_y - d.min_y ? d.max_x - d.min_x : d.max_y - d.min_y) + 1;
+  while (cell_bits < SFC_ORDER && ((uint64_t)1 << (cell_bits + 1)) <= span / 8) {
+    cell_bits++;
+  }
+  d.max_level = SFC_ORDER - cell_bits;
+
+  result = sfc_descend(&d, 0, 0, 0);
+  if (result != SQLITE_OK) {
+    sqlite3_free(d.ranges);
+    return result;
+  }
+
+  *ranges = d.ranges;
+  *count = d.count;
+  return SQLITE_OK;
+}
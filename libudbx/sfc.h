@@ -0,0 +1,108 @@
+#ifndef UDBX_SFC_H
+#define UDBX_SFC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * \addtogroup sfc Space filling curves
+ * @{
+ */
+
+/**
+ * The number of bits per axis of the curve grid. Keys use 2 * SFC_ORDER bits so they are always positive 64-bit
+ * SQLite integers.
+ */
+#define SFC_ORDER 31
+
+/**
+ * The largest cell coordinate on each axis of the curve grid.
+ */
+#define SFC_MAX_CELL ((uint32_t)((1u << SFC_ORDER) - 1))
+
+/**
+ * Enumeration of the supported curves.
+ */
+typedef enum {
+  /**
+   * Z-order curve (bit interleaving).
+   */
+  SFC_MORTON,
+  /**
+   * Hilbert curve. Consecutive keys are always neighbouring cells, which gives better locality than SFC_MORTON.
+   */
+  SFC_HILBERT
+} sfc_curve_t;
+
+/**
+ * The extent that is mapped onto the curve grid. Coordinates outside the extent are clamped to the border cells.
+ */
+typedef struct {
+  double min_x;
+  double min_y;
+  double max_x;
+  double max_y;
+} sfc_extent_t;
+
+/**
+ * A contiguous range of curve keys.
+ */
+typedef struct {
+  /**
+   * The first key of the range.
+   */
+  int64_t start;
+  /**
+   * The last key of the range (inclusive).
+   */
+  int64_t end;
+  /**
+   * Non-zero if every cell of the range lies strictly inside the query box, so matching points need no further
+   * checking.
+   */
+  int inside;
+} sfc_range_t;
+
+/**
+ * Maps a coordinate onto a cell index of the curve grid.
+ * @param value the coordinate
+ * @param min the lower bound of the extent on this axis
+ * @param max the upper bound of the extent on this axis
+ * @return the cell index in [0, SFC_MAX_CELL]
+ */
+uint32_t sfc_quantize(double value, double min, double max);
+
+/**
+ * Computes the curve key of a grid cell.
+ */
+int64_t sfc_cell_key(sfc_curve_t curve, uint32_t x, uint32_t y);
+
+/**
+ * Computes the grid cell of a curve key.
+ */
+void sfc_key_cell(sfc_curve_t curve, int64_t key, uint32_t *x, uint32_t *y);
+
+/**
+ * Computes the curve key of a point.
+ */
+int64_t sfc_key(sfc_curve_t curve, const sfc_extent_t *extent, double x, double y);
+
+/**
+ * Decomposes a query box into a sorted list of key ranges that together contain the keys of all points inside the
+ * box. Ranges near the border of the box may also contain keys of points outside it; those ranges have inside set
+ * to 0.
+ * @param curve the curve
+ * @param extent the extent of the curve grid
+ * @param min_x the minimum X of the query box
+ * @param min_y the minimum Y of the query box
+ * @param max_x the maximum X of the query box
+ * @param max_y the maximum Y of the query box
+ * @param[out] ranges receives an array allocated with sqlite3_malloc that must be freed with sqlite3_free
+ * @param[out] count receives the number of ranges
+ * @return SQLITE_OK on success, an error code otherwise
+ */
+int sfc_ranges(sfc_curve_t curve, const sfc_extent_t *extent, double min_x, double min_y, double max_x, double max_y, sfc_range_t **ranges, size_t *count);
+
+/** @} */
+
+#endif
@@ -0,0 +1,1962 @@
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include "spatial_index.h"
+#include "geomio.h"
+#include "sfc.h"
+#include "sql.h"
+#include "strbuf.h"
+
+#define N NULL_VALUE
+
+static column_info_t udbx_sfc_index_columns[] = {
+  {"table_name", "TEXT", N, SQL_NOT_NULL | SQL_PRIMARY_KEY, NULL},
+  {"column_name", "TEXT", N, SQL_NOT_NULL | SQL_PRIMARY_KEY, NULL},
+  {"id_column_name", "TEXT", N, SQL_NOT_NULL, NULL},
+  {"curve", "TEXT", N, SQL_NOT_NULL, NULL},
+  {"min_x", "DOUBLE", N, SQL_NOT_NULL, NULL},
+  {"min_y", "DOUBLE", N, SQL_NOT_NULL, NULL},
+  {"max_x", "DOUBLE", N, SQL_NOT_NULL, NULL},
+  {"max_y", "DOUBLE", N, SQL_NOT_NULL, NULL},
+  {NULL, NULL, N, 0, NULL}
+};
+static table_info_t udbx_sfc_index = {
+  "udbx_sfc_index",
+  udbx_sfc_index_columns,
+  NULL, 0
+};
+
+static column_info_t udbx_rtree_count_columns[] = {
+  {"table_name", "TEXT", N, SQL_NOT_NULL | SQL_PRIMARY_KEY, NULL},
+  {"column_name", "TEXT", N, SQL_NOT_NULL | SQL_PRIMARY_KEY, NULL},
+  {"nodeno", "INTEGER", N, SQL_NOT_NULL | SQL_PRIMARY_KEY, NULL},
+  {"generation", "INTEGER", N, SQL_NOT_NULL, NULL},
+  {"count", "INTEGER", N, SQL_NOT_NULL, NULL},
+  {"min_x", "DOUBLE", N, 0, NULL},
+  {"min_y", "DOUBLE", N, 0, NULL},
+  {"max_x", "DOUBLE", N, 0, NULL},
+  {"max_y", "DOUBLE", N, 0, NULL},
+  {NULL, NULL, N, 0, NULL}
+};
+static table_info_t udbx_rtree_count = {
+  "udbx_rtree_count",
+  udbx_rtree_count_columns,
+  NULL, 0
+};
+
+#define RTREE_QUERY_COL_ID 0
+#define RTREE_QUERY_COL_MAXM 8
+#define RTREE_QUERY_COL_TABLE 9
+#define RTREE_QUERY_COL_COLUMN 10
+#define RTREE_QUERY_COL_XMIN 11
+#define RTREE_QUERY_COL_DB 19
+#define RTREE_QUERY_ARG_COUNT (RTREE_QUERY_COL_DB - RTREE_QUERY_COL_TABLE + 1)
+#define RTREE_QUERY_BOUND_COUNT 8
+
+/*
+ * Index constraint for each query bound, in argument order (xmin, ymin, xmax, ymax, zmin, zmax, mmin, mmax). A box
+ * intersects the query range when its maximum is above the range minimum and its minimum below the range maximum.
+ */
+static const char *rtree_query_terms[RTREE_QUERY_BOUND_COUNT] = {
+  "maxx >= ?", "maxy >= ?", "minx <= ?", "miny <= ?", "maxz >= ?", "minz <= ?", "maxm >= ?", "minm <= ?"
+};
+
+typedef struct {
+  sqlite3_vtab base;
+  sqlite3 *db;
+} rtree_query_vtab;
+
+typedef struct {
+  sqlite3_vtab_cursor base;
+  sqlite3_stmt *stmt;
+  int eof;
+} rtree_query_cursor;
+
+static int rtree_query_connect(sqlite3 *db, void *aux, int argc, const char *const *argv, sqlite3_vtab **vtab, char **err) {
+  rtree_query_vtab *query_vtab;
+  int result;
+
+  result = sqlite3_declare_vtab(
+             db,
+             "CREATE TABLE x(id INTEGER, minx REAL, maxx REAL, miny REAL, maxy REAL, minz REAL, maxz REAL, minm REAL, maxm REAL, "
+             "table_name HIDDEN, column_name HIDDEN, "
+             "xmin HIDDEN, ymin HIDDEN, xmax HIDDEN, ymax HIDDEN, zmin HIDDEN, zmax HIDDEN, mmin HIDDEN, mmax HIDDEN, "
+             "db_name HIDDEN)"
+           );
+  if (result != SQLITE_OK) {
+    return result;
+  }
+
+  query_vtab = (rtree_query_vtab *)sqlite3_malloc(sizeof(rtree_query_vtab));
+  if (query_vtab == NULL) {
+    return SQLITE_NOMEM;
+  }
+  memset(query_vtab, 0, sizeof(rtree_query_vtab));
+  query_vtab->db = db;
+
+  *vtab = &query_vtab->base;
+  return SQLITE_OK;
+}
+
+static int rtree_query_disconnect(sqlite3_vtab *vtab) {
+  sqlite3_free(vtab);
+  return SQLITE_OK;
+}
+
+static int rtree_query_best_index(sqlite3_vtab *vtab, sqlite3_index_info *info) {
+  int constraint[RTREE_QUERY_ARG_COUNT];
+  int i;
+  int arg = 0;
+  int mask = 0;
+
+  for (i = 0; i < RTREE_QUERY_ARG_COUNT; i++) {
+    constraint[i] = -1;
+  }
+
+  for (i = 0; i < info->nConstraint; i++) {
+    const struct sqlite3_index_constraint *c = &info->aConstraint[i];
+    if (c->usable && c->op == SQLITE_INDEX_CONSTRAINT_EQ && c->iColumn >= RTREE_QUERY_COL_TABLE) {
+      constraint[c->iColumn - RTREE_QUERY_COL_TABLE] = i;
+    }
+  }
+
+  // Arguments are passed to xFilter in column order; idxNum records which ones are present
+  for (i = 0; i < RTREE_QUERY_ARG_COUNT; i++) {
+    if (constraint[i] >= 0) {
+      info->aConstraintUsage[constraint[i]].argvIndex = ++arg;
+      info->aConstraintUsage[constraint[i]].omit = 1;
+      mask |= 1 << i;
+    }
+  }
+
+  info->idxNum = mask;
+  if ((mask & 0x3) == 0x3) {
+    info->estimatedCost = 1000.0 / (1 + arg);
+  } else {
+    info->estimatedCost = 1e99;
+  }
+  return SQLITE_OK;
+}
+
+static int rtree_query_open(sqlite3_vtab *vtab, sqlite3_vtab_cursor **cursor) {
+  rtree_query_cursor *query_cursor = (rtree_query_cursor *)sqlite3_malloc(sizeof(rtree_query_cursor));
+  if (query_cursor == NULL) {
+    return SQLITE_NOMEM;
+  }
+  memset(query_cursor, 0, sizeof(rtree_query_cursor));
+  query_cursor->eof = 1;
+  *cursor = &query_cursor->base;
+  return SQLITE_OK;
+}
+
+static int rtree_query_close(sqlite3_vtab_cursor *cursor) {
+  rtree_query_cursor *query_cursor = (rtree_query_cursor *)cursor;
+  sqlite3_finalize(query_cursor->stmt);
+  sqlite3_free(query_cursor);
+  return SQLITE_OK;
+}
+
+static int rtree_query_next(sqlite3_vtab_cursor *cursor) {
+  rtree_query_cursor *query_cursor = (rtree_query_cursor *)cursor;
+  int result = sqlite3_step(query_cursor->stmt);
+  if (result == SQLITE_ROW) {
+    return SQLITE_OK;
+  }
+
+  query_cursor->eof = 1;
+  if (result == SQLITE_DONE) {
+    return SQLITE_OK;
+  }
+
+  cursor->pVtab->zErrMsg = sqlite3_mprintf("%s", sqlite3_errmsg(((rtree_query_vtab *)cursor->pVtab)->db));
+  return result;
+}
+
+static int rtree_query_filter(sqlite3_vtab_cursor *cursor, int idxNum, const char *idxStr, int argc, sqlite3_value **argv) {
+  rtree_query_cursor *query_cursor = (rtree_query_cursor *)cursor;
+  sqlite3 *db = ((rtree_query_vtab *)cursor->pVtab)->db;
+  sqlite3_value *args[RTREE_QUERY_ARG_COUNT];
+  const char *table_name;
+  const char *column_name;
+  const char *db_name = "main";
+  char *index_table_name = NULL;
+  strbuf_t sql;
+  int exists = 0;
+  int has_z = 0;
+  int has_m = 0;
+  int bind = 0;
+  int i;
+  int arg = 0;
+  int result = SQLITE_OK;
+
+  sqlite3_finalize(query_cursor->stmt);
+  query_cursor->stmt = NULL;
+  query_cursor->eof = 1;
+
+  for (i = 0; i < RTREE_QUERY_ARG_COUNT; i++) {
+    args[i] = (idxNum & (1 << i)) != 0 && arg < argc ? argv[arg++] : NULL;
+  }
+
+  table_name = args[0] != NULL ? (const char *)sqlite3_value_text(args[0]) : NULL;
+  column_name = args[1] != NULL ? (const char *)sqlite3_value_text(args[1]) : NULL;
+  if (table_name == NULL || column_name == NULL) {
+    cursor->pVtab->zErrMsg = sqlite3_mprintf("udbx_rtree_query requires a table and geometry column name");
+    return SQLITE_ERROR;
+  }
+  if (args[RTREE_QUERY_ARG_COUNT - 1] != NULL && sqlite3_value_type(args[RTREE_QUERY_ARG_COUNT - 1]) != SQLITE_NULL) {
+    db_name = (const char *)sqlite3_value_text(args[RTREE_QUERY_ARG_COUNT - 1]);
+  }
+
+  if (strbuf_init(&sql, 256) != SQLITE_OK) {
+    return SQLITE_NOMEM;
+  }
+
+  index_table_name = sqlite3_mprintf("rtree_%s_%s", table_name, column_name);
+  if (index_table_name == NULL) {
+    result = SQLITE_NOMEM;
+    goto exit;
+  }
+
+  result = sql_check_table_exists(db, db_name, index_table_name, &exists);
+  if (result == SQLITE_OK && exists) {
+    result = sql_check_column_exists(db, db_name, index_table_name, "minz", &has_z);
+  }
+  if (result == SQLITE_OK && exists) {
+    result = sql_check_column_exists(db, db_name, index_table_name, "minm", &has_m);
+  }
+  if (result != SQLITE_OK) {
+    cursor->pVtab->zErrMsg = sqlite3_mprintf("Could not inspect index table %s.%s: %s", db_name, index_table_name, sqlite3_errmsg(db));
+    goto exit;
+  }
+  if (!exists) {
+    cursor->pVtab->zErrMsg = sqlite3_mprintf("No spatial index on %s.%s.%s", db_name, table_name, column_name);
+    result = SQLITE_ERROR;
+    goto exit;
+  }
+
+  result = strbuf_append(
+             &sql, "SELECT id, minx, maxx, miny, maxy, %s, %s FROM \"%w\".\"%w\" WHERE 1",
+             has_z ? "minz, maxz" : "NULL, NULL", has_m ? "minm, maxm" : "NULL, NULL", db_name, index_table_name
+           );
+
+  for (i = 0; i < RTREE_QUERY_BOUND_COUNT && result == SQLITE_OK; i++) {
+    sqlite3_value *bound = args[2 + i];
+    if (bound == NULL || sqlite3_value_type(bound) == SQLITE_NULL) {
+      continue;
+    }
+    if ((i >= 4 && i < 6 && !has_z) || (i >= 6 && !has_m)) {
+      cursor->pVtab->zErrMsg = sqlite3_mprintf("Spatial index %s.%s has no %s dimension", db_name, index_table_name, i < 6 ? "Z" : "M");
+      result = SQLITE_ERROR;
+      goto exit;
+    }
+    result = strbuf_append(&sql, " AND %s", rtree_query_terms[i]);
+  }
+  if (result != SQLITE_OK) {
+    goto exit;
+  }
+
+  result = sqlite3_prepare_v2(db, strbuf_data_pointer(&sql), -1, &query_cursor->stmt, NULL);
+  if (result != SQLITE_OK) {
+    cursor->pVtab->zErrMsg = sqlite3_mprintf("%s", sqlite3_errmsg(db));
+    goto exit;
+  }
+
+  for (i = 0; i < RTREE_QUERY_BOUND_COUNT; i++) {
+    sqlite3_value *bound = args[2 + i];
+    if (bound != NULL && sqlite3_value_type(bound) != SQLITE_NULL) {
+      sqlite3_bind_double(query_cursor->stmt, ++bind, sqlite3_value_double(bound));
+    }
+  }
+
+  query_cursor->eof = 0;
+  result = rtree_query_next(cursor);
+
+exit:
+  sqlite3_free(index_table_name);
+  strbuf_destroy(&sql);
+  return result;
+}
+
+static int rtree_query_eof(sqlite3_vtab_cursor *cursor) {
+  return ((rtree_query_cursor *)cursor)->eof;
+}
+
+static int rtree_query_column(sqlite3_vtab_cursor *cursor, sqlite3_context *context, int column) {
+  rtree_query_cursor *query_cursor = (rtree_query_cursor *)cursor;
+  if (column <= RTREE_QUERY_COL_MAXM) {
+    sqlite3_result_value(context, sqlite3_column_value(query_cursor->stmt, column));
+  } else {
+    sqlite3_result_null(context);
+  }
+  return SQLITE_OK;
+}
+
+static int rtree_query_rowid(sqlite3_vtab_cursor *cursor, sqlite_int64 *rowid) {
+  *rowid = sqlite3_column_int64(((rtree_query_cursor *)cursor)->stmt, RTREE_QUERY_COL_ID);
+  return SQLITE_OK;
+}
+
+static sqlite3_module rtree_query_module = {
+  0,
+  rtree_query_connect,
+  rtree_query_connect,
+  rtree_query_best_index,
+  rtree_query_disconnect,
+  rtree_query_disconnect,
+  rtree_query_open,
+  rtree_query_close,
+  rtree_query_filter,
+  rtree_query_next,
+  rtree_query_eof,
+  rtree_query_column,
+  rtree_query_rowid,
+  NULL, /* xUpdate */
+  NULL, /* xBegin */
+  NULL, /* xSync */
+  NULL, /* xCommit */
+  NULL, /* xRollback */
+  NULL, /* xFindFunction */
+  NULL, /* xRename */
+  NULL, /* xSavepoint */
+  NULL, /* xRelease */
+  NULL  /* xRollbackTo */
+};
+
+#define SFC_QUERY_COL_ID 0
+#define SFC_QUERY_COL_KEY 1
+#define SFC_QUERY_COL_TABLE 2
+#define SFC_QUERY_COL_DB 8
+#define SFC_QUERY_ARG_COUNT (SFC_QUERY_COL_DB - SFC_QUERY_COL_TABLE + 1)
+
+typedef struct {
+  sqlite3_vtab_cursor base;
+  sfc_curve_t curve;
+  sfc_extent_t extent;
+  double query[4];
+  uint32_t cells[4];
+  sfc_range_t *ranges;
+  size_t range_count;
+  size_t range_index;
+  sqlite3_stmt *range_stmt;
+  sqlite3_stmt *check_stmt;
+  int64_t key;
+  int64_t id;
+  int eof;
+} sfc_query_cursor;
+
+static int sfc_query_connect(sqlite3 *db, void *aux, int argc, const char *const *argv, sqlite3_vtab **vtab, char **err) {
+  rtree_query_vtab *query_vtab;
+  int result;
+
+  result = sqlite3_declare_vtab(
+             db,
+             "CREATE TABLE x(id INTEGER, key INTEGER, "
+             "table_name HIDDEN, column_name HIDDEN, xmin HIDDEN, ymin HIDDEN, xmax HIDDEN, ymax HIDDEN, db_name HIDDEN)"
+           );
+  if (result != SQLITE_OK) {
+    return result;
+  }
+
+  query_vtab = (rtree_query_vtab *)sqlite3_malloc(sizeof(rtree_query_vtab));
+  if (query_vtab == NULL) {
+    return SQLITE_NOMEM;
+  }
+  memset(query_vtab, 0, sizeof(rtree_query_vtab));
+  query_vtab->db = db;
+
+  *vtab = &query_vtab->base;
+  return SQLITE_OK;
+}
+
+static int sfc_query_best_index(sqlite3_vtab *vtab, sqlite3_index_info *info) {
+  int constraint[SFC_QUERY_ARG_COUNT];
+  int i;
+  int arg = 0;
+  int mask = 0;
+
+  for (i = 0; i < SFC_QUERY_ARG_COUNT; i++) {
+    constraint[i] = -1;
+  }
+
+  for (i = 0; i < info->nConstraint; i++) {
+    const struct sqlite3_index_constraint *c = &info->aConstraint[i];
+    if (c->usable && c->op == SQLITE_INDEX_CONSTRAINT_EQ && c->iColumn >= SFC_QUERY_COL_TABLE) {
+      constraint[c->iColumn - SFC_QUERY_COL_TABLE] = i;
+    }
+  }
+
+  for (i = 0; i < SFC_QUERY_ARG_COUNT; i++) {
+    if (constraint[i] >= 0) {
+      info->aConstraintUsage[constraint[i]].argvIndex = ++arg;
+      info->aConstraintUsage[constraint[i]].omit = 1;
+      mask |= 1 << i;
+    }
+  }
+
+  info->idxNum = mask;
+  if ((mask & 0x3) == 0x3) {
+    info->estimatedCost = 1000.0 / (1 + arg);
+  } else {
+    info->estimatedCost = 1e99;
+  }
+  return SQLITE_OK;
+}
+
+static int sfc_query_open(sqlite3_vtab *vtab, sqlite3_vtab_cursor **cursor) {
+  sfc_query_cursor *query_cursor = (sfc_query_cursor *)sqlite3_malloc(sizeof(sfc_query_cursor));
+  if (query_cursor == NULL) {
+    return SQLITE_NOMEM;
+  }
+  memset(query_cursor, 0, sizeof(sfc_query_cursor));
+  query_cursor->eof = 1;
+  *cursor = &query_cursor->base;
+  return SQLITE_OK;
+}
+
+static void sfc_query_reset(sfc_query_cursor *query_cursor) {
+  sqlite3_finalize(query_cursor->range_stmt);
+  sqlite3_finalize(query_cursor->check_stmt);
+  sqlite3_free(query_cursor->ranges);
+  query_cursor->range_stmt = NULL;
+  query_cursor->check_stmt = NULL;
+  query_cursor->ranges = NULL;
+  query_cursor->range_count = 0;
+  query_cursor->range_index = 0;
+  query_cursor->eof = 1;
+}
+
+static int sfc_query_close(sqlite3_vtab_cursor *cursor) {
+  sfc_query_reset((sfc_query_cursor *)cursor);
+  sqlite3_free(cursor);
+  return SQLITE_OK;
+}
+
+/*
+ * Decides whether the current candidate lies inside the query box. Keys carry the point position at grid
+ * resolution, so only points in grid cells on the border of the box need their geometry checked.
+ */
+static int sfc_query_accept(sfc_query_cursor *query_cursor, int *accept) {
+  uint32_t x, y;
+  int result;
+
+  if (query_cursor->ranges[query_cursor->range_index].inside) {
+    *accept = 1;
+    return SQLITE_OK;
+  }
+
+  sfc_key_cell(query_cursor->curve, query_cursor->key, &x, &y);
+  if (x < query_cursor->cells[0] || y < query_cursor->cells[1] || x > query_cursor->cells[2] || y > query_cursor->cells[3]) {
+    *accept = 0;
+    return SQLITE_OK;
+  }
+  if (x > query_cursor->cells[0] && y > query_cursor->cells[1] && x < query_cursor->cells[2] && y < query_cursor->cells[3]) {
+    *accept = 1;
+    return SQLITE_OK;
+  }
+
+  sqlite3_reset(query_cursor->check_stmt);
+  sqlite3_bind_int64(query_cursor->check_stmt, 1, query_cursor->id);
+  result = sqlite3_step(query_cursor->check_stmt);
+  if (result == SQLITE_ROW) {
+    *accept = sqlite3_column_type(query_cursor->check_stmt, 0) != SQLITE_NULL
+              && sqlite3_column_double(query_cursor->check_stmt, 2) >= query_cursor->query[0]
+              && sqlite3_column_double(query_cursor->check_stmt, 3) >= query_cursor->query[1]
+              && sqlite3_column_double(query_cursor->check_stmt, 0) <= query_cursor->query[2]
+              && sqlite3_column_double(query_cursor->check_stmt, 1) <= query_cursor->query[3];
+    return SQLITE_OK;
+  } else if (result == SQLITE_DONE) {
+    *accept = 0;
+    return SQLITE_OK;
+  } else {
+    return result;
+  }
+}
+
+static int sfc_query_next(sqlite3_vtab_cursor *cursor) {
+  sfc_query_cursor *query_cursor = (sfc_query_cursor *)cursor;
+  int result;
+  int accept;
+
+  while (query_cursor->range_index < query_cursor->range_count) {
+    result = sqlite3_step(query_cursor->range_stmt);
+    if (result == SQLITE_ROW) {
+      query_cursor->key = sqlite3_column_int64(query_cursor->range_stmt, 0);
+      query_cursor->id = sqlite3_column_int64(query_cursor->range_stmt, 1);
+      result = sfc_query_accept(query_cursor, &accept);
+      if (result != SQLITE_OK) {
+        break;
+      }
+      if (accept) {
+        return SQLITE_OK;
+      }
+    } else if (result == SQLITE_DONE) {
+      query_cursor->range_index++;
+      if (query_cursor->range_index < query_cursor->range_count) {
+        sqlite3_reset(query_cursor->range_stmt);
+        sqlite3_bind_int64(query_cursor->range_stmt, 1, query_cursor->ranges[query_cursor->range_index].start);
+        sqlite3_bind_int64(query_cursor->range_stmt, 2, query_cursor->ranges[query_cursor->range_index].end);
+      }
+    } else {
+      break;
+    }
+  }
+
+  query_cursor->eof = 1;
+  if (query_cursor->range_index >= query_cursor->range_count) {
+    return SQLITE_OK;
+  }
+
+  cursor->pVtab->zErrMsg = sqlite3_mprintf("%s", sqlite3_errmsg(((rtree_query_vtab *)cursor->pVtab)->db));
+  return result;
+}
+
+static int sfc_query_filter(sqlite3_vtab_cursor *cursor, int idxNum, const char *idxStr, int argc, sqlite3_value **argv) {
+  sfc_query_cursor *query_cursor = (sfc_query_cursor *)cursor;
+  sqlite3 *db = ((rtree_query_vtab *)cursor->pVtab)->db;
+  sqlite3_value *args[SFC_QUERY_ARG_COUNT];
+  sqlite3_stmt *stmt = NULL;
+  const char *table_name;
+  const char *column_name;
+  const char *db_name = "main";
+  char *sql = NULL;
+  int i;
+  int arg = 0;
+  int result = SQLITE_OK;
+
+  sfc_query_reset(query_cursor);
+
+  for (i = 0; i < SFC_QUERY_ARG_COUNT; i++) {
+    args[i] = (idxNum & (1 << i)) != 0 && arg < argc ? argv[arg++] : NULL;
+  }
+
+  table_name = args[0] != NULL ? (const char *)sqlite3_value_text(args[0]) : NULL;
+  column_name = args[1] != NULL ? (const char *)sqlite3_value_text(args[1]) : NULL;
+  if (table_name == NULL || column_name == NULL) {
+    cursor->pVtab->zErrMsg = sqlite3_mprintf("udbx_sfc_query requires a table and geometry column name");
+    return SQLITE_ERROR;
+  }
+  if (args[SFC_QUERY_ARG_COUNT - 1] != NULL && sqlite3_value_type(args[SFC_QUERY_ARG_COUNT - 1]) != SQLITE_NULL) {
+    db_name = (const char *)sqlite3_value_text(args[SFC_QUERY_ARG_COUNT - 1]);
+  }
+
+  for (i = 0; i < 4; i++) {
+    if (args[2 + i] == NULL || sqlite3_value_type(args[2 + i]) == SQLITE_NULL) {
+      query_cursor->query[i] = i < 2 ? -HUGE_VAL : HUGE_VAL;
+    } else {
+      query_cursor->query[i] = sqlite3_value_double(args[2 + i]);
+    }
+  }
+
+  sql = sqlite3_mprintf(
+          "SELECT id_column_name, min_x, min_y, max_x, max_y, curve FROM \"%w\".\"%w\" WHERE table_name = %Q AND column_name = %Q",
+          db_name, udbx_sfc_index.name, table_name, column_name
+        );
+  if (sql == NULL) {
+    return SQLITE_NOMEM;
+  }
+  result = sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
+  sqlite3_free(sql);
+  sql = NULL;
+  if (result == SQLITE_OK) {
+    result = sqlite3_step(stmt);
+  }
+  if (result != SQLITE_ROW) {
+    if (result == SQLITE_DONE || result == SQLITE_ERROR) {
+      cursor->pVtab->zErrMsg = sqlite3_mprintf("No space filling curve index on %s.%s.%s", db_name, table_name, column_name);
+      result = SQLITE_ERROR;
+    }
+    goto exit;
+  }
+
+  query_cursor->curve = sqlite3_stricmp((const char *)sqlite3_column_text(stmt, 5), "hilbert") == 0 ? SFC_HILBERT : SFC_MORTON;
+  query_cursor->extent.min_x = sqlite3_column_double(stmt, 1);
+  query_cursor->extent.min_y = sqlite3_column_double(stmt, 2);
+  query_cursor->extent.max_x = sqlite3_column_double(stmt, 3);
+  query_cursor->extent.max_y = sqlite3_column_double(stmt, 4);
+
+  sql = sqlite3_mprintf(
+          "SELECT ST_MinX(\"%w\"), ST_MinY(\"%w\"), ST_MaxX(\"%w\"), ST_MaxY(\"%w\") FROM \"%w\".\"%w\" WHERE \"%w\" = ?",
+          column_name, column_name, column_name, column_name, db_name, table_name, (const char *)sqlite3_column_text(stmt, 0)
+        );
+  if (sql == NULL) {
+    result = SQLITE_NOMEM;
+    goto exit;
+  }
+  result = sqlite3_prepare_v2(db, sql, -1, &query_cursor->check_stmt, NULL);
+  sqlite3_free(sql);
+  sql = NULL;
+  if (result != SQLITE_OK) {
+    cursor->pVtab->zErrMsg = sqlite3_mprintf("%s", sqlite3_errmsg(db));
+    goto exit;
+  }
+
+  sql = sqlite3_mprintf("SELECT key, id FROM \"%w\".\"sfc_%w_%w\" WHERE key BETWEEN ? AND ?", db_name, table_name, column_name);
+  if (sql == NULL) {
+    result = SQLITE_NOMEM;
+    goto exit;
+  }
+  result = sqlite3_prepare_v2(db, sql, -1, &query_cursor->range_stmt, NULL);
+  sqlite3_free(sql);
+  sql = NULL;
+  if (result != SQLITE_OK) {
+    cursor->pVtab->zErrMsg = sqlite3_mprintf("%s", sqlite3_errmsg(db));
+    goto exit;
+  }
+
+  query_cursor->cells[0] = sfc_quantize(query_cursor->query[0], query_cursor->extent.min_x, query_cursor->extent.max_x);
+  query_cursor->cells[1] = sfc_quantize(query_cursor->query[1], query_cursor->extent.min_y, query_cursor->extent.max_y);
+  query_cursor->cells[2] = sfc_quantize(query_cursor->query[2], query_cursor->extent.min_x, query_cursor->extent.max_x);
+  query_cursor->cells[3] = sfc_quantize(query_cursor->query[3], query_cursor->extent.min_y, query_cursor->extent.max_y);
+
+  result = sfc_ranges(
+             query_cursor->curve, &query_cursor->extent,
+             query_cursor->query[0], query_cursor->query[1], query_cursor->query[2], query_cursor->query[3],
+             &query_cursor->ranges, &query_cursor->range_count
+           );
+  if (result != SQLITE_OK) {
+    goto exit;
+  }
+
+  query_cursor->eof = 0;
+  if (query_cursor->range_count > 0) {
+    sqlite3_bind_int64(query_cursor->range_stmt, 1, query_cursor->ranges[0].start);
+    sqlite3_bind_int64(query_cursor->range_stmt, 2, query_cursor->ranges[0].end);
+  }
+  result = sfc_query_next(cursor);
+
+exit:
+  sqlite3_finalize(stmt);
+  return result;
+}
+
+static int sfc_query_eof(sqlite3_vtab_cursor *cursor) {
+  return ((sfc_query_cursor *)cursor)->eof;
+}
+
+static int sfc_query_column(sqlite3_vtab_cursor *cursor, sqlite3_context *context, int column) {
+  sfc_query_cursor *query_cursor = (sfc_query_cursor *)cursor;
+  if (column == SFC_QUERY_COL_ID) {
+    sqlite3_result_int64(context, query_cursor->id);
+  } else if (column == SFC_QUERY_COL_KEY) {
+    sqlite3_result_int64(context, query_cursor->key);
+  } else {
+    sqlite3_result_null(context);
+  }
+  return SQLITE_OK;
+}
+
+static int sfc_query_rowid(sqlite3_vtab_cursor *cursor, sqlite_int64 *rowid) {
+  *rowid = ((sfc_query_cursor *)cursor)->id;
+  return SQLITE_OK;
+}
+
+static sqlite3_module sfc_query_module = {
+  0,
+  sfc_query_connect,
+  sfc_query_connect,
+  sfc_query_best_index,
+  rtree_query_disconnect,
+  rtree_query_disconnect,
+  sfc_query_open,
+  sfc_query_close,
+  sfc_query_filter,
+  sfc_query_next,
+  sfc_query_eof,
+  sfc_query_column,
+  sfc_query_rowid,
+  NULL, /* xUpdate */
+  NULL, /* xBegin */
+  NULL, /* xSync */
+  NULL, /* xCommit */
+  NULL, /* xRollback */
+  NULL, /* xFindFunction */
+  NULL, /* xRename */
+  NULL, /* xSavepoint */
+  NULL, /* xRelease */
+  NULL  /* xRollbackTo */
+};
+
+typedef struct {
+  int count;
+  double extent[4];
+} extent_row_t;
+
+static int read_extent_row(sqlite3 *db, sqlite3_stmt *stmt, void *data) {
+  extent_row_t *row = (extent_row_t *)data;
+  int i;
+  for (i = 0; i < 4; i++) {
+    if (sqlite3_column_type(stmt, i) == SQLITE_NULL) {
+      return SQLITE_ABORT;
+    }
+    row->extent[i] = sqlite3_column_double(stmt, i);
+  }
+  row->count = 1;
+  return SQLITE_ABORT;
+}
+
+static int is_point_type(const char *geometry_type_name) {
+  geom_type_t geom_type;
+  if (geometry_type_name == NULL || geom_type_from_string(geometry_type_name, &geom_type) != SQLITE_OK) {
+    return 0;
+  }
+  return geom_type == GEOM_POINT || geom_type == GEOM_PARAMETRICPOINT
+         || geom_type == GEOM_ANNOTATION || geom_type == GEOM_PARAMETRICANNOTATION;
+}
+
+int spatial_key_index_create(sqlite3 *db, const char *db_name, const char *table_name, const char *geometry_column_name, const char *id_column_name, const double *extent, errorstream_t *error) {
+  int result = SQLITE_OK;
+  char *index_table_name = NULL;
+  char *geometry_type_name = NULL;
+  char *extent_sql = NULL;
+  char *key_sql = NULL;
+  char *new_key = NULL;
+  char *old_key = NULL;
+  extent_row_t data_extent;
+  int exists = 0;
+
+  index_table_name = sqlite3_mprintf("sfc_%s_%s", table_name, geometry_column_name);
+  if (index_table_name == NULL) {
+    result = SQLITE_NOMEM;
+    goto exit;
+  }
+
+  result = sql_check_table_exists(db, db_name, index_table_name, &exists);
+  if (result != SQLITE_OK) {
+    error_append(error, "Could not check if index table %s.%s exists: %s", db_name, index_table_name, sqlite3_errmsg(db));
+    goto exit;
+  }
+
+  if (exists) {
+    goto exit;
+  }
+
+  result = sql_check_table_exists(db, db_name, table_name, &exists);
+  if (result != SQLITE_OK) {
+    error_append(error, "Could not check if table %s.%s exists: %s", db_name, table_name, sqlite3_errmsg(db));
+    goto exit;
+  }
+
+  if (!exists) {
+    error_append(error, "Table %s.%s does not exist", db_name, table_name);
+    goto exit;
+  }
+
+  result = sql_exec_for_string(db, &geometry_type_name, "SELECT geometry_type_name FROM \"%w\".gpkg_geometry_columns WHERE table_name LIKE %Q AND column_name LIKE %Q", db_name, table_name, geometry_column_name);
+  if (result != SQLITE_OK) {
+    error_append(error, "Could not read geometry type of %s.%s.%s: %s", db_name, table_name, geometry_column_name, sqlite3_errmsg(db));
+    goto exit;
+  }
+
+  if (!is_point_type(geometry_type_name)) {
+    error_append(error, "Space filling curve indexes require a point column, %s.%s.%s is %s", db_name, table_name, geometry_column_name, geometry_type_name == NULL ? "not registered" : geometry_type_name);
+    goto exit;
+  }
+
+  if (extent == NULL) {
+    memset(&data_extent, 0, sizeof(extent_row_t));
+    result = sql_exec_stmt(
+               db, read_extent_row, NULL, &data_extent,
+               "SELECT min(ST_MinX(\"%w\")), min(ST_MinY(\"%w\")), max(ST_MaxX(\"%w\")), max(ST_MaxY(\"%w\")) FROM \"%w\".\"%w\"",
+               geometry_column_name, geometry_column_name, geometry_column_name, geometry_column_name, db_name, table_name
+             );
+    if (result != SQLITE_OK) {
+      error_append(error, "Could not compute extent of %s.%s.%s: %s", db_name, table_name, geometry_column_name, sqlite3_errmsg(db));
+      goto exit;
+    }
+    if (data_extent.count == 0) {
+      error_append(error, "Table %s.%s has no geometries; specify the index extent explicitly", db_name, table_name);
+      goto exit;
+    }
+    extent = data_extent.extent;
+  }
+
+  if (!(extent[2] >= extent[0]) || !(extent[3] >= extent[1])) {
+    error_append(error, "Invalid index extent");
+    goto exit;
+  }
+
+  // Triggers, bulk load and udbx_sfc_index all use the same literals so every key is computed from identical values
+  extent_sql = sqlite3_mprintf("%!.17g, %!.17g, %!.17g, %!.17g", extent[0], extent[1], extent[2], extent[3]);
+  key_sql = sqlite3_mprintf("ST_MortonKey(\"%w\", %s)", geometry_column_name, extent_sql);
+  new_key = sqlite3_mprintf("ST_MortonKey(NEW.\"%w\", %s)", geometry_column_name, extent_sql);
+  old_key = sqlite3_mprintf("ST_MortonKey(OLD.\"%w\", %s)", geometry_column_name, extent_sql);
+  if (extent_sql == NULL || key_sql == NULL || new_key == NULL || old_key == NULL) {
+    result = SQLITE_NOMEM;
+    goto exit;
+  }
+
+  result = sql_init_table(db, db_name, &udbx_sfc_index, error);
+  if (result != SQLITE_OK) {
+    goto exit;
+  }
+
+  result = sql_exec(
+             db,
+             "INSERT OR REPLACE INTO \"%w\".\"%w\" (table_name, column_name, id_column_name, curve, min_x, min_y, max_x, max_y) VALUES (%Q, %Q, %Q, 'morton', %s)",
+             db_name, udbx_sfc_index.name, table_name, geometry_column_name, id_column_name, extent_sql
+           );
+  if (result != SQLITE_OK) {
+    error_append(error, "Could not register space filling curve index: %s", sqlite3_errmsg(db));
+    goto exit;
+  }
+
+  result = sql_exec(db, "CREATE TABLE \"%w\".\"%w\" (key INTEGER NOT NULL, id INTEGER NOT NULL, PRIMARY KEY (key, id)) WITHOUT ROWID", db_name, index_table_name);
+  if (result != SQLITE_OK) {
+    error_append(error, "Could not create index table %s.%s: %s", db_name, index_table_name, sqlite3_errmsg(db));
+    goto exit;
+  }
+
+  // Empty geometries have no key; selecting from a subquery evaluates the key once per row
+  result = sql_exec(
+             db,
+             "CREATE TRIGGER \"%w\".\"sfc_%w_%w_insert\" AFTER INSERT ON \"%w\"\n"
+             "BEGIN\n"
+             "  INSERT OR REPLACE INTO \"%w\" SELECT k, NEW.\"%w\" FROM (SELECT %s AS k) WHERE k NOTNULL;\n"
+             "END;",
+             db_name, table_name, geometry_column_name, table_name,
+             index_table_name, id_column_name, new_key
+           );
+  if (result != SQLITE_OK) {
+    error_append(error, "Could not create index insert trigger: %s", sqlite3_errmsg(db));
+    goto exit;
+  }
+
+  result = sql_exec(
+             db,
+             "CREATE TRIGGER \"%w\".\"sfc_%w_%w_update\" AFTER UPDATE OF \"%w\", \"%w\" ON \"%w\"\n"
+             "BEGIN\n"
+             "  DELETE FROM \"%w\" WHERE key = %s AND id = OLD.\"%w\";\n"
+             "  INSERT OR REPLACE INTO \"%w\" SELECT k, NEW.\"%w\" FROM (SELECT %s AS k) WHERE k NOTNULL;\n"
+             "END;",
+             db_name, table_name, geometry_column_name, geometry_column_name, id_column_name, table_name,
+             index_table_name, old_key, id_column_name,
+             index_table_name, id_column_name, new_key
+           );
+  if (result != SQLITE_OK) {
+    error_append(error, "Could not create index update trigger: %s", sqlite3_errmsg(db));
+    goto exit;
+  }
+
+  result = sql_exec(
+             db,
+             "CREATE TRIGGER \"%w\".\"sfc_%w_%w_delete\" AFTER DELETE ON \"%w\"\n"
+             "BEGIN\n"
+             "  DELETE FROM \"%w\" WHERE key = %s AND id = OLD.\"%w\";\n"
+             "END;",
+             db_name, table_name, geometry_column_name, table_name,
+             index_table_name, old_key, id_column_name
+           );
+  if (result != SQLITE_OK) {
+    error_append(error, "Could not create index delete trigger: %s", sqlite3_errmsg(db));
+    goto exit;
+  }
+
+  // Loading in key order appends to the b-tree instead of splitting pages all over it
+  result = sql_exec(
+             db,
+             "INSERT OR REPLACE INTO \"%w\".\"%w\" (key, id)"
+             "  SELECT k, i FROM (SELECT %s AS k, \"%w\" AS i FROM \"%w\".\"%w\") WHERE k NOTNULL ORDER BY k",
+             db_name, index_table_name,
+             key_sql, id_column_name, db_name, table_name
+           );
+  if (result != SQLITE_OK) {
+    error_append(error, "Could not populate index: %s", sqlite3_errmsg(db));
+    goto exit;
+  }
+
+  result = sql_exec(
+             db,
+             "INSERT OR REPLACE INTO \"%w\".\"gpkg_extensions\" (table_name, column_name, extension_name, definition, scope) VALUES (%Q, %Q, %Q, %Q, %Q)",
+             db_name, table_name, geometry_column_name, "udbx_sfc_index", "Morton key point index", "write-only"
+           );
+  if (result != SQLITE_OK) {
+    error_append(error, "Could not register index usage in gpkg_extensions: %s", sqlite3_errmsg(db));
+    goto exit;
+  }
+
+exit:
+  sqlite3_free(index_table_name);
+  sqlite3_free(geometry_type_name);
+  sqlite3_free(extent_sql);
+  sqlite3_free(key_sql);
+  sqlite3_free(new_key);
+  sqlite3_free(old_key);
+  return result;
+}
+
+static int read_index_extent_row(sqlite3 *db, sqlite3_stmt *stmt, void *data) {
+  extent_row_t *row = (extent_row_t *)data;
+  int i;
+  for (i = 0; i < 4; i++) {
+    row->extent[i] = sqlite3_column_double(stmt, i);
+  }
+  row->count = 1;
+  return SQLITE_ABORT;
+}
+
+int spatial_key_index_extent(sqlite3 *db, const char *db_name, const char *table_name, const char *geometry_column_name, double *extent, int *exists) {
+  extent_row_t row;
+  int result;
+
+  *exists = 0;
+  result = sql_check_table_exists(db, db_name, udbx_sfc_index.name, exists);
+  if (result != SQLITE_OK || !*exists) {
+    return result;
+  }
+
+  memset(&row, 0, sizeof(extent_row_t));
+  result = sql_exec_stmt(
+             db, read_index_extent_row, NULL, &row,
+             "SELECT min_x, min_y, max_x, max_y FROM \"%w\".\"%w\" WHERE table_name = %Q AND column_name = %Q",
+             db_name, udbx_sfc_index.name, table_name, geometry_column_name
+           );
+  *exists = row.count;
+  memcpy(extent, row.extent, sizeof(row.extent));
+  return result;
+}
+
+int spatial_key_index_drop(sqlite3 *db, const char *db_name, const char *table_name, const char *geometry_column_name, errorstream_t *error) {
+  int result = SQLITE_OK;
+  int exists = 0;
+
+  result = sql_exec(db, "DROP TRIGGER IF EXISTS \"%w\".\"sfc_%w_%w_insert\"", db_name, table_name, geometry_column_name);
+  if (result == SQLITE_OK) {
+    result = sql_exec(db, "DROP TRIGGER IF EXISTS \"%w\".\"sfc_%w_%w_update\"", db_name, table_name, geometry_column_name);
+  }
+  if (result == SQLITE_OK) {
+    result = sql_exec(db, "DROP TRIGGER IF EXISTS \"%w\".\"sfc_%w_%w_delete\"", db_name, table_name, geometry_column_name);
+  }
+  if (result == SQLITE_OK) {
+    result = sql_exec(db, "DROP TABLE IF EXISTS \"%w\".\"sfc_%w_%w\"", db_name, table_name, geometry_column_name);
+  }
+  if (result != SQLITE_OK) {
+    error_append(error, "Could not drop space filling curve index: %s", sqlite3_errmsg(db));
+    goto exit;
+  }
+
+  result = sql_check_table_exists(db, db_name, udbx_sfc_index.name, &exists);
+  if (result == SQLITE_OK && exists) {
+    result = sql_exec(db, "DELETE FROM \"%w\".\"%w\" WHERE table_name = %Q AND column_name = %Q", db_name, udbx_sfc_index.name, table_name, geometry_column_name);
+  }
+  if (result == SQLITE_OK) {
+    result = sql_exec(db, "DELETE FROM \"%w\".gpkg_extensions WHERE table_name = %Q AND column_name = %Q AND extension_name = 'udbx_sfc_index'", db_name, table_name, geometry_column_name);
+  }
+  if (result != SQLITE_OK) {
+    error_append(error, "Could not unregister space filling curve index: %s", sqlite3_errmsg(db));
+  }
+
+exit:
+  return result;
+}
+
+/*
+ * The counts below read the rtree node blobs directly. A node starts with a 2 byte depth (only meaningful for the
+ * root, node 1) and a 2 byte cell count, followed by the cells: a 64-bit id and a min/max pair of 32-bit floats per
+ * dimension, all big-endian. Leaf cell ids are rowids, inner cell ids are child node numbers.
+ */
+typedef struct {
+  sqlite3 *db;
+  char *index_table_name;
+  sqlite3_stmt *node_stmt;
+  sqlite3_stmt *cache_read_stmt;
+  sqlite3_stmt *cache_write_stmt;
+  sqlite3_int64 generation;
+  int cell_size;
+  double query[4];
+  double query_area;
+  double tolerance;
+} rtree_count_t;
+
+static sqlite3_int64 rtree_node_int64(const unsigned char *p) {
+  sqlite3_int64 value = 0;
+  int i;
+  for (i = 0; i < 8; i++) {
+    value = (value << 8) | p[i];
+  }
+  return value;
+}
+
+static double rtree_node_coord(const unsigned char *p) {
+  uint32_t bits = ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+  float value;
+  memcpy(&value, &bits, sizeof(float));
+  return value;
+}
+
+static int rtree_count_read_node(rtree_count_t *c, sqlite3_int64 nodeno, unsigned char **data, int *cells) {
+  int result;
+  int size;
+
+  *data = NULL;
+  *cells = 0;
+  sqlite3_bind_int64(c->node_stmt, 1, nodeno);
+  result = sqlite3_step(c->node_stmt);
+  if (result == SQLITE_ROW) {
+    size = sqlite3_column_bytes(c->node_stmt, 0);
+    if (size < 4) {
+      result = SQLITE_CORRUPT;
+    } else {
+      *data = (unsigned char *)sqlite3_malloc(size);
+      if (*data == NULL) {
+        result = SQLITE_NOMEM;
+      } else {
+        memcpy(*data, sqlite3_column_blob(c->node_stmt, 0), (size_t)size);
+        *cells = ((*data)[2] << 8) | (*data)[3];
+        result = 4 + *cells * c->cell_size <= size ? SQLITE_OK : SQLITE_CORRUPT;
+      }
+    }
+  } else if (result == SQLITE_DONE) {
+    result = SQLITE_CORRUPT;
+  }
+  sqlite3_reset(c->node_stmt);
+
+  if (result != SQLITE_OK) {
+    sqlite3_free(*data);
+    *data = NULL;
+  }
+  return result;
+}
+
+/*
+ * Counts the leaf cells below the node of a cell. Inner node counts are cached in udbx_rtree_count together with the
+ * box of the node when the column has a count cache; a cached count only applies while the node still has that box.
+ * Cache writes are best effort so read-only databases still get an answer.
+ */
+static int rtree_count_subtree(rtree_count_t *c, const unsigned char *cell, int depth, sqlite3_int64 *count) {
+  sqlite3_int64 nodeno = rtree_node_int64(cell);
+  unsigned char *data = NULL;
+  int cells = 0;
+  int result;
+  int i;
+
+  *count = 0;
+  if (depth > 0 && c->cache_read_stmt != NULL) {
+    sqlite3_bind_int64(c->cache_read_stmt, 3, nodeno);
+    sqlite3_bind_int64(c->cache_read_stmt, 4, c->generation);
+    for (i = 0; i < 4; i++) {
+      sqlite3_bind_double(c->cache_read_stmt, 5 + i, rtree_node_coord(cell + 8 + 4 * i));
+    }
+    result = sqlite3_step(c->cache_read_stmt);
+    if (result == SQLITE_ROW) {
+      *count = sqlite3_column_int64(c->cache_read_stmt, 0);
+    }
+    sqlite3_reset(c->cache_read_stmt);
+    if (result == SQLITE_ROW) {
+      return SQLITE_OK;
+    }
+  }
+
+  result = rtree_count_read_node(c, nodeno, &data, &cells);
+  if (result != SQLITE_OK) {
+    return result;
+  }
+
+  if (depth == 0) {
+    *count = cells;
+  } else {
+    for (i = 0; i < cells && result == SQLITE_OK; i++) {
+      sqlite3_int64 child_count = 0;
+      result = rtree_count_subtree(c, data + 4 + i * c->cell_size, depth - 1, &child_count);
+      *count += child_count;
+    }
+  }
+  sqlite3_free(data);
+
+  if (result == SQLITE_OK && depth > 0 && c->cache_write_stmt != NULL) {
+    sqlite3_bind_int64(c->cache_write_stmt, 3, nodeno);
+    sqlite3_bind_int64(c->cache_write_stmt, 4, c->generation);
+    sqlite3_bind_int64(c->cache_write_stmt, 5, *count);
+    for (i = 0; i < 4; i++) {
+      sqlite3_bind_double(c->cache_write_stmt, 6 + i, rtree_node_coord(cell + 8 + 4 * i));
+    }
+    sqlite3_step(c->cache_write_stmt);
+    sqlite3_reset(c->cache_write_stmt);
+  }
+  return result;
+}
+
+static int rtree_count_node(rtree_count_t *c, sqlite3_int64 nodeno, int depth, double *count) {
+  unsigned char *data = NULL;
+  int cells = 0;
+  int result;
+  int i;
+
+  result = rtree_count_read_node(c, nodeno, &data, &cells);
+  if (result != SQLITE_OK) {
+    return result;
+  }
+
+  for (i = 0; i < cells && result == SQLITE_OK; i++) {
+    const unsigned char *cell = data + 4 + i * c->cell_size;
+    double min_x = rtree_node_coord(cell + 8);
+    double max_x = rtree_node_coord(cell + 12);
+    double min_y = rtree_node_coord(cell + 16);
+    double max_y = rtree_node_coord(cell + 20);
+    double area;
+    sqlite3_int64 child_count = 0;
+
+    if (max_x < c->query[0] || min_x > c->query[2] || max_y < c->query[1] || min_y > c->query[3]) {
+      continue;
+    }
+
+    if (depth == 0) {
+      *count += 1;
+      continue;
+    }
+
+    area = (max_x - min_x) * (max_y - min_y);
+    if (min_x >= c->query[0] && max_x <= c->query[2] && min_y >= c->query[1] && max_y <= c->query[3]) {
+      result = rtree_count_subtree(c, cell, depth - 1, &child_count);
+      *count += (double)child_count;
+    } else if (c->tolerance > 0.0 && area <= c->tolerance * c->query_area) {
+      // Small, partially covered node: assume its features are spread evenly over its envelope
+      double overlap_x = (max_x < c->query[2] ? max_x : c->query[2]) - (min_x > c->query[0] ? min_x : c->query[0]);
+      double overlap_y = (max_y < c->query[3] ? max_y : c->query[3]) - (min_y > c->query[1] ? min_y : c->query[1]);
+      result = rtree_count_subtree(c, cell, depth - 1, &child_count);
+      *count += area > 0.0 ? (double)child_count * (overlap_x * overlap_y) / area : (double)child_count;
+    } else {
+      result = rtree_count_node(c, rtree_node_int64(cell), depth - 1, count);
+    }
+  }
+
+  sqlite3_free(data);
+  return result;
+}
+
+static int read_generation_row(sqlite3 *db, sqlite3_stmt *stmt, void *data) {
+  *((sqlite3_int64 *)data) = sqlite3_column_int64(stmt, 0);
+  return SQLITE_ABORT;
+}
+
+/*
+ * Checks whether GPKG_CreateSpatialIndexStep is still filling the rtree of a column.
+ */
+static int rtree_build_pending(sqlite3 *db, const char *db_name, const char *table_name, const char *column_name, int *pending) {
+  int exists = 0;
+  int result = sql_check_table_exists(db, db_name, "udbx_spatial_index_build", &exists);
+  *pending = 0;
+  if (result != SQLITE_OK || !exists) {
+    return result;
+  }
+
+  return sql_exec_for_int(
+           db, pending,
+           "SELECT count(*) FROM \"%w\".\"udbx_spatial_index_build\" WHERE table_name = %Q AND column_name = %Q",
+           db_name, table_name, column_name
+         );
+}
+
+/*
+ * Prepares the node and count cache statements of a spatial index. Sets exists to 0 and appends an error when the
+ * column has no spatial index, or has one that an incremental build has only partly filled.
+ */
+static int rtree_count_open(rtree_count_t *c, sqlite3 *db, const char *db_name, const char *table_name, const char *column_name, int *exists, errorstream_t *error) {
+  int result = SQLITE_OK;
+  char *sql = NULL;
+  int has_z = 0;
+  int has_m = 0;
+  int cache_exists = 0;
+  int pending = 0;
+
+  memset(c, 0, sizeof(rtree_count_t));
+  c->db = db;
+  c->generation = -1;
+  *exists = 0;
+
+  c->index_table_name = sqlite3_mprintf("rtree_%s_%s", table_name, column_name);
+  if (c->index_table_name == NULL) {
+    return SQLITE_NOMEM;
+  }
+
+  result = sql_check_table_exists(db, db_name, c->index_table_name, exists);
+  if (result == SQLITE_OK && *exists) {
+    result = sql_check_column_exists(db, db_name, c->index_table_name, "minz", &has_z);
+  }
+  if (result == SQLITE_OK && *exists) {
+    result = sql_check_column_exists(db, db_name, c->index_table_name, "minm", &has_m);
+  }
+  if (result != SQLITE_OK) {
+    error_append(error, "Could not inspect index table %s.%s: %s", db_name, c->index_table_name, sqlite3_errmsg(db));
+    return result;
+  }
+  if (!*exists) {
+    error_append(error, "No spatial index on %s.%s.%s", db_name, table_name, column_name);
+    return SQLITE_OK;
+  }
+
+  result = rtree_build_pending(db, db_name, table_name, column_name, &pending);
+  if (result != SQLITE_OK) {
+    error_append(error, "Could not read spatial index build state: %s", sqlite3_errmsg(db));
+    return result;
+  }
+  if (pending) {
+    *exists = 0;
+    error_append(error, "Spatial index on %s.%s.%s is still being built; finish it with GPKG_CreateSpatialIndexStep", db_name, table_name, column_name);
+    return SQLITE_OK;
+  }
+  c->cell_size = 8 + 8 * (2 + has_z + has_m);
+
+  sql = sqlite3_mprintf("SELECT data FROM \"%w\".\"%w_node\" WHERE nodeno = ?", db_name, c->index_table_name);
+  if (sql == NULL) {
+    return SQLITE_NOMEM;
+  }
+  result = sql_init_stmt(&c->node_stmt, db, sql);
+  sqlite3_free(sql);
+  sql = NULL;
+  if (result != SQLITE_OK) {
+    error_append(error, "Could not read index table %s.%s: %s", db_name, c->index_table_name, sqlite3_errmsg(db));
+    return result;
+  }
+
+  result = sql_check_table_exists(db, db_name, udbx_rtree_count.name, &cache_exists);
+  if (result == SQLITE_OK && cache_exists) {
+    // The count of node 0 is the number of rtree entries moved between nodes since the last read; moved entries change
+    // the counts of nodes that the update triggers do not clear. Without write access the cache is not used until a
+    // later read starts the new generation.
+    sql_exec(
+      db,
+      "UPDATE \"%w\".\"%w\" SET generation = generation + 1, count = 0 WHERE table_name = %Q AND column_name = %Q AND nodeno = 0 AND count <> 0",
+      db_name, udbx_rtree_count.name, table_name, column_name
+    );
+    result = sql_exec_stmt(
+               db, read_generation_row, NULL, &c->generation,
+               "SELECT generation FROM \"%w\".\"%w\" WHERE table_name = %Q AND column_name = %Q AND nodeno = 0 AND count = 0",
+               db_name, udbx_rtree_count.name, table_name, column_name
+             );
+  }
+  if (result != SQLITE_OK) {
+    error_append(error, "Could not read %s.%s: %s", db_name, udbx_rtree_count.name, sqlite3_errmsg(db));
+    return result;
+  }
+
+  if (c->generation >= 0) {
+    sql = sqlite3_mprintf(
+            "SELECT count FROM \"%w\".\"%w\" WHERE table_name = ?1 AND column_name = ?2 AND nodeno = ?3 AND generation = ?4"
+            " AND min_x = ?5 AND max_x = ?6 AND min_y = ?7 AND max_y = ?8",
+            db_name, udbx_rtree_count.name
+          );
+    if (sql == NULL) {
+      return SQLITE_NOMEM;
+    }
+    result = sql_init_stmt(&c->cache_read_stmt, db, sql);
+    sqlite3_free(sql);
+    sql = NULL;
+    if (result != SQLITE_OK) {
+      error_append(error, "Could not read %s.%s: %s", db_name, udbx_rtree_count.name, sqlite3_errmsg(db));
+      return result;
+    }
+    sqlite3_bind_text(c->cache_read_stmt, 1, table_name, -1, SQLITE_STATIC);
+    sqlite3_bind_text(c->cache_read_stmt, 2, column_name, -1, SQLITE_STATIC);
+
+    sql = sqlite3_mprintf(
+            "INSERT OR REPLACE INTO \"%w\".\"%w\" (table_name, column_name, nodeno, generation, count, min_x, max_x, min_y, max_y)"
+            " VALUES (?1, ?2, ?3, ?4, ?5, ?6, ?7, ?8, ?9)",
+            db_name, udbx_rtree_count.name
+          );
+    if (sql == NULL) {
+      return SQLITE_NOMEM;
+    }
+    // Without write access the cache is only read
+    if (sql_init_stmt(&c->cache_write_stmt, db, sql) == SQLITE_OK) {
+      sqlite3_bind_text(c->cache_write_stmt, 1, table_name, -1, SQLITE_STATIC);
+      sqlite3_bind_text(c->cache_write_stmt, 2, column_name, -1, SQLITE_STATIC);
+    }
+    sqlite3_free(sql);
+  }
+  return SQLITE_OK;
+}
+
+static void rtree_count_close(rtree_count_t *c) {
+  sqlite3_finalize(c->node_stmt);
+  sqlite3_finalize(c->cache_read_stmt);
+  sqlite3_finalize(c->cache_write_stmt);
+  sqlite3_free(c->index_table_name);
+  c->node_stmt = NULL;
+  c->cache_read_stmt = NULL;
+  c->cache_write_stmt = NULL;
+  c->index_table_name = NULL;
+}
+
+int spatial_index_count(sqlite3 *db, const char *db_name, const char *table_name, const char *column_name, const double *bbox, double tolerance, double *count, errorstream_t *error) {
+  int result = SQLITE_OK;
+  rtree_count_t c;
+  unsigned char *root = NULL;
+  int cells = 0;
+  int exists = 0;
+
+  *count = 0.0;
+  result = rtree_count_open(&c, db, db_name, table_name, column_name, &exists, error);
+  if (result != SQLITE_OK || !exists) {
+    goto exit;
+  }
+  memcpy(c.query, bbox, sizeof(c.query));
+  c.query_area = (bbox[2] - bbox[0]) * (bbox[3] - bbox[1]);
+  c.tolerance = tolerance;
+
+  if (!(bbox[2] >= bbox[0]) || !(bbox[3] >= bbox[1])) {
+    goto exit;
+  }
+
+  result = rtree_count_read_node(&c, 1, &root, &cells);
+  if (result == SQLITE_OK) {
+    result = rtree_count_node(&c, 1, (root[0] << 8) | root[1], count);
+  }
+  if (result != SQLITE_OK) {
+    error_append(error, "Could not count index entries of %s.%s: %s", db_name, c.index_table_name, sqlite3_errstr(result));
+  }
+
+exit:
+  sqlite3_free(root);
+  rtree_count_close(&c);
+  return result;
+}
+
+typedef struct {
+  rtree_count_t count;
+  double bbox[4];
+  double cell_size;
+  int columns;
+  int rows;
+  sqlite3_int64 *counts;
+} rtree_density_t;
+
+static int rtree_density_cell(const rtree_density_t *d, double value, double min, int cells) {
+  double cell = floor((value - min) / d->cell_size);
+  if (cell < 0.0) {
+    return 0;
+  }
+  return cell >= (double)cells ? cells - 1 : (int)cell;
+}
+
+/*
+ * Features are binned by the center of their index envelope. A node whose envelope lies inside a single grid cell
+ * adds its subtree count to that cell without being descended.
+ */
+static int rtree_density_node(rtree_density_t *d, sqlite3_int64 nodeno, int depth) {
+  rtree_count_t *c = &d->count;
+  unsigned char *data = NULL;
+  int cells = 0;
+  int result;
+  int i;
+
+  result = rtree_count_read_node(c, nodeno, &data, &cells);
+  if (result != SQLITE_OK) {
+    return result;
+  }
+
+  for (i = 0; i < cells && result == SQLITE_OK; i++) {
+    const unsigned char *cell = data + 4 + i * c->cell_size;
+    double min_x = rtree_node_coord(cell + 8);
+    double max_x = rtree_node_coord(cell + 12);
+    double min_y = rtree_node_coord(cell + 16);
+    double max_y = rtree_node_coord(cell + 20);
+    int x0, y0;
+
+    if (max_x < d->bbox[0] || min_x > d->bbox[2] || max_y < d->bbox[1] || min_y > d->bbox[3]) {
+      continue;
+    }
+
+    if (depth == 0) {
+      double x = (min_x + max_x) / 2.0;
+      double y = (min_y + max_y) / 2.0;
+      if (x >= d->bbox[0] && x <= d->bbox[2] && y >= d->bbox[1] && y <= d->bbox[3]) {
+        x0 = rtree_density_cell(d, x, d->bbox[0], d->columns);
+        y0 = rtree_density_cell(d, y, d->bbox[1], d->rows);
+        d->counts[(size_t)y0 * d->columns + x0]++;
+      }
+      continue;
+    }
+
+    if (min_x >= d->bbox[0] && max_x <= d->bbox[2] && min_y >= d->bbox[1] && max_y <= d->bbox[3]) {
+      x0 = rtree_density_cell(d, min_x, d->bbox[0], d->columns);
+      y0 = rtree_density_cell(d, min_y, d->bbox[1], d->rows);
+      if (x0 == rtree_density_cell(d, max_x, d->bbox[0], d->columns) && y0 == rtree_density_cell(d, max_y, d->bbox[1], d->rows)) {
+        sqlite3_int64 child_count = 0;
+        result = rtree_count_subtree(c, cell, depth - 1, &child_count);
+        d->counts[(size_t)y0 * d->columns + x0] += child_count;
+        continue;
+      }
+    }
+    result = rtree_density_node(d, rtree_node_int64(cell), depth - 1);
+  }
+
+  sqlite3_free(data);
+  return result;
+}
+
+int spatial_index_density(sqlite3 *db, const char *db_name, const char *table_name, const char *column_name, const double *bbox, double cell_size, int columns, int rows, sqlite3_int64 *counts, errorstream_t *error) {
+  int result = SQLITE_OK;
+  rtree_density_t d;
+  unsigned char *root = NULL;
+  int cells = 0;
+  int exists = 0;
+
+  memset(counts, 0, (size_t)columns * (size_t)rows * sizeof(sqlite3_int64));
+  result = rtree_count_open(&d.count, db, db_name, table_name, column_name, &exists, error);
+  if (result != SQLITE_OK || !exists) {
+    goto exit;
+  }
+  memcpy(d.bbox, bbox, sizeof(d.bbox));
+  d.cell_size = cell_size;
+  d.columns = columns;
+  d.rows = rows;
+  d.counts = counts;
+
+  result = rtree_count_read_node(&d.count, 1, &root, &cells);
+  if (result == SQLITE_OK) {
+    result = rtree_density_node(&d, 1, (root[0] << 8) | root[1]);
+  }
+  if (result != SQLITE_OK) {
+    error_append(error, "Could not count index entries of %s.%s: %s", db_name, d.count.index_table_name, sqlite3_errstr(result));
+  }
+
+exit:
+  sqlite3_free(root);
+  rtree_count_close(&d.count);
+  return result;
+}
+
+#define DENSITY_COL_IX 0
+#define DENSITY_COL_IY 1
+#define DENSITY_COL_X 2
+#define DENSITY_COL_Y 3
+#define DENSITY_COL_COUNT 4
+#define DENSITY_COL_TABLE 5
+#define DENSITY_COL_DB 12
+#define DENSITY_ARG_COUNT (DENSITY_COL_DB - DENSITY_COL_TABLE + 1)
+
+typedef struct {
+  sqlite3_vtab_cursor base;
+  sqlite3_int64 *counts;
+  double bbox[4];
+  double cell_size;
+  int columns;
+  int rows;
+  sqlite3_int64 index;
+} density_cursor;
+
+static int density_connect(sqlite3 *db, void *aux, int argc, const char *const *argv, sqlite3_vtab **vtab, char **err) {
+  rtree_query_vtab *query_vtab;
+  int result;
+
+  result = sqlite3_declare_vtab(
+             db,
+             "CREATE TABLE x(ix INTEGER, iy INTEGER, x REAL, y REAL, count INTEGER, "
+             "table_name HIDDEN, column_name HIDDEN, xmin HIDDEN, ymin HIDDEN, xmax HIDDEN, ymax HIDDEN, cell_size HIDDEN, "
+             "db_name HIDDEN)"
+           );
+  if (result != SQLITE_OK) {
+    return result;
+  }
+
+  query_vtab = (rtree_query_vtab *)sqlite3_malloc(sizeof(rtree_query_vtab));
+  if (query_vtab == NULL) {
+    return SQLITE_NOMEM;
+  }
+  memset(query_vtab, 0, sizeof(rtree_query_vtab));
+  query_vtab->db = db;
+
+  *vtab = &query_vtab->base;
+  return SQLITE_OK;
+}
+
+static int density_best_index(sqlite3_vtab *vtab, sqlite3_index_info *info) {
+  int constraint[DENSITY_ARG_COUNT];
+  int i;
+  int arg = 0;
+  int mask = 0;
+
+  for (i = 0; i < DENSITY_ARG_COUNT; i++) {
+    constraint[i] = -1;
+  }
+
+  for (i = 0; i < info->nConstraint; i++) {
+    const struct sqlite3_index_constraint *c = &info->aConstraint[i];
+    if (c->usable && c->op == SQLITE_INDEX_CONSTRAINT_EQ && c->iColumn >= DENSITY_COL_TABLE) {
+      constraint[c->iColumn - DENSITY_COL_TABLE] = i;
+    }
+  }
+
+  for (i = 0; i < DENSITY_ARG_COUNT; i++) {
+    if (constraint[i] >= 0) {
+      info->aConstraintUsage[constraint[i]].argvIndex = ++arg;
+      info->aConstraintUsage[constraint[i]].omit = 1;
+      mask |= 1 << i;
+    }
+  }
+
+  // Everything but the database name is required
+  info->idxNum = mask;
+  if ((mask & 0x7F) == 0x7F) {
+    info->estimatedCost = 1000.0;
+  } else {
+    info->estimatedCost = 1e99;
+  }
+  return SQLITE_OK;
+}
+
+static int density_open(sqlite3_vtab *vtab, sqlite3_vtab_cursor **cursor) {
+  density_cursor *density = (density_cursor *)sqlite3_malloc(sizeof(density_cursor));
+  if (density == NULL) {
+    return SQLITE_NOMEM;
+  }
+  memset(density, 0, sizeof(density_cursor));
+  *cursor = &density->base;
+  return SQLITE_OK;
+}
+
+static int density_close(sqlite3_vtab_cursor *cursor) {
+  sqlite3_free(((density_cursor *)cursor)->counts);
+  sqlite3_free(cursor);
+  return SQLITE_OK;
+}
+
+static int density_eof(sqlite3_vtab_cursor *cursor) {
+  density_cursor *density = (density_cursor *)cursor;
+  return density->index >= (sqlite3_int64)density->columns * density->rows;
+}
+
+// Only cells holding at least one feature are returned
+static int density_next(sqlite3_vtab_cursor *cursor) {
+  density_cursor *density = (density_cursor *)cursor;
+  sqlite3_int64 cells = (sqlite3_int64)density->columns * density->rows;
+
+  do {
+    density->index++;
+  } while (density->index < cells && density->counts[density->index] == 0);
+  return SQLITE_OK;
+}
+
+static int density_filter(sqlite3_vtab_cursor *cursor, int idxNum, const char *idxStr, int argc, sqlite3_value **argv) {
+  density_cursor *density = (density_cursor *)cursor;
+  sqlite3 *db = ((rtree_query_vtab *)cursor->pVtab)->db;
+  sqlite3_value *args[DENSITY_ARG_COUNT];
+  const char *table_name;
+  const char *column_name;
+  const char *db_name = "main";
+  double columns, rows;
+  errorstream_t error;
+  int i;
+  int arg = 0;
+  int result = SQLITE_OK;
+
+  sqlite3_free(density->counts);
+  density->counts = NULL;
+  density->columns = 0;
+  density->rows = 0;
+  density->index = 0;
+
+  for (i = 0; i < DENSITY_ARG_COUNT; i++) {
+    args[i] = (idxNum & (1 << i)) != 0 && arg < argc ? argv[arg++] : NULL;
+  }
+  for (i = 0; i < DENSITY_ARG_COUNT - 1; i++) {
+    if (args[i] == NULL || sqlite3_value_type(args[i]) == SQLITE_NULL) {
+      cursor->pVtab->zErrMsg = sqlite3_mprintf("udbx_density requires a table, geometry column, bounding box and cell size");
+      return SQLITE_ERROR;
+    }
+  }
+  table_name = (const char *)sqlite3_value_text(args[0]);
+  column_name = (const char *)sqlite3_value_text(args[1]);
+  if (args[DENSITY_ARG_COUNT - 1] != NULL && sqlite3_value_type(args[DENSITY_ARG_COUNT - 1]) != SQLITE_NULL) {
+    db_name = (const char *)sqlite3_value_text(args[DENSITY_ARG_COUNT - 1]);
+  }
+  for (i = 0; i < 4; i++) {
+    density->bbox[i] = sqlite3_value_double(args[2 + i]);
+  }
+  density->cell_size = sqlite3_value_double(args[6]);
+
+  if (!(density->cell_size > 0.0) || !(density->bbox[2] >= density->bbox[0]) || !(density->bbox[3] >= density->bbox[1])) {
+    cursor->pVtab->zErrMsg = sqlite3_mprintf("udbx_density requires a valid bounding box and a positive cell size");
+    return SQLITE_ERROR;
+  }
+
+  columns = ceil((density->bbox[2] - density->bbox[0]) / density->cell_size);
+  rows = ceil((density->bbox[3] - density->bbox[1]) / density->cell_size);
+  columns = columns < 1.0 ? 1.0 : columns;
+  rows = rows < 1.0 ? 1.0 : rows;
+  if (columns * rows > DENSITY_MAX_CELLS) {
+    cursor->pVtab->zErrMsg = sqlite3_mprintf("udbx_density grid of %.0f x %.0f cells exceeds the limit of %d cells", columns, rows, DENSITY_MAX_CELLS);
+    return SQLITE_ERROR;
+  }
+
+  if (error_init(&error) != SQLITE_OK) {
+    return SQLITE_NOMEM;
+  }
+  density->columns = (int)columns;
+  density->rows = (int)rows;
+  density->counts = (sqlite3_int64 *)sqlite3_malloc((int)(density->columns * density->rows * sizeof(sqlite3_int64)));
+  if (density->counts == NULL) {
+    density->columns = 0;
+    density->rows = 0;
+    error_destroy(&error);
+    return SQLITE_NOMEM;
+  }
+
+  result = spatial_index_density(db, db_name, table_name, column_name, density->bbox, density->cell_size, density->columns, density->rows, density->counts, &error);
+  if (result == SQLITE_OK && error_count(&error) > 0) {
+    result = SQLITE_ERROR;
+  }
+  if (result != SQLITE_OK) {
+    cursor->pVtab->zErrMsg = sqlite3_mprintf("%s", error_count(&error) > 0 ? error_message(&error) : sqlite3_errstr(result));
+    density->index = (sqlite3_int64)density->columns * density->rows;
+  } else {
+    density->index = -1;
+    density_next(cursor);
+  }
+  error_destroy(&error);
+  return result;
+}
+
+static int density_column(sqlite3_vtab_cursor *cursor, sqlite3_context *context, int column) {
+  density_cursor *density = (density_cursor *)cursor;
+  int ix = (int)(density->index % density->columns);
+  int iy = (int)(density->index / density->columns);
+
+  switch (column) {
+    case DENSITY_COL_IX:
+      sqlite3_result_int(context, ix);
+      break;
+    case DENSITY_COL_IY:
+      sqlite3_result_int(context, iy);
+      break;
+    case DENSITY_COL_X:
+      sqlite3_result_double(context, density->bbox[0] + (ix + 0.5) * density->cell_size);
+      break;
+    case DENSITY_COL_Y:
+      sqlite3_result_double(context, density->bbox[1] + (iy + 0.5) * density->cell_size);
+      break;
+    case DENSITY_COL_COUNT:
+      sqlite3_result_int64(context, density->counts[density->index]);
+      break;
+    default:
+      sqlite3_result_null(context);
+      break;
+  }
+  return SQLITE_OK;
+}
+
+static int density_rowid(sqlite3_vtab_cursor *cursor, sqlite_int64 *rowid) {
+  *rowid = ((density_cursor *)cursor)->index;
+  return SQLITE_OK;
+}
+
+static sqlite3_module density_module = {
+  0,
+  density_connect,
+  density_connect,
+  density_best_index,
+  rtree_query_disconnect,
+  rtree_query_disconnect,
+  density_open,
+  density_close,
+  density_filter,
+  density_next,
+  density_eof,
+  density_column,
+  density_rowid,
+  NULL, /* xUpdate */
+  NULL, /* xBegin */
+  NULL, /* xSync */
+  NULL, /* xCommit */
+  NULL, /* xRollback */
+  NULL, /* xFindFunction */
+  NULL, /* xRename */
+  NULL, /* xSavepoint */
+  NULL, /* xRelease */
+  NULL  /* xRollbackTo */
+};
+
+int spatial_index_count_cache_create(sqlite3 *db, const char *db_name, const char *table_name, const char *column_name, errorstream_t *error) {
+  int result = SQLITE_OK;
+  char *index_table_name = NULL;
+  char *bump = NULL;
+  int exists = 0;
+  int moves = 0;
+
+  index_table_name = sqlite3_mprintf("rtree_%s_%s", table_name, column_name);
+  if (index_table_name == NULL) {
+    result = SQLITE_NOMEM;
+    goto exit;
+  }
+
+  result = sql_check_table_exists(db, db_name, index_table_name, &exists);
+  if (result != SQLITE_OK) {
+    error_append(error, "Could not check if index table %s.%s exists: %s", db_name, index_table_name, sqlite3_errmsg(db));
+    goto exit;
+  }
+
+  if (!exists) {
+    error_append(error, "No spatial index on %s.%s.%s", db_name, table_name, column_name);
+    goto exit;
+  }
+
+  result = sql_init_table(db, db_name, &udbx_rtree_count, error);
+  if (result != SQLITE_OK) {
+    goto exit;
+  }
+
+  result = sql_exec(
+             db,
+             "INSERT OR IGNORE INTO \"%w\".\"%w\" (table_name, column_name, nodeno, generation, count) VALUES (%Q, %Q, 0, 0, 0)",
+             db_name, udbx_rtree_count.name, table_name, column_name
+           );
+  if (result != SQLITE_OK) {
+    error_append(error, "Could not register count cache: %s", sqlite3_errmsg(db));
+    goto exit;
+  }
+
+  // Node 0 does not exist in an rtree; its row holds the generation that cached counts must match to be valid
+  bump = sqlite3_mprintf(
+           "UPDATE \"%w\" SET generation = generation + 1 WHERE table_name = %Q AND column_name = %Q AND nodeno = 0",
+           udbx_rtree_count.name, table_name, column_name
+         );
+  if (bump == NULL) {
+    result = SQLITE_NOMEM;
+    goto exit;
+  }
+
+  result = sql_exec(
+             db,
+             "CREATE TRIGGER IF NOT EXISTS \"%w\".\"udbx_rtree_count_%w_%w_insert\" AFTER INSERT ON \"%w\"\n"
+             "BEGIN\n"
+             "  %s;\n"
+             "END;",
+             db_name, table_name, column_name, table_name, bump
+           );
+  // Besides the nodes holding the old and new envelope of an updated geometry, an rtree update changes the counts of
+  // the nodes that receive entries SQLite moves out of an overflowing or underflowing node. Every entry written to the
+  // rowid table of the rtree increments the count of node 0 and every updated geometry decrements it, so a count
+  // other than 0 tells the next reader that entries moved and starts a new generation. Without a trigger on the rowid
+  // table, such as in defensive mode, updates invalidate all counts.
+  if (result == SQLITE_OK) {
+    moves = sql_exec(
+              db,
+              "CREATE TRIGGER IF NOT EXISTS \"%w\".\"udbx_rtree_count_%w_%w_moves\" AFTER INSERT ON \"%w_rowid\"\n"
+              "BEGIN\n"
+              "  UPDATE \"%w\" SET count = count + 1 WHERE table_name = %Q AND column_name = %Q AND nodeno = 0;\n"
+              "END;",
+              db_name, table_name, column_name, index_table_name,
+              udbx_rtree_count.name, table_name, column_name
+            ) == SQLITE_OK;
+  }
+  if (result == SQLITE_OK && moves) {
+    result = sql_exec(
+               db,
+               "CREATE TRIGGER IF NOT EXISTS \"%w\".\"udbx_rtree_count_%w_%w_update\" AFTER UPDATE OF \"%w\" ON \"%w\"\n"
+               "BEGIN\n"
+               "  UPDATE \"%w\" SET count = count - 1 WHERE table_name = %Q AND column_name = %Q AND nodeno = 0 AND NOT ST_IsEmpty(NEW.\"%w\");\n"
+               "  DELETE FROM \"%w\" WHERE table_name = %Q AND column_name = %Q AND nodeno > 0 AND (\n"
+               "    (NOT ST_IsEmpty(OLD.\"%w\") AND min_x <= ST_MaxX(OLD.\"%w\") AND max_x >= ST_MinX(OLD.\"%w\") AND min_y <= ST_MaxY(OLD.\"%w\") AND max_y >= ST_MinY(OLD.\"%w\"))\n"
+               "    OR (NOT ST_IsEmpty(NEW.\"%w\") AND min_x <= ST_MaxX(NEW.\"%w\") AND max_x >= ST_MinX(NEW.\"%w\") AND min_y <= ST_MaxY(NEW.\"%w\") AND max_y >= ST_MinY(NEW.\"%w\")));\n"
+               "END;",
+               db_name, table_name, column_name, column_name, table_name,
+               udbx_rtree_count.name, table_name, column_name, column_name,
+               udbx_rtree_count.name, table_name, column_name,
+               column_name, column_name, column_name, column_name, column_name,
+               column_name, column_name, column_name, column_name, column_name
+             );
+  } else if (result == SQLITE_OK) {
+    result = sql_exec(
+               db,
+               "CREATE TRIGGER IF NOT EXISTS \"%w\".\"udbx_rtree_count_%w_%w_update\" AFTER UPDATE OF \"%w\" ON \"%w\"\n"
+               "BEGIN\n"
+               "  %s;\n"
+               "END;",
+               db_name, table_name, column_name, column_name, table_name, bump
+             );
+  }
+  if (result == SQLITE_OK) {
+    result = sql_exec(
+               db,
+               "CREATE TRIGGER IF NOT EXISTS \"%w\".\"udbx_rtree_count_%w_%w_delete\" AFTER DELETE ON \"%w\"\n"
+               "BEGIN\n"
+               "  %s;\n"
+               "END;",
+               db_name, table_name, column_name, table_name, bump
+             );
+  }
+  if (result != SQLITE_OK) {
+    error_append(error, "Could not create count cache triggers: %s", sqlite3_errmsg(db));
+  }
+
+exit:
+  sqlite3_free(index_table_name);
+  sqlite3_free(bump);
+  return result;
+}
+
+int spatial_index_count_invalidate(sqlite3 *db, const char *db_name, const char *table_name, const char *column_name) {
+  int exists = 0;
+  int result = sql_check_table_exists(db, db_name, udbx_rtree_count.name, &exists);
+  if (result != SQLITE_OK || !exists) {
+    return result;
+  }
+
+  return sql_exec(
+           db,
+           "UPDATE \"%w\".\"%w\" SET generation = generation + 1 WHERE table_name = %Q AND column_name = %Q AND nodeno = 0",
+           db_name, udbx_rtree_count.name, table_name, column_name
+         );
+}
+
+typedef struct {
+  unsigned char *data;
+  int size;
+} rtree_root_t;
+
+static int read_root_row(sqlite3 *db, sqlite3_stmt *stmt, void *data) {
+  rtree_root_t *root = (rtree_root_t *)data;
+  root->size = sqlite3_column_bytes(stmt, 0);
+  root->data = (unsigned char *)sqlite3_malloc(root->size > 0 ? root->size : 1);
+  if (root->data == NULL) {
+    return SQLITE_NOMEM;
+  }
+  memcpy(root->data, sqlite3_column_blob(stmt, 0), (size_t)root->size);
+  return SQLITE_ABORT;
+}
+
+int spatial_index_extent(sqlite3 *db, const char *db_name, const char *table_name, const char *column_name, double *extent, int *exists, int *empty, errorstream_t *error) {
+  int result = SQLITE_OK;
+  char *index_table_name = NULL;
+  rtree_root_t root;
+  int has_z = 0;
+  int has_m = 0;
+  int pending = 0;
+  int cell_size;
+  int cells;
+  int i;
+
+  memset(&root, 0, sizeof(rtree_root_t));
+  *exists = 0;
+  *empty = 1;
+
+  index_table_name = sqlite3_mprintf("rtree_%s_%s", table_name, column_name);
+  if (index_table_name == NULL) {
+    result = SQLITE_NOMEM;
+    goto exit;
+  }
+
+  result = sql_check_table_exists(db, db_name, index_table_name, exists);
+  if (result == SQLITE_OK && *exists) {
+    result = sql_check_column_exists(db, db_name, index_table_name, "minz", &has_z);
+  }
+  if (result == SQLITE_OK && *exists) {
+    result = sql_check_column_exists(db, db_name, index_table_name, "minm", &has_m);
+  }
+  if (result != SQLITE_OK) {
+    error_append(error, "Could not inspect index table %s.%s: %s", db_name, index_table_name, sqlite3_errmsg(db));
+    goto exit;
+  }
+  if (!*exists) {
+    goto exit;
+  }
+
+  // A partially built rtree only covers the features indexed so far, so it is treated as missing
+  result = rtree_build_pending(db, db_name, table_name, column_name, &pending);
+  if (result != SQLITE_OK) {
+    error_append(error, "Could not read spatial index build state: %s", sqlite3_errmsg(db));
+    goto exit;
+  }
+  if (pending) {
+    *exists = 0;
+    goto exit;
+  }
+  cell_size = 8 + 8 * (2 + has_z + has_m);
+
+  // The cells of the root node cover the whole index
+  result = sql_exec_stmt(
+             db, read_root_row, NULL, &root,
+             "SELECT data FROM \"%w\".\"%w_node\" WHERE nodeno = 1", db_name, index_table_name
+           );
+  if (result != SQLITE_OK) {
+    error_append(error, "Could not read index table %s.%s: %s", db_name, index_table_name, sqlite3_errmsg(db));
+    goto exit;
+  }
+  if (root.data == NULL || root.size < 4) {
+    goto exit;
+  }
+
+  cells = (root.data[2] << 8) | root.data[3];
+  if (4 + cells * cell_size > root.size) {
+    result = SQLITE_CORRUPT;
+    error_append(error, "Could not read index table %s.%s: %s", db_name, index_table_name, sqlite3_errstr(result));
+    goto exit;
+  }
+
+  for (i = 0; i < cells; i++) {
+    const unsigned char *cell = root.data + 4 + i * cell_size;
+    double min_x = rtree_node_coord(cell + 8);
+    double max_x = rtree_node_coord(cell + 12);
+    double min_y = rtree_node_coord(cell + 16);
+    double max_y = rtree_node_coord(cell + 20);
+
+    if (*empty) {
+      extent[0] = min_x;
+      extent[1] = min_y;
+      extent[2] = max_x;
+      extent[3] = max_y;
+      *empty = 0;
+    } else {
+      if (min_x < extent[0]) extent[0] = min_x;
+      if (min_y < extent[1]) extent[1] = min_y;
+      if (max_x > extent[2]) extent[2] = max_x;
+      if (max_y > extent[3]) extent[3] = max_y;
+    }
+  }
+
+exit:
+  sqlite3_free(root.data);
+  sqlite3_free(index_table_name);
+  return result;
+}
+
+typedef struct {
+  int32_t srid;
+  int registered;
+} srid_row_t;
+
+static int read_srid_row(sqlite3 *db, sqlite3_stmt *stmt, void *data) {
+  srid_row_t *row = (srid_row_t *)data;
+  row->srid = sqlite3_column_int(stmt, 0);
+  row->registered = 1;
+  return SQLITE_ABORT;
+}
+
+int spatial_index_srid(sqlite3 *db, const char *db_name, const char *table_name, const char *column_name, int32_t *srid, int *registered, errorstream_t *error) {
+  int result;
+  srid_row_t row;
+
+  memset(&row, 0, sizeof(srid_row_t));
+  result = sql_exec_stmt(
+             db, read_srid_row, NULL, &row,
+             "SELECT srs_id FROM \"%w\".gpkg_geometry_columns WHERE table_name LIKE %Q AND column_name LIKE %Q",
+             db_name, table_name, column_name
+           );
+  if (result != SQLITE_OK) {
+    error_append(error, "Could not read SRID of %s.%s.%s: %s", db_name, table_name, column_name, sqlite3_errmsg(db));
+    return result;
+  }
+  *srid = row.srid;
+  *registered = row.registered;
+  return SQLITE_OK;
+}
+
+int spatial_index_query_init(sqlite3 *db, errorstream_t *error) {
+  int result = sqlite3_create_module(db, "udbx_rtree_query", &rtree_query_module, NULL);
+  if (result != SQLITE_OK) {
+    error_append(error, "Error registering module udbx_rtree_query: %s", sqlite3_errmsg(db));
+    return result;
+  }
+
+  result = sqlite3_create_module(db, "udbx_sfc_query", &sfc_query_module, NULL);
+  if (result != SQLITE_OK) {
+    error_append(error, "Error registering module udbx_sfc_query: %s", sqlite3_errmsg(db));
+    return result;
+  }
+
+  result = sqlite3_create_module(db, "udbx_density", &density_module, NULL);
+  if (result != SQLITE_OK) {
+    error_append(error, "Error registering module udbx_density: %s", sqlite3_errmsg(db));
+  }
+  return result;
+}
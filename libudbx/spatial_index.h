@@ -0,0 +1,128 @@
+#ifndef UDBX_SPATIAL_INDEX_H
+#define UDBX_SPATIAL_INDEX_H
+
+#include <stdint.h>
+#include "sqlite.h"
+#include "error.h"
+
+/**
+ * \addtogroup spatial_index Spatial index queries
+ * @{
+ */
+
+/**
+ * Registers the spatial index query table-valued functions. udbx_rtree_query returns the rows of the
+ * rtree_<table>_<column> index whose envelope intersects the given query ranges:
+ *
+ *   SELECT id FROM udbx_rtree_query('table', 'geom', xmin, ymin, xmax, ymax [, zmin, zmax [, mmin, mmax [, 'db']]])
+ *
+ * NULL or omitted bounds leave that side of the range open. Z and M bounds require an index created with
+ * GPKG_CreateSpatialIndexZM. udbx_sfc_query queries the indexes created by spatial_key_index_create. udbx_density
+ * returns the non-empty cells of a feature density grid computed with spatial_index_density:
+ *
+ *   SELECT ix, iy, x, y, count FROM udbx_density('table', 'geom', xmin, ymin, xmax, ymax, cell_size [, 'db'])
+ *
+ * @param db the database handle
+ * @param error the error stream to report errors to
+ * @return SQLITE_OK on success, an error code otherwise
+ */
+int spatial_index_query_init(sqlite3 *db, errorstream_t *error);
+
+/**
+ * Creates a space filling curve index on a point column. The index is a WITHOUT ROWID table sfc_<table>_<column>
+ * holding (key, id) pairs ordered by curve key and is kept up to date by triggers. Box queries go through the
+ * udbx_sfc_query table-valued function:
+ *
+ *   SELECT id FROM udbx_sfc_query('table', 'geom', xmin, ymin, xmax, ymax [, 'db'])
+ *
+ * @param db the database handle
+ * @param db_name the database name
+ * @param table_name the feature table
+ * @param geometry_column_name the point column to index
+ * @param id_column_name the integer primary key column of the feature table
+ * @param extent the extent mapped onto the curve as {min_x, min_y, max_x, max_y}, or NULL to use the current extent
+ *        of the data
+ * @param error the error stream to report errors to
+ * @return SQLITE_OK on success, an error code otherwise
+ */
+int spatial_key_index_create(sqlite3 *db, const char *db_name, const char *table_name, const char *geometry_column_name, const char *id_column_name, const double *extent, errorstream_t *error);
+
+/**
+ * Looks up the extent of a space filling curve index.
+ * @param[out] extent receives {min_x, min_y, max_x, max_y}
+ * @param[out] exists set to 1 if the column has a space filling curve index, 0 otherwise
+ */
+int spatial_key_index_extent(sqlite3 *db, const char *db_name, const char *table_name, const char *geometry_column_name, double *extent, int *exists);
+
+/**
+ * Drops a space filling curve index created by spatial_key_index_create.
+ */
+int spatial_key_index_drop(sqlite3 *db, const char *db_name, const char *table_name, const char *geometry_column_name, errorstream_t *error);
+
+/**
+ * Counts the features whose index envelope intersects a box by walking the rtree_<table>_<column> nodes. Nodes that
+ * lie inside the box contribute their subtree count without being descended. With a tolerance greater than 0,
+ * partially covered nodes whose area is at most tolerance times the box area are estimated from the covered fraction
+ * of their area instead of being descended; a tolerance of 0 gives the exact count. Reports an error while an
+ * incremental build of the index is in progress, since the rtree then only holds part of the features.
+ * @param bbox the box as {min_x, min_y, max_x, max_y}
+ * @param[out] count receives the (estimated) count
+ * @return SQLITE_OK on success, an error code otherwise
+ */
+int spatial_index_count(sqlite3 *db, const char *db_name, const char *table_name, const char *column_name, const double *bbox, double tolerance, double *count, errorstream_t *error);
+
+/**
+ * The largest number of cells of a density grid.
+ */
+#define DENSITY_MAX_CELLS (1 << 22)
+
+/**
+ * Counts the features of each cell of a regular grid by walking the rtree_<table>_<column> nodes. Features are binned
+ * by the center of their index envelope; nodes that lie inside a single cell contribute their subtree count without
+ * being descended, using the count cache when there is one. Like spatial_index_count, reports an error while an
+ * incremental build of the index is in progress.
+ * @param bbox the box covered by the grid as {min_x, min_y, max_x, max_y}; cell (0, 0) starts at its lower left corner
+ * @param cell_size the width and height of a cell
+ * @param columns the number of cells along X
+ * @param rows the number of cells along Y
+ * @param[out] counts receives the count of cell (ix, iy) at index iy * columns + ix
+ * @return SQLITE_OK on success, an error code otherwise
+ */
+int spatial_index_density(sqlite3 *db, const char *db_name, const char *table_name, const char *column_name, const double *bbox, double cell_size, int columns, int rows, sqlite3_int64 *counts, errorstream_t *error);
+
+/**
+ * Enables caching of rtree subtree counts in udbx_rtree_count for spatial_index_count. Inserts and deletes invalidate
+ * all cached counts and the next counts refill them node by node. A geometry update only clears the counts of the
+ * nodes whose box holds its old or new envelope, unless the rtree moved other entries between nodes, and updates of
+ * other columns keep every count.
+ */
+int spatial_index_count_cache_create(sqlite3 *db, const char *db_name, const char *table_name, const char *column_name, errorstream_t *error);
+
+/**
+ * Invalidates the cached subtree counts of a spatial index. Must be called when an rtree is modified without going
+ * through the feature table.
+ */
+int spatial_index_count_invalidate(sqlite3 *db, const char *db_name, const char *table_name, const char *column_name);
+
+/**
+ * Reads the extent of a spatial index from the cells of its root node, without visiting the features. The rtree
+ * stores single precision coordinates rounded outwards, so the extent may be slightly larger than the exact one.
+ * @param[out] extent receives {min_x, min_y, max_x, max_y}
+ * @param[out] exists set to 1 if the column has a complete spatial index, 0 if it has none or an incremental build of
+ *             the index is still in progress
+ * @param[out] empty set to 1 if there is no index or the index holds no entries, 0 otherwise
+ * @return SQLITE_OK on success, an error code otherwise
+ */
+int spatial_index_extent(sqlite3 *db, const char *db_name, const char *table_name, const char *column_name, double *extent, int *exists, int *empty, errorstream_t *error);
+
+/**
+ * Reads the SRID of a geometry column from the srs_id of its gpkg_geometry_columns row.
+ * @param[out] srid receives the SRID of the column
+ * @param[out] registered set to 1 if the column is registered in gpkg_geometry_columns, 0 otherwise
+ * @return SQLITE_OK on success, an error code otherwise
+ */
+int spatial_index_srid(sqlite3 *db, const char *db_name, const char *table_name, const char *column_name, int32_t *srid, int *registered, errorstream_t *error);
+
+/** @} */
+
+#endif
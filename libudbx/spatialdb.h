@@ -20,6 +20,15 @@
 #include "blobio.h"
 #include "sqlite.h"
 
+/**
+ * Spatial index flag that adds the Z range of each geometry as an extra index dimension.
+ */
+#define SPATIAL_INDEX_Z 0x1
+/**
+ * Spatial index flag that adds the M range of each geometry as an extra index dimension.
+ */
+#define SPATIAL_INDEX_M 0x2
+
 /**
  * Abstraction layer for spatial databases.
  */
@@ -73,9 +82,10 @@ typedef struct spatialdb {
    */
   int(*create_tiles_table)(sqlite3 *db, const char *db_name, const char *table_name, errorstream_t *error);
   /**
-   * Creates a spatial index on a given table column.
+   * Creates a spatial index on a given table column. The index always covers X and Y; index_flags is a combination
+   * of SPATIAL_INDEX_Z and SPATIAL_INDEX_M selecting the additional dimensions.
    */
-  int(*create_spatial_index)(sqlite3 *db, const char *db_name, const char *table_name, const char *geometry_column_name, const char *id_column_name, errorstream_t *error);
+  int(*create_spatial_index)(sqlite3 *db, const char *db_name, const char *table_name, const char *geometry_column_name, const char *id_column_name, int index_flags, errorstream_t *error);
   /**
    * Populates a geometry envelope based on a geometry blob. The stream is expected to be positioned at the start
    * of the geometry body (i.e., immediately after the blob header). When this function returns the stream is positioned
@@ -100,6 +110,14 @@ typedef struct spatialdb {
   */
   int(*drop_spatial_index)(sqlite3 *db, const char *db_name, const char *table_name, const char *geometry_column_name, errorstream_t *error);
 
+  /**
+   * Performs one step of building a spatial index in rowid ranges of at most batch_size rows. The index triggers are
+   * installed by the first step so rows written between steps are never missed. progress receives the fraction of
+   * rows indexed so far, 1 once the index is complete or -1 if the column has no index. A batch_size of 0 only
+   * reports the progress.
+   */
+  int(*create_spatial_index_step)(sqlite3 *db, const char *db_name, const char *table_name, const char *geometry_column_name, const char *id_column_name, int index_flags, int batch_size, double *progress, errorstream_t *error);
+
 } spatialdb_t;
 
 /**
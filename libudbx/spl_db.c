@@ -672,11 +672,17 @@ static int read_geometry(binstream_t *stream, geom_consumer_t const *consumer, e
   return wkb_read_geometry(stream, WKB_SPATIALITE, consumer, error);
 }
 
-static int create_spatial_index(sqlite3 *db, const char *db_name, const char *table_name, const char *geometry_column_name, const char *id_column_name, errorstream_t *error) {
+static int create_spatial_index(sqlite3 *db, const char *db_name, const char *table_name, const char *geometry_column_name, const char *id_column_name, int index_flags, errorstream_t *error) {
   int result = SQLITE_OK;
   char *index_table_name = NULL;
   int exists = 0;
 
+  if (index_flags != 0) {
+    error_append(error, "Spatialite spatial indexes only support the XY dimensions");
+    result = SQLITE_ERROR;
+    goto exit;
+  }
+
   index_table_name = sqlite3_mprintf("idx_%s_%s", table_name, geometry_column_name);
   if (index_table_name == NULL) {
     result = SQLITE_NOMEM;
@@ -893,7 +899,8 @@ static const spatialdb_t SPATIALITE2 = {
   fill_envelope,
   read_geometry_header,
   read_geometry,
-  drop_spatial_index
+  drop_spatial_index,
+  NULL
 };
 
 static const spatialdb_t SPATIALITE3 = {
@@ -912,7 +919,8 @@ static const spatialdb_t SPATIALITE3 = {
   fill_envelope,
   read_geometry_header,
   read_geometry,
-  drop_spatial_index
+  drop_spatial_index,
+  NULL
 };
 
 static const spatialdb_t SPATIALITE4 = {
@@ -931,7 +939,8 @@ static const spatialdb_t SPATIALITE4 = {
   fill_envelope,
   read_geometry_header,
   read_geometry,
-  drop_spatial_index
+  drop_spatial_index,
+  NULL
 };
 
 const spatialdb_t *spatialdb_spatialite2_schema() {
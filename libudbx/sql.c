@@ -987,3 +987,22 @@ int sql_create_function(sqlite3 *db, const char *name, void (*function)(sqlite3_
 
   return result;
 }
+
+int sql_create_aggregate(sqlite3 *db, const char *name, sql_function *step, sql_final_function *final, int args, int flags, void *user_data, errorstream_t *error) {
+  int function_flags = SQLITE_UTF8;
+
+#if SQLITE_VERSION_NUMBER >= 3008003
+  if (((flags & SQL_DETERMINISTIC) != 0) && sqlite3_libversion_number() >= 3008003) {
+    function_flags |= SQLITE_DETERMINISTIC;
+  }
+#endif
+
+  int result = sqlite3_create_function_v2(
+                 db, name, args, function_flags, user_data, NULL, step, final, NULL
+               );
+  if (result != SQLITE_OK) {
+    error_append(error, "Error registering aggregate %s/%d: %s", name, args, sqlite3_errmsg(db));
+  }
+
+  return result;
+}
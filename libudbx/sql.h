@@ -367,6 +367,10 @@ typedef void(sql_function)(sqlite3_context *, int, sqlite3_value **);
 
 int sql_create_function(sqlite3 *db, const char *name, sql_function *function, int args, int flags, void *user_data, void (*destroy)(void *), errorstream_t *error);
 
+typedef void(sql_final_function)(sqlite3_context *);
+
+int sql_create_aggregate(sqlite3 *db, const char *name, sql_function *step, sql_final_function *final, int args, int flags, void *user_data, errorstream_t *error);
+
 /** @} */
 
 #endif
@@ -0,0 +1,411 @@
+#include <math.h>
+#include <string.h>
+#include "summary_pyramid.h"
+#include "sql.h"
+#include "strbuf.h"
+
+#define N NULL_VALUE
+
+static column_info_t udbx_summary_pyramid_columns[] = {
+  {"table_name", "TEXT", N, SQL_NOT_NULL | SQL_PRIMARY_KEY, NULL},
+  {"column_name", "TEXT", N, SQL_NOT_NULL | SQL_PRIMARY_KEY, NULL},
+  {"max_level", "INTEGER", N, SQL_NOT_NULL, NULL},
+  {"min_x", "DOUBLE", N, SQL_NOT_NULL, NULL},
+  {"min_y", "DOUBLE", N, SQL_NOT_NULL, NULL},
+  {"max_x", "DOUBLE", N, SQL_NOT_NULL, NULL},
+  {"max_y", "DOUBLE", N, SQL_NOT_NULL, NULL},
+  {NULL, NULL, N, 0, NULL}
+};
+static table_info_t udbx_summary_pyramid = {
+  "udbx_summary_pyramid",
+  udbx_summary_pyramid_columns,
+  NULL, 0
+};
+
+typedef struct {
+  int count;
+  double extent[4];
+} pyramid_extent_t;
+
+static int read_pyramid_extent(sqlite3 *db, sqlite3_stmt *stmt, void *data) {
+  pyramid_extent_t *row = (pyramid_extent_t *)data;
+  int i;
+  for (i = 0; i < 4; i++) {
+    if (sqlite3_column_type(stmt, i) == SQLITE_NULL) {
+      return SQLITE_ABORT;
+    }
+    row->extent[i] = sqlite3_column_double(stmt, i);
+  }
+  row->count = 1;
+  return SQLITE_ABORT;
+}
+
+/*
+ * The cells of the deepest level, clamped to the grid. Scaling by a power of two is exact, so shifting a cell index
+ * of the deepest level right by k gives the index of level max_level - k computed the same way.
+ */
+typedef struct {
+  int max_level;
+  double origin[2];
+  double scale[2];
+} pyramid_grid_t;
+
+static void pyramid_grid_init(pyramid_grid_t *grid, int max_level, const double *extent) {
+  int i;
+  grid->max_level = max_level;
+  for (i = 0; i < 2; i++) {
+    double width = extent[i + 2] - extent[i];
+    grid->origin[i] = extent[i];
+    grid->scale[i] = width > 0.0 ? ldexp(1.0, max_level) / width : 0.0;
+  }
+}
+
+/*
+ * Appends the SQL expression for the cell index along axis i of the deepest level from the envelope bounds min and max.
+ */
+static int pyramid_cell_sql(strbuf_t *sql, const pyramid_grid_t *grid, int i, const char *min, const char *max) {
+  return strbuf_append(
+           sql, "max(0, min(%d, CAST(((%s + %s) * 0.5 - %!.17g) * %!.17g AS INTEGER)))",
+           (1 << grid->max_level) - 1, min, max, grid->origin[i], grid->scale[i]
+         );
+}
+
+/*
+ * Appends the WHERE clause selecting the cell of level that contains the envelope inserted into the envelope view.
+ */
+static int pyramid_cell_where(strbuf_t *sql, const pyramid_grid_t *grid, int level) {
+  int result = strbuf_append(sql, " WHERE level = %d AND cx = ", level);
+  if (result == SQLITE_OK) {
+    result = pyramid_cell_sql(sql, grid, 0, "NEW.x0", "NEW.x1");
+  }
+  if (result == SQLITE_OK) {
+    result = strbuf_append(sql, " >> %d AND cy = ", grid->max_level - level);
+  }
+  if (result == SQLITE_OK) {
+    result = pyramid_cell_sql(sql, grid, 1, "NEW.y0", "NEW.y1");
+  }
+  if (result == SQLITE_OK) {
+    result = strbuf_append(sql, " >> %d", grid->max_level - level);
+  }
+  return result;
+}
+
+/*
+ * Appends the trigger statements that add an envelope to, or remove it from, its cell of every level.
+ * SQLite versions without upsert need an INSERT OR IGNORE of an empty cell followed by an UPDATE.
+ */
+static int pyramid_trigger_body(strbuf_t *sql, const pyramid_grid_t *grid, const char *pyramid_table_name, int add) {
+  int result = SQLITE_OK;
+  int level;
+
+  for (level = 0; level <= grid->max_level && result == SQLITE_OK; level++) {
+    if (add) {
+      result = strbuf_append(
+                 sql,
+                 "  INSERT OR IGNORE INTO \"%w\" (level, cx, cy, count, min_x, min_y, max_x, max_y) SELECT %d, ",
+                 pyramid_table_name, level
+               );
+      if (result == SQLITE_OK) {
+        result = pyramid_cell_sql(sql, grid, 0, "NEW.x0", "NEW.x1");
+      }
+      if (result == SQLITE_OK) {
+        result = strbuf_append(sql, " >> %d, ", grid->max_level - level);
+      }
+      if (result == SQLITE_OK) {
+        result = pyramid_cell_sql(sql, grid, 1, "NEW.y0", "NEW.y1");
+      }
+      if (result == SQLITE_OK) {
+        result = strbuf_append(
+                   sql,
+                   " >> %d, 0, NEW.x0, NEW.y0, NEW.x1, NEW.y1;\n"
+                   "  UPDATE \"%w\" SET count = count + 1,"
+                   " min_x = min(min_x, NEW.x0), min_y = min(min_y, NEW.y0), max_x = max(max_x, NEW.x1), max_y = max(max_y, NEW.y1)",
+                   grid->max_level - level, pyramid_table_name
+                 );
+      }
+    } else {
+      result = strbuf_append(sql, "  UPDATE \"%w\" SET count = count - 1", pyramid_table_name);
+    }
+    if (result == SQLITE_OK) {
+      result = pyramid_cell_where(sql, grid, level);
+    }
+    if (result == SQLITE_OK) {
+      result = strbuf_append(sql, ";\n");
+    }
+    if (result == SQLITE_OK && !add) {
+      result = strbuf_append(sql, "  DELETE FROM \"%w\"", pyramid_table_name);
+      if (result == SQLITE_OK) {
+        result = pyramid_cell_where(sql, grid, level);
+      }
+      if (result == SQLITE_OK) {
+        result = strbuf_append(sql, " AND count <= 0;\n");
+      }
+    }
+  }
+  return result;
+}
+
+/*
+ * Creates the INSTEAD OF trigger of the envelope view that applies inserted envelopes with the given sign of delta.
+ */
+static int pyramid_create_view_trigger(sqlite3 *db, const char *db_name, const char *pyramid_table_name, const pyramid_grid_t *grid, int add) {
+  strbuf_t sql;
+  int result;
+
+  result = strbuf_init(&sql, 4096);
+  if (result != SQLITE_OK) {
+    return result;
+  }
+
+  result = strbuf_append(
+             &sql,
+             "CREATE TRIGGER \"%w\".\"%w_%s\" INSTEAD OF INSERT ON \"%w_envelope\"\n"
+             "WHEN NEW.delta %s 0\n"
+             "BEGIN\n",
+             db_name, pyramid_table_name, add ? "add" : "remove", pyramid_table_name, add ? ">" : "<"
+           );
+  if (result == SQLITE_OK) {
+    result = pyramid_trigger_body(&sql, grid, pyramid_table_name, add);
+  }
+  if (result == SQLITE_OK) {
+    result = strbuf_append(&sql, "END;");
+  }
+  if (result == SQLITE_OK) {
+    result = sql_exec(db, "%s", strbuf_data_pointer(&sql));
+  }
+
+  strbuf_destroy(&sql);
+  return result;
+}
+
+/*
+ * Creates a feature table trigger that computes the envelope of the NEW or OLD geometry once and inserts it into the
+ * envelope view.
+ */
+static int pyramid_create_trigger(sqlite3 *db, const char *db_name, const char *table_name, const char *column_name, const char *pyramid_table_name, const char *suffix, const char *event, const char *row, int add) {
+  return sql_exec(
+           db,
+           "CREATE TRIGGER \"%w\".\"%w_%s\" %s ON \"%w\"\n"
+           "WHEN %s.\"%w\" NOTNULL AND NOT ST_IsEmpty(%s.\"%w\")\n"
+           "BEGIN\n"
+           "  INSERT INTO \"%w_envelope\" (x0, y0, x1, y1, delta)"
+           " VALUES (ST_MinX(%s.\"%w\"), ST_MinY(%s.\"%w\"), ST_MaxX(%s.\"%w\"), ST_MaxY(%s.\"%w\"), %d);\n"
+           "END;",
+           db_name, pyramid_table_name, suffix, event, table_name,
+           row, column_name, row, column_name,
+           pyramid_table_name,
+           row, column_name, row, column_name, row, column_name, row, column_name, add ? 1 : -1
+         );
+}
+
+int summary_pyramid_create(sqlite3 *db, const char *db_name, const char *table_name, const char *column_name, int max_level, const double *extent, errorstream_t *error) {
+  int result = SQLITE_OK;
+  char *pyramid_table_name = NULL;
+  char *update_event = NULL;
+  strbuf_t sql;
+  pyramid_extent_t data_extent;
+  pyramid_grid_t grid;
+  int exists = 0;
+  int level;
+
+  if (strbuf_init(&sql, 1024) != SQLITE_OK) {
+    return SQLITE_NOMEM;
+  }
+
+  if (max_level < 0 || max_level > SUMMARY_PYRAMID_MAX_LEVEL) {
+    error_append(error, "Summary pyramid requires a maximum level between 0 and %d", SUMMARY_PYRAMID_MAX_LEVEL);
+    goto exit;
+  }
+
+  result = sql_check_column_exists(db, db_name, table_name, column_name, &exists);
+  if (result != SQLITE_OK) {
+    error_append(error, "Could not check if column %s.%s.%s exists: %s", db_name, table_name, column_name, sqlite3_errmsg(db));
+    goto exit;
+  }
+  if (!exists) {
+    error_append(error, "Column %s.%s.%s does not exist", db_name, table_name, column_name);
+    goto exit;
+  }
+
+  if (extent == NULL) {
+    memset(&data_extent, 0, sizeof(pyramid_extent_t));
+    result = sql_exec_stmt(
+               db, read_pyramid_extent, NULL, &data_extent,
+               "SELECT min(ST_MinX(\"%w\")), min(ST_MinY(\"%w\")), max(ST_MaxX(\"%w\")), max(ST_MaxY(\"%w\")) FROM \"%w\".\"%w\" WHERE NOT ST_IsEmpty(\"%w\")",
+               column_name, column_name, column_name, column_name, db_name, table_name, column_name
+             );
+    if (result != SQLITE_OK) {
+      error_append(error, "Could not compute extent of %s.%s.%s: %s", db_name, table_name, column_name, sqlite3_errmsg(db));
+      goto exit;
+    }
+    if (data_extent.count == 0) {
+      error_append(error, "Table %s.%s has no geometries; specify the pyramid extent explicitly", db_name, table_name);
+      goto exit;
+    }
+    extent = data_extent.extent;
+  }
+
+  if (!(extent[2] >= extent[0]) || !(extent[3] >= extent[1])) {
+    error_append(error, "Invalid pyramid extent");
+    goto exit;
+  }
+
+  result = summary_pyramid_drop(db, db_name, table_name, column_name, error);
+  if (result != SQLITE_OK) {
+    goto exit;
+  }
+
+  pyramid_table_name = sqlite3_mprintf("pyramid_%s_%s", table_name, column_name);
+  update_event = sqlite3_mprintf("AFTER UPDATE OF \"%w\"", column_name);
+  if (pyramid_table_name == NULL || update_event == NULL) {
+    result = SQLITE_NOMEM;
+    goto exit;
+  }
+  pyramid_grid_init(&grid, max_level, extent);
+
+  result = sql_init_table(db, db_name, &udbx_summary_pyramid, error);
+  if (result != SQLITE_OK) {
+    goto exit;
+  }
+
+  result = sql_exec(
+             db,
+             "INSERT OR REPLACE INTO \"%w\".\"%w\" (table_name, column_name, max_level, min_x, min_y, max_x, max_y) VALUES (%Q, %Q, %d, %!.17g, %!.17g, %!.17g, %!.17g)",
+             db_name, udbx_summary_pyramid.name, table_name, column_name, max_level, extent[0], extent[1], extent[2], extent[3]
+           );
+  if (result != SQLITE_OK) {
+    error_append(error, "Could not register summary pyramid: %s", sqlite3_errmsg(db));
+    goto exit;
+  }
+
+  result = sql_exec(
+             db,
+             "CREATE TABLE \"%w\".\"%w\" (level INTEGER NOT NULL, cx INTEGER NOT NULL, cy INTEGER NOT NULL, count INTEGER NOT NULL,"
+             " min_x DOUBLE NOT NULL, min_y DOUBLE NOT NULL, max_x DOUBLE NOT NULL, max_y DOUBLE NOT NULL, PRIMARY KEY (level, cx, cy)) WITHOUT ROWID",
+             db_name, pyramid_table_name
+           );
+  if (result != SQLITE_OK) {
+    error_append(error, "Could not create summary pyramid table %s.%s: %s", db_name, pyramid_table_name, sqlite3_errmsg(db));
+    goto exit;
+  }
+
+  // The deepest level is binned from the features, every other level from the level below it
+  result = strbuf_append(&sql, "INSERT INTO \"%w\".\"%w\" (level, cx, cy, count, min_x, min_y, max_x, max_y) SELECT %d, cx, cy, count(*), min(x0), min(y0), max(x1), max(y1) FROM (SELECT ", db_name, pyramid_table_name, max_level);
+  if (result == SQLITE_OK) {
+    result = pyramid_cell_sql(&sql, &grid, 0, "x0", "x1");
+  }
+  if (result == SQLITE_OK) {
+    result = strbuf_append(&sql, " AS cx, ");
+  }
+  if (result == SQLITE_OK) {
+    result = pyramid_cell_sql(&sql, &grid, 1, "y0", "y1");
+  }
+  if (result == SQLITE_OK) {
+    result = strbuf_append(
+               &sql,
+               " AS cy, x0, y0, x1, y1 FROM (SELECT ST_MinX(\"%w\") AS x0, ST_MinY(\"%w\") AS y0, ST_MaxX(\"%w\") AS x1, ST_MaxY(\"%w\") AS y1"
+               " FROM \"%w\".\"%w\" WHERE \"%w\" NOTNULL AND NOT ST_IsEmpty(\"%w\"))) GROUP BY cx, cy",
+               column_name, column_name, column_name, column_name, db_name, table_name, column_name, column_name
+             );
+  }
+  if (result == SQLITE_OK) {
+    result = sql_exec(db, "%s", strbuf_data_pointer(&sql));
+  }
+  for (level = max_level - 1; level >= 0 && result == SQLITE_OK; level--) {
+    result = sql_exec(
+               db,
+               "INSERT INTO \"%w\".\"%w\" (level, cx, cy, count, min_x, min_y, max_x, max_y)"
+               " SELECT %d, cx >> 1, cy >> 1, sum(count), min(min_x), min(min_y), max(max_x), max(max_y) FROM \"%w\".\"%w\" WHERE level = %d GROUP BY cx >> 1, cy >> 1",
+               db_name, pyramid_table_name, level, db_name, pyramid_table_name, level + 1
+             );
+  }
+  if (result != SQLITE_OK) {
+    error_append(error, "Could not populate summary pyramid: %s", sqlite3_errmsg(db));
+    goto exit;
+  }
+
+  // The feature triggers hand each envelope to a view whose triggers update every level, so the envelope of a
+  // geometry is computed once per change rather than once per level
+  result = sql_exec(
+             db,
+             "CREATE VIEW \"%w\".\"%w_envelope\" AS SELECT NULL AS x0, NULL AS y0, NULL AS x1, NULL AS y1, NULL AS delta WHERE 0",
+             db_name, pyramid_table_name
+           );
+  if (result == SQLITE_OK) {
+    result = pyramid_create_view_trigger(db, db_name, pyramid_table_name, &grid, 1);
+  }
+  if (result == SQLITE_OK) {
+    result = pyramid_create_view_trigger(db, db_name, pyramid_table_name, &grid, 0);
+  }
+
+  // An update that changes the geometry removes the old feature from its cells and adds the new one to its cells
+  if (result == SQLITE_OK) {
+    result = pyramid_create_trigger(db, db_name, table_name, column_name, pyramid_table_name, "insert", "AFTER INSERT", "NEW", 1);
+  }
+  if (result == SQLITE_OK) {
+    result = pyramid_create_trigger(db, db_name, table_name, column_name, pyramid_table_name, "update_old", update_event, "OLD", 0);
+  }
+  if (result == SQLITE_OK) {
+    result = pyramid_create_trigger(db, db_name, table_name, column_name, pyramid_table_name, "update_new", update_event, "NEW", 1);
+  }
+  if (result == SQLITE_OK) {
+    result = pyramid_create_trigger(db, db_name, table_name, column_name, pyramid_table_name, "delete", "AFTER DELETE", "OLD", 0);
+  }
+  if (result != SQLITE_OK) {
+    error_append(error, "Could not create summary pyramid triggers: %s", sqlite3_errmsg(db));
+    goto exit;
+  }
+
+  // Only GeoPackage databases have an extensions table; the pyramid itself works on every schema
+  result = sql_check_table_exists(db, db_name, "gpkg_extensions", &exists);
+  if (result == SQLITE_OK && exists) {
+    result = sql_exec(
+               db,
+               "INSERT OR REPLACE INTO \"%w\".\"gpkg_extensions\" (table_name, column_name, extension_name, definition, scope) VALUES (%Q, %Q, %Q, %Q, %Q)",
+               db_name, table_name, column_name, "udbx_summary_pyramid", "Quadtree cell counts and extents", "write-only"
+             );
+  }
+  if (result != SQLITE_OK) {
+    error_append(error, "Could not register summary pyramid usage in gpkg_extensions: %s", sqlite3_errmsg(db));
+    goto exit;
+  }
+
+exit:
+  sqlite3_free(pyramid_table_name);
+  sqlite3_free(update_event);
+  strbuf_destroy(&sql);
+  return result;
+}
+
+int summary_pyramid_drop(sqlite3 *db, const char *db_name, const char *table_name, const char *column_name, errorstream_t *error) {
+  static const char *triggers[] = {"insert", "update_old", "update_new", "delete"};
+  int result = SQLITE_OK;
+  int exists = 0;
+  int i;
+
+  for (i = 0; i < 4 && result == SQLITE_OK; i++) {
+    result = sql_exec(db, "DROP TRIGGER IF EXISTS \"%w\".\"pyramid_%w_%w_%w\"", db_name, table_name, column_name, triggers[i]);
+  }
+  if (result == SQLITE_OK) {
+    result = sql_exec(db, "DROP VIEW IF EXISTS \"%w\".\"pyramid_%w_%w_envelope\"", db_name, table_name, column_name);
+  }
+  if (result == SQLITE_OK) {
+    result = sql_exec(db, "DROP TABLE IF EXISTS \"%w\".\"pyramid_%w_%w\"", db_name, table_name, column_name);
+  }
+  if (result == SQLITE_OK) {
+    result = sql_check_table_exists(db, db_name, udbx_summary_pyramid.name, &exists);
+  }
+  if (result == SQLITE_OK && exists) {
+    result = sql_exec(db, "DELETE FROM \"%w\".\"%w\" WHERE table_name = %Q AND column_name = %Q", db_name, udbx_summary_pyramid.name, table_name, column_name);
+  }
+  if (result == SQLITE_OK) {
+    result = sql_check_table_exists(db, db_name, "gpkg_extensions", &exists);
+  }
+  if (result == SQLITE_OK && exists) {
+    result = sql_exec(db, "DELETE FROM \"%w\".gpkg_extensions WHERE table_name = %Q AND column_name = %Q AND extension_name = 'udbx_summary_pyramid'", db_name, table_name, column_name);
+  }
+  if (result != SQLITE_OK) {
+    error_append(error, "Could not drop summary pyramid: %s", sqlite3_errmsg(db));
+  }
+  return result;
+}
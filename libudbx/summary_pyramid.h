@@ -0,0 +1,51 @@
+#ifndef UDBX_SUMMARY_PYRAMID_H
+#define UDBX_SUMMARY_PYRAMID_H
+
+#include "sqlite.h"
+#include "error.h"
+
+/**
+ * \addtogroup summary_pyramid Summary pyramids
+ * @{
+ */
+
+/**
+ * The largest supported pyramid level. Level l divides the pyramid extent into 2^l by 2^l cells.
+ */
+#define SUMMARY_PYRAMID_MAX_LEVEL 20
+
+/**
+ * Creates a summary pyramid for a geometry column: the table pyramid_<table>_<column> with one row per non-empty
+ * quadtree cell of levels 0 to max_level:
+ *
+ *   level, cx, cy, count, min_x, min_y, max_x, max_y
+ *
+ * Features are assigned to a cell by the center of their envelope; count is the number of features of the cell and
+ * min_x to max_y the union of their envelopes. Cell (cx, cy) of level l covers 1 / 2^l of the pyramid extent in each
+ * direction, counted from its minimum corner; features outside of the extent are counted in the border cells. The
+ * extent and the maximum level are registered in udbx_summary_pyramid.
+ *
+ * Triggers on the feature table keep the counts current on every insert, update and delete: they insert the envelope
+ * of the changed geometry into the view pyramid_<table>_<column>_envelope, whose triggers update the cell of every
+ * level. Cell envelopes only
+ * grow: deleting a feature does not shrink the envelope of its cell until the pyramid is created again.
+ * Creating the pyramid of a column that already has one rebuilds it.
+ * @param db the database handle
+ * @param db_name the database name
+ * @param table_name the feature table
+ * @param column_name the geometry column
+ * @param max_level the deepest level, between 0 and SUMMARY_PYRAMID_MAX_LEVEL
+ * @param extent the pyramid extent as {min_x, min_y, max_x, max_y}, or NULL to use the current extent of the data
+ * @param error the error stream to report errors to
+ * @return SQLITE_OK on success, an error code otherwise
+ */
+int summary_pyramid_create(sqlite3 *db, const char *db_name, const char *table_name, const char *column_name, int max_level, const double *extent, errorstream_t *error);
+
+/**
+ * Drops a summary pyramid created by summary_pyramid_create.
+ */
+int summary_pyramid_drop(sqlite3 *db, const char *db_name, const char *table_name, const char *column_name, errorstream_t *error);
+
+/** @} */
+
+#endif
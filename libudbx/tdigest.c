@@ -0,0 +1,253 @@
+#include <float.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include "tdigest.h"
+#include "fp.h"
+#include "sqlite.h"
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+#define TDIGEST_VERSION 1
+
+static int tdigest_centroid_cmp(const void *a, const void *b) {
+  double ma = ((const tdigest_centroid_t *)a)->mean;
+  double mb = ((const tdigest_centroid_t *)b)->mean;
+  return ma < mb ? -1 : (ma > mb ? 1 : 0);
+}
+
+int tdigest_init(tdigest_t *digest, double compression) {
+  memset(digest, 0, sizeof(tdigest_t));
+
+  if (!(compression >= TDIGEST_MIN_COMPRESSION)) {
+    compression = TDIGEST_MIN_COMPRESSION;
+  } else if (compression > TDIGEST_MAX_COMPRESSION) {
+    compression = TDIGEST_MAX_COMPRESSION;
+  }
+
+  // A merge leaves at most compression + 1 centroids; the rest of the array buffers incoming values
+  digest->compression = compression;
+  digest->capacity = (size_t)(6 * ceil(compression)) + 10;
+  digest->centroids = (tdigest_centroid_t *)sqlite3_malloc((int)(digest->capacity * sizeof(tdigest_centroid_t)));
+  if (digest->centroids == NULL) {
+    return SQLITE_NOMEM;
+  }
+  digest->min = DBL_MAX;
+  digest->max = -DBL_MAX;
+  return SQLITE_OK;
+}
+
+void tdigest_destroy(tdigest_t *digest) {
+  if (digest == NULL) {
+    return;
+  }
+  sqlite3_free(digest->centroids);
+  digest->centroids = NULL;
+  digest->capacity = 0;
+  digest->count = 0;
+}
+
+/*
+ * Uses the k1 scale function k(q) = compression / (2 pi) * asin(2q - 1). A centroid starting at quantile q0 may grow up
+ * to the quantile where k has increased by one, which keeps centroids near 0 and 1 small.
+ */
+static double tdigest_q_limit(double compression, double q0) {
+  double k = compression / (2.0 * M_PI) * asin(2.0 * q0 - 1.0) + 1.0;
+  if (k >= compression / 4.0) {
+    return 1.0;
+  }
+  return (sin(k * 2.0 * M_PI / compression) + 1.0) / 2.0;
+}
+
+static void tdigest_compress(tdigest_t *digest) {
+  tdigest_centroid_t *c = digest->centroids;
+  double q0 = 0.0;
+  double limit;
+  size_t i, w = 0;
+
+  if (digest->count <= 1) {
+    return;
+  }
+
+  qsort(c, digest->count, sizeof(tdigest_centroid_t), tdigest_centroid_cmp);
+
+  // Alternate the merge direction between passes; always merging upwards biases the centroids towards the low end
+  if (digest->merges++ & 1) {
+    for (i = 0; i < digest->count / 2; i++) {
+      tdigest_centroid_t t = c[i];
+      c[i] = c[digest->count - 1 - i];
+      c[digest->count - 1 - i] = t;
+    }
+  }
+
+  limit = tdigest_q_limit(digest->compression, q0);
+  for (i = 1; i < digest->count; i++) {
+    double q = q0 + (c[w].weight + c[i].weight) / digest->weight;
+    if (q <= limit) {
+      c[w].weight += c[i].weight;
+      c[w].mean += (c[i].mean - c[w].mean) * c[i].weight / c[w].weight;
+    } else {
+      q0 += c[w].weight / digest->weight;
+      limit = tdigest_q_limit(digest->compression, q0);
+      c[++w] = c[i];
+    }
+  }
+  digest->count = w + 1;
+}
+
+void tdigest_add(tdigest_t *digest, double value, double weight) {
+  if (digest->count == digest->capacity) {
+    tdigest_compress(digest);
+  }
+
+  digest->centroids[digest->count].mean = value;
+  digest->centroids[digest->count].weight = weight;
+  digest->count++;
+  digest->weight += weight;
+  if (value < digest->min) {
+    digest->min = value;
+  }
+  if (value > digest->max) {
+    digest->max = value;
+  }
+}
+
+double tdigest_weight(const tdigest_t *digest) {
+  return digest->weight;
+}
+
+/*
+ * Each centroid is taken to sit at the middle of its weight. Quantiles in between interpolate linearly between
+ * neighbouring centroid means; the outer halves of the first and last centroid interpolate towards min and max.
+ */
+double tdigest_quantile(tdigest_t *digest, double q) {
+  tdigest_centroid_t *c = digest->centroids;
+  size_t n = digest->count;
+  size_t i;
+  double t, cum, left, right, result;
+
+  if (q <= 0.0 || n == 0) {
+    return digest->min;
+  }
+  if (q >= 1.0) {
+    return digest->max;
+  }
+
+  // Sorting is enough for interpolation; merging is left to tdigest_add so small inputs stay exact
+  qsort(c, n, sizeof(tdigest_centroid_t), tdigest_centroid_cmp);
+
+  t = q * digest->weight;
+  if (t < c[0].weight / 2.0) {
+    result = digest->min + (c[0].mean - digest->min) * t / (c[0].weight / 2.0);
+  } else {
+    result = c[n - 1].mean;
+    cum = 0.0;
+    for (i = 0; i + 1 < n; i++) {
+      left = cum + c[i].weight / 2.0;
+      right = cum + c[i].weight + c[i + 1].weight / 2.0;
+      if (t < right) {
+        result = c[i].mean + (c[i + 1].mean - c[i].mean) * (t - left) / (right - left);
+        break;
+      }
+      cum += c[i].weight;
+    }
+    if (i + 1 == n) {
+      left = digest->weight - c[n - 1].weight / 2.0;
+      result = c[n - 1].mean + (digest->max - c[n - 1].mean) * (t - left) / (c[n - 1].weight / 2.0);
+    }
+  }
+
+  if (result < digest->min) {
+    result = digest->min;
+  } else if (result > digest->max) {
+    result = digest->max;
+  }
+  return result;
+}
+
+int tdigest_write(tdigest_t *digest, binstream_t *stream) {
+  int result;
+  size_t i;
+
+  tdigest_compress(digest);
+
+  binstream_set_endianness(stream, LITTLE);
+  result = binstream_write_u8(stream, 'T');
+  if (result == SQLITE_OK) {
+    result = binstream_write_u8(stream, 'D');
+  }
+  if (result == SQLITE_OK) {
+    result = binstream_write_u8(stream, TDIGEST_VERSION);
+  }
+  if (result == SQLITE_OK) {
+    result = binstream_write_u8(stream, 0);
+  }
+  if (result == SQLITE_OK) {
+    result = binstream_write_double(stream, digest->compression);
+  }
+  if (result == SQLITE_OK) {
+    result = binstream_write_double(stream, digest->min);
+  }
+  if (result == SQLITE_OK) {
+    result = binstream_write_double(stream, digest->max);
+  }
+  if (result == SQLITE_OK) {
+    result = binstream_write_u32(stream, (uint32_t)digest->count);
+  }
+  for (i = 0; i < digest->count && result == SQLITE_OK; i++) {
+    result = binstream_write_double(stream, digest->centroids[i].mean);
+    if (result == SQLITE_OK) {
+      result = binstream_write_double(stream, digest->centroids[i].weight);
+    }
+  }
+  return result;
+}
+
+int tdigest_read(tdigest_t *digest, binstream_t *stream, int init) {
+  uint8_t header[4];
+  double compression, min, max, mean, weight;
+  uint32_t count, i;
+  int result;
+
+  binstream_set_endianness(stream, LITTLE);
+  if (binstream_nread_u8(stream, header, 4) != SQLITE_OK
+      || header[0] != 'T' || header[1] != 'D' || header[2] != TDIGEST_VERSION
+      || binstream_read_double(stream, &compression) != SQLITE_OK
+      || binstream_read_double(stream, &min) != SQLITE_OK
+      || binstream_read_double(stream, &max) != SQLITE_OK
+      || binstream_read_u32(stream, &count) != SQLITE_OK
+      || binstream_available(stream) / (2 * sizeof(double)) < count) {
+    return SQLITE_IOERR;
+  }
+
+  if (init) {
+    result = tdigest_init(digest, compression);
+    if (result != SQLITE_OK) {
+      return result;
+    }
+  }
+
+  for (i = 0; i < count; i++) {
+    if (binstream_read_double(stream, &mean) != SQLITE_OK || binstream_read_double(stream, &weight) != SQLITE_OK
+        || !(weight > 0.0) || fp_isnan(mean)) {
+      // A digest initialised here is not handed back to the caller
+      if (init) {
+        tdigest_destroy(digest);
+      }
+      return SQLITE_IOERR;
+    }
+    tdigest_add(digest, mean, weight);
+  }
+
+  if (count > 0) {
+    if (min < digest->min) {
+      digest->min = min;
+    }
+    if (max > digest->max) {
+      digest->max = max;
+    }
+  }
+  return SQLITE_OK;
+}
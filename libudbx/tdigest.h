@@ -0,0 +1,111 @@
+#ifndef UDBX_TDIGEST_H
+#define UDBX_TDIGEST_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "binstream.h"
+
+/**
+ * \addtogroup tdigest Approximate quantiles
+ * @{
+ */
+
+/**
+ * The compression used when none is specified. Larger values give more accurate quantiles at the cost of memory.
+ */
+#define TDIGEST_DEFAULT_COMPRESSION 100.0
+
+/**
+ * The smallest accepted compression.
+ */
+#define TDIGEST_MIN_COMPRESSION 10.0
+
+/**
+ * The largest accepted compression.
+ */
+#define TDIGEST_MAX_COMPRESSION 10000.0
+
+/**
+ * A cluster of nearby values summarized by their mean and count.
+ */
+typedef struct {
+  double mean;
+  double weight;
+} tdigest_centroid_t;
+
+/**
+ * A merging t-digest. Incoming values are buffered and periodically merged into at most about compression centroids,
+ * so memory is fixed by the compression and does not grow with the number of values. Centroids near the tails are kept
+ * small, which makes extreme quantiles more accurate than central ones.
+ */
+typedef struct {
+  /** @private */
+  double compression;
+  /** @private */
+  tdigest_centroid_t *centroids;
+  /** @private */
+  size_t capacity;
+  /** @private */
+  size_t count;
+  /** @private */
+  double weight;
+  /** @private */
+  unsigned int merges;
+  /** @private */
+  double min;
+  /** @private */
+  double max;
+} tdigest_t;
+
+/**
+ * Initialises an empty digest.
+ * @param digest the digest to initialise
+ * @param compression the compression, clamped to [TDIGEST_MIN_COMPRESSION, TDIGEST_MAX_COMPRESSION]
+ * @return SQLITE_OK on success, SQLITE_NOMEM if the centroid buffer could not be allocated
+ */
+int tdigest_init(tdigest_t *digest, double compression);
+
+/**
+ * Frees the memory held by a digest.
+ */
+void tdigest_destroy(tdigest_t *digest);
+
+/**
+ * Adds a value to the digest.
+ * @param weight the number of occurrences of the value, must be greater than 0
+ */
+void tdigest_add(tdigest_t *digest, double value, double weight);
+
+/**
+ * Returns the total weight of the values added to the digest.
+ */
+double tdigest_weight(const tdigest_t *digest);
+
+/**
+ * Estimates a quantile. The result interpolates between centroids and is exact at 0 and 1. With no more values than
+ * the digest can hold unmerged the result equals the exact interpolated quantile.
+ * @param digest a digest with a weight greater than 0
+ * @param q the quantile in [0, 1]
+ * @return the estimated value
+ */
+double tdigest_quantile(tdigest_t *digest, double q);
+
+/**
+ * Writes the digest in a portable little endian format that can be read back with tdigest_read. Buffered values are
+ * merged first so the written state holds at most about compression centroids.
+ */
+int tdigest_write(tdigest_t *digest, binstream_t *stream);
+
+/**
+ * Reads a digest written by tdigest_write and adds its centroids to an existing digest. Reading several digests into
+ * the same one merges them.
+ * @param digest an initialised digest, or an uninitialised one when init is non-zero
+ * @param init non-zero to initialise the digest with the compression of the serialized one; on failure the digest is
+ *        left uninitialised
+ * @return SQLITE_OK on success, SQLITE_IOERR if the data is not a valid digest, SQLITE_NOMEM on allocation failure
+ */
+int tdigest_read(tdigest_t *digest, binstream_t *stream, int init);
+
+/** @} */
+
+#endif
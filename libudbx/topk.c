@@ -0,0 +1,320 @@
+#include <stdlib.h>
+#include <string.h>
+#include "topk.h"
+#include "fp.h"
+#include "sqlite.h"
+
+int topk_init(topk_t *topk, int capacity) {
+  uint32_t slots = 16;
+
+  memset(topk, 0, sizeof(topk_t));
+  while (slots < (uint32_t)capacity * 2) {
+    slots <<= 1;
+  }
+
+  topk->capacity = capacity;
+  topk->slot_mask = slots - 1;
+  topk->counters = (topk_counter_t *)sqlite3_malloc((int)(capacity * sizeof(topk_counter_t)));
+  topk->heap = (int *)sqlite3_malloc((int)(capacity * sizeof(int)));
+  topk->slots = (int *)sqlite3_malloc((int)(slots * sizeof(int)));
+  if (topk->counters == NULL || topk->heap == NULL || topk->slots == NULL) {
+    topk_destroy(topk);
+    return SQLITE_NOMEM;
+  }
+  memset(topk->slots, 0, slots * sizeof(int));
+  return SQLITE_OK;
+}
+
+void topk_destroy(topk_t *topk) {
+  int i;
+
+  if (topk == NULL) {
+    return;
+  }
+  if (topk->counters != NULL) {
+    for (i = 0; i < topk->count; i++) {
+      sqlite3_free((void *)topk->counters[i].value.data);
+    }
+  }
+  sqlite3_free(topk->counters);
+  sqlite3_free(topk->heap);
+  sqlite3_free(topk->slots);
+  topk->counters = NULL;
+  topk->heap = NULL;
+  topk->slots = NULL;
+  topk->count = 0;
+}
+
+static uint64_t topk_hash_bytes(uint64_t h, const uint8_t *data, size_t length) {
+  size_t i;
+  for (i = 0; i < length; i++) {
+    h ^= data[i];
+    h *= 0x100000001B3ULL;
+  }
+  return h;
+}
+
+static uint64_t topk_hash(const topk_value_t *value) {
+  uint64_t h = 0xCBF29CE484222325ULL ^ (uint64_t)value->type;
+  switch (value->type) {
+    case SQLITE_INTEGER:
+      return topk_hash_bytes(h, (const uint8_t *)&value->i, sizeof(int64_t));
+    case SQLITE_FLOAT:
+      return topk_hash_bytes(h, (const uint8_t *)&value->d, sizeof(double));
+    default:
+      return topk_hash_bytes(h, value->data, (size_t)value->length);
+  }
+}
+
+static int topk_equals(const topk_value_t *a, const topk_value_t *b) {
+  if (a->type != b->type) {
+    return 0;
+  }
+  switch (a->type) {
+    case SQLITE_INTEGER:
+      return a->i == b->i;
+    case SQLITE_FLOAT:
+      return a->d == b->d;
+    default:
+      return a->length == b->length && (a->length == 0 || memcmp(a->data, b->data, (size_t)a->length) == 0);
+  }
+}
+
+static void topk_heap_swap(topk_t *topk, int a, int b) {
+  int t = topk->heap[a];
+  topk->heap[a] = topk->heap[b];
+  topk->heap[b] = t;
+  topk->counters[topk->heap[a]].heap = a;
+  topk->counters[topk->heap[b]].heap = b;
+}
+
+static void topk_sift_up(topk_t *topk, int h) {
+  while (h > 0) {
+    int parent = (h - 1) / 2;
+    if (topk->counters[topk->heap[parent]].count <= topk->counters[topk->heap[h]].count) {
+      break;
+    }
+    topk_heap_swap(topk, parent, h);
+    h = parent;
+  }
+}
+
+static void topk_sift_down(topk_t *topk, int h) {
+  for (;;) {
+    int smallest = h;
+    int child = 2 * h + 1;
+    if (child < topk->count && topk->counters[topk->heap[child]].count < topk->counters[topk->heap[smallest]].count) {
+      smallest = child;
+    }
+    child++;
+    if (child < topk->count && topk->counters[topk->heap[child]].count < topk->counters[topk->heap[smallest]].count) {
+      smallest = child;
+    }
+    if (smallest == h) {
+      break;
+    }
+    topk_heap_swap(topk, smallest, h);
+    h = smallest;
+  }
+}
+
+/*
+ * Slots hold counter index + 1 with 0 meaning empty. Removal shifts later entries of the probe sequence back so
+ * lookups never need tombstones.
+ */
+static void topk_slot_remove(topk_t *topk, int counter) {
+  uint32_t mask = topk->slot_mask;
+  uint32_t i = (uint32_t)topk->counters[counter].hash & mask;
+  uint32_t j;
+
+  while (topk->slots[i] != counter + 1) {
+    i = (i + 1) & mask;
+  }
+
+  j = i;
+  for (;;) {
+    uint32_t home;
+    j = (j + 1) & mask;
+    if (topk->slots[j] == 0) {
+      break;
+    }
+    home = (uint32_t)topk->counters[topk->slots[j] - 1].hash & mask;
+    if ((j > i && (home <= i || home > j)) || (j < i && (home <= i && home > j))) {
+      topk->slots[i] = topk->slots[j];
+      i = j;
+    }
+  }
+  topk->slots[i] = 0;
+}
+
+static int topk_set_value(topk_counter_t *counter, const topk_value_t *value, uint64_t hash) {
+  counter->value = *value;
+  counter->value.data = NULL;
+  counter->hash = hash;
+  if (value->type == SQLITE_TEXT || value->type == SQLITE_BLOB) {
+    uint8_t *data = (uint8_t *)sqlite3_malloc(value->length > 0 ? value->length : 1);
+    if (data == NULL) {
+      counter->value.type = SQLITE_INTEGER;
+      counter->value.length = 0;
+      return SQLITE_NOMEM;
+    }
+    if (value->length > 0) {
+      memcpy(data, value->data, (size_t)value->length);
+    }
+    counter->value.data = data;
+  }
+  return SQLITE_OK;
+}
+
+int topk_add(topk_t *topk, const topk_value_t *value) {
+  topk_value_t key = *value;
+  uint64_t hash;
+  uint32_t slot;
+  int c;
+
+  if (key.type == SQLITE_FLOAT && key.d >= -9223372036854775808.0 && key.d < 9223372036854775808.0
+      && (double)(int64_t)key.d == key.d) {
+    key.type = SQLITE_INTEGER;
+    key.i = (int64_t)key.d;
+  }
+
+  topk->total++;
+  hash = topk_hash(&key);
+  slot = (uint32_t)hash & topk->slot_mask;
+  while (topk->slots[slot] != 0) {
+    c = topk->slots[slot] - 1;
+    if (topk->counters[c].hash == hash && topk_equals(&topk->counters[c].value, &key)) {
+      topk->counters[c].count++;
+      topk_sift_down(topk, topk->counters[c].heap);
+      return SQLITE_OK;
+    }
+    slot = (slot + 1) & topk->slot_mask;
+  }
+
+  if (topk->count < topk->capacity) {
+    c = topk->count++;
+    if (topk_set_value(&topk->counters[c], &key, hash) != SQLITE_OK) {
+      topk->count--;
+      return SQLITE_NOMEM;
+    }
+    topk->counters[c].count = 1;
+    topk->counters[c].error = 0;
+    topk->counters[c].heap = c;
+    topk->heap[c] = c;
+    topk->slots[slot] = c + 1;
+    topk_sift_up(topk, c);
+    return SQLITE_OK;
+  }
+
+  // Reassign the smallest counter; the new value may have occurred up to that many times before
+  c = topk->heap[0];
+  topk_slot_remove(topk, c);
+  sqlite3_free((void *)topk->counters[c].value.data);
+  topk->counters[c].error = topk->counters[c].count;
+  topk->counters[c].count++;
+  slot = (uint32_t)hash & topk->slot_mask;
+  while (topk->slots[slot] != 0) {
+    slot = (slot + 1) & topk->slot_mask;
+  }
+  topk->slots[slot] = c + 1;
+  topk_sift_down(topk, 0);
+  return topk_set_value(&topk->counters[c], &key, hash);
+}
+
+static int topk_counter_cmp(const void *a, const void *b) {
+  const topk_counter_t *ca = *(const topk_counter_t * const *)a;
+  const topk_counter_t *cb = *(const topk_counter_t * const *)b;
+  if (ca->count != cb->count) {
+    return ca->count > cb->count ? -1 : 1;
+  }
+  if (ca->error != cb->error) {
+    return ca->error < cb->error ? -1 : 1;
+  }
+  return 0;
+}
+
+static int topk_write_json_string(strbuf_t *out, const uint8_t *data, int length) {
+  int result = strbuf_append(out, "\"");
+  int start = 0;
+  int i;
+
+  for (i = 0; i < length && result == SQLITE_OK; i++) {
+    uint8_t ch = data[i];
+    if (ch == '"' || ch == '\\' || ch < 0x20) {
+      result = strbuf_append(out, "%.*s", i - start, (const char *)data + start);
+      if (result == SQLITE_OK) {
+        if (ch == '"' || ch == '\\') {
+          result = strbuf_append(out, "\\%c", ch);
+        } else {
+          result = strbuf_append(out, "\\u%04x", ch);
+        }
+      }
+      start = i + 1;
+    }
+  }
+  if (result == SQLITE_OK) {
+    result = strbuf_append(out, "%.*s\"", length - start, (const char *)data + start);
+  }
+  return result;
+}
+
+static int topk_write_json_value(strbuf_t *out, const topk_value_t *value) {
+  int result = SQLITE_OK;
+  int i;
+
+  switch (value->type) {
+    case SQLITE_INTEGER:
+      return strbuf_append(out, "%lld", (long long)value->i);
+    case SQLITE_FLOAT:
+      if (fp_isnan(value->d) || value->d > 1.7976931348623157e308 || value->d < -1.7976931348623157e308) {
+        return strbuf_append(out, "null");
+      }
+      return strbuf_append(out, "%!.15g", value->d);
+    case SQLITE_TEXT:
+      return topk_write_json_string(out, value->data, value->length);
+    default:
+      result = strbuf_append(out, "\"");
+      for (i = 0; i < value->length && result == SQLITE_OK; i++) {
+        result = strbuf_append(out, "%02X", value->data[i]);
+      }
+      if (result == SQLITE_OK) {
+        result = strbuf_append(out, "\"");
+      }
+      return result;
+  }
+}
+
+int topk_write_json(topk_t *topk, int k, strbuf_t *out) {
+  topk_counter_t **sorted;
+  int result;
+  int i;
+
+  sorted = (topk_counter_t **)sqlite3_malloc((int)((topk->count > 0 ? topk->count : 1) * sizeof(topk_counter_t *)));
+  if (sorted == NULL) {
+    return SQLITE_NOMEM;
+  }
+  for (i = 0; i < topk->count; i++) {
+    sorted[i] = &topk->counters[i];
+  }
+  qsort(sorted, (size_t)topk->count, sizeof(topk_counter_t *), topk_counter_cmp);
+
+  if (k > topk->count) {
+    k = topk->count;
+  }
+  result = strbuf_append(out, "[");
+  for (i = 0; i < k && result == SQLITE_OK; i++) {
+    result = strbuf_append(out, i > 0 ? ",{\"value\":" : "{\"value\":");
+    if (result == SQLITE_OK) {
+      result = topk_write_json_value(out, &sorted[i]->value);
+    }
+    if (result == SQLITE_OK) {
+      result = strbuf_append(out, ",\"count\":%lld,\"error\":%lld}", (long long)sorted[i]->count, (long long)sorted[i]->error);
+    }
+  }
+  if (result == SQLITE_OK) {
+    result = strbuf_append(out, "]");
+  }
+
+  sqlite3_free(sorted);
+  return result;
+}
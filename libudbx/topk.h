@@ -0,0 +1,102 @@
+#ifndef UDBX_TOPK_H
+#define UDBX_TOPK_H
+
+#include <stdint.h>
+#include "strbuf.h"
+
+/**
+ * \addtogroup topk Heavy hitters
+ * @{
+ */
+
+/**
+ * The default number of counters per requested value.
+ */
+#define TOPK_DEFAULT_FACTOR 10
+
+/**
+ * The smallest number of counters used when none is specified.
+ */
+#define TOPK_MIN_CAPACITY 64
+
+/**
+ * The largest accepted number of counters.
+ */
+#define TOPK_MAX_CAPACITY 1000000
+
+/**
+ * A value to count. The type is one of SQLITE_INTEGER, SQLITE_FLOAT, SQLITE_TEXT or SQLITE_BLOB; text and blob
+ * values point to data owned by the caller.
+ */
+typedef struct {
+  int type;
+  int64_t i;
+  double d;
+  const uint8_t *data;
+  int length;
+} topk_value_t;
+
+/**
+ * A monitored value with its estimated count. The true count lies in [count - error, count].
+ */
+typedef struct {
+  /** @private */
+  topk_value_t value;
+  /** @private */
+  uint64_t hash;
+  /** @private */
+  int heap;
+  int64_t count;
+  int64_t error;
+} topk_counter_t;
+
+/**
+ * Space-saving summary of the most frequent values. A fixed number of counters is kept; when a value that is not
+ * monitored arrives, the counter with the smallest count is reassigned to it. Any value occurring more than
+ * total / capacity times is guaranteed to be monitored.
+ */
+typedef struct {
+  /** @private */
+  topk_counter_t *counters;
+  /** @private */
+  int capacity;
+  /** @private */
+  int count;
+  /** @private */
+  int *heap;
+  /** @private */
+  int *slots;
+  /** @private */
+  uint32_t slot_mask;
+  /** @private */
+  int64_t total;
+} topk_t;
+
+/**
+ * Initialises an empty summary.
+ * @param capacity the number of counters
+ * @return SQLITE_OK on success, SQLITE_NOMEM on allocation failure
+ */
+int topk_init(topk_t *topk, int capacity);
+
+/**
+ * Frees the memory held by a summary.
+ */
+void topk_destroy(topk_t *topk);
+
+/**
+ * Counts one occurrence of a value. Floating point values with an integral value are counted as integers, matching
+ * SQL equality.
+ * @return SQLITE_OK on success, SQLITE_NOMEM if a text or blob value could not be copied
+ */
+int topk_add(topk_t *topk, const topk_value_t *value);
+
+/**
+ * Appends the k most frequent values as a JSON array of {"value": ..., "count": ..., "error": ...} objects ordered
+ * by decreasing count. Blobs are written as hexadecimal strings.
+ */
+int topk_write_json(topk_t *topk, int k, strbuf_t *out);
+
+/** @} */
+
+#endif
@@ -125,9 +125,6 @@ Original code 2006 June 05 by relicoder.
 #include <stdlib.h>
 #include <assert.h>
 
-#ifndef _MAP_H_
-#define _MAP_H_
-
 #include <stdint.h>
 #include "sqlite3.h"
 #include <sys/types.h>
@@ -136,68 +133,32 @@ Original code 2006 June 05 by relicoder.
 #include "binstream.h"
 #include "blobio.h"
 #include "geomio.h"
+#include "geodesic.h"
+#include "geom_measure.h"
+#include "geom_clip.h"
+#include "geom_hull.h"
+#include "geom_linearize.h"
+#include "geom_parts.h"
+#include "geom_render.h"
+#include "geom_simplify.h"
+#include "geom_transform.h"
 #include "geom_func.h"
 #include "i18n.h"
 #include "sql.h"
 #include "sqlite.h"
 #include "spatialdb_internal.h"
+#include "spatial_index.h"
+#include "sfc.h"
+#include "cluster.h"
+#include "point_cluster.h"
+#include "summary_pyramid.h"
+#include "tdigest.h"
+#include "topk.h"
+#include "hll.h"
+#include "fp.h"
 #include "wkb.h"
 #include "wkt.h"
 
-/*
-** Simple binary tree implementation to use in median, mode and quartile calculations
-** Tree is not necessarily balanced. That would require something like red&black trees of AVL
-*/
-
-typedef int(*cmp_func)(const void *, const void *);
-typedef void(*map_iterator)(void*, int64_t, void*);
-
-typedef struct node{
-  struct node *l;
-  struct node *r;
-  void* data;
-  int64_t count;
-} node;
-
-typedef struct map{
-  node *base;
-  cmp_func cmp;
-  short free;
-} map;
-
-/*
-** creates a map given a comparison function
-*/
-map map_make(cmp_func cmp);
-
-/*
-** inserts the element e into map m
-*/
-void map_insert(map *m, void *e);
-
-/*
-** executes function iter over all elements in the map, in key increasing order
-*/
-void map_iterate(map *m, map_iterator iter, void* p);
-
-/*
-** frees all memory used by a map
-*/
-void map_destroy(map *m);
-
-/*
-** compares 2 integers
-** to use with map_make
-*/
-int int_cmp(const void *a, const void *b);
-
-/*
-** compares 2 doubles
-** to use with map_make
-*/
-int double_cmp(const void *a, const void *b);
-
-#endif /* _MAP_H_ */
 
 typedef uint8_t         u8;
 typedef uint16_t        u16;
@@ -1203,27 +1164,76 @@ struct StdevCtx {
   i64 cnt;          /* number of elements */
 };
 
+/*
+** One run of equal values collected by mode(), median(), the quartiles and percentile()
+*/
+typedef struct ModeRun ModeRun;
+struct ModeRun {
+  union {
+    i64 i;
+    double d;
+  } v;                /* the value */
+  i64 n;              /* number of consecutive occurrences */
+};
+
+/*
+** Node of the order statistic tree used when median(), the quartiles and percentile()
+** run as window functions
+*/
+typedef struct ModeNode ModeNode;
+struct ModeNode {
+  ModeRun run;        /* the value and its number of occurrences */
+  i64 size;           /* number of occurrences in this subtree */
+  int left;           /* left child, 0 for none */
+  int right;          /* right child, 0 for none */
+  unsigned int pri;   /* heap priority */
+};
+
+/*
+** Treap of distinct values keyed on value with subtree counts, so values can be added,
+** removed and ranked in logarithmic time as a window frame slides.
+** Nodes are kept in one array and referenced by index; node 0 is an empty sentinel.
+*/
+typedef struct ModeTree ModeTree;
+struct ModeTree {
+  ModeNode *nodes;    /* node pool */
+  int nAlloc;         /* number of nodes allocated */
+  int nUsed;          /* number of nodes handed out, including the sentinel */
+  int freeList;       /* first free node, chained through left */
+  int root;           /* root node */
+  unsigned int seed;  /* state of the priority generator */
+};
+
 /*
 ** An instance of the following structure holds the context of a
 ** mode() or median() aggregate computation.
-** Depends on structures defined in map.c (see map & map)
+** The values are kept in a growable array; consecutive equal values share one run so
+** sorted or constant columns stay small. Order statistics are found by selection at
+** the end, which is linear on average and never degenerates on sorted input.
 ** These aggregate functions only work for integers and floats although
 ** they could be made to work for strings. This is usually considered meaningless.
 ** Only usuall order (for median), no use of collation functions (would this even make sense?)
 */
 typedef struct ModeCtx ModeCtx;
 struct ModeCtx {
-  i64 riM;            /* integer value found so far */
-  double rdM;         /* double value found so far */
+  ModeRun *runs;      /* the collected runs */
+  i64 nRun;           /* number of runs in use */
+  i64 nAlloc;         /* number of runs allocated */
   i64 cnt;            /* number of elements so far */
-  double pcnt;        /* number of elements smaller than a percentile */
-  i64 mcnt;           /* maximum number of occurrences (for mode) */
-  i64 mn;             /* number of occurrences (for mode and percentiles) */
-  i64 is_double;      /* whether the computation is being done for doubles (>0) or integers (=0) */
-  map* m;             /* map structure used for the computation */
-  int done;           /* whether the answer has been found */
+  int is_double;      /* whether the computation is being done for doubles (>0) or integers (=0) */
+  double p;           /* requested fraction for percentile() */
+  int has_p;          /* whether p has been read */
+  ModeTree *tree;     /* replaces runs once used as a window function */
 };
 
+/*
+** Returns whether an argument is a number or text that converts to one; NULL and other text are not numeric
+*/
+static int isNumeric(sqlite3_value *value){
+  int type = sqlite3_value_numeric_type(value);
+  return type==SQLITE_INTEGER || type==SQLITE_FLOAT;
+}
+
 /*
 ** called for each value received during a calculation of stdev or variance
 */
@@ -1245,233 +1255,1084 @@ static void varianceStep(sqlite3_context *context, int argc, sqlite3_value **arg
   }
 }
 
+#if SQLITE_VERSION_NUMBER >= 3025000
+/*
+** called for each value leaving the window frame of stdev or variance; reverses varianceStep
+*/
+static void varianceInverse(sqlite3_context *context, int argc, sqlite3_value **argv){
+  StdevCtx *p;
+
+  double delta;
+  double x;
+
+  p = sqlite3_aggregate_context(context, sizeof(*p));
+  if( p && SQLITE_NULL != sqlite3_value_numeric_type(argv[0]) ){
+    if( p->cnt<=1 ){
+      p->cnt = 0;
+      p->rM = 0.0;
+      p->rS = 0.0;
+      return;
+    }
+    p->cnt--;
+    x = sqlite3_value_double(argv[0]);
+    delta = (x-p->rM);
+    p->rM -= delta/p->cnt;
+    p->rS -= delta*(x-p->rM);
+    if( p->rS<0.0 ) p->rS = 0.0;
+  }
+}
+#endif
+
+static int modeTreeInsert(ModeTree *t, int n, const ModeRun *run, int is_double, int *rc);
+
 /*
 ** called for each value received during a calculation of mode of median
 */
 static void modeStep(sqlite3_context *context, int argc, sqlite3_value **argv){
   ModeCtx *p;
-  i64 xi=0;
-  double xd=0.0;
-  i64 *iptr;
-  double *dptr;
+  ModeRun *last;
   int type;
+  i64 j;
 
-  assert( argc==1 );
   type = sqlite3_value_numeric_type(argv[0]);
 
   if( type == SQLITE_NULL)
     return;
-  
+
   p = sqlite3_aggregate_context(context, sizeof(*p));
+  if( p==0 ){
+    sqlite3_result_error_nomem(context);
+    return;
+  }
 
-  if( 0==(p->m) ){
-    p->m = calloc(1, sizeof(map));
-    if( type==SQLITE_INTEGER ){
-      /* map will be used for integers */
-      *(p->m) = map_make(int_cmp);
-      p->is_double = 0;
+  if( p->cnt==0 && p->tree==0 ){
+    p->is_double = type!=SQLITE_INTEGER;
+  }else if( 0==p->is_double && type!=SQLITE_INTEGER ){
+    /* first non integer value: continue with doubles */
+    for(j=0; j<p->nRun; j++){
+      p->runs[j].v.d = (double)p->runs[j].v.i;
+    }
+    if( p->tree ){
+      for(j=1; j<p->tree->nUsed; j++){
+        p->tree->nodes[j].run.v.d = (double)p->tree->nodes[j].run.v.i;
+      }
+    }
+    p->is_double = 1;
+  }
+
+  if( p->tree ){
+    ModeRun run;
+    int rc = SQLITE_OK;
+    if( 0==p->is_double ){
+      run.v.i = sqlite3_value_int64(argv[0]);
     }else{
-      p->is_double = 1;
-      /* map will be used for doubles */
-      *(p->m) = map_make(double_cmp);
+      run.v.d = sqlite3_value_double(argv[0]);
+    }
+    run.n = 1;
+    p->tree->root = modeTreeInsert(p->tree, p->tree->root, &run, p->is_double, &rc);
+    if( rc!=SQLITE_OK ){
+      sqlite3_result_error_nomem(context);
+      return;
+    }
+    ++p->cnt;
+    return;
+  }
+
+  last = p->nRun>0 ? &p->runs[p->nRun-1] : 0;
+  if( 0==p->is_double ){
+    i64 x = sqlite3_value_int64(argv[0]);
+    if( last && last->v.i==x ){
+      ++last->n;
+      ++p->cnt;
+      return;
+    }
+  }else{
+    double x = sqlite3_value_double(argv[0]);
+    if( last && last->v.d==x ){
+      ++last->n;
+      ++p->cnt;
+      return;
     }
   }
 
-  ++(p->cnt);
+  if( p->nRun==p->nAlloc ){
+    i64 nAlloc = p->nAlloc ? p->nAlloc*2 : 64;
+    ModeRun *runs = sqlite3_realloc64(p->runs, nAlloc*sizeof(ModeRun));
+    if( runs==0 ){
+      sqlite3_result_error_nomem(context);
+      return;
+    }
+    p->runs = runs;
+    p->nAlloc = nAlloc;
+  }
 
+  last = &p->runs[p->nRun++];
   if( 0==p->is_double ){
-    xi = sqlite3_value_int64(argv[0]);
-    iptr = (i64*)calloc(1,sizeof(i64));
-    *iptr = xi;
-    map_insert(p->m, iptr);
+    last->v.i = sqlite3_value_int64(argv[0]);
   }else{
-    xd = sqlite3_value_double(argv[0]);
-    dptr = (double*)calloc(1,sizeof(double));
-    *dptr = xd;
-    map_insert(p->m, dptr);
+    last->v.d = sqlite3_value_double(argv[0]);
   }
+  last->n = 1;
+  ++p->cnt;
 }
 
 /*
-**  Auxiliary function that iterates all elements in a map and finds the mode
-**  (most frequent value)
+** called for each value received during a calculation of percentile; p must be the same for all rows
 */
-static void modeIterate(void* e, i64 c, void* pp){
-  i64 ei;
-  double ed;
-  ModeCtx *p = (ModeCtx*)pp;
-  
-  if( 0==p->is_double ){
-    ei = *(int*)(e);
-
-	if( p->mcnt==c ){
-      ++p->mn;
-    }else if( p->mcnt<c ){
-      p->riM = ei;
-      p->mcnt = c;
-	  p->mn=1;
+static void percentileStep(sqlite3_context *context, int argc, sqlite3_value **argv){
+  ModeCtx *p;
+  double rP;
+
+  if( !isNumeric(argv[1]) ){
+    sqlite3_result_error(context, "percentile() requires a numeric fraction", -1);
+    return;
+  }
+  rP = sqlite3_value_double(argv[1]);
+  if( rP<0.0 || rP>1.0 ){
+    sqlite3_result_error(context, "percentile() fraction must be between 0 and 1", -1);
+    return;
+  }
+
+  p = sqlite3_aggregate_context(context, sizeof(*p));
+  if( p==0 ){
+    sqlite3_result_error_nomem(context);
+    return;
+  }
+  if( p->has_p && p->p!=rP ){
+    sqlite3_result_error(context, "percentile() fraction must be the same for all rows", -1);
+    return;
+  }
+  p->p = rP;
+  p->has_p = 1;
+
+  modeStep(context, 1, argv);
+}
+
+static int modeRunCmp(const ModeRun *a, const ModeRun *b, int is_double){
+  if( is_double ){
+    return a->v.d<b->v.d ? -1 : (a->v.d>b->v.d ? 1 : 0);
+  }
+  return a->v.i<b->v.i ? -1 : (a->v.i>b->v.i ? 1 : 0);
+}
+
+static int modeRunCmpInt(const void *a, const void *b){
+  return modeRunCmp((const ModeRun*)a, (const ModeRun*)b, 0);
+}
+
+static int modeRunCmpDouble(const void *a, const void *b){
+  return modeRunCmp((const ModeRun*)a, (const ModeRun*)b, 1);
+}
+
+static void modeRunSwap(ModeRun *a, ModeRun *b){
+  ModeRun t = *a;
+  *a = *b;
+  *b = t;
+}
+
+/*
+** Returns the run holding the k-th smallest value (1 based, counting every occurrence).
+** Introselect: quickselect with a three way partition so duplicates are split off in one
+** pass, falling back to sorting the remaining range when partitioning stops making progress.
+*/
+static ModeRun *modeSelect(ModeCtx *p, i64 k){
+  ModeRun *runs = p->runs;
+  i64 lo = 0;
+  i64 hi = p->nRun;
+  int depth = 2;
+  i64 n;
+
+  for(n=p->nRun; n>1; n>>=1){
+    depth += 2;
+  }
+
+  while( hi-lo>16 && depth-->0 ){
+    i64 mid = lo + (hi-lo)/2;
+    i64 lt, gt, i;
+    i64 wLess = 0;
+    i64 wEqual = 0;
+    ModeRun pivot;
+
+    /* median of three */
+    if( modeRunCmp(&runs[mid], &runs[lo], p->is_double)<0 ) modeRunSwap(&runs[mid], &runs[lo]);
+    if( modeRunCmp(&runs[hi-1], &runs[lo], p->is_double)<0 ) modeRunSwap(&runs[hi-1], &runs[lo]);
+    if( modeRunCmp(&runs[hi-1], &runs[mid], p->is_double)<0 ) modeRunSwap(&runs[hi-1], &runs[mid]);
+    pivot = runs[mid];
+
+    lt = lo;
+    gt = hi;
+    i = lo;
+    while( i<gt ){
+      int c = modeRunCmp(&runs[i], &pivot, p->is_double);
+      if( c<0 ){
+        wLess += runs[i].n;
+        modeRunSwap(&runs[lt++], &runs[i++]);
+      }else if( c>0 ){
+        modeRunSwap(&runs[i], &runs[--gt]);
+      }else{
+        wEqual += runs[i].n;
+        i++;
+      }
+    }
+
+    if( k<=wLess ){
+      hi = lt;
+    }else if( k<=wLess+wEqual ){
+      return &runs[lt];
+    }else{
+      k -= wLess+wEqual;
+      lo = gt;
+    }
+  }
+
+  qsort(&runs[lo], (size_t)(hi-lo), sizeof(ModeRun), p->is_double ? modeRunCmpDouble : modeRunCmpInt);
+  for(; lo<hi; lo++){
+    if( k<=runs[lo].n ){
+      return &runs[lo];
+    }
+    k -= runs[lo].n;
+  }
+  return &runs[hi-1];
+}
+
+static void modeTreeUpdate(ModeTree *t, int n){
+  ModeNode *node = &t->nodes[n];
+  node->size = node->run.n + t->nodes[node->left].size + t->nodes[node->right].size;
+}
+
+static int modeTreeRotateRight(ModeTree *t, int n){
+  int l = t->nodes[n].left;
+  t->nodes[n].left = t->nodes[l].right;
+  t->nodes[l].right = n;
+  modeTreeUpdate(t, n);
+  modeTreeUpdate(t, l);
+  return l;
+}
+
+static int modeTreeRotateLeft(ModeTree *t, int n){
+  int r = t->nodes[n].right;
+  t->nodes[n].right = t->nodes[r].left;
+  t->nodes[r].left = n;
+  modeTreeUpdate(t, n);
+  modeTreeUpdate(t, r);
+  return r;
+}
+
+/*
+** Adds run->n occurrences of run->v to the subtree rooted at n and returns the new subtree root
+*/
+static int modeTreeInsert(ModeTree *t, int n, const ModeRun *run, int is_double, int *rc){
+  int c;
+
+  if( n==0 ){
+    if( t->freeList ){
+      n = t->freeList;
+      t->freeList = t->nodes[n].left;
+    }else{
+      if( t->nUsed==t->nAlloc ){
+        int nAlloc = t->nAlloc ? t->nAlloc*2 : 64;
+        ModeNode *nodes = sqlite3_realloc64(t->nodes, nAlloc*sizeof(ModeNode));
+        if( nodes==0 ){
+          *rc = SQLITE_NOMEM;
+          return 0;
+        }
+        if( t->nAlloc==0 ){
+          memset(&nodes[0], 0, sizeof(ModeNode));
+          t->nUsed = 1;
+        }
+        t->nodes = nodes;
+        t->nAlloc = nAlloc;
+      }
+      n = t->nUsed++;
+    }
+    t->seed ^= t->seed << 13;
+    t->seed ^= t->seed >> 17;
+    t->seed ^= t->seed << 5;
+    t->nodes[n].run = *run;
+    t->nodes[n].size = run->n;
+    t->nodes[n].left = 0;
+    t->nodes[n].right = 0;
+    t->nodes[n].pri = t->seed;
+    return n;
+  }
+
+  c = modeRunCmp(run, &t->nodes[n].run, is_double);
+  if( c==0 ){
+    t->nodes[n].run.n += run->n;
+  }else if( c<0 ){
+    int l = modeTreeInsert(t, t->nodes[n].left, run, is_double, rc);
+    t->nodes[n].left = l;
+    if( t->nodes[l].pri>t->nodes[n].pri ){
+      return modeTreeRotateRight(t, n);
     }
   }else{
-    ed = *(double*)(e);
-
-	if( p->mcnt==c ){
-      ++p->mn;
-    }else if(p->mcnt<c){
-      p->rdM = ed;
-      p->mcnt = c;
-	  p->mn=1;
+    int r = modeTreeInsert(t, t->nodes[n].right, run, is_double, rc);
+    t->nodes[n].right = r;
+    if( t->nodes[r].pri>t->nodes[n].pri ){
+      return modeTreeRotateLeft(t, n);
     }
   }
+  modeTreeUpdate(t, n);
+  return n;
+}
+
+#if SQLITE_VERSION_NUMBER >= 3025000
+static int modeTreeJoin(ModeTree *t, int a, int b){
+  if( a==0 ) return b;
+  if( b==0 ) return a;
+  if( t->nodes[a].pri>t->nodes[b].pri ){
+    t->nodes[a].right = modeTreeJoin(t, t->nodes[a].right, b);
+    modeTreeUpdate(t, a);
+    return a;
+  }
+  t->nodes[b].left = modeTreeJoin(t, a, t->nodes[b].left);
+  modeTreeUpdate(t, b);
+  return b;
 }
 
 /*
-**  Auxiliary function that iterates all elements in a map and finds the median
-**  (the value such that the number of elements smaller is equal the the number of 
-**  elements larger)
+** Removes one occurrence of run->v from the subtree rooted at n and returns the new subtree root
 */
-static void medianIterate(void* e, i64 c, void* pp){
-  i64 ei;
-  double ed;
-  double iL;
-  double iR;
-  int il;
-  int ir;
-  ModeCtx *p = (ModeCtx*)pp;
+static int modeTreeRemove(ModeTree *t, int n, const ModeRun *run, int is_double){
+  int c;
 
-  if(p->done>0)
-    return;
+  if( n==0 )
+    return 0;
 
-  iL = p->pcnt;
-  iR = p->cnt - p->pcnt;
-  il = p->mcnt + c;
-  ir = p->cnt - p->mcnt;
-
-  if( il >= iL ){
-    if( ir >= iR ){
-    ++p->mn;
-      if( 0==p->is_double ){
-        ei = *(int*)(e);
-        p->riM += ei;
-      }else{
-        ed = *(double*)(e);
-        p->rdM += ed;
-      }
+  c = modeRunCmp(run, &t->nodes[n].run, is_double);
+  if( c<0 ){
+    t->nodes[n].left = modeTreeRemove(t, t->nodes[n].left, run, is_double);
+  }else if( c>0 ){
+    t->nodes[n].right = modeTreeRemove(t, t->nodes[n].right, run, is_double);
+  }else if( --t->nodes[n].run.n==0 ){
+    int m = modeTreeJoin(t, t->nodes[n].left, t->nodes[n].right);
+    t->nodes[n].left = t->freeList;
+    t->freeList = n;
+    return m;
+  }
+  modeTreeUpdate(t, n);
+  return n;
+}
+#endif
+
+/*
+** Returns the node holding the k-th smallest value (1 based, counting every occurrence)
+*/
+static ModeRun *modeTreeRank(ModeTree *t, i64 k){
+  int n = t->root;
+  while( n ){
+    ModeNode *node = &t->nodes[n];
+    i64 l = t->nodes[node->left].size;
+    if( k<=l ){
+      n = node->left;
+    }else if( k<=l+node->run.n ){
+      return &node->run;
     }else{
-      p->done=1;
+      k -= l+node->run.n;
+      n = node->right;
     }
   }
-  p->mcnt+=c;
+  return 0;
+}
+
+#if SQLITE_VERSION_NUMBER >= 3025000
+/*
+** Moves the collected runs into an order statistic tree; called once the aggregate is used as a window function
+*/
+static int modeTreeEnsure(ModeCtx *p){
+  i64 j;
+  int rc = SQLITE_OK;
+
+  if( p->tree )
+    return SQLITE_OK;
+
+  p->tree = sqlite3_malloc(sizeof(ModeTree));
+  if( p->tree==0 )
+    return SQLITE_NOMEM;
+  memset(p->tree, 0, sizeof(ModeTree));
+  p->tree->seed = 2463534242u;
+
+  for(j=0; j<p->nRun && rc==SQLITE_OK; j++){
+    p->tree->root = modeTreeInsert(p->tree, p->tree->root, &p->runs[j], p->is_double, &rc);
+  }
+  sqlite3_free(p->runs);
+  p->runs = 0;
+  p->nRun = 0;
+  p->nAlloc = 0;
+  return rc;
+}
+#endif
+
+static void modeFree(ModeCtx *p){
+  sqlite3_free(p->runs);
+  p->runs = 0;
+  if( p->tree ){
+    sqlite3_free(p->tree->nodes);
+    sqlite3_free(p->tree);
+    p->tree = 0;
+  }
+}
+
+#if SQLITE_VERSION_NUMBER >= 3025000
+/*
+** called for each value leaving the window frame of median, the quartiles or percentile
+*/
+static void modeInverse(sqlite3_context *context, int argc, sqlite3_value **argv){
+  ModeCtx *p;
+  ModeRun run;
+
+  if( SQLITE_NULL==sqlite3_value_numeric_type(argv[0]) )
+    return;
+
+  p = sqlite3_aggregate_context(context, sizeof(*p));
+  if( p==0 ){
+    sqlite3_result_error_nomem(context);
+    return;
+  }
+  if( modeTreeEnsure(p)!=SQLITE_OK ){
+    sqlite3_result_error_nomem(context);
+    return;
+  }
+
+  if( 0==p->is_double ){
+    run.v.i = sqlite3_value_int64(argv[0]);
+  }else{
+    run.v.d = sqlite3_value_double(argv[0]);
+  }
+  run.n = 1;
+  p->tree->root = modeTreeRemove(p->tree, p->tree->root, &run, p->is_double);
+  --p->cnt;
 }
+#endif
 
 /*
 ** Returns the mode value
 */
 static void modeFinalize(sqlite3_context *context){
   ModeCtx *p;
+  i64 i, j;
+  i64 mcnt = 0;       /* maximum number of occurrences */
+  i64 mn = 0;         /* number of values with that many occurrences */
+  ModeRun *mode = 0;
+
   p = sqlite3_aggregate_context(context, 0);
-  if( p && p->m ){
-    map_iterate(p->m, modeIterate, p);
-    map_destroy(p->m);
-    free(p->m);
+  if( p && p->nRun>0 ){
+    qsort(p->runs, (size_t)p->nRun, sizeof(ModeRun), p->is_double ? modeRunCmpDouble : modeRunCmpInt);
+
+    for(i=0; i<p->nRun; i=j){
+      i64 c = 0;
+      for(j=i; j<p->nRun && modeRunCmp(&p->runs[i], &p->runs[j], p->is_double)==0; j++){
+        c += p->runs[j].n;
+      }
+      if( mcnt==c ){
+        ++mn;
+      }else if( mcnt<c ){
+        mode = &p->runs[i];
+        mcnt = c;
+        mn = 1;
+      }
+    }
 
-    if( 1==p->mn ){
+    if( 1==mn ){
       if( 0==p->is_double )
-        sqlite3_result_int64(context, p->riM);
+        sqlite3_result_int64(context, mode->v.i);
       else
-        sqlite3_result_double(context, p->rdM);
+        sqlite3_result_double(context, mode->v.d);
     }
   }
+  if( p ){
+    modeFree(p);
+  }
+}
+
+static ModeRun *modeRank(ModeCtx *p, i64 k){
+  return p->tree ? modeTreeRank(p->tree, k) : modeSelect(p, k);
 }
 
 /*
 ** auxiliary function for percentiles
+** The result is the value at rank ceil(rP*n) averaged with the one at rank floor(rP*n)+1
+** when they differ, which gives the usual median for an even number of values.
 */
-static void _medianFinalize(sqlite3_context *context){
+static void _medianResult(sqlite3_context *context, ModeCtx *p, double rP){
+  ModeRun *lower;
+  ModeRun *upper;
+  double pcnt;
+  i64 a, b;
+
+  pcnt = p->cnt*rP;
+  a = (i64)ceil(pcnt);
+  b = (i64)floor(pcnt)+1;
+  if( a<1 ) a = 1;
+  if( a>p->cnt ) a = p->cnt;
+  if( b<1 ) b = 1;
+  if( b>p->cnt ) b = p->cnt;
+
+  lower = modeRank(p, a);
+  if( 0==p->is_double ){
+    i64 riM = lower->v.i;
+    if( b!=a ){
+      upper = modeRank(p, b);
+      if( upper->v.i!=riM ){
+        sqlite3_result_double(context, (riM + (double)upper->v.i)/2.0);
+        return;
+      }
+    }
+    sqlite3_result_int64(context, riM);
+  }else{
+    double rdM = lower->v.d;
+    if( b!=a ){
+      upper = modeRank(p, b);
+      rdM = (rdM + upper->v.d)/2.0;
+    }
+    sqlite3_result_double(context, rdM);
+  }
+}
+
+static void _medianFinalize(sqlite3_context *context, double rP){
   ModeCtx *p;
+
   p = (ModeCtx*) sqlite3_aggregate_context(context, 0);
-  if( p && p->m ){
-    p->done=0;
-    map_iterate(p->m, medianIterate, p);
-    map_destroy(p->m);
-    free(p->m);
-
-    if( 0==p->is_double )
-      if( 1==p->mn )
-      	sqlite3_result_int64(context, p->riM);
-      else
-      	sqlite3_result_double(context, p->riM*1.0/p->mn);
-    else
-      sqlite3_result_double(context, p->rdM/p->mn);
+  if( p ){
+    if( p->cnt>0 ){
+      _medianResult(context, p, rP);
+    }
+    modeFree(p);
   }
 }
 
+#if SQLITE_VERSION_NUMBER >= 3025000
 /*
-** Returns the median value
+** auxiliary function for the current value of a percentile window function
 */
-static void medianFinalize(sqlite3_context *context){
+static void _medianValue(sqlite3_context *context, double rP){
   ModeCtx *p;
+
   p = (ModeCtx*) sqlite3_aggregate_context(context, 0);
-  if( p!=0 ){
-    p->pcnt = (p->cnt)/2.0;
-    _medianFinalize(context);
+  if( p && p->cnt>0 ){
+    if( modeTreeEnsure(p)!=SQLITE_OK ){
+      sqlite3_result_error_nomem(context);
+      return;
+    }
+    _medianResult(context, p, rP);
   }
 }
+#endif
+
+/*
+** Returns the median value
+*/
+static void medianFinalize(sqlite3_context *context){
+  _medianFinalize(context, 0.5);
+}
 
 /*
 ** Returns the lower_quartile value
 */
 static void lower_quartileFinalize(sqlite3_context *context){
-  ModeCtx *p;
-  p = (ModeCtx*) sqlite3_aggregate_context(context, 0);
-  if( p!=0 ){
-    p->pcnt = (p->cnt)/4.0;
-    _medianFinalize(context);
-  }
+  _medianFinalize(context, 0.25);
 }
 
 /*
 ** Returns the upper_quartile value
 */
 static void upper_quartileFinalize(sqlite3_context *context){
-  ModeCtx *p;
-  p = (ModeCtx*) sqlite3_aggregate_context(context, 0);
-  if( p!=0 ){
-    p->pcnt = (p->cnt)*3/4.0;
-    _medianFinalize(context);
-  }
+  _medianFinalize(context, 0.75);
 }
 
 /*
-** Returns the stdev value
+** Returns the percentile value
 */
-static void stdevFinalize(sqlite3_context *context){
-  StdevCtx *p;
-  p = sqlite3_aggregate_context(context, 0);
-  if( p && p->cnt>1 ){
-    sqlite3_result_double(context, sqrt(p->rS/(p->cnt-1)));
-  }else{
-    sqlite3_result_double(context, 0.0);
-  }
+static void percentileFinalize(sqlite3_context *context){
+  ModeCtx *p;
+  p = (ModeCtx*) sqlite3_aggregate_context(context, 0);
+  _medianFinalize(context, p ? p->p : 0.0);
 }
 
-/*
-** Returns the variance value
-*/
-static void varianceFinalize(sqlite3_context *context){
-  StdevCtx *p;
-  p = sqlite3_aggregate_context(context, 0);
-  if( p && p->cnt>1 ){
-    sqlite3_result_double(context, p->rS/(p->cnt-1));
-  }else{
-    sqlite3_result_double(context, 0.0);
-  }
+#if SQLITE_VERSION_NUMBER >= 3025000
+static void medianValue(sqlite3_context *context){
+  _medianValue(context, 0.5);
 }
 
-#ifdef SQLITE_SOUNDEX
+static void lower_quartileValue(sqlite3_context *context){
+  _medianValue(context, 0.25);
+}
 
-/* relicoder factored code */
-/*
-** Calculates the soundex value of a string
+static void upper_quartileValue(sqlite3_context *context){
+  _medianValue(context, 0.75);
+}
+
+static void percentileValue(sqlite3_context *context){
+  ModeCtx *p;
+  p = (ModeCtx*) sqlite3_aggregate_context(context, 0);
+  _medianValue(context, p ? p->p : 0.0);
+}
+#endif
+
+/*
+** An instance of the following structure holds the context of an
+** approx_percentile(), approx_percentile_state() or approx_percentile_merge() aggregate computation.
+** The t-digest keeps a fixed number of centroids so memory does not depend on the number of rows.
+*/
+typedef struct DigestCtx DigestCtx;
+struct DigestCtx {
+  tdigest_t digest;   /* the digest, valid when init is set */
+  int init;           /* whether the digest has been initialised */
+  double p;           /* requested fraction */
+  int has_p;          /* whether p has been read */
+};
+
+/*
+** Reads the fraction argument of the approx_percentile functions; it must be the same for all rows
+*/
+static int digestFraction(sqlite3_context *context, DigestCtx *p, sqlite3_value *arg){
+  double rP;
+
+  if( !isNumeric(arg) ){
+    sqlite3_result_error(context, "approx_percentile requires a numeric fraction", -1);
+    return 0;
+  }
+  rP = sqlite3_value_double(arg);
+  if( rP<0.0 || rP>1.0 ){
+    sqlite3_result_error(context, "approx_percentile fraction must be between 0 and 1", -1);
+    return 0;
+  }
+  if( p->has_p && p->p!=rP ){
+    sqlite3_result_error(context, "approx_percentile fraction must be the same for all rows", -1);
+    return 0;
+  }
+  p->p = rP;
+  p->has_p = 1;
+  return 1;
+}
+
+/*
+** Adds one value to the digest; compression is the optional compression argument
+*/
+static void digestAdd(sqlite3_context *context, DigestCtx *p, sqlite3_value *value, sqlite3_value *compression){
+  if( SQLITE_NULL==sqlite3_value_numeric_type(value) )
+    return;
+
+  if( 0==p->init ){
+    double rC = compression ? sqlite3_value_double(compression) : TDIGEST_DEFAULT_COMPRESSION;
+    if( (compression && !isNumeric(compression)) || rC<TDIGEST_MIN_COMPRESSION || rC>TDIGEST_MAX_COMPRESSION ){
+      sqlite3_result_error(context, "approx_percentile compression must be between 10 and 10000", -1);
+      return;
+    }
+    if( tdigest_init(&p->digest, rC)!=SQLITE_OK ){
+      sqlite3_result_error_nomem(context);
+      return;
+    }
+    p->init = 1;
+  }
+
+  tdigest_add(&p->digest, sqlite3_value_double(value), 1.0);
+}
+
+/*
+** called for each value received during a calculation of approx_percentile(x, p [, compression])
+*/
+static void approxPercentileStep(sqlite3_context *context, int argc, sqlite3_value **argv){
+  DigestCtx *p;
+
+  p = sqlite3_aggregate_context(context, sizeof(*p));
+  if( p==0 ){
+    sqlite3_result_error_nomem(context);
+    return;
+  }
+  if( !digestFraction(context, p, argv[1]) )
+    return;
+
+  digestAdd(context, p, argv[0], argc>2 ? argv[2] : 0);
+}
+
+/*
+** called for each value received during a calculation of approx_percentile_state(x [, compression])
+*/
+static void approxPercentileStateStep(sqlite3_context *context, int argc, sqlite3_value **argv){
+  DigestCtx *p;
+
+  p = sqlite3_aggregate_context(context, sizeof(*p));
+  if( p==0 ){
+    sqlite3_result_error_nomem(context);
+    return;
+  }
+
+  digestAdd(context, p, argv[0], argc>1 ? argv[1] : 0);
+}
+
+/*
+** called for each state received during a calculation of approx_percentile_merge(state [, p])
+*/
+static void approxPercentileMergeStep(sqlite3_context *context, int argc, sqlite3_value **argv){
+  DigestCtx *p;
+  binstream_t stream;
+  int rc;
+
+  if( sqlite3_value_type(argv[0])==SQLITE_NULL )
+    return;
+
+  p = sqlite3_aggregate_context(context, sizeof(*p));
+  if( p==0 ){
+    sqlite3_result_error_nomem(context);
+    return;
+  }
+  if( argc>1 && !digestFraction(context, p, argv[1]) )
+    return;
+
+  binstream_init(&stream, (uint8_t *)sqlite3_value_blob(argv[0]), (size_t)sqlite3_value_bytes(argv[0]));
+  rc = tdigest_read(&p->digest, &stream, 0==p->init);
+  if( rc==SQLITE_NOMEM ){
+    sqlite3_result_error_nomem(context);
+    return;
+  }
+  p->init = p->init || rc==SQLITE_OK;
+  if( rc!=SQLITE_OK ){
+    sqlite3_result_error(context, "approx_percentile_merge: invalid state", -1);
+    return;
+  }
+}
+
+/*
+** Returns the approximate percentile value
+*/
+static void approxPercentileFinalize(sqlite3_context *context){
+  DigestCtx *p;
+
+  p = (DigestCtx*) sqlite3_aggregate_context(context, 0);
+  if( p && p->init ){
+    if( tdigest_weight(&p->digest)>0.0 ){
+      sqlite3_result_double(context, tdigest_quantile(&p->digest, p->p));
+    }
+    tdigest_destroy(&p->digest);
+  }
+}
+
+/*
+** Returns the serialized digest, which can be combined with approx_percentile_merge
+*/
+static void approxPercentileStateFinalize(sqlite3_context *context){
+  DigestCtx *p;
+  binstream_t stream;
+
+  p = (DigestCtx*) sqlite3_aggregate_context(context, 0);
+  if( p && p->init ){
+    if( binstream_init_growable(&stream, 64)!=SQLITE_OK ){
+      sqlite3_result_error_nomem(context);
+    }else{
+      if( tdigest_write(&p->digest, &stream)==SQLITE_OK ){
+        binstream_flip(&stream);
+        sqlite3_result_blob(context, binstream_data(&stream), (int)binstream_available(&stream), SQLITE_TRANSIENT);
+      }else{
+        sqlite3_result_error_nomem(context);
+      }
+      binstream_destroy(&stream, 1);
+    }
+    tdigest_destroy(&p->digest);
+  }
+}
+
+/*
+** An instance of the following structure holds the context of an approx_topk() aggregate computation.
+** The space-saving summary keeps a fixed number of counters however many distinct values there are.
+*/
+typedef struct TopkCtx TopkCtx;
+struct TopkCtx {
+  topk_t topk;        /* the summary, valid when init is set */
+  int init;           /* whether the summary has been initialised */
+  int k;              /* number of values to return */
+};
+
+/*
+** called for each value received during a calculation of approx_topk(x, k [, capacity])
+*/
+static void approxTopkStep(sqlite3_context *context, int argc, sqlite3_value **argv){
+  TopkCtx *p;
+  topk_value_t value;
+
+  p = sqlite3_aggregate_context(context, sizeof(*p));
+  if( p==0 ){
+    sqlite3_result_error_nomem(context);
+    return;
+  }
+
+  if( 0==p->init ){
+    i64 k = sqlite3_value_int64(argv[1]);
+    i64 capacity;
+    if( k<1 || k>TOPK_MAX_CAPACITY ){
+      sqlite3_result_error(context, "approx_topk: k must be between 1 and 1000000", -1);
+      return;
+    }
+    capacity = argc>2 ? sqlite3_value_int64(argv[2]) : k*TOPK_DEFAULT_FACTOR;
+    if( argc<=2 && capacity<TOPK_MIN_CAPACITY ){
+      capacity = TOPK_MIN_CAPACITY;
+    }
+    if( capacity>TOPK_MAX_CAPACITY ){
+      capacity = TOPK_MAX_CAPACITY;
+    }
+    if( capacity<k ){
+      sqlite3_result_error(context, "approx_topk: capacity must not be less than k", -1);
+      return;
+    }
+    if( topk_init(&p->topk, (int)capacity)!=SQLITE_OK ){
+      sqlite3_result_error_nomem(context);
+      return;
+    }
+    p->k = (int)k;
+    p->init = 1;
+  }
+
+  memset(&value, 0, sizeof(value));
+  value.type = sqlite3_value_type(argv[0]);
+  switch( value.type ){
+    case SQLITE_NULL:
+      return;
+    case SQLITE_INTEGER:
+      value.i = sqlite3_value_int64(argv[0]);
+      break;
+    case SQLITE_FLOAT:
+      value.d = sqlite3_value_double(argv[0]);
+      break;
+    case SQLITE_TEXT:
+      value.data = sqlite3_value_text(argv[0]);
+      value.length = sqlite3_value_bytes(argv[0]);
+      break;
+    default:
+      value.data = sqlite3_value_blob(argv[0]);
+      value.length = sqlite3_value_bytes(argv[0]);
+      break;
+  }
+
+  if( topk_add(&p->topk, &value)!=SQLITE_OK ){
+    sqlite3_result_error_nomem(context);
+  }
+}
+
+/*
+** Returns the most frequent values as a JSON array of {"value", "count", "error"} objects
+*/
+static void approxTopkFinalize(sqlite3_context *context){
+  TopkCtx *p;
+  strbuf_t json;
+
+  p = (TopkCtx*) sqlite3_aggregate_context(context, 0);
+  if( p && p->init ){
+    if( p->topk.count>0 ){
+      if( strbuf_init(&json, 256)!=SQLITE_OK ){
+        sqlite3_result_error_nomem(context);
+      }else{
+        if( topk_write_json(&p->topk, p->k, &json)==SQLITE_OK ){
+          sqlite3_result_text(context, strbuf_data_pointer(&json), -1, SQLITE_TRANSIENT);
+        }else{
+          sqlite3_result_error_nomem(context);
+        }
+        strbuf_destroy(&json);
+      }
+    }
+    topk_destroy(&p->topk);
+  }
+}
+
+/*
+** An instance of the following structure holds the context of an approx_count_distinct(),
+** approx_count_distinct_state() or approx_count_distinct_merge() aggregate computation.
+*/
+typedef struct HllCtx HllCtx;
+struct HllCtx {
+  hll_t hll;          /* the sketch, valid when init is set */
+  int init;           /* whether the sketch has been initialised */
+};
+
+/*
+** Hashes a value for the distinct count; integral floats hash like integers to match SQL equality
+*/
+static uint64_t hllValueHash(sqlite3_value *value){
+  uint8_t bytes[8];
+  uint64_t bits;
+  int seed;
+  int i;
+
+  switch( sqlite3_value_type(value) ){
+    case SQLITE_FLOAT: {
+      double d = sqlite3_value_double(value);
+      if( d>=-9223372036854775808.0 && d<9223372036854775808.0 && (double)(i64)d==d ){
+        bits = (uint64_t)(i64)d;
+        seed = SQLITE_INTEGER;
+      }else{
+        bits = fp_double_to_uint64(d);
+        seed = SQLITE_FLOAT;
+      }
+      break;
+    }
+    case SQLITE_INTEGER:
+      bits = (uint64_t)sqlite3_value_int64(value);
+      seed = SQLITE_INTEGER;
+      break;
+    case SQLITE_TEXT:
+      return hll_hash(sqlite3_value_text(value), (size_t)sqlite3_value_bytes(value), SQLITE_TEXT);
+    default:
+      return hll_hash(sqlite3_value_blob(value), (size_t)sqlite3_value_bytes(value), SQLITE_BLOB);
+  }
+
+  for(i=0; i<8; i++){
+    bytes[i] = (uint8_t)(bits >> (8*i));
+  }
+  return hll_hash(bytes, 8, (uint64_t)seed);
+}
+
+/*
+** called for each value received during a calculation of approx_count_distinct(x [, precision])
+** or approx_count_distinct_state(x [, precision])
+*/
+static void approxCountDistinctStep(sqlite3_context *context, int argc, sqlite3_value **argv){
+  HllCtx *p;
+
+  p = sqlite3_aggregate_context(context, sizeof(*p));
+  if( p==0 ){
+    sqlite3_result_error_nomem(context);
+    return;
+  }
+
+  if( 0==p->init ){
+    i64 precision = argc>1 ? sqlite3_value_int64(argv[1]) : HLL_DEFAULT_PRECISION;
+    if( precision<HLL_MIN_PRECISION || precision>HLL_MAX_PRECISION ){
+      sqlite3_result_error(context, "approx_count_distinct: precision must be between 4 and 18", -1);
+      return;
+    }
+    if( hll_init(&p->hll, (int)precision)!=SQLITE_OK ){
+      sqlite3_result_error_nomem(context);
+      return;
+    }
+    p->init = 1;
+  }
+
+  if( sqlite3_value_type(argv[0])!=SQLITE_NULL ){
+    hll_add(&p->hll, hllValueHash(argv[0]));
+  }
+}
+
+/*
+** called for each state received during a calculation of approx_count_distinct_merge(state)
+*/
+static void approxCountDistinctMergeStep(sqlite3_context *context, int argc, sqlite3_value **argv){
+  HllCtx *p;
+  binstream_t stream;
+  int rc;
+
+  if( sqlite3_value_type(argv[0])==SQLITE_NULL )
+    return;
+
+  p = sqlite3_aggregate_context(context, sizeof(*p));
+  if( p==0 ){
+    sqlite3_result_error_nomem(context);
+    return;
+  }
+
+  binstream_init(&stream, (uint8_t *)sqlite3_value_blob(argv[0]), (size_t)sqlite3_value_bytes(argv[0]));
+  rc = hll_read(&p->hll, &stream, 0==p->init);
+  if( rc==SQLITE_NOMEM ){
+    sqlite3_result_error_nomem(context);
+    return;
+  }
+  if( rc!=SQLITE_OK ){
+    sqlite3_result_error(context, "approx_count_distinct_merge: invalid sketch", -1);
+    return;
+  }
+  p->init = 1;
+}
+
+/*
+** Returns the estimated number of distinct values
+*/
+static void approxCountDistinctFinalize(sqlite3_context *context){
+  HllCtx *p;
+
+  p = (HllCtx*) sqlite3_aggregate_context(context, 0);
+  if( p && p->init ){
+    sqlite3_result_int64(context, (i64)floor(hll_estimate(&p->hll) + 0.5));
+    hll_destroy(&p->hll);
+  }else{
+    sqlite3_result_int64(context, 0);
+  }
+}
+
+/*
+** Returns the serialized sketch, which can be combined with approx_count_distinct_merge
+*/
+static void approxCountDistinctStateFinalize(sqlite3_context *context){
+  HllCtx *p;
+  binstream_t stream;
+
+  p = (HllCtx*) sqlite3_aggregate_context(context, 0);
+  if( p && p->init ){
+    if( binstream_init_growable(&stream, 64)!=SQLITE_OK ){
+      sqlite3_result_error_nomem(context);
+    }else{
+      if( hll_write(&p->hll, &stream)==SQLITE_OK ){
+        binstream_flip(&stream);
+        sqlite3_result_blob(context, binstream_data(&stream), (int)binstream_available(&stream), SQLITE_TRANSIENT);
+      }else{
+        sqlite3_result_error_nomem(context);
+      }
+      binstream_destroy(&stream, 1);
+    }
+    hll_destroy(&p->hll);
+  }
+}
+
+/*
+** Returns the estimated number of distinct values of a serialized sketch
+*/
+static void approxCountDistinctEstimateFunc(sqlite3_context *context, int argc, sqlite3_value **argv){
+  hll_t hll;
+  binstream_t stream;
+  int rc;
+
+  if( sqlite3_value_type(argv[0])==SQLITE_NULL )
+    return;
+
+  binstream_init(&stream, (uint8_t *)sqlite3_value_blob(argv[0]), (size_t)sqlite3_value_bytes(argv[0]));
+  rc = hll_read(&hll, &stream, 1);
+  if( rc==SQLITE_NOMEM ){
+    sqlite3_result_error_nomem(context);
+  }else if( rc!=SQLITE_OK ){
+    sqlite3_result_error(context, "approx_count_distinct_estimate: invalid sketch", -1);
+  }else{
+    sqlite3_result_int64(context, (i64)floor(hll_estimate(&hll) + 0.5));
+    hll_destroy(&hll);
+  }
+}
+
+/*
+** Returns the stdev value
+*/
+static void stdevFinalize(sqlite3_context *context){
+  StdevCtx *p;
+  p = sqlite3_aggregate_context(context, 0);
+  if( p && p->cnt>1 ){
+    sqlite3_result_double(context, sqrt(p->rS/(p->cnt-1)));
+  }else{
+    sqlite3_result_double(context, 0.0);
+  }
+}
+
+/*
+** Returns the variance value
+*/
+static void varianceFinalize(sqlite3_context *context){
+  StdevCtx *p;
+  p = sqlite3_aggregate_context(context, 0);
+  if( p && p->cnt>1 ){
+    sqlite3_result_double(context, p->rS/(p->cnt-1));
+  }else{
+    sqlite3_result_double(context, 0.0);
+  }
+}
+
+#ifdef SQLITE_SOUNDEX
+
+/* relicoder factored code */
+/*
+** Calculates the soundex value of a string
 */
 
 static void soundex(const u8 *zIn, char *zResult){
@@ -1576,458 +2437,2655 @@ ST_MIN_MAX(MaxZ, has_env_z, max_z)
 ST_MIN_MAX(MinM, has_env_m, min_m)
 ST_MIN_MAX(MaxM, has_env_m, max_m)
 
-static void ST_SRID(sqlite3_context *context, int nbArgs, sqlite3_value **args) {
+/*
+** ST_Extent(geom) is an aggregate returning the bounding rectangle of all geometries as a polygon with the SRID of
+** the first geometry. The envelope is taken from the blob header when present; otherwise the geometry is decoded
+** once to compute it.
+*/
+typedef struct {
+	geom_envelope_t envelope;
+	int32_t srid;
+	int init;
+} extent_ctx_t;
+
+static void ST_Extent_step(sqlite3_context *context, int nbArgs, sqlite3_value **args) {
 	spatialdb_t *spatialdb;
+	extent_ctx_t *extent;
 	FUNCTION_GEOM_ARG(geomblob);
 
 	FUNCTION_START_STATIC(context, 256);
 	spatialdb = (spatialdb_t *)sqlite3_user_data(context);
-	FUNCTION_GET_GEOM_ARG_UNSAFE(context, spatialdb, geomblob, 0);
 
-	if (nbArgs == 1) {
-		sqlite3_result_int(context, geomblob.srid);
+	extent = (extent_ctx_t *)sqlite3_aggregate_context(context, sizeof(extent_ctx_t));
+	if (extent == NULL) {
+		FUNCTION_RESULT = SQLITE_NOMEM;
+		goto exit;
 	}
-	else {
-		FUNCTION_GET_INT_ARG(geomblob.srid, 1);
-		if (binstream_seek(&FUNCTION_GEOM_ARG_STREAM(geomblob), 0) != SQLITE_OK) {
-			sqlite3_result_error(context, "Error writing geometry blob header", -1);
-			goto exit;
-		}
-		if (spatialdb->write_blob_header(&FUNCTION_GEOM_ARG_STREAM(geomblob), &geomblob,0, FUNCTION_ERROR) != SQLITE_OK) {
-			if (error_count(FUNCTION_ERROR) == 0) {
-				error_append(FUNCTION_ERROR, "Error writing geometry blob header");
-			}
+
+	FUNCTION_GET_GEOM_ARG_UNSAFE(context, spatialdb, geomblob, 0);
+
+	if (geomblob.envelope.has_env_x == 0 || geomblob.envelope.has_env_y == 0) {
+		if (spatialdb->fill_envelope(&FUNCTION_GEOM_ARG_STREAM(geomblob), &geomblob.envelope, FUNCTION_ERROR) != SQLITE_OK) {
+			if (error_count(FUNCTION_ERROR) == 0) error_append(FUNCTION_ERROR, "Invalid geometry blob header");
 			goto exit;
 		}
-		binstream_seek(&FUNCTION_GEOM_ARG_STREAM(geomblob), 0);
-		sqlite3_result_blob(context, binstream_data(&FUNCTION_GEOM_ARG_STREAM(geomblob)), (int)binstream_available(&FUNCTION_GEOM_ARG_STREAM(geomblob)), SQLITE_TRANSIENT);
+	}
+
+	if (geomblob.empty || geomblob.envelope.has_env_x == 0 || geomblob.envelope.has_env_y == 0) {
+		goto exit;
+	}
+
+	if (!extent->init) {
+		extent->envelope = geomblob.envelope;
+		extent->srid = geomblob.srid;
+		extent->init = 1;
+	}
+	else {
+		if (geomblob.envelope.min_x < extent->envelope.min_x) extent->envelope.min_x = geomblob.envelope.min_x;
+		if (geomblob.envelope.min_y < extent->envelope.min_y) extent->envelope.min_y = geomblob.envelope.min_y;
+		if (geomblob.envelope.max_x > extent->envelope.max_x) extent->envelope.max_x = geomblob.envelope.max_x;
+		if (geomblob.envelope.max_y > extent->envelope.max_y) extent->envelope.max_y = geomblob.envelope.max_y;
 	}
 
 	FUNCTION_END(context);
 	FUNCTION_FREE_GEOM_ARG(geomblob);
 }
 
-static void ST_IsEmpty(sqlite3_context *context, int nbArgs, sqlite3_value **args) {
+/*
+** Writes the rectangle {min_x, min_y, max_x, max_y} as a polygon in the blob format of the database.
+*/
+static int envelope_polygon(sqlite3_context *context, const spatialdb_t *spatialdb, int32_t srid, const double *bounds, errorstream_t *error) {
+	geom_blob_writer_t writer;
+	geom_consumer_t *consumer;
+	geom_header_t polygon;
+	geom_header_t ring;
+	double coords[10];
+	int result;
+
+	coords[0] = bounds[0]; coords[1] = bounds[1];
+	coords[2] = bounds[2]; coords[3] = bounds[1];
+	coords[4] = bounds[2]; coords[5] = bounds[3];
+	coords[6] = bounds[0]; coords[7] = bounds[3];
+	coords[8] = bounds[0]; coords[9] = bounds[1];
+
+	polygon.geom_type = GEOM_POLYGON;
+	polygon.coord_type = GEOM_XY;
+	polygon.coord_size = 2;
+	ring = polygon;
+	ring.geom_type = GEOM_LINEARRING;
+
+	result = spatialdb->writer_init_srid(&writer, srid);
+	if (result != SQLITE_OK) {
+		return result;
+	}
+	consumer = geom_blob_writer_geom_consumer(&writer);
+
+	result = consumer->begin(consumer, error);
+	if (result == SQLITE_OK) {
+		result = consumer->begin_geometry(consumer, &polygon, error);
+	}
+	if (result == SQLITE_OK) {
+		result = consumer->begin_geometry(consumer, &ring, error);
+	}
+	if (result == SQLITE_OK) {
+		result = consumer->coordinates(consumer, &ring, 5, coords, 0, error);
+	}
+	if (result == SQLITE_OK) {
+		result = consumer->end_geometry(consumer, &ring, error);
+	}
+	if (result == SQLITE_OK) {
+		result = consumer->end_geometry(consumer, &polygon, error);
+	}
+	if (result == SQLITE_OK) {
+		result = consumer->end(consumer, error);
+	}
+	if (result == SQLITE_OK) {
+		sqlite3_result_blob(context, geom_blob_writer_getdata(&writer), (int)geom_blob_writer_length(&writer), SQLITE_TRANSIENT);
+	}
+
+	spatialdb->writer_destroy(&writer, 1);
+	return result;
+}
+
+static void ST_Extent_final(sqlite3_context *context) {
 	spatialdb_t *spatialdb;
-	FUNCTION_GEOM_ARG(geomblob);
+	extent_ctx_t *extent;
+	double bounds[4];
 
 	FUNCTION_START_STATIC(context, 256);
 	spatialdb = (spatialdb_t *)sqlite3_user_data(context);
-	FUNCTION_GET_GEOM_ARG_UNSAFE(context, spatialdb, geomblob, 0);
 
-	sqlite3_result_int(context, geomblob.empty);
+	extent = (extent_ctx_t *)sqlite3_aggregate_context(context, 0);
+	if (extent == NULL || !extent->init) {
+		sqlite3_result_null(context);
+		goto exit;
+	}
+
+	bounds[0] = extent->envelope.min_x;
+	bounds[1] = extent->envelope.min_y;
+	bounds[2] = extent->envelope.max_x;
+	bounds[3] = extent->envelope.max_y;
+	FUNCTION_RESULT = envelope_polygon(context, spatialdb, extent->srid, bounds, FUNCTION_ERROR);
 
 	FUNCTION_END(context);
+}
 
-	FUNCTION_FREE_GEOM_ARG(geomblob);
+typedef struct {
+	uint8_t *data;
+	int length;
+} extent_row_t;
+
+static int read_extent_blob(sqlite3 *db, sqlite3_stmt *stmt, void *data) {
+	extent_row_t *row = (extent_row_t *)data;
+	if (sqlite3_column_type(stmt, 0) == SQLITE_BLOB) {
+		row->length = sqlite3_column_bytes(stmt, 0);
+		row->data = (uint8_t *)sqlite3_malloc(row->length);
+		if (row->data == NULL) {
+			return SQLITE_NOMEM;
+		}
+		memcpy(row->data, sqlite3_column_blob(stmt, 0), (size_t)row->length);
+	}
+	return SQLITE_ABORT;
 }
 
-static void ST_IsMeasured(sqlite3_context *context, int nbArgs, sqlite3_value **args) {
+/*
+** GPKG_Extent([db,] table, column) returns the extent of a layer. When the column has a spatial index the extent is
+** read from the root node of the rtree, which is constant time but may be slightly larger than the exact extent
+** because the rtree stores single precision coordinates, and takes the SRID registered for the column in
+** gpkg_geometry_columns. Otherwise, or while an incremental build of the index is still in progress, it falls back to
+** ST_Extent over the table.
+*/
+static void GPKG_Extent(sqlite3_context *context, int nbArgs, sqlite3_value **args) {
 	spatialdb_t *spatialdb;
-	FUNCTION_WKB_ARG(wkb);
-
-	FUNCTION_START_STATIC(context, 256);
+	FUNCTION_TEXT_ARG(db_name);
+	FUNCTION_TEXT_ARG(table_name);
+	FUNCTION_TEXT_ARG(column_name);
+	extent_row_t row;
+	double bounds[4];
+	int32_t srid = 0;
+	int registered = 0;
+	int exists = 0;
+	int empty = 1;
+	int base = (nbArgs == 3) ? 1 : 0;
+
+	memset(&row, 0, sizeof(extent_row_t));
+	FUNCTION_START(context);
 	spatialdb = (spatialdb_t *)sqlite3_user_data(context);
-	FUNCTION_GET_WKB_ARG_UNSAFE(context, spatialdb, wkb, 0);
 
-	sqlite3_result_int(context, wkb.coord_type == GEOM_XYM || wkb.coord_type == GEOM_XYZM);
+	if (base) {
+		FUNCTION_GET_TEXT_ARG(context, db_name, 0);
+	}
+	else {
+		FUNCTION_SET_TEXT_ARG(db_name, "main");
+	}
+	FUNCTION_GET_TEXT_ARG(context, table_name, base);
+	FUNCTION_GET_TEXT_ARG(context, column_name, base + 1);
+
+	FUNCTION_RESULT = spatial_index_extent(FUNCTION_DB_HANDLE, db_name, table_name, column_name, bounds, &exists, &empty, FUNCTION_ERROR);
+	if (FUNCTION_RESULT != SQLITE_OK) {
+		goto exit;
+	}
+
+	if (exists) {
+		if (empty) {
+			sqlite3_result_null(context);
+			goto exit;
+		}
+		FUNCTION_RESULT = spatial_index_srid(FUNCTION_DB_HANDLE, db_name, table_name, column_name, &srid, &registered, FUNCTION_ERROR);
+		if (FUNCTION_RESULT != SQLITE_OK) {
+			goto exit;
+		}
+		if (!registered) {
+			error_append(FUNCTION_ERROR, "Column %s.%s.%s is not registered in gpkg_geometry_columns", db_name, table_name, column_name);
+			goto exit;
+		}
+		FUNCTION_RESULT = envelope_polygon(context, spatialdb, srid, bounds, FUNCTION_ERROR);
+		goto exit;
+	}
+
+	FUNCTION_RESULT = sql_exec_stmt(
+		FUNCTION_DB_HANDLE, read_extent_blob, NULL, &row,
+		"SELECT ST_Extent(\"%w\") FROM \"%w\".\"%w\"",
+		column_name, db_name, table_name
+	);
+	if (FUNCTION_RESULT != SQLITE_OK) {
+		error_append(FUNCTION_ERROR, "Could not compute extent of %s.%s.%s: %s", db_name, table_name, column_name, sqlite3_errmsg(FUNCTION_DB_HANDLE));
+		goto exit;
+	}
+	if (row.data != NULL) {
+		sqlite3_result_blob(context, row.data, row.length, SQLITE_TRANSIENT);
+	}
+	else {
+		sqlite3_result_null(context);
+	}
 
 	FUNCTION_END(context);
-	FUNCTION_FREE_WKB_ARG(wkb);
+	sqlite3_free(row.data);
+	FUNCTION_FREE_TEXT_ARG(db_name);
+	FUNCTION_FREE_TEXT_ARG(table_name);
+	FUNCTION_FREE_TEXT_ARG(column_name);
 }
 
-static void ST_Is3d(sqlite3_context *context, int nbArgs, sqlite3_value **args) {
-	spatialdb_t *spatialdb;
-	FUNCTION_WKB_ARG(wkb);
+/*
+** ST_Collect(geom) is an aggregate combining all geometries into one collection with the SRID of the first geometry.
+** Each geometry is streamed into a single growable blob writer as it arrives, so the cost is linear in the total
+** size of the input. The collection header is written last: a MultiPoint, MultiLineString or MultiPolygon when all
+** members are points, line strings or polygons respectively and a GeometryCollection otherwise. The envelope is
+** accumulated by the writer while the coordinates are streamed.
+*/
+typedef struct {
+	geom_consumer_t consumer;
+	geom_blob_writer_t writer;
+	geom_header_t collection;
+	geom_type_t member_type;
+	int homogeneous;
+	int depth;
+	int started;
+	int init;
+} collect_ctx_t;
+
+static int collect_begin_geometry(const geom_consumer_t *consumer, const geom_header_t *header, errorstream_t *error) {
+	collect_ctx_t *collect = (collect_ctx_t *)consumer;
+	geom_consumer_t *target = geom_blob_writer_geom_consumer(&collect->writer);
+	int result;
 
-	FUNCTION_START_STATIC(context, 256);
-	spatialdb = (spatialdb_t *)sqlite3_user_data(context);
-	FUNCTION_GET_WKB_ARG_UNSAFE(context, spatialdb, wkb, 0);
+	if (collect->depth == 0) {
+		if (!collect->started) {
+			// The coordinate type of the collection is only known once the first member has been seen
+			collect->collection.geom_type = GEOM_GEOMETRYCOLLECTION;
+			collect->collection.coord_type = header->coord_type;
+			collect->collection.coord_size = header->coord_size;
+			collect->member_type = header->geom_type;
+			collect->homogeneous = 1;
+
+			result = target->begin(target, error);
+			if (result == SQLITE_OK) {
+				result = target->begin_geometry(target, &collect->collection, error);
+			}
+			if (result != SQLITE_OK) {
+				return result;
+			}
+			collect->started = 1;
+		}
+		else if (header->coord_type != collect->collection.coord_type) {
+			if (error) {
+				error_append(error, "ST_Collect: all geometries must have the same coordinate dimension");
+			}
+			return SQLITE_ERROR;
+		}
+		else if (header->geom_type != collect->member_type) {
+			collect->homogeneous = 0;
+		}
+	}
 
-	sqlite3_result_int(context, wkb.coord_type == GEOM_XYZ || wkb.coord_type == GEOM_XYZM);
+	collect->depth++;
+	return target->begin_geometry(target, header, error);
+}
 
-	FUNCTION_END(context);
-	FUNCTION_FREE_WKB_ARG(wkb);
+static int collect_end_geometry(const geom_consumer_t *consumer, const geom_header_t *header, errorstream_t *error) {
+	collect_ctx_t *collect = (collect_ctx_t *)consumer;
+	geom_consumer_t *target = geom_blob_writer_geom_consumer(&collect->writer);
+
+	collect->depth--;
+	return target->end_geometry(target, header, error);
 }
 
-static void ST_CoordDim(sqlite3_context *context, int nbArgs, sqlite3_value **args) {
+static int collect_coordinates(const geom_consumer_t *consumer, const geom_header_t *header, size_t point_count, const double *coords, int skip_coords, errorstream_t *error) {
+	collect_ctx_t *collect = (collect_ctx_t *)consumer;
+	geom_consumer_t *target = geom_blob_writer_geom_consumer(&collect->writer);
+	return target->coordinates(target, header, point_count, coords, skip_coords, error);
+}
+
+static int collect_data(const geom_consumer_t *consumer, const geom_header_t *header, size_t data_count, const char *data, errorstream_t *error) {
+	collect_ctx_t *collect = (collect_ctx_t *)consumer;
+	geom_consumer_t *target = geom_blob_writer_geom_consumer(&collect->writer);
+	return target->data(target, header, data_count, data, error);
+}
+
+static void ST_Collect_step(sqlite3_context *context, int nbArgs, sqlite3_value **args) {
 	spatialdb_t *spatialdb;
-	FUNCTION_WKB_ARG(wkb);
+	collect_ctx_t *collect;
+	FUNCTION_GEOM_ARG(geomblob);
 
 	FUNCTION_START_STATIC(context, 256);
 	spatialdb = (spatialdb_t *)sqlite3_user_data(context);
-	FUNCTION_GET_WKB_ARG_UNSAFE(context, spatialdb, wkb, 0);
 
-	sqlite3_result_int(context, geom_coord_dim(wkb.coord_type));
+	collect = (collect_ctx_t *)sqlite3_aggregate_context(context, sizeof(collect_ctx_t));
+	if (collect == NULL) {
+		FUNCTION_RESULT = SQLITE_NOMEM;
+		goto exit;
+	}
 
-	FUNCTION_END(context);
+	FUNCTION_GET_GEOM_ARG_UNSAFE(context, spatialdb, geomblob, 0);
 
-	FUNCTION_FREE_WKB_ARG(wkb);
+	if (!collect->init) {
+		FUNCTION_RESULT = spatialdb->writer_init_srid(&collect->writer, geomblob.srid);
+		if (FUNCTION_RESULT != SQLITE_OK) {
+			goto exit;
+		}
+		// The members are passed on one level down; only the begin and end of the root are kept for finalization
+		geom_consumer_init(&collect->consumer, NULL, NULL, collect_begin_geometry, collect_end_geometry, collect_coordinates, collect_data);
+		collect->init = 1;
+	}
+
+	FUNCTION_RESULT = spatialdb->read_geometry(&FUNCTION_GEOM_ARG_STREAM(geomblob), &collect->consumer, FUNCTION_ERROR);
+
+	FUNCTION_END(context);
+	FUNCTION_FREE_GEOM_ARG(geomblob);
 }
 
-static void ST_GeometryType(sqlite3_context *context, int nbArgs, sqlite3_value **args) {
+static void ST_Collect_final(sqlite3_context *context) {
 	spatialdb_t *spatialdb;
-	FUNCTION_WKB_ARG(wkb);
+	collect_ctx_t *collect = NULL;
+	geom_consumer_t *target;
 
 	FUNCTION_START_STATIC(context, 256);
 	spatialdb = (spatialdb_t *)sqlite3_user_data(context);
-	FUNCTION_GET_WKB_ARG_UNSAFE(context, spatialdb, wkb, 0);
 
-	const char *type_name;
-	if (geom_type_name(wkb.geom_type, &type_name) == SQLITE_OK) {
-		sqlite3_result_text(context, type_name, -1, SQLITE_STATIC);
+	collect = (collect_ctx_t *)sqlite3_aggregate_context(context, 0);
+	if (collect == NULL || !collect->init || !collect->started || collect->depth != 0) {
+		sqlite3_result_null(context);
+		goto exit;
 	}
-	else {
-		error_append(FUNCTION_ERROR, "Unknown geometry type: %d", wkb.geom_type);
+
+	if (collect->homogeneous) {
+		switch (collect->member_type) {
+			case GEOM_POINT:
+				collect->collection.geom_type = GEOM_MULTIPOINT;
+				break;
+			case GEOM_LINESTRING:
+				collect->collection.geom_type = GEOM_MULTILINESTRING;
+				break;
+			case GEOM_POLYGON:
+				collect->collection.geom_type = GEOM_MULTIPOLYGON;
+				break;
+			default:
+				break;
+		}
 	}
 
-	FUNCTION_END(context);
+	target = geom_blob_writer_geom_consumer(&collect->writer);
+	FUNCTION_RESULT = target->end_geometry(target, &collect->collection, FUNCTION_ERROR);
+	if (FUNCTION_RESULT == SQLITE_OK) {
+		FUNCTION_RESULT = target->end(target, FUNCTION_ERROR);
+	}
+	if (FUNCTION_RESULT == SQLITE_OK) {
+		sqlite3_result_blob(context, geom_blob_writer_getdata(&collect->writer), (int)geom_blob_writer_length(&collect->writer), SQLITE_TRANSIENT);
+	}
 
-	FUNCTION_FREE_WKB_ARG(wkb);
+	FUNCTION_END(context);
+	if (collect != NULL && collect->init) {
+		spatialdb->writer_destroy(&collect->writer, 1);
+	}
 }
 
-typedef struct {
-	uint8_t *data;
-	int length;
-} geom_blob_auxdata;
+/*
+** Arcs are linearized to this fraction of the envelope size before predicates and geodesic measures, which work on
+** straight segments.
+*/
+#define ARC_TOLERANCE 1e-6
 
-static geom_blob_auxdata *geom_blob_auxdata_malloc() {
-	return (geom_blob_auxdata *)sqlite3_malloc(sizeof(geom_blob_auxdata));
+/*
+** Convex hulls only need the outline of an arc, so they linearize it to a coarser fraction of the envelope size.
+*/
+#define HULL_ARC_TOLERANCE 1e-3
+
+/*
+** Reads a geometry through a linearizer into consumer, with arcs kept within fraction of the envelope size. Without an
+** envelope in blob, such as for GeoPackage points, the tolerance is fraction itself.
+*/
+static int read_linearized_fraction(const spatialdb_t *spatialdb, binstream_t *stream, const geom_blob_header_t *blob, double fraction, geom_linearize_t *linearize, geom_consumer_t *consumer, errorstream_t *error) {
+	double tolerance = 0.0;
+	if (blob->envelope.has_env_x && blob->envelope.has_env_y) {
+		double width = blob->envelope.max_x - blob->envelope.min_x;
+		double height = blob->envelope.max_y - blob->envelope.min_y;
+		tolerance = (width > height ? width : height) * fraction;
+	}
+	return spatialdb->read_geometry(stream, geom_linearize_consumer(linearize, consumer, tolerance > 0.0 ? tolerance : fraction), error);
 }
 
-static void geom_blob_auxdata_free(void *auxdata) {
-	if (auxdata != NULL) {
-		geom_blob_auxdata *geom = (geom_blob_auxdata *)auxdata;
-		sqlite3_free(geom->data);
-		geom->data = NULL;
-		sqlite3_free(geom);
+/*
+** Reads a geometry through a linearizer into consumer with arcs kept within ARC_TOLERANCE of the envelope size.
+*/
+static int read_linearized(const spatialdb_t *spatialdb, binstream_t *stream, const geom_blob_header_t *blob, geom_linearize_t *linearize, geom_consumer_t *consumer, errorstream_t *error) {
+	return read_linearized_fraction(spatialdb, stream, blob, ARC_TOLERANCE, linearize, consumer, error);
+}
+
+/*
+** Writes the hull computed by geom_hull_compute() as the result of a function.
+*/
+static int hull_blob(sqlite3_context *context, const spatialdb_t *spatialdb, int32_t srid, const geom_hull_t *hull, errorstream_t *error) {
+	geom_blob_writer_t writer;
+	int result;
+
+	result = spatialdb->writer_init_srid(&writer, srid);
+	if (result != SQLITE_OK) {
+		return result;
+	}
+	result = geom_hull_write(hull, geom_blob_writer_geom_consumer(&writer), error);
+	if (result == SQLITE_OK) {
+		sqlite3_result_blob(context, geom_blob_writer_getdata(&writer), (int)geom_blob_writer_length(&writer), SQLITE_TRANSIENT);
 	}
+	spatialdb->writer_destroy(&writer, 1);
+	return result;
 }
 
-static void ST_AsBinary(sqlite3_context *context, int nbArgs, sqlite3_value **args) {
+/*
+** ST_ConvexHull(geom) returns the convex hull of a geometry: a polygon, or a line string or point when all of its
+** points are collinear or equal. Arcs are linearized first, to HULL_ARC_TOLERANCE of the envelope size.
+*/
+static void ST_ConvexHull(sqlite3_context *context, int nbArgs, sqlite3_value **args) {
 	spatialdb_t *spatialdb;
+	geom_hull_t hull;
+	geom_linearize_t linearize;
 	FUNCTION_GEOM_ARG(geomblob);
 
+	geom_hull_init(&hull);
+	geom_linearize_init(&linearize);
+
 	FUNCTION_START_STATIC(context, 256);
 	spatialdb = (spatialdb_t *)sqlite3_user_data(context);
 	FUNCTION_GET_GEOM_ARG_UNSAFE(context, spatialdb, geomblob, 0);
 
-	wkb_writer_t writer;
-	wkb_writer_init(&writer, WKB_ISO);
-
-	FUNCTION_RESULT = spatialdb->read_geometry(&FUNCTION_GEOM_ARG_STREAM(geomblob), wkb_writer_geom_consumer(&writer), FUNCTION_ERROR);
-
+	FUNCTION_RESULT = read_linearized_fraction(spatialdb, &FUNCTION_GEOM_ARG_STREAM(geomblob), &geomblob, HULL_ARC_TOLERANCE, &linearize, geom_hull_consumer(&hull), FUNCTION_ERROR);
 	if (FUNCTION_RESULT == SQLITE_OK) {
-		sqlite3_result_blob(context, wkb_writer_getwkb(&writer), (int)wkb_writer_length(&writer), sqlite3_free);
-		wkb_writer_destroy(&writer, 0);
+		FUNCTION_RESULT = geom_hull_compute(&hull);
 	}
-	else {
-		wkb_writer_destroy(&writer, 1);
+	if (FUNCTION_RESULT == SQLITE_OK) {
+		FUNCTION_RESULT = hull_blob(context, spatialdb, geomblob.srid, &hull, FUNCTION_ERROR);
 	}
 
 	FUNCTION_END(context);
-
 	FUNCTION_FREE_GEOM_ARG(geomblob);
+	geom_hull_destroy(&hull);
+	geom_linearize_destroy(&linearize);
 }
 
-static void ST_AsText(sqlite3_context *context, int nbArgs, sqlite3_value **args) {
+/*
+** ST_ConvexHullAgg(geom) is an aggregate returning the convex hull of all geometries, which must share one SRID.
+** Points strictly inside the octagon of the extreme points seen so far are discarded as they arrive and the
+** candidates are periodically reduced to their hull, so memory depends on the size of the hull, not on the number of
+** points.
+*/
+typedef struct {
+	geom_hull_t hull;
+	geom_linearize_t linearize;
+	int32_t srid;
+	int init;
+} hull_ctx_t;
+
+static void ST_ConvexHullAgg_step(sqlite3_context *context, int nbArgs, sqlite3_value **args) {
 	spatialdb_t *spatialdb;
+	hull_ctx_t *ctx;
 	FUNCTION_GEOM_ARG(geomblob);
 
 	FUNCTION_START_STATIC(context, 256);
 	spatialdb = (spatialdb_t *)sqlite3_user_data(context);
-	FUNCTION_GET_GEOM_ARG_UNSAFE(context, spatialdb, geomblob, 0);
 
-	wkt_writer_t writer;
-	wkt_writer_init(&writer);
+	ctx = (hull_ctx_t *)sqlite3_aggregate_context(context, sizeof(hull_ctx_t));
+	if (ctx == NULL) {
+		FUNCTION_RESULT = SQLITE_NOMEM;
+		goto exit;
+	}
 
-	FUNCTION_RESULT = spatialdb->read_geometry(&FUNCTION_GEOM_ARG_STREAM(geomblob), wkt_writer_geom_consumer(&writer), FUNCTION_ERROR);
+	FUNCTION_GET_GEOM_ARG_UNSAFE(context, spatialdb, geomblob, 0);
 
-	if (FUNCTION_RESULT == SQLITE_OK) {
-		sqlite3_result_text(context, wkt_writer_getwkt(&writer), (int)wkt_writer_length(&writer), SQLITE_TRANSIENT);
+	if (!ctx->init) {
+		geom_hull_init(&ctx->hull);
+		geom_linearize_init(&ctx->linearize);
+		ctx->srid = geomblob.srid;
+		ctx->init = 1;
+	}
+	else if (geomblob.srid != ctx->srid) {
+		error_append(FUNCTION_ERROR, "Geometries have different SRIDs: %d and %d", ctx->srid, geomblob.srid);
+		goto exit;
 	}
-	wkt_writer_destroy(&writer);
 
-	FUNCTION_END(context);
+	FUNCTION_RESULT = read_linearized_fraction(spatialdb, &FUNCTION_GEOM_ARG_STREAM(geomblob), &geomblob, HULL_ARC_TOLERANCE, &ctx->linearize, geom_hull_consumer(&ctx->hull), FUNCTION_ERROR);
 
+	FUNCTION_END(context);
 	FUNCTION_FREE_GEOM_ARG(geomblob);
 }
 
-static int geometry_is_assignable(geom_type_t expected, geom_type_t actual, errorstream_t* error) {
-	if (!geom_is_assignable(expected, actual)) {
-		const char* expectedName = NULL;
-		const char* actualName = NULL;
-		if (geom_type_name(expected, &expectedName) == SQLITE_OK && geom_type_name(actual, &actualName) == SQLITE_OK) {
-			error_append(error, "Incorrect geometry type. Expected '%d' actual '%s'", expectedName, actualName);
-		}
-		else {
-			error_append(error, "Incorrect geometry type");
-		}
-		return SQLITE_ERROR;
+static void ST_ConvexHullAgg_final(sqlite3_context *context) {
+	spatialdb_t *spatialdb;
+	hull_ctx_t *ctx = NULL;
+
+	FUNCTION_START_STATIC(context, 256);
+	spatialdb = (spatialdb_t *)sqlite3_user_data(context);
+
+	ctx = (hull_ctx_t *)sqlite3_aggregate_context(context, 0);
+	if (ctx == NULL || !ctx->init) {
+		sqlite3_result_null(context);
+		goto exit;
 	}
-	else {
-		return SQLITE_OK;
+
+	FUNCTION_RESULT = geom_hull_compute(&ctx->hull);
+	if (FUNCTION_RESULT == SQLITE_OK) {
+		FUNCTION_RESULT = hull_blob(context, spatialdb, ctx->srid, &ctx->hull, FUNCTION_ERROR);
+	}
+
+	FUNCTION_END(context);
+	if (ctx != NULL && ctx->init) {
+		geom_hull_destroy(&ctx->hull);
+		geom_linearize_destroy(&ctx->linearize);
 	}
 }
 
-typedef int(*geometry_constructor_func)(sqlite3_context *context, void *user_data, geom_consumer_t *consumer, int nbArgs, sqlite3_value **args, errorstream_t *error);
+/*
+** ST_MortonKey(geom, xmin, ymin, xmax, ymax) and ST_HilbertKey(geom, xmin, ymin, xmax, ymax) return the curve key
+** of the envelope center of geom on a 2^31 x 2^31 grid spanning the given extent. Only the blob header is read
+** when it carries an envelope.
+*/
+static void spatial_key(sqlite3_context *context, int nbArgs, sqlite3_value **args, sfc_curve_t curve) {
+	spatialdb_t *spatialdb;
+	sfc_extent_t extent;
+	FUNCTION_GEOM_ARG(geomblob);
 
-static void geometry_constructor(sqlite3_context *context, const spatialdb_t *spatialdb, geometry_constructor_func constructor, void* user_data, geom_type_t requiredType, int nbArgs, sqlite3_value **args) {
 	FUNCTION_START_STATIC(context, 256);
+	spatialdb = (spatialdb_t *)sqlite3_user_data(context);
+	FUNCTION_GET_GEOM_ARG_UNSAFE(context, spatialdb, geomblob, 0);
 
-	geom_blob_auxdata *geom = (geom_blob_auxdata *)sqlite3_get_auxdata(context, 0);
-
-	if (geom == NULL) {
-		geom_blob_writer_t writer;
-
-		if (sqlite3_value_type(args[nbArgs - 1]) == SQLITE_INTEGER) {
-			spatialdb->writer_init_srid(&writer, sqlite3_value_int(args[nbArgs - 1]));
-			nbArgs -= 1;
-		}
-		else {
-			spatialdb->writer_init(&writer);
-		}
-
-		FUNCTION_RESULT = constructor(context, user_data, geom_blob_writer_geom_consumer(&writer), nbArgs, args, FUNCTION_ERROR);
-
-		if (FUNCTION_RESULT == SQLITE_OK) {
-			if (geometry_is_assignable(requiredType, writer.geom_type, FUNCTION_ERROR) == SQLITE_OK) {
-				uint8_t *data = geom_blob_writer_getdata(&writer);
-				int length = (int)geom_blob_writer_length(&writer);
-				sqlite3_result_blob(context, data, length, SQLITE_TRANSIENT);
-				spatialdb->writer_destroy(&writer, 0);
-
-				geom = geom_blob_auxdata_malloc();
-				if (geom != NULL) {
-					geom->data = data;
-					geom->length = length;
-					sqlite3_set_auxdata(context, 0, geom, geom_blob_auxdata_free);
-				}
-			}
-		}
-		else {
-			spatialdb->writer_destroy(&writer, 1);
+	if (geomblob.envelope.has_env_x == 0 || geomblob.envelope.has_env_y == 0) {
+		if (spatialdb->fill_envelope(&FUNCTION_GEOM_ARG_STREAM(geomblob), &geomblob.envelope, FUNCTION_ERROR) != SQLITE_OK) {
+			if (error_count(FUNCTION_ERROR) == 0) error_append(FUNCTION_ERROR, "Invalid geometry blob header");
+			goto exit;
 		}
 	}
-	else {
-		sqlite3_result_blob(context, geom->data, geom->length, SQLITE_TRANSIENT);
+
+	if (geomblob.empty || geomblob.envelope.has_env_x == 0 || geomblob.envelope.has_env_y == 0) {
+		sqlite3_result_null(context);
+		goto exit;
 	}
 
+	extent.min_x = sqlite3_value_double(args[1]);
+	extent.min_y = sqlite3_value_double(args[2]);
+	extent.max_x = sqlite3_value_double(args[3]);
+	extent.max_y = sqlite3_value_double(args[4]);
+	sqlite3_result_int64(context, sfc_key(
+		curve, &extent,
+		(geomblob.envelope.min_x + geomblob.envelope.max_x) / 2.0,
+		(geomblob.envelope.min_y + geomblob.envelope.max_y) / 2.0
+	));
+
 	FUNCTION_END(context);
+	FUNCTION_FREE_GEOM_ARG(geomblob);
 }
 
-static int geom_from_wkb(sqlite3_context *context, void *user_data, geom_consumer_t* consumer, int nbArgs, sqlite3_value **args, errorstream_t *error) {
-	FUNCTION_STREAM_ARG(wkb);
-	FUNCTION_START_NESTED(context, error);
-	FUNCTION_GET_STREAM_ARG_UNSAFE(context, wkb, 0);
-
-	FUNCTION_RESULT = wkb_read_geometry(&wkb, WKB_ISO, consumer, FUNCTION_ERROR);
+static void ST_MortonKey(sqlite3_context *context, int nbArgs, sqlite3_value **args) {
+	spatial_key(context, nbArgs, args, SFC_MORTON);
+}
 
-	FUNCTION_END_NESTED(context);
-	FUNCTION_FREE_STREAM_ARG(wkb);
+static void ST_HilbertKey(sqlite3_context *context, int nbArgs, sqlite3_value **args) {
+	spatial_key(context, nbArgs, args, SFC_HILBERT);
+}
 
-	return FUNCTION_RESULT;
+/*
+** ST_SnapToGridKey(geom, cell) and ST_HexbinKey(geom, size) return an integer key of the square grid cell or the
+** hexagon containing the envelope center of geom, meant for GROUP BY. A key packs a signed column and row as
+** column * 2^32 + (row + 2^31), so column = key >> 32 and row = (key & 4294967295) - 2147483648. Grid cell (column,
+** row) spans [column * cell, (column + 1) * cell) along X and likewise along Y. Hexagons are pointy-top with
+** circumradius size in axial coordinates; the center of hexagon (column, row) is
+** (size * sqrt(3) * (column + row / 2), size * 1.5 * row).
+*/
+static sqlite3_int64 bin_pack(double column, double row) {
+	if (column < -2147483648.0) column = -2147483648.0;
+	if (column > 2147483647.0) column = 2147483647.0;
+	if (row < -2147483648.0) row = -2147483648.0;
+	if (row > 2147483647.0) row = 2147483647.0;
+	return (sqlite3_int64)column * 4294967296LL + ((sqlite3_int64)row + 2147483648LL);
 }
 
-static void ST_GeomFromWKB(sqlite3_context *context, int nbArgs, sqlite3_value **args) {
-	spatialdb_t *spatialdb = (spatialdb_t *)sqlite3_user_data(context);
-	geometry_constructor(context, spatialdb, geom_from_wkb, NULL, GEOM_GEOMETRY, nbArgs, args);
+static sqlite3_int64 hexbin_key(double x, double y, double size) {
+	double q = (sqrt(3.0) / 3.0 * x - y / 3.0) / size;
+	double r = (2.0 / 3.0 * y) / size;
+	double s = -q - r;
+	double rq = floor(q + 0.5);
+	double rr = floor(r + 0.5);
+	double rs = floor(s + 0.5);
+	double dq = fabs(rq - q);
+	double dr = fabs(rr - r);
+	double ds = fabs(rs - s);
+
+	// Rounding each cube coordinate may break q + r + s = 0; recompute the one with the largest rounding error
+	if (dq > dr && dq > ds) {
+		rq = -rr - rs;
+	}
+	else if (dr > ds) {
+		rr = -rq - rs;
+	}
+	return bin_pack(rq, rr);
 }
 
-typedef struct {
-	volatile long ref_count;
-	const spatialdb_t *spatialdb;
-	i18n_locale_t *locale;
-} fromtext_t;
+static void bin_key(sqlite3_context *context, int nbArgs, sqlite3_value **args, int hexagon) {
+	spatialdb_t *spatialdb;
+	double size, x, y;
+	FUNCTION_GEOM_ARG(geomblob);
 
-static fromtext_t *fromtext_init(const spatialdb_t *spatialdb) {
-	fromtext_t *ctx = (fromtext_t *)sqlite3_malloc(sizeof(fromtext_t));
+	FUNCTION_START_STATIC(context, 256);
+	spatialdb = (spatialdb_t *)sqlite3_user_data(context);
 
-	if (ctx == NULL) {
-		return NULL;
+	size = sqlite3_value_double(args[1]);
+	if (!(size > 0.0 && size < HUGE_VAL)) {
+		error_append(FUNCTION_ERROR, "%s: %s must be a positive number", hexagon ? "ST_HexbinKey" : "ST_SnapToGridKey", hexagon ? "size" : "cell");
+		goto exit;
 	}
 
-	i18n_locale_t *locale = i18n_locale_init("C");
-	if (locale == NULL) {
-		sqlite3_free(ctx);
-		return NULL;
+	FUNCTION_GET_GEOM_ARG_UNSAFE(context, spatialdb, geomblob, 0);
+
+	if (geomblob.envelope.has_env_x == 0 || geomblob.envelope.has_env_y == 0) {
+		if (spatialdb->fill_envelope(&FUNCTION_GEOM_ARG_STREAM(geomblob), &geomblob.envelope, FUNCTION_ERROR) != SQLITE_OK) {
+			if (error_count(FUNCTION_ERROR) == 0) error_append(FUNCTION_ERROR, "Invalid geometry blob header");
+			goto exit;
+		}
 	}
 
-	ctx->ref_count = 1;
-	ctx->locale = locale;
-	ctx->spatialdb = spatialdb;
-	return ctx;
-}
+	if (geomblob.empty || geomblob.envelope.has_env_x == 0 || geomblob.envelope.has_env_y == 0) {
+		sqlite3_result_null(context);
+		goto exit;
+	}
 
-static void fromtext_acquire(fromtext_t *fromtext) {
-	if (fromtext) {
-		atomic_inc_long(&fromtext->ref_count);
+	x = (geomblob.envelope.min_x + geomblob.envelope.max_x) / 2.0;
+	y = (geomblob.envelope.min_y + geomblob.envelope.max_y) / 2.0;
+	if (hexagon) {
+		sqlite3_result_int64(context, hexbin_key(x, y, size));
 	}
+	else {
+		sqlite3_result_int64(context, bin_pack(floor(x / size), floor(y / size)));
+	}
+
+	FUNCTION_END(context);
+	FUNCTION_FREE_GEOM_ARG(geomblob);
 }
 
-static void fromtext_release(fromtext_t *fromtext) {
-	if (fromtext) {
-		long newval = atomic_dec_long(&fromtext->ref_count);
-		if (newval == 0) {
-			i18n_locale_destroy(fromtext->locale);
-			fromtext->locale = NULL;
-			sqlite3_free(fromtext);
-		}
-	}
+static void ST_SnapToGridKey(sqlite3_context *context, int nbArgs, sqlite3_value **args) {
+	bin_key(context, nbArgs, args, 0);
 }
 
-static int geom_from_wkt(sqlite3_context *context, void *user_data, geom_consumer_t* consumer, int nbArgs, sqlite3_value **args, errorstream_t *error) {
-	FUNCTION_TEXT_ARG(wkt);
-	FUNCTION_START_NESTED(context, error);
+static void ST_HexbinKey(sqlite3_context *context, int nbArgs, sqlite3_value **args) {
+	bin_key(context, nbArgs, args, 1);
+}
 
-	FUNCTION_GET_TEXT_ARG_UNSAFE(wkt, 0);
+/*
+** Makes sure the envelope of a geometry blob is known, computing it from the geometry body when the header has none.
+** The stream is left positioned at the start of the geometry body.
+*/
+static int geom_blob_envelope(const spatialdb_t *spatialdb, binstream_t *stream, geom_blob_header_t *blob, errorstream_t *error) {
+	size_t body;
 
-	FUNCTION_RESULT = wkt_read_geometry(wkt, FUNCTION_TEXT_ARG_LENGTH(wkt), consumer, (i18n_locale_t *)user_data, FUNCTION_ERROR);
+	if (blob->envelope.has_env_x && blob->envelope.has_env_y) {
+		return SQLITE_OK;
+	}
 
-	FUNCTION_END_NESTED(context);
-	FUNCTION_FREE_TEXT_ARG(wkt);
+	body = binstream_position(stream);
+	if (spatialdb->fill_envelope(stream, &blob->envelope, error) != SQLITE_OK) {
+		if (error_count(error) == 0) error_append(error, "Invalid geometry blob header");
+		return SQLITE_IOERR;
+	}
+	return binstream_seek(stream, body);
+}
 
-	return FUNCTION_RESULT;
+static int geom_blob_is_empty(const geom_blob_header_t *blob) {
+	return blob->empty || blob->envelope.has_env_x == 0 || blob->envelope.has_env_y == 0;
 }
 
-static void ST_GeomFromText(sqlite3_context *context, int nbArgs, sqlite3_value **args) {
-	fromtext_t *fromtext = (fromtext_t *)sqlite3_user_data(context);
-	geometry_constructor(context, fromtext->spatialdb, geom_from_wkt, fromtext->locale, GEOM_GEOMETRY, nbArgs, args);
+/*
+** Reports an error when two geometries that are compared with each other have different SRIDs.
+*/
+static int geom_blob_check_srid(const geom_blob_header_t *a, const geom_blob_header_t *b, errorstream_t *error) {
+	if (a->srid != b->srid) {
+		error_append(error, "Geometries have different SRIDs: %d and %d", a->srid, b->srid);
+		return SQLITE_ERROR;
+	}
+	return SQLITE_OK;
 }
 
-static int point_from_coords(sqlite3_context *context, void *user_data, geom_consumer_t *consumer, int nbArgs, sqlite3_value **args, errorstream_t *error) {
-	int result = SQLITE_OK;
+/*
+** ST_EnvIntersects(a, b) and ST_EnvIntersects(a, xmin, ymin, xmax, ymax) determine if the envelope of a intersects
+** the envelope of b or the given box. Envelopes are read from the blob headers; only geometries without a header
+** envelope, such as GeoPackage points, are decoded.
+*/
+static void ST_EnvIntersects(sqlite3_context *context, int nbArgs, sqlite3_value **args) {
+	spatialdb_t *spatialdb;
+	double box[4];
+	int i;
+	FUNCTION_GEOM_ARG(geom_a);
+	FUNCTION_GEOM_ARG(geom_b);
 
-	if (nbArgs < 2 || nbArgs > 4) {
-		error_append(error, "Invalid number of coordinates: %d", nbArgs);
-		result = SQLITE_ERROR;
-	}
-	else {
-		double coord[4];
-		for (int i = 0; i < nbArgs; i++) {
-			coord[i] = sqlite3_value_double(args[i]);
-		}
+	FUNCTION_START_STATIC(context, 256);
+	spatialdb = (spatialdb_t *)sqlite3_user_data(context);
+	FUNCTION_GET_GEOM_ARG_UNSAFE(context, spatialdb, geom_a, 0);
 
-		geom_header_t header;
-		header.geom_type = GEOM_POINT;
-		if (nbArgs == 2) {
-			header.coord_type = GEOM_XY;
-			header.coord_size = 2;
+	if (nbArgs == 2) {
+		FUNCTION_GET_GEOM_ARG_UNSAFE(context, spatialdb, geom_b, 1);
+		FUNCTION_RESULT = geom_blob_envelope(spatialdb, &FUNCTION_GEOM_ARG_STREAM(geom_b), &geom_b, FUNCTION_ERROR);
+		if (FUNCTION_RESULT != SQLITE_OK) {
+			goto exit;
 		}
-		else if (nbArgs == 3) {
-			header.coord_type = GEOM_XYZ;
-			header.coord_size = 3;
+		if (geom_blob_is_empty(&geom_b)) {
+			sqlite3_result_int(context, 0);
+			goto exit;
 		}
-		else {
-			header.coord_type = GEOM_XYZM;
-			header.coord_size = 4;
+		box[0] = geom_b.envelope.min_x;
+		box[1] = geom_b.envelope.min_y;
+		box[2] = geom_b.envelope.max_x;
+		box[3] = geom_b.envelope.max_y;
+	}
+	else {
+		for (i = 0; i < 4; i++) {
+			if (sqlite3_value_type(args[i + 1]) == SQLITE_NULL) {
+				sqlite3_result_null(context);
+				goto exit;
+			}
+			box[i] = sqlite3_value_double(args[i + 1]);
 		}
+	}
 
-		if (result == SQLITE_OK) {
-			result = consumer->begin(consumer, error);
-		}
-		if (result == SQLITE_OK) {
-			result = consumer->begin_geometry(consumer, &header, error);
-		}
-		if (result == SQLITE_OK) {
-			result = consumer->coordinates(consumer, &header, 1, coord, 0, error);
-		}
-		if (result == SQLITE_OK) {
-			result = consumer->end_geometry(consumer, &header, error);
-		}
-		if (result == SQLITE_OK) {
-			result = consumer->end(consumer, error);
-		}
+	FUNCTION_RESULT = geom_blob_envelope(spatialdb, &FUNCTION_GEOM_ARG_STREAM(geom_a), &geom_a, FUNCTION_ERROR);
+	if (FUNCTION_RESULT != SQLITE_OK) {
+		goto exit;
 	}
 
-	return result;
-}
+	sqlite3_result_int(context, !geom_blob_is_empty(&geom_a)
+		&& geom_a.envelope.min_x <= box[2] && geom_a.envelope.max_x >= box[0]
+		&& geom_a.envelope.min_y <= box[3] && geom_a.envelope.max_y >= box[1]);
 
-static void ST_Point(sqlite3_context *context, int nbArgs, sqlite3_value **args) {
-	fromtext_t *fromtext = (fromtext_t *)sqlite3_user_data(context);
-	if (sqlite3_value_type(args[0]) == SQLITE_TEXT) {
-		geometry_constructor(context, fromtext->spatialdb, geom_from_wkt, fromtext->locale, GEOM_POINT, nbArgs, args);
-	}
-	else if (sqlite3_value_type(args[0]) == SQLITE_BLOB) {
-		geometry_constructor(context, fromtext->spatialdb, geom_from_wkb, NULL, GEOM_POINT, nbArgs, args);
-	}
-	else {
-		geometry_constructor(context, fromtext->spatialdb, point_from_coords, NULL, GEOM_POINT, nbArgs, args);
-	}
+	FUNCTION_END(context);
+	FUNCTION_FREE_GEOM_ARG(geom_a);
+	FUNCTION_FREE_GEOM_ARG(geom_b);
 }
 
-static void GPKG_IsAssignable(sqlite3_context *context, int nbArgs, sqlite3_value **args) {
-	FUNCTION_TEXT_ARG(expected_type_name);
-	FUNCTION_TEXT_ARG(actual_type_name);
+/*
+** ST_Intersects(a, b) determines if two geometries have at least one point in common. Disjoint envelopes are
+** rejected from the blob headers; otherwise both geometries are decoded, with arcs linearized, for point in polygon
+** and segment tests. Both geometries must have the same SRID.
+*/
+static void ST_Intersects(sqlite3_context *context, int nbArgs, sqlite3_value **args) {
+	spatialdb_t *spatialdb;
+	geom_parts_t parts_a;
+	geom_parts_t parts_b;
+	geom_linearize_t linearize;
+	int intersects = 0;
+	FUNCTION_GEOM_ARG(geom_a);
+	FUNCTION_GEOM_ARG(geom_b);
 
-	FUNCTION_START(context);
-	FUNCTION_GET_TEXT_ARG(context, expected_type_name, 0);
-	FUNCTION_GET_TEXT_ARG(context, actual_type_name, 1);
+	geom_parts_init(&parts_a);
+	geom_parts_init(&parts_b);
+	geom_linearize_init(&linearize);
 
-	geom_type_t expected_type;
-	FUNCTION_RESULT = geom_type_from_string(expected_type_name, &expected_type);
+	FUNCTION_START_STATIC(context, 256);
+	spatialdb = (spatialdb_t *)sqlite3_user_data(context);
+	FUNCTION_GET_GEOM_ARG_UNSAFE(context, spatialdb, geom_a, 0);
+	FUNCTION_GET_GEOM_ARG_UNSAFE(context, spatialdb, geom_b, 1);
+
+	FUNCTION_RESULT = geom_blob_check_srid(&geom_a, &geom_b, FUNCTION_ERROR);
+	if (FUNCTION_RESULT == SQLITE_OK) {
+		FUNCTION_RESULT = geom_blob_envelope(spatialdb, &FUNCTION_GEOM_ARG_STREAM(geom_a), &geom_a, FUNCTION_ERROR);
+	}
+	if (FUNCTION_RESULT == SQLITE_OK) {
+		FUNCTION_RESULT = geom_blob_envelope(spatialdb, &FUNCTION_GEOM_ARG_STREAM(geom_b), &geom_b, FUNCTION_ERROR);
+	}
 	if (FUNCTION_RESULT != SQLITE_OK) {
-		error_append(FUNCTION_ERROR, "Invalid geometry type %s", expected_type_name);
 		goto exit;
 	}
 
-	geom_type_t actual_type;
-	FUNCTION_RESULT = geom_type_from_string(actual_type_name, &actual_type);
-	if (FUNCTION_RESULT != SQLITE_OK) {
-		error_append(FUNCTION_ERROR, "Invalid geometry type %s", actual_type_name);
+	if (geom_blob_is_empty(&geom_a) || geom_blob_is_empty(&geom_b)
+		|| geom_a.envelope.min_x > geom_b.envelope.max_x || geom_a.envelope.max_x < geom_b.envelope.min_x
+		|| geom_a.envelope.min_y > geom_b.envelope.max_y || geom_a.envelope.max_y < geom_b.envelope.min_y) {
+		sqlite3_result_int(context, 0);
 		goto exit;
 	}
 
-	sqlite3_result_int(context, geom_is_assignable(expected_type, actual_type));
+	FUNCTION_RESULT = read_linearized(spatialdb, &FUNCTION_GEOM_ARG_STREAM(geom_a), &geom_a, &linearize, geom_parts_consumer(&parts_a), FUNCTION_ERROR);
+	if (FUNCTION_RESULT == SQLITE_OK) {
+		FUNCTION_RESULT = read_linearized(spatialdb, &FUNCTION_GEOM_ARG_STREAM(geom_b), &geom_b, &linearize, geom_parts_consumer(&parts_b), FUNCTION_ERROR);
+	}
+	if (FUNCTION_RESULT == SQLITE_OK) {
+		FUNCTION_RESULT = geom_parts_intersects(&parts_a, &parts_b, &intersects);
+	}
+	if (FUNCTION_RESULT == SQLITE_OK) {
+		sqlite3_result_int(context, intersects);
+	}
 
 	FUNCTION_END(context);
-	FUNCTION_FREE_TEXT_ARG(expected_type_name);
-	FUNCTION_FREE_TEXT_ARG(actual_type_name);
+	FUNCTION_FREE_GEOM_ARG(geom_a);
+	FUNCTION_FREE_GEOM_ARG(geom_b);
+	geom_parts_destroy(&parts_a);
+	geom_parts_destroy(&parts_b);
+	geom_linearize_destroy(&linearize);
 }
 
-static void GPKG_SpatialDBType(sqlite3_context *context, int nbArgs, sqlite3_value **args) {
+/*
+** Computes the distance between the envelopes of two geometry blobs: the smallest distance when farthest is 0,
+** otherwise the largest distance between any two points of the envelopes.
+*/
+static double envelope_distance(const geom_blob_header_t *a, const geom_blob_header_t *b, int farthest) {
+	const geom_envelope_t *ea = &a->envelope;
+	const geom_envelope_t *eb = &b->envelope;
+	double dx, dy;
+
+	if (farthest) {
+		dx = ea->max_x - eb->min_x > eb->max_x - ea->min_x ? ea->max_x - eb->min_x : eb->max_x - ea->min_x;
+		dy = ea->max_y - eb->min_y > eb->max_y - ea->min_y ? ea->max_y - eb->min_y : eb->max_y - ea->min_y;
+	}
+	else {
+		dx = eb->min_x > ea->max_x ? eb->min_x - ea->max_x : ea->min_x > eb->max_x ? ea->min_x - eb->max_x : 0.0;
+		dy = eb->min_y > ea->max_y ? eb->min_y - ea->max_y : ea->min_y > eb->max_y ? ea->min_y - eb->max_y : 0.0;
+	}
+	return sqrt(dx * dx + dy * dy);
+}
+
+/*
+** Implements ST_Distance when limit is NULL and ST_DWithin otherwise.
+*/
+static void distance(sqlite3_context *context, sqlite3_value **args, sqlite3_value *limit) {
 	spatialdb_t *spatialdb;
+	geom_parts_t parts_a;
+	geom_parts_t parts_b;
+	geom_linearize_t linearize;
+	double d = -1.0;
+	double result;
+	FUNCTION_GEOM_ARG(geom_a);
+	FUNCTION_GEOM_ARG(geom_b);
+
+	geom_parts_init(&parts_a);
+	geom_parts_init(&parts_b);
+	geom_linearize_init(&linearize);
 
-	FUNCTION_START(context);
+	FUNCTION_START_STATIC(context, 256);
 	spatialdb = (spatialdb_t *)sqlite3_user_data(context);
+	if (limit != NULL) {
+		if (sqlite3_value_type(limit) == SQLITE_NULL) {
+			sqlite3_result_null(context);
+			goto exit;
+		}
+		if (!isNumeric(limit)) {
+			error_append(FUNCTION_ERROR, "ST_DWithin requires a numeric distance");
+			goto exit;
+		}
+		d = sqlite3_value_double(limit);
+	}
+	FUNCTION_GET_GEOM_ARG_UNSAFE(context, spatialdb, geom_a, 0);
+	FUNCTION_GET_GEOM_ARG_UNSAFE(context, spatialdb, geom_b, 1);
+
+	FUNCTION_RESULT = geom_blob_check_srid(&geom_a, &geom_b, FUNCTION_ERROR);
+	if (FUNCTION_RESULT == SQLITE_OK) {
+		FUNCTION_RESULT = geom_blob_envelope(spatialdb, &FUNCTION_GEOM_ARG_STREAM(geom_a), &geom_a, FUNCTION_ERROR);
+	}
+	if (FUNCTION_RESULT == SQLITE_OK) {
+		FUNCTION_RESULT = geom_blob_envelope(spatialdb, &FUNCTION_GEOM_ARG_STREAM(geom_b), &geom_b, FUNCTION_ERROR);
+	}
+	if (FUNCTION_RESULT != SQLITE_OK) {
+		goto exit;
+	}
+
+	if (geom_blob_is_empty(&geom_a) || geom_blob_is_empty(&geom_b)) {
+		if (limit == NULL) {
+			sqlite3_result_null(context);
+		}
+		else {
+			sqlite3_result_int(context, 0);
+		}
+		goto exit;
+	}
+	if (limit != NULL) {
+		// Envelopes further apart than d can not hold points within d of each other; if even the farthest corners are
+		// within d, so is every pair of points
+		if (d < 0.0 || envelope_distance(&geom_a, &geom_b, 0) > d) {
+			sqlite3_result_int(context, 0);
+			goto exit;
+		}
+		if (envelope_distance(&geom_a, &geom_b, 1) <= d) {
+			sqlite3_result_int(context, 1);
+			goto exit;
+		}
+	}
+
+	FUNCTION_RESULT = read_linearized(spatialdb, &FUNCTION_GEOM_ARG_STREAM(geom_a), &geom_a, &linearize, geom_parts_consumer(&parts_a), FUNCTION_ERROR);
+	if (FUNCTION_RESULT == SQLITE_OK) {
+		FUNCTION_RESULT = read_linearized(spatialdb, &FUNCTION_GEOM_ARG_STREAM(geom_b), &geom_b, &linearize, geom_parts_consumer(&parts_b), FUNCTION_ERROR);
+	}
+	if (FUNCTION_RESULT == SQLITE_OK) {
+		FUNCTION_RESULT = geom_parts_distance(&parts_a, &parts_b, d, &result);
+	}
+	if (FUNCTION_RESULT == SQLITE_OK) {
+		if (limit != NULL) {
+			sqlite3_result_int(context, result <= d);
+		}
+		else if (result == HUGE_VAL) {
+			sqlite3_result_null(context);
+		}
+		else {
+			sqlite3_result_double(context, result);
+		}
+	}
+
+	FUNCTION_END(context);
+	FUNCTION_FREE_GEOM_ARG(geom_a);
+	FUNCTION_FREE_GEOM_ARG(geom_b);
+	geom_parts_destroy(&parts_a);
+	geom_parts_destroy(&parts_b);
+	geom_linearize_destroy(&linearize);
+}
+
+/*
+** ST_Distance(a, b) returns the smallest planar distance between two geometries, 0 if they intersect. Either
+** geometry being empty gives NULL; geometries with different SRIDs are an error.
+*/
+static void ST_Distance(sqlite3_context *context, int nbArgs, sqlite3_value **args) {
+	distance(context, args, NULL);
+}
+
+/*
+** ST_DWithin(a, b, d) determines if two geometries are no further than d apart. Most pairs are decided from the
+** envelopes in the blob headers; the others are decoded and the search stops at the first pair of segments within d.
+** Both geometries must have the same SRID and d must be a number.
+*/
+static void ST_DWithin(sqlite3_context *context, int nbArgs, sqlite3_value **args) {
+	distance(context, args, args[2]);
+}
+
+/*
+** Writes a point as a geometry blob in the format of the database. Without coordinates the point is empty.
+*/
+static int point_blob(sqlite3_context *context, const spatialdb_t *spatialdb, int32_t srid, const double *coords, errorstream_t *error) {
+	geom_blob_writer_t writer;
+	geom_consumer_t *consumer;
+	geom_header_t point;
+	double empty[2];
+	int result;
+
+	point.geom_type = GEOM_POINT;
+	point.coord_type = GEOM_XY;
+	point.coord_size = 2;
+	if (coords == NULL) {
+		empty[0] = empty[1] = fp_nan();
+		coords = empty;
+	}
+
+	result = spatialdb->writer_init_srid(&writer, srid);
+	if (result != SQLITE_OK) {
+		return result;
+	}
+	consumer = geom_blob_writer_geom_consumer(&writer);
+
+	result = consumer->begin(consumer, error);
+	if (result == SQLITE_OK) {
+		result = consumer->begin_geometry(consumer, &point, error);
+	}
+	if (result == SQLITE_OK) {
+		result = consumer->coordinates(consumer, &point, 1, coords, 0, error);
+	}
+	if (result == SQLITE_OK) {
+		result = consumer->end_geometry(consumer, &point, error);
+	}
+	if (result == SQLITE_OK) {
+		result = consumer->end(consumer, error);
+	}
+	if (result == SQLITE_OK) {
+		sqlite3_result_blob(context, geom_blob_writer_getdata(&writer), (int)geom_blob_writer_length(&writer), SQLITE_TRANSIENT);
+	}
+
+	spatialdb->writer_destroy(&writer, 1);
+	return result;
+}
+
+#define MEASURE_AREA 0
+#define MEASURE_LENGTH 1
+#define MEASURE_PERIMETER 2
+#define MEASURE_CENTROID 3
+
+/*
+** How measure computes lengths and areas: in the units of the coordinates, or in metres for longitude, latitude
+** coordinates on a sphere or on the ellipsoid of the SRID.
+*/
+#define MEASURE_NONE -2
+#define MEASURE_PLANAR -1
+#define MEASURE_SPHERE 0
+#define MEASURE_SPHEROID 1
+
+/*
+** ST_Area(geom), ST_Length(geom), ST_Perimeter(geom) and ST_Centroid(geom) compute planar measures in the units of
+** the coordinates while the geometry is decoded, without building an intermediate copy. Circular arcs are measured
+** exactly. Area and perimeter count polygons only and length counts lines only, so the measures of points and
+** annotations are 0.
+**
+** ST_Area(geom, use_spheroid), ST_Length(geom, use_spheroid) and ST_Perimeter(geom, use_spheroid) measure in metres:
+** geometries with a geographic SRID are measured geodesically, on the ellipsoid of the SRID or on a sphere of its
+** mean radius, with arcs linearized, and projected geometries are measured in the plane. A NULL use_spheroid gives
+** NULL. ST_LengthSpheroid and ST_LengthSphere always measure geodesically and report an error when the SRID is not
+** one of the geographic SRIDs known to geodesic_ellipsoid.
+*/
+static void measure(sqlite3_context *context, sqlite3_value **args, int what, int mode, int geographic) {
+	spatialdb_t *spatialdb;
+	const geodesic_ellipsoid_t *ellipsoid = NULL;
+	geom_measure_t m;
+	geom_geodesic_t g;
+	geom_linearize_t linearize;
+	double centroid[2];
+	FUNCTION_GEOM_ARG(geomblob);
+
+	geom_linearize_init(&linearize);
+
+	FUNCTION_START_STATIC(context, 256);
+	spatialdb = (spatialdb_t *)sqlite3_user_data(context);
+	if (mode == MEASURE_NONE) {
+		sqlite3_result_null(context);
+		goto exit;
+	}
+	FUNCTION_GET_GEOM_ARG_UNSAFE(context, spatialdb, geomblob, 0);
+
+	if (mode != MEASURE_PLANAR) {
+		ellipsoid = geodesic_ellipsoid(geomblob.srid);
+		if (ellipsoid == NULL && geographic) {
+			error_append(FUNCTION_ERROR, "SRID %d is not a known geographic SRID", geomblob.srid);
+			goto exit;
+		}
+	}
+
+	if (ellipsoid != NULL) {
+		geom_geodesic_init(&g, ellipsoid, mode == MEASURE_SPHEROID);
+		FUNCTION_RESULT = geom_blob_envelope(spatialdb, &FUNCTION_GEOM_ARG_STREAM(geomblob), &geomblob, FUNCTION_ERROR);
+		if (FUNCTION_RESULT == SQLITE_OK) {
+			FUNCTION_RESULT = read_linearized(spatialdb, &FUNCTION_GEOM_ARG_STREAM(geomblob), &geomblob, &linearize, geom_geodesic_consumer(&g), FUNCTION_ERROR);
+		}
+		if (FUNCTION_RESULT == SQLITE_OK) {
+			sqlite3_result_double(context, what == MEASURE_AREA ? g.area : what == MEASURE_LENGTH ? g.length : g.perimeter);
+		}
+		goto exit;
+	}
+
+	geom_measure_init(&m);
+	FUNCTION_RESULT = spatialdb->read_geometry(&FUNCTION_GEOM_ARG_STREAM(geomblob), geom_measure_consumer(&m), FUNCTION_ERROR);
+	if (FUNCTION_RESULT != SQLITE_OK) {
+		goto exit;
+	}
+
+	switch (what) {
+		case MEASURE_AREA:
+			sqlite3_result_double(context, m.area);
+			break;
+		case MEASURE_LENGTH:
+			sqlite3_result_double(context, m.length);
+			break;
+		case MEASURE_PERIMETER:
+			sqlite3_result_double(context, m.perimeter);
+			break;
+		default:
+			FUNCTION_RESULT = point_blob(context, spatialdb, geomblob.srid, geom_measure_centroid(&m, &centroid[0], &centroid[1]) ? centroid : NULL, FUNCTION_ERROR);
+			break;
+	}
+
+	FUNCTION_END(context);
+	FUNCTION_FREE_GEOM_ARG(geomblob);
+	geom_linearize_destroy(&linearize);
+}
+
+/*
+** Returns the measure mode selected by the optional use_spheroid argument of ST_Area, ST_Length and ST_Perimeter, or
+** MEASURE_NONE when it is NULL.
+*/
+static int measure_mode(int nbArgs, sqlite3_value **args) {
+	if (nbArgs < 2) {
+		return MEASURE_PLANAR;
+	}
+	if (sqlite3_value_type(args[1]) == SQLITE_NULL) {
+		return MEASURE_NONE;
+	}
+	return sqlite3_value_int(args[1]) ? MEASURE_SPHEROID : MEASURE_SPHERE;
+}
+
+static void ST_Area(sqlite3_context *context, int nbArgs, sqlite3_value **args) {
+	measure(context, args, MEASURE_AREA, measure_mode(nbArgs, args), 0);
+}
+
+static void ST_Length(sqlite3_context *context, int nbArgs, sqlite3_value **args) {
+	measure(context, args, MEASURE_LENGTH, measure_mode(nbArgs, args), 0);
+}
+
+static void ST_Perimeter(sqlite3_context *context, int nbArgs, sqlite3_value **args) {
+	measure(context, args, MEASURE_PERIMETER, measure_mode(nbArgs, args), 0);
+}
+
+static void ST_Centroid(sqlite3_context *context, int nbArgs, sqlite3_value **args) {
+	measure(context, args, MEASURE_CENTROID, MEASURE_PLANAR, 0);
+}
+
+static void ST_LengthSpheroid(sqlite3_context *context, int nbArgs, sqlite3_value **args) {
+	measure(context, args, MEASURE_LENGTH, MEASURE_SPHEROID, 1);
+}
+
+static void ST_LengthSphere(sqlite3_context *context, int nbArgs, sqlite3_value **args) {
+	measure(context, args, MEASURE_LENGTH, MEASURE_SPHERE, 1);
+}
+
+/*
+** Implements ST_DistanceSphere and ST_DistanceSpheroid: the geodesic distance in metres between two points, on the
+** ellipsoid of their SRID. Both points must have the same SRID, one of the geographic SRIDs known to
+** geodesic_ellipsoid. Empty points give NULL.
+*/
+static void distance_geodesic(sqlite3_context *context, sqlite3_value **args, int mode) {
+	spatialdb_t *spatialdb;
+	const geodesic_ellipsoid_t *ellipsoid;
+	geom_parts_t parts_a;
+	geom_parts_t parts_b;
+	FUNCTION_GEOM_ARG(geom_a);
+	FUNCTION_GEOM_ARG(geom_b);
+
+	geom_parts_init(&parts_a);
+	geom_parts_init(&parts_b);
+
+	FUNCTION_START_STATIC(context, 256);
+	spatialdb = (spatialdb_t *)sqlite3_user_data(context);
+	FUNCTION_GET_GEOM_ARG_UNSAFE(context, spatialdb, geom_a, 0);
+	FUNCTION_GET_GEOM_ARG_UNSAFE(context, spatialdb, geom_b, 1);
+
+	FUNCTION_RESULT = geom_blob_check_srid(&geom_a, &geom_b, FUNCTION_ERROR);
+	if (FUNCTION_RESULT != SQLITE_OK) {
+		goto exit;
+	}
+	ellipsoid = geodesic_ellipsoid(geom_a.srid);
+	if (ellipsoid == NULL) {
+		error_append(FUNCTION_ERROR, "SRID %d is not a known geographic SRID", geom_a.srid);
+		goto exit;
+	}
+
+	FUNCTION_RESULT = spatialdb->read_geometry(&FUNCTION_GEOM_ARG_STREAM(geom_a), geom_parts_consumer(&parts_a), FUNCTION_ERROR);
+	if (FUNCTION_RESULT == SQLITE_OK) {
+		FUNCTION_RESULT = spatialdb->read_geometry(&FUNCTION_GEOM_ARG_STREAM(geom_b), geom_parts_consumer(&parts_b), FUNCTION_ERROR);
+	}
+	if (FUNCTION_RESULT != SQLITE_OK) {
+		goto exit;
+	}
+
+	if (parts_a.point_count > 1 || parts_b.point_count > 1
+		|| (parts_a.part_count > 0 && parts_a.parts[0].kind != GEOM_PART_POINTS)
+		|| (parts_b.part_count > 0 && parts_b.parts[0].kind != GEOM_PART_POINTS)) {
+		error_append(FUNCTION_ERROR, "Geodesic distances are only supported between points");
+		goto exit;
+	}
+	if (parts_a.point_count == 0 || parts_b.point_count == 0) {
+		sqlite3_result_null(context);
+		goto exit;
+	}
+
+	if (mode == MEASURE_SPHEROID) {
+		sqlite3_result_double(context, geodesic_distance_spheroid(ellipsoid, parts_a.xy, parts_b.xy));
+	}
+	else {
+		sqlite3_result_double(context, geodesic_distance_sphere(geodesic_mean_radius(ellipsoid), parts_a.xy, parts_b.xy));
+	}
+
+	FUNCTION_END(context);
+	FUNCTION_FREE_GEOM_ARG(geom_a);
+	FUNCTION_FREE_GEOM_ARG(geom_b);
+	geom_parts_destroy(&parts_a);
+	geom_parts_destroy(&parts_b);
+}
+
+static void ST_DistanceSphere(sqlite3_context *context, int nbArgs, sqlite3_value **args) {
+	distance_geodesic(context, args, MEASURE_SPHERE);
+}
+
+static void ST_DistanceSpheroid(sqlite3_context *context, int nbArgs, sqlite3_value **args) {
+	distance_geodesic(context, args, MEASURE_SPHEROID);
+}
+
+/*
+** Writes a geometry transformed by the given steps as a blob of the format of the database, in a single pass from
+** the decoder through the transformation into the blob writer. The result has SRID srid.
+*/
+static void transform(sqlite3_context *context, sqlite3_value **args, int has_srid, int32_t srid, const double *matrix) {
+	spatialdb_t *spatialdb;
+	geom_blob_writer_t writer;
+	geom_transform_t t;
+	int has_writer = 0;
+	FUNCTION_GEOM_ARG(geomblob);
+
+	FUNCTION_START_STATIC(context, 256);
+	spatialdb = (spatialdb_t *)sqlite3_user_data(context);
+	FUNCTION_GET_GEOM_ARG_UNSAFE(context, spatialdb, geomblob, 0);
+
+	FUNCTION_RESULT = spatialdb->writer_init_srid(&writer, has_srid ? srid : geomblob.srid);
+	if (FUNCTION_RESULT != SQLITE_OK) {
+		goto exit;
+	}
+	has_writer = 1;
+	geom_transform_init(&t, geom_blob_writer_geom_consumer(&writer));
+
+	if (has_srid) {
+		FUNCTION_RESULT = geom_transform_add_srid(&t, geomblob.srid, srid, FUNCTION_ERROR);
+	}
+	else {
+		FUNCTION_RESULT = geom_transform_add_affine(&t, matrix, FUNCTION_ERROR);
+	}
+	if (FUNCTION_RESULT == SQLITE_OK) {
+		FUNCTION_RESULT = spatialdb->read_geometry(&FUNCTION_GEOM_ARG_STREAM(geomblob), geom_transform_consumer(&t), FUNCTION_ERROR);
+	}
+	if (FUNCTION_RESULT == SQLITE_OK) {
+		sqlite3_result_blob(context, geom_blob_writer_getdata(&writer), (int)geom_blob_writer_length(&writer), SQLITE_TRANSIENT);
+	}
+	geom_transform_destroy(&t);
+
+	FUNCTION_END(context);
+	if (has_writer) {
+		spatialdb->writer_destroy(&writer, 1);
+	}
+	FUNCTION_FREE_GEOM_ARG(geomblob);
+}
+
+/*
+** Reads count double arguments. Returns 0 if one of them is NULL.
+*/
+static int transform_args(sqlite3_value **args, int count, double *values) {
+	int i;
+	for (i = 0; i < count; i++) {
+		if (sqlite3_value_type(args[i]) == SQLITE_NULL) {
+			return 0;
+		}
+		values[i] = sqlite3_value_double(args[i]);
+	}
+	return 1;
+}
+
+/*
+** ST_Transform(geom, srid) converts a geometry to another SRID. WGS 84 (4326), Web Mercator (3857) and the WGS 84
+** UTM zones (326xx and 327xx) are supported.
+*/
+static void ST_Transform(sqlite3_context *context, int nbArgs, sqlite3_value **args) {
+	if (sqlite3_value_type(args[1]) == SQLITE_NULL) {
+		sqlite3_result_null(context);
+		return;
+	}
+	transform(context, args, 1, sqlite3_value_int(args[1]), NULL);
+}
+
+/*
+** ST_Affine(geom, a, b, d, e, xoff, yoff) and ST_Affine(geom, a, b, c, d, e, f, g, h, i, xoff, yoff, zoff) apply
+** an affine transformation: x' = a x + b y + c z + xoff, y' = d x + e y + f z + yoff, z' = g x + h y + i z + zoff.
+*/
+static void ST_Affine(sqlite3_context *context, int nbArgs, sqlite3_value **args) {
+	double values[12];
+	double m[12] = {1, 0, 0, 0, 1, 0, 0, 0, 1, 0, 0, 0};
+
+	if (!transform_args(args + 1, nbArgs - 1, values)) {
+		sqlite3_result_null(context);
+		return;
+	}
+	if (nbArgs == 7) {
+		m[0] = values[0];
+		m[1] = values[1];
+		m[3] = values[2];
+		m[4] = values[3];
+		m[9] = values[4];
+		m[10] = values[5];
+	}
+	else {
+		memcpy(m, values, sizeof(m));
+	}
+	transform(context, args, 0, 0, m);
+}
+
+/*
+** ST_Translate(geom, dx, dy [, dz]) moves a geometry.
+*/
+static void ST_Translate(sqlite3_context *context, int nbArgs, sqlite3_value **args) {
+	double values[3] = {0, 0, 0};
+	double m[12] = {1, 0, 0, 0, 1, 0, 0, 0, 1, 0, 0, 0};
+
+	if (!transform_args(args + 1, nbArgs - 1, values)) {
+		sqlite3_result_null(context);
+		return;
+	}
+	m[9] = values[0];
+	m[10] = values[1];
+	m[11] = values[2];
+	transform(context, args, 0, 0, m);
+}
+
+/*
+** ST_Scale(geom, sx, sy [, sz]) scales a geometry relative to the origin.
+*/
+static void ST_Scale(sqlite3_context *context, int nbArgs, sqlite3_value **args) {
+	double values[3] = {1, 1, 1};
+	double m[12] = {1, 0, 0, 0, 1, 0, 0, 0, 1, 0, 0, 0};
+
+	if (!transform_args(args + 1, nbArgs - 1, values)) {
+		sqlite3_result_null(context);
+		return;
+	}
+	m[0] = values[0];
+	m[4] = values[1];
+	m[8] = values[2];
+	transform(context, args, 0, 0, m);
+}
+
+static void simplify_auxdata_free(void *auxdata) {
+	geom_simplify_t *simplify = (geom_simplify_t *)auxdata;
+	geom_simplify_destroy(simplify);
+	sqlite3_free(simplify);
+}
+
+/*
+** Implements ST_Simplify and ST_SimplifyVW. The geometry is simplified on its way from the decoder to the blob writer.
+** The simplifier and its buffers are attached to the tolerance argument, so a statement with a constant tolerance
+** reuses them for every row.
+*/
+static void simplify(sqlite3_context *context, sqlite3_value **args, geom_simplify_method_t method) {
+	spatialdb_t *spatialdb;
+	geom_blob_writer_t writer;
+	geom_simplify_t *simplifier;
+	int cached = 1;
+	int has_writer = 0;
+	double tolerance;
+	FUNCTION_GEOM_ARG(geomblob);
+
+	FUNCTION_START_STATIC(context, 256);
+	spatialdb = (spatialdb_t *)sqlite3_user_data(context);
+	if (sqlite3_value_type(args[1]) == SQLITE_NULL) {
+		sqlite3_result_null(context);
+		goto exit;
+	}
+	tolerance = sqlite3_value_double(args[1]);
+	FUNCTION_GET_GEOM_ARG_UNSAFE(context, spatialdb, geomblob, 0);
+
+	simplifier = (geom_simplify_t *)sqlite3_get_auxdata(context, 1);
+	if (simplifier == NULL) {
+		simplifier = (geom_simplify_t *)sqlite3_malloc(sizeof(geom_simplify_t));
+		if (simplifier == NULL) {
+			FUNCTION_RESULT = SQLITE_NOMEM;
+			goto exit;
+		}
+		geom_simplify_init(simplifier);
+		cached = 0;
+	}
+
+	FUNCTION_RESULT = spatialdb->writer_init_srid(&writer, geomblob.srid);
+	if (FUNCTION_RESULT == SQLITE_OK) {
+		has_writer = 1;
+		FUNCTION_RESULT = spatialdb->read_geometry(&FUNCTION_GEOM_ARG_STREAM(geomblob), geom_simplify_consumer(simplifier, geom_blob_writer_geom_consumer(&writer), method, tolerance < 0.0 ? 0.0 : tolerance), FUNCTION_ERROR);
+	}
+	if (FUNCTION_RESULT == SQLITE_OK) {
+		sqlite3_result_blob(context, geom_blob_writer_getdata(&writer), (int)geom_blob_writer_length(&writer), SQLITE_TRANSIENT);
+	}
+	// SQLite may free the auxiliary data right away, so it is only handed over once the simplifier is no longer used
+	if (!cached) {
+		sqlite3_set_auxdata(context, 1, simplifier, simplify_auxdata_free);
+	}
+
+	FUNCTION_END(context);
+	if (has_writer) {
+		spatialdb->writer_destroy(&writer, 1);
+	}
+	FUNCTION_FREE_GEOM_ARG(geomblob);
+}
+
+/*
+** ST_Simplify(geom, tolerance) simplifies the lines and rings of a geometry with Douglas-Peucker after removing the
+** vertices within tolerance of their predecessor. Rings that collapse are removed.
+*/
+static void ST_Simplify(sqlite3_context *context, int nbArgs, sqlite3_value **args) {
+	simplify(context, args, GEOM_SIMPLIFY_DOUGLAS_PEUCKER);
+}
+
+/*
+** ST_SimplifyVW(geom, area) simplifies the lines and rings of a geometry with Visvalingam-Whyatt, removing vertices
+** whose effective area is smaller than area.
+*/
+static void ST_SimplifyVW(sqlite3_context *context, int nbArgs, sqlite3_value **args) {
+	simplify(context, args, GEOM_SIMPLIFY_VISVALINGAM);
+}
+
+static void clip_auxdata_free(void *auxdata) {
+	geom_clip_t *clip = (geom_clip_t *)auxdata;
+	geom_clip_destroy(clip);
+	sqlite3_free(clip);
+}
+
+/*
+** ST_ClipByBox(geom, xmin, ymin, xmax, ymax) clips a geometry to a box. Geometries whose envelope lies inside the box
+** are returned unchanged without being decoded; otherwise arcs are linearized to within a millionth of the box size,
+** lines are clipped with Liang-Barsky and rings with Sutherland-Hodgman, and parts outside the box are dropped. The
+** clipper buffers are attached to the second argument.
+*/
+static void ST_ClipByBox(sqlite3_context *context, int nbArgs, sqlite3_value **args) {
+	spatialdb_t *spatialdb;
+	geom_blob_writer_t writer;
+	geom_clip_t *clip = NULL;
+	int cached = 1;
+	int has_writer = 0;
+	double box[4];
+	int i;
+	FUNCTION_GEOM_ARG(geomblob);
+
+	FUNCTION_START_STATIC(context, 256);
+	spatialdb = (spatialdb_t *)sqlite3_user_data(context);
+	for (i = 1; i < 5; i++) {
+		if (sqlite3_value_type(args[i]) == SQLITE_NULL) {
+			sqlite3_result_null(context);
+			goto exit;
+		}
+		box[i - 1] = sqlite3_value_double(args[i]);
+	}
+	if (!(box[2] >= box[0]) || !(box[3] >= box[1])) {
+		error_append(FUNCTION_ERROR, "Invalid clip box");
+		goto exit;
+	}
+	FUNCTION_GET_GEOM_ARG_UNSAFE(context, spatialdb, geomblob, 0);
+
+	FUNCTION_RESULT = geom_blob_envelope(spatialdb, &FUNCTION_GEOM_ARG_STREAM(geomblob), &geomblob, FUNCTION_ERROR);
+	if (FUNCTION_RESULT != SQLITE_OK) {
+		goto exit;
+	}
+	if (geom_blob_is_empty(&geomblob)
+		|| (geomblob.envelope.min_x >= box[0] && geomblob.envelope.max_x <= box[2] && geomblob.envelope.min_y >= box[1] && geomblob.envelope.max_y <= box[3])) {
+		sqlite3_result_value(context, args[0]);
+		goto exit;
+	}
+
+	clip = (geom_clip_t *)sqlite3_get_auxdata(context, 1);
+	if (clip == NULL) {
+		clip = (geom_clip_t *)sqlite3_malloc(sizeof(geom_clip_t));
+		if (clip == NULL) {
+			FUNCTION_RESULT = SQLITE_NOMEM;
+			goto exit;
+		}
+		geom_clip_init(clip);
+		cached = 0;
+	}
+
+	FUNCTION_RESULT = spatialdb->writer_init_srid(&writer, geomblob.srid);
+	if (FUNCTION_RESULT == SQLITE_OK) {
+		has_writer = 1;
+		FUNCTION_RESULT = spatialdb->read_geometry(&FUNCTION_GEOM_ARG_STREAM(geomblob), geom_clip_consumer(clip, geom_blob_writer_geom_consumer(&writer), box), FUNCTION_ERROR);
+	}
+	if (FUNCTION_RESULT == SQLITE_OK) {
+		sqlite3_result_blob(context, geom_blob_writer_getdata(&writer), (int)geom_blob_writer_length(&writer), SQLITE_TRANSIENT);
+	}
+
+	FUNCTION_END(context);
+	// SQLite may free the auxiliary data right away, so it is only handed over once the clipper is no longer used
+	if (clip != NULL && !cached) {
+		sqlite3_set_auxdata(context, 1, clip, clip_auxdata_free);
+	}
+	if (has_writer) {
+		spatialdb->writer_destroy(&writer, 1);
+	}
+	FUNCTION_FREE_GEOM_ARG(geomblob);
+}
+
+/*
+** The linearizer of ST_CurveToLine with the last input blob and its result, so that evaluating it repeatedly on the
+** same geometry, as in the inner loop of a join, only linearizes once.
+*/
+typedef struct {
+	geom_linearize_t linearize;
+	uint8_t *key;
+	int key_length;
+	uint8_t *value;
+	int value_length;
+} curve_to_line_t;
+
+static void curve_to_line_auxdata_free(void *auxdata) {
+	curve_to_line_t *cache = (curve_to_line_t *)auxdata;
+	geom_linearize_destroy(&cache->linearize);
+	sqlite3_free(cache->key);
+	sqlite3_free(cache->value);
+	sqlite3_free(cache);
+}
+
+static int curve_to_line_store(curve_to_line_t *cache, const uint8_t *key, int key_length, const uint8_t *value, int value_length) {
+	uint8_t *data;
+
+	data = (uint8_t *)sqlite3_realloc(cache->key, key_length);
+	if (data == NULL) {
+		return SQLITE_NOMEM;
+	}
+	cache->key = data;
+	data = (uint8_t *)sqlite3_realloc(cache->value, value_length);
+	if (data == NULL) {
+		cache->key_length = 0;
+		return SQLITE_NOMEM;
+	}
+	cache->value = data;
+	memcpy(cache->key, key, (size_t)key_length);
+	memcpy(cache->value, value, (size_t)value_length);
+	cache->key_length = key_length;
+	cache->value_length = value_length;
+	return SQLITE_OK;
+}
+
+/*
+** ST_CurveToLine(geom, tolerance) replaces the circular arcs of a geometry by chords that deviate at most tolerance
+** from the arc. Curve types are replaced by their linear counterparts. The linearizer and the last result are
+** attached to the second argument.
+*/
+static void ST_CurveToLine(sqlite3_context *context, int nbArgs, sqlite3_value **args) {
+	spatialdb_t *spatialdb;
+	geom_blob_writer_t writer;
+	curve_to_line_t *cache = NULL;
+	int cached = 1;
+	int has_writer = 0;
+	double tolerance;
+	FUNCTION_GEOM_ARG(geomblob);
+
+	FUNCTION_START_STATIC(context, 256);
+	spatialdb = (spatialdb_t *)sqlite3_user_data(context);
+	if (sqlite3_value_type(args[1]) == SQLITE_NULL) {
+		sqlite3_result_null(context);
+		goto exit;
+	}
+	tolerance = sqlite3_value_double(args[1]);
+	if (!(tolerance > 0.0)) {
+		error_append(FUNCTION_ERROR, "Tolerance must be positive");
+		goto exit;
+	}
+	FUNCTION_GET_GEOM_ARG_UNSAFE(context, spatialdb, geomblob, 0);
+
+	cache = (curve_to_line_t *)sqlite3_get_auxdata(context, 1);
+	if (cache != NULL && cache->key_length == (int)geomblob_stream_blob_length && memcmp(cache->key, geomblob_stream_blob, geomblob_stream_blob_length) == 0) {
+		sqlite3_result_blob(context, cache->value, cache->value_length, SQLITE_TRANSIENT);
+		goto exit;
+	}
+	if (cache == NULL) {
+		cache = (curve_to_line_t *)sqlite3_malloc(sizeof(curve_to_line_t));
+		if (cache == NULL) {
+			FUNCTION_RESULT = SQLITE_NOMEM;
+			goto exit;
+		}
+		memset(cache, 0, sizeof(curve_to_line_t));
+		geom_linearize_init(&cache->linearize);
+		cached = 0;
+	}
+
+	FUNCTION_RESULT = spatialdb->writer_init_srid(&writer, geomblob.srid);
+	if (FUNCTION_RESULT == SQLITE_OK) {
+		has_writer = 1;
+		FUNCTION_RESULT = spatialdb->read_geometry(&FUNCTION_GEOM_ARG_STREAM(geomblob), geom_linearize_consumer(&cache->linearize, geom_blob_writer_geom_consumer(&writer), tolerance), FUNCTION_ERROR);
+	}
+	if (FUNCTION_RESULT == SQLITE_OK) {
+		sqlite3_result_blob(context, geom_blob_writer_getdata(&writer), (int)geom_blob_writer_length(&writer), SQLITE_TRANSIENT);
+		FUNCTION_RESULT = curve_to_line_store(cache, geomblob_stream_blob, (int)geomblob_stream_blob_length, geom_blob_writer_getdata(&writer), (int)geom_blob_writer_length(&writer));
+	}
+
+	FUNCTION_END(context);
+	// SQLite may free the auxiliary data right away, so it is only handed over once the linearizer is no longer used
+	if (cache != NULL && !cached) {
+		sqlite3_set_auxdata(context, 1, cache, curve_to_line_auxdata_free);
+	}
+	if (has_writer) {
+		spatialdb->writer_destroy(&writer, 1);
+	}
+	FUNCTION_FREE_GEOM_ARG(geomblob);
+}
+
+static void render_auxdata_free(void *auxdata) {
+	geom_render_t *render = (geom_render_t *)auxdata;
+	geom_render_destroy(render);
+	sqlite3_free(render);
+}
+
+/*
+** ST_AsRenderBinary(geom, bbox, width, height) and ST_AsRenderBinary(geom, xmin, ymin, xmax, ymax, width, height)
+** quantize a geometry to the pixel grid of a width by height image covering the envelope of bbox or the given box,
+** and return it as a render binary (see geom_render.h). The writer and its output buffer are attached to the second
+** argument, so a statement with a constant box reuses them for every row.
+*/
+static void ST_AsRenderBinary(sqlite3_context *context, int nbArgs, sqlite3_value **args) {
+	spatialdb_t *spatialdb;
+	geom_render_t *render = NULL;
+	int cached = 1;
+	double box[4];
+	int width, height;
+	int i;
+	FUNCTION_GEOM_ARG(geomblob);
+	FUNCTION_GEOM_ARG(bbox);
+
+	FUNCTION_START_STATIC(context, 256);
+	spatialdb = (spatialdb_t *)sqlite3_user_data(context);
+	for (i = 1; i < nbArgs; i++) {
+		if (sqlite3_value_type(args[i]) == SQLITE_NULL) {
+			sqlite3_result_null(context);
+			goto exit;
+		}
+	}
+	FUNCTION_GET_GEOM_ARG_UNSAFE(context, spatialdb, geomblob, 0);
+
+	if (nbArgs == 4) {
+		FUNCTION_GET_GEOM_ARG_UNSAFE(context, spatialdb, bbox, 1);
+		FUNCTION_RESULT = geom_blob_envelope(spatialdb, &FUNCTION_GEOM_ARG_STREAM(bbox), &bbox, FUNCTION_ERROR);
+		if (FUNCTION_RESULT != SQLITE_OK) {
+			goto exit;
+		}
+		if (geom_blob_is_empty(&bbox)) {
+			error_append(FUNCTION_ERROR, "The render box is empty");
+			goto exit;
+		}
+		box[0] = bbox.envelope.min_x;
+		box[1] = bbox.envelope.min_y;
+		box[2] = bbox.envelope.max_x;
+		box[3] = bbox.envelope.max_y;
+	}
+	else {
+		for (i = 0; i < 4; i++) {
+			box[i] = sqlite3_value_double(args[i + 1]);
+		}
+	}
+	width = sqlite3_value_int(args[nbArgs - 2]);
+	height = sqlite3_value_int(args[nbArgs - 1]);
+	if (width <= 0 || height <= 0 || !(box[2] > box[0]) || !(box[3] > box[1])) {
+		error_append(FUNCTION_ERROR, "Invalid render box or image size");
+		goto exit;
+	}
+
+	render = (geom_render_t *)sqlite3_get_auxdata(context, 1);
+	if (render == NULL) {
+		render = (geom_render_t *)sqlite3_malloc(sizeof(geom_render_t));
+		if (render == NULL) {
+			FUNCTION_RESULT = SQLITE_NOMEM;
+			goto exit;
+		}
+		cached = 0;
+		FUNCTION_RESULT = geom_render_init(render);
+		if (FUNCTION_RESULT != SQLITE_OK) {
+			goto exit;
+		}
+	}
+
+	FUNCTION_RESULT = spatialdb->read_geometry(&FUNCTION_GEOM_ARG_STREAM(geomblob), geom_render_consumer(render, box, width, height), FUNCTION_ERROR);
+	if (FUNCTION_RESULT == SQLITE_OK) {
+		sqlite3_result_blob(context, geom_render_data(render), (int)geom_render_length(render), SQLITE_TRANSIENT);
+	}
+
+	FUNCTION_END(context);
+	// SQLite may free the auxiliary data right away, so it is only handed over once the writer is no longer used
+	if (render != NULL && !cached) {
+		sqlite3_set_auxdata(context, 1, render, render_auxdata_free);
+	}
+	FUNCTION_FREE_GEOM_ARG(geomblob);
+	FUNCTION_FREE_GEOM_ARG(bbox);
+}
+
+static void ST_SRID(sqlite3_context *context, int nbArgs, sqlite3_value **args) {
+	spatialdb_t *spatialdb;
+	FUNCTION_GEOM_ARG(geomblob);
+
+	FUNCTION_START_STATIC(context, 256);
+	spatialdb = (spatialdb_t *)sqlite3_user_data(context);
+	FUNCTION_GET_GEOM_ARG_UNSAFE(context, spatialdb, geomblob, 0);
+
+	if (nbArgs == 1) {
+		sqlite3_result_int(context, geomblob.srid);
+	}
+	else {
+		FUNCTION_GET_INT_ARG(geomblob.srid, 1);
+		if (binstream_seek(&FUNCTION_GEOM_ARG_STREAM(geomblob), 0) != SQLITE_OK) {
+			sqlite3_result_error(context, "Error writing geometry blob header", -1);
+			goto exit;
+		}
+		if (spatialdb->write_blob_header(&FUNCTION_GEOM_ARG_STREAM(geomblob), &geomblob,0, FUNCTION_ERROR) != SQLITE_OK) {
+			if (error_count(FUNCTION_ERROR) == 0) {
+				error_append(FUNCTION_ERROR, "Error writing geometry blob header");
+			}
+			goto exit;
+		}
+		binstream_seek(&FUNCTION_GEOM_ARG_STREAM(geomblob), 0);
+		sqlite3_result_blob(context, binstream_data(&FUNCTION_GEOM_ARG_STREAM(geomblob)), (int)binstream_available(&FUNCTION_GEOM_ARG_STREAM(geomblob)), SQLITE_TRANSIENT);
+	}
+
+	FUNCTION_END(context);
+	FUNCTION_FREE_GEOM_ARG(geomblob);
+}
+
+static void ST_IsEmpty(sqlite3_context *context, int nbArgs, sqlite3_value **args) {
+	spatialdb_t *spatialdb;
+	FUNCTION_GEOM_ARG(geomblob);
+
+	FUNCTION_START_STATIC(context, 256);
+	spatialdb = (spatialdb_t *)sqlite3_user_data(context);
+	FUNCTION_GET_GEOM_ARG_UNSAFE(context, spatialdb, geomblob, 0);
+
+	sqlite3_result_int(context, geomblob.empty);
+
+	FUNCTION_END(context);
+
+	FUNCTION_FREE_GEOM_ARG(geomblob);
+}
+
+static void ST_IsMeasured(sqlite3_context *context, int nbArgs, sqlite3_value **args) {
+	spatialdb_t *spatialdb;
+	FUNCTION_WKB_ARG(wkb);
+
+	FUNCTION_START_STATIC(context, 256);
+	spatialdb = (spatialdb_t *)sqlite3_user_data(context);
+	FUNCTION_GET_WKB_ARG_UNSAFE(context, spatialdb, wkb, 0);
+
+	sqlite3_result_int(context, wkb.coord_type == GEOM_XYM || wkb.coord_type == GEOM_XYZM);
+
+	FUNCTION_END(context);
+	FUNCTION_FREE_WKB_ARG(wkb);
+}
+
+static void ST_Is3d(sqlite3_context *context, int nbArgs, sqlite3_value **args) {
+	spatialdb_t *spatialdb;
+	FUNCTION_WKB_ARG(wkb);
+
+	FUNCTION_START_STATIC(context, 256);
+	spatialdb = (spatialdb_t *)sqlite3_user_data(context);
+	FUNCTION_GET_WKB_ARG_UNSAFE(context, spatialdb, wkb, 0);
+
+	sqlite3_result_int(context, wkb.coord_type == GEOM_XYZ || wkb.coord_type == GEOM_XYZM);
+
+	FUNCTION_END(context);
+	FUNCTION_FREE_WKB_ARG(wkb);
+}
+
+static void ST_CoordDim(sqlite3_context *context, int nbArgs, sqlite3_value **args) {
+	spatialdb_t *spatialdb;
+	FUNCTION_WKB_ARG(wkb);
+
+	FUNCTION_START_STATIC(context, 256);
+	spatialdb = (spatialdb_t *)sqlite3_user_data(context);
+	FUNCTION_GET_WKB_ARG_UNSAFE(context, spatialdb, wkb, 0);
+
+	sqlite3_result_int(context, geom_coord_dim(wkb.coord_type));
+
+	FUNCTION_END(context);
+
+	FUNCTION_FREE_WKB_ARG(wkb);
+}
+
+static void ST_GeometryType(sqlite3_context *context, int nbArgs, sqlite3_value **args) {
+	spatialdb_t *spatialdb;
+	FUNCTION_WKB_ARG(wkb);
+
+	FUNCTION_START_STATIC(context, 256);
+	spatialdb = (spatialdb_t *)sqlite3_user_data(context);
+	FUNCTION_GET_WKB_ARG_UNSAFE(context, spatialdb, wkb, 0);
+
+	const char *type_name;
+	if (geom_type_name(wkb.geom_type, &type_name) == SQLITE_OK) {
+		sqlite3_result_text(context, type_name, -1, SQLITE_STATIC);
+	}
+	else {
+		error_append(FUNCTION_ERROR, "Unknown geometry type: %d", wkb.geom_type);
+	}
+
+	FUNCTION_END(context);
+
+	FUNCTION_FREE_WKB_ARG(wkb);
+}
+
+typedef struct {
+	uint8_t *data;
+	int length;
+} geom_blob_auxdata;
+
+static geom_blob_auxdata *geom_blob_auxdata_malloc() {
+	return (geom_blob_auxdata *)sqlite3_malloc(sizeof(geom_blob_auxdata));
+}
+
+static void geom_blob_auxdata_free(void *auxdata) {
+	if (auxdata != NULL) {
+		geom_blob_auxdata *geom = (geom_blob_auxdata *)auxdata;
+		sqlite3_free(geom->data);
+		geom->data = NULL;
+		sqlite3_free(geom);
+	}
+}
+
+static void ST_AsBinary(sqlite3_context *context, int nbArgs, sqlite3_value **args) {
+	spatialdb_t *spatialdb;
+	FUNCTION_GEOM_ARG(geomblob);
+
+	FUNCTION_START_STATIC(context, 256);
+	spatialdb = (spatialdb_t *)sqlite3_user_data(context);
+	FUNCTION_GET_GEOM_ARG_UNSAFE(context, spatialdb, geomblob, 0);
+
+	wkb_writer_t writer;
+	wkb_writer_init(&writer, WKB_ISO);
+
+	FUNCTION_RESULT = spatialdb->read_geometry(&FUNCTION_GEOM_ARG_STREAM(geomblob), wkb_writer_geom_consumer(&writer), FUNCTION_ERROR);
+
+	if (FUNCTION_RESULT == SQLITE_OK) {
+		sqlite3_result_blob(context, wkb_writer_getwkb(&writer), (int)wkb_writer_length(&writer), sqlite3_free);
+		wkb_writer_destroy(&writer, 0);
+	}
+	else {
+		wkb_writer_destroy(&writer, 1);
+	}
+
+	FUNCTION_END(context);
+
+	FUNCTION_FREE_GEOM_ARG(geomblob);
+}
+
+static void ST_AsText(sqlite3_context *context, int nbArgs, sqlite3_value **args) {
+	spatialdb_t *spatialdb;
+	FUNCTION_GEOM_ARG(geomblob);
+
+	FUNCTION_START_STATIC(context, 256);
+	spatialdb = (spatialdb_t *)sqlite3_user_data(context);
+	FUNCTION_GET_GEOM_ARG_UNSAFE(context, spatialdb, geomblob, 0);
+
+	wkt_writer_t writer;
+	wkt_writer_init(&writer);
+
+	FUNCTION_RESULT = spatialdb->read_geometry(&FUNCTION_GEOM_ARG_STREAM(geomblob), wkt_writer_geom_consumer(&writer), FUNCTION_ERROR);
+
+	if (FUNCTION_RESULT == SQLITE_OK) {
+		sqlite3_result_text(context, wkt_writer_getwkt(&writer), (int)wkt_writer_length(&writer), SQLITE_TRANSIENT);
+	}
+	wkt_writer_destroy(&writer);
+
+	FUNCTION_END(context);
+
+	FUNCTION_FREE_GEOM_ARG(geomblob);
+}
+
+static int geometry_is_assignable(geom_type_t expected, geom_type_t actual, errorstream_t* error) {
+	if (!geom_is_assignable(expected, actual)) {
+		const char* expectedName = NULL;
+		const char* actualName = NULL;
+		if (geom_type_name(expected, &expectedName) == SQLITE_OK && geom_type_name(actual, &actualName) == SQLITE_OK) {
+			error_append(error, "Incorrect geometry type. Expected '%d' actual '%s'", expectedName, actualName);
+		}
+		else {
+			error_append(error, "Incorrect geometry type");
+		}
+		return SQLITE_ERROR;
+	}
+	else {
+		return SQLITE_OK;
+	}
+}
+
+typedef int(*geometry_constructor_func)(sqlite3_context *context, void *user_data, geom_consumer_t *consumer, int nbArgs, sqlite3_value **args, errorstream_t *error);
+
+static void geometry_constructor(sqlite3_context *context, const spatialdb_t *spatialdb, geometry_constructor_func constructor, void* user_data, geom_type_t requiredType, int nbArgs, sqlite3_value **args) {
+	FUNCTION_START_STATIC(context, 256);
+
+	geom_blob_auxdata *geom = (geom_blob_auxdata *)sqlite3_get_auxdata(context, 0);
+
+	if (geom == NULL) {
+		geom_blob_writer_t writer;
+
+		if (sqlite3_value_type(args[nbArgs - 1]) == SQLITE_INTEGER) {
+			spatialdb->writer_init_srid(&writer, sqlite3_value_int(args[nbArgs - 1]));
+			nbArgs -= 1;
+		}
+		else {
+			spatialdb->writer_init(&writer);
+		}
+
+		FUNCTION_RESULT = constructor(context, user_data, geom_blob_writer_geom_consumer(&writer), nbArgs, args, FUNCTION_ERROR);
+
+		if (FUNCTION_RESULT == SQLITE_OK) {
+			if (geometry_is_assignable(requiredType, writer.geom_type, FUNCTION_ERROR) == SQLITE_OK) {
+				uint8_t *data = geom_blob_writer_getdata(&writer);
+				int length = (int)geom_blob_writer_length(&writer);
+				sqlite3_result_blob(context, data, length, SQLITE_TRANSIENT);
+				spatialdb->writer_destroy(&writer, 0);
+
+				geom = geom_blob_auxdata_malloc();
+				if (geom != NULL) {
+					geom->data = data;
+					geom->length = length;
+					sqlite3_set_auxdata(context, 0, geom, geom_blob_auxdata_free);
+				}
+			}
+		}
+		else {
+			spatialdb->writer_destroy(&writer, 1);
+		}
+	}
+	else {
+		sqlite3_result_blob(context, geom->data, geom->length, SQLITE_TRANSIENT);
+	}
+
+	FUNCTION_END(context);
+}
+
+static int geom_from_wkb(sqlite3_context *context, void *user_data, geom_consumer_t* consumer, int nbArgs, sqlite3_value **args, errorstream_t *error) {
+	FUNCTION_STREAM_ARG(wkb);
+	FUNCTION_START_NESTED(context, error);
+	FUNCTION_GET_STREAM_ARG_UNSAFE(context, wkb, 0);
+
+	FUNCTION_RESULT = wkb_read_geometry(&wkb, WKB_ISO, consumer, FUNCTION_ERROR);
+
+	FUNCTION_END_NESTED(context);
+	FUNCTION_FREE_STREAM_ARG(wkb);
+
+	return FUNCTION_RESULT;
+}
+
+static void ST_GeomFromWKB(sqlite3_context *context, int nbArgs, sqlite3_value **args) {
+	spatialdb_t *spatialdb = (spatialdb_t *)sqlite3_user_data(context);
+	geometry_constructor(context, spatialdb, geom_from_wkb, NULL, GEOM_GEOMETRY, nbArgs, args);
+}
+
+typedef struct {
+	volatile long ref_count;
+	const spatialdb_t *spatialdb;
+	i18n_locale_t *locale;
+} fromtext_t;
+
+static fromtext_t *fromtext_init(const spatialdb_t *spatialdb) {
+	fromtext_t *ctx = (fromtext_t *)sqlite3_malloc(sizeof(fromtext_t));
+
+	if (ctx == NULL) {
+		return NULL;
+	}
+
+	i18n_locale_t *locale = i18n_locale_init("C");
+	if (locale == NULL) {
+		sqlite3_free(ctx);
+		return NULL;
+	}
+
+	ctx->ref_count = 1;
+	ctx->locale = locale;
+	ctx->spatialdb = spatialdb;
+	return ctx;
+}
+
+static void fromtext_acquire(fromtext_t *fromtext) {
+	if (fromtext) {
+		atomic_inc_long(&fromtext->ref_count);
+	}
+}
+
+static void fromtext_release(fromtext_t *fromtext) {
+	if (fromtext) {
+		long newval = atomic_dec_long(&fromtext->ref_count);
+		if (newval == 0) {
+			i18n_locale_destroy(fromtext->locale);
+			fromtext->locale = NULL;
+			sqlite3_free(fromtext);
+		}
+	}
+}
+
+static int geom_from_wkt(sqlite3_context *context, void *user_data, geom_consumer_t* consumer, int nbArgs, sqlite3_value **args, errorstream_t *error) {
+	FUNCTION_TEXT_ARG(wkt);
+	FUNCTION_START_NESTED(context, error);
+
+	FUNCTION_GET_TEXT_ARG_UNSAFE(wkt, 0);
+
+	FUNCTION_RESULT = wkt_read_geometry(wkt, FUNCTION_TEXT_ARG_LENGTH(wkt), consumer, (i18n_locale_t *)user_data, FUNCTION_ERROR);
+
+	FUNCTION_END_NESTED(context);
+	FUNCTION_FREE_TEXT_ARG(wkt);
+
+	return FUNCTION_RESULT;
+}
+
+static void ST_GeomFromText(sqlite3_context *context, int nbArgs, sqlite3_value **args) {
+	fromtext_t *fromtext = (fromtext_t *)sqlite3_user_data(context);
+	geometry_constructor(context, fromtext->spatialdb, geom_from_wkt, fromtext->locale, GEOM_GEOMETRY, nbArgs, args);
+}
+
+static int point_from_coords(sqlite3_context *context, void *user_data, geom_consumer_t *consumer, int nbArgs, sqlite3_value **args, errorstream_t *error) {
+	int result = SQLITE_OK;
+
+	if (nbArgs < 2 || nbArgs > 4) {
+		error_append(error, "Invalid number of coordinates: %d", nbArgs);
+		result = SQLITE_ERROR;
+	}
+	else {
+		double coord[4];
+		for (int i = 0; i < nbArgs; i++) {
+			coord[i] = sqlite3_value_double(args[i]);
+		}
+
+		geom_header_t header;
+		header.geom_type = GEOM_POINT;
+		if (nbArgs == 2) {
+			header.coord_type = GEOM_XY;
+			header.coord_size = 2;
+		}
+		else if (nbArgs == 3) {
+			header.coord_type = GEOM_XYZ;
+			header.coord_size = 3;
+		}
+		else {
+			header.coord_type = GEOM_XYZM;
+			header.coord_size = 4;
+		}
+
+		if (result == SQLITE_OK) {
+			result = consumer->begin(consumer, error);
+		}
+		if (result == SQLITE_OK) {
+			result = consumer->begin_geometry(consumer, &header, error);
+		}
+		if (result == SQLITE_OK) {
+			result = consumer->coordinates(consumer, &header, 1, coord, 0, error);
+		}
+		if (result == SQLITE_OK) {
+			result = consumer->end_geometry(consumer, &header, error);
+		}
+		if (result == SQLITE_OK) {
+			result = consumer->end(consumer, error);
+		}
+	}
+
+	return result;
+}
+
+static void ST_Point(sqlite3_context *context, int nbArgs, sqlite3_value **args) {
+	fromtext_t *fromtext = (fromtext_t *)sqlite3_user_data(context);
+	if (sqlite3_value_type(args[0]) == SQLITE_TEXT) {
+		geometry_constructor(context, fromtext->spatialdb, geom_from_wkt, fromtext->locale, GEOM_POINT, nbArgs, args);
+	}
+	else if (sqlite3_value_type(args[0]) == SQLITE_BLOB) {
+		geometry_constructor(context, fromtext->spatialdb, geom_from_wkb, NULL, GEOM_POINT, nbArgs, args);
+	}
+	else {
+		geometry_constructor(context, fromtext->spatialdb, point_from_coords, NULL, GEOM_POINT, nbArgs, args);
+	}
+}
+
+static void GPKG_IsAssignable(sqlite3_context *context, int nbArgs, sqlite3_value **args) {
+	FUNCTION_TEXT_ARG(expected_type_name);
+	FUNCTION_TEXT_ARG(actual_type_name);
+
+	FUNCTION_START(context);
+	FUNCTION_GET_TEXT_ARG(context, expected_type_name, 0);
+	FUNCTION_GET_TEXT_ARG(context, actual_type_name, 1);
+
+	geom_type_t expected_type;
+	FUNCTION_RESULT = geom_type_from_string(expected_type_name, &expected_type);
+	if (FUNCTION_RESULT != SQLITE_OK) {
+		error_append(FUNCTION_ERROR, "Invalid geometry type %s", expected_type_name);
+		goto exit;
+	}
+
+	geom_type_t actual_type;
+	FUNCTION_RESULT = geom_type_from_string(actual_type_name, &actual_type);
+	if (FUNCTION_RESULT != SQLITE_OK) {
+		error_append(FUNCTION_ERROR, "Invalid geometry type %s", actual_type_name);
+		goto exit;
+	}
+
+	sqlite3_result_int(context, geom_is_assignable(expected_type, actual_type));
+
+	FUNCTION_END(context);
+	FUNCTION_FREE_TEXT_ARG(expected_type_name);
+	FUNCTION_FREE_TEXT_ARG(actual_type_name);
+}
+
+static void GPKG_SpatialDBType(sqlite3_context *context, int nbArgs, sqlite3_value **args) {
+	spatialdb_t *spatialdb;
+
+	FUNCTION_START(context);
+	spatialdb = (spatialdb_t *)sqlite3_user_data(context);
+
+	sqlite3_result_text(context, spatialdb->name, -1, SQLITE_STATIC);
+
+	FUNCTION_END(context);
+}
+
+static void GPKG_CheckSpatialMetaData(sqlite3_context *context, int nbArgs, sqlite3_value **args) {
+	spatialdb_t *spatialdb;
+	FUNCTION_TEXT_ARG(db_name);
+	FUNCTION_INT_ARG(check);
+	FUNCTION_INT_ARG(type);
+	FUNCTION_START(context);
+
+	spatialdb = (spatialdb_t *)sqlite3_user_data(context);
+	if (nbArgs == 0) {
+		FUNCTION_SET_TEXT_ARG(db_name, "main");
+		FUNCTION_SET_INT_ARG(check, 0);
+	}
+	else if (nbArgs == 1) {
+		FUNCTION_GET_TYPE(type, 0);
+		if (type == SQLITE_TEXT) {
+			FUNCTION_GET_TEXT_ARG(context, db_name, 0);
+		}
+		else {
+			FUNCTION_SET_TEXT_ARG(db_name, "main");
+			FUNCTION_GET_INT_ARG(check, 0);
+		}
+	}
+	else {
+		FUNCTION_GET_TEXT_ARG(context, db_name, 0);
+		FUNCTION_GET_INT_ARG(check, 1);
+	}
+
+	if (check != 0) {
+		check = SQL_CHECK_ALL;
+	}
+
+	FUNCTION_RESULT = spatialdb->check_meta(FUNCTION_DB_HANDLE, db_name, check, FUNCTION_ERROR);
+	if (FUNCTION_RESULT == SQLITE_OK) {
+		sqlite3_result_null(context);
+	}
+
+	FUNCTION_END(context);
+
+	FUNCTION_FREE_TEXT_ARG(db_name);
+	FUNCTION_FREE_INT_ARG(check);
+	FUNCTION_FREE_INT_ARG(type);
+}
+
+static void GPKG_InitSpatialMetaData(sqlite3_context *context, int nbArgs, sqlite3_value **args) {
+	spatialdb_t *spatialdb;
+	FUNCTION_TEXT_ARG(db_name);
+
+	FUNCTION_START(context);
+	spatialdb = (spatialdb_t *)sqlite3_user_data(context);
+	if (nbArgs == 0) {
+		FUNCTION_SET_TEXT_ARG(db_name, "main");
+	}
+	else {
+		FUNCTION_GET_TEXT_ARG(context, db_name, 0);
+	}
+
+	FUNCTION_START_TRANSACTION(__initspatialdb);
+	FUNCTION_RESULT = spatialdb->init_meta(FUNCTION_DB_HANDLE, db_name, FUNCTION_ERROR);
+	FUNCTION_END_TRANSACTION(__initspatialdb);
+
+	if (FUNCTION_RESULT == SQLITE_OK) {
+		sqlite3_result_null(context);
+	}
+
+	FUNCTION_END(context);
+
+	FUNCTION_FREE_TEXT_ARG(db_name);
+}
+
+/*
+* Supports the following parameter lists:
+* 4: table, column, type, srid
+* 5: db, table, column, type, srid
+* 6: table, column, type, srid, z, m
+* 7: db, table, column, type, srid, z, m
+*/
+static void GPKG_AddGeometryColumn(sqlite3_context *context, int nbArgs, sqlite3_value **args) {
+	spatialdb_t *spatialdb;
+	FUNCTION_TEXT_ARG(db_name);
+	FUNCTION_TEXT_ARG(table_name);
+	FUNCTION_TEXT_ARG(column_name);
+	FUNCTION_TEXT_ARG(geometry_type);
+	FUNCTION_INT_ARG(srs_id);
+	FUNCTION_INT_ARG(z);
+	FUNCTION_INT_ARG(m);
+	FUNCTION_START(context);
+
+	spatialdb = (spatialdb_t *)sqlite3_user_data(context);
+	if (nbArgs == 4) {
+		FUNCTION_SET_TEXT_ARG(db_name, "main");
+		FUNCTION_GET_TEXT_ARG(context, table_name, 0);
+		FUNCTION_GET_TEXT_ARG(context, column_name, 1);
+		FUNCTION_GET_TEXT_ARG(context, geometry_type, 2);
+		FUNCTION_GET_INT_ARG(srs_id, 3);
+		FUNCTION_SET_INT_ARG(z, 2);
+		FUNCTION_SET_INT_ARG(m, 2);
+	}
+	else if (nbArgs == 5) {
+		FUNCTION_GET_TEXT_ARG(context, db_name, 0);
+		FUNCTION_GET_TEXT_ARG(context, table_name, 1);
+		FUNCTION_GET_TEXT_ARG(context, column_name, 2);
+		FUNCTION_GET_TEXT_ARG(context, geometry_type, 3);
+		FUNCTION_GET_INT_ARG(srs_id, 4);
+	}
+	else if (nbArgs == 6) {
+		FUNCTION_SET_TEXT_ARG(db_name, "main");
+		FUNCTION_GET_TEXT_ARG(context, table_name, 0);
+		FUNCTION_GET_TEXT_ARG(context, column_name, 1);
+		FUNCTION_GET_TEXT_ARG(context, geometry_type, 2);
+		FUNCTION_GET_INT_ARG(srs_id, 3);
+		FUNCTION_GET_INT_ARG(z, 4);
+		FUNCTION_GET_INT_ARG(m, 5);
+	}
+	else {
+		FUNCTION_GET_TEXT_ARG(context, db_name, 0);
+		FUNCTION_GET_TEXT_ARG(context, table_name, 1);
+		FUNCTION_GET_TEXT_ARG(context, column_name, 2);
+		FUNCTION_GET_TEXT_ARG(context, geometry_type, 3);
+		FUNCTION_GET_INT_ARG(srs_id, 4);
+		FUNCTION_GET_INT_ARG(z, 5);
+		FUNCTION_GET_INT_ARG(m, 6);
+	}
+
+	FUNCTION_START_TRANSACTION(__add_geom_col);
+
+	FUNCTION_RESULT = spatialdb->init_meta(FUNCTION_DB_HANDLE, db_name, FUNCTION_ERROR);
+
+	if (FUNCTION_RESULT == SQLITE_OK) {
+		FUNCTION_RESULT = spatialdb->add_geometry_column(FUNCTION_DB_HANDLE, db_name, table_name, column_name, geometry_type, srs_id, z, m, FUNCTION_ERROR);
+	}
+
+	FUNCTION_END_TRANSACTION(__add_geom_col);
+
+	if (FUNCTION_RESULT == SQLITE_OK) {
+		sqlite3_result_null(context);
+	}
+
+	FUNCTION_END(context);
+
+	FUNCTION_FREE_TEXT_ARG(db_name);
+	FUNCTION_FREE_TEXT_ARG(table_name);
+	FUNCTION_FREE_TEXT_ARG(column_name);
+	FUNCTION_FREE_TEXT_ARG(geometry_type);
+	FUNCTION_FREE_INT_ARG(srid);
+	FUNCTION_FREE_INT_ARG(z);
+	FUNCTION_FREE_INT_ARG(m);
+}
+
+static void GPKG_CreateTilesTable(sqlite3_context *context, int nbArgs, sqlite3_value **args) {
+	spatialdb_t *spatialdb;
+	FUNCTION_TEXT_ARG(db_name);
+	FUNCTION_TEXT_ARG(table_name);
+	FUNCTION_START(context);
+
+	spatialdb = (spatialdb_t *)sqlite3_user_data(context);
+	if (nbArgs == 2) {
+		FUNCTION_GET_TEXT_ARG(context, db_name, 0);
+		FUNCTION_GET_TEXT_ARG(context, table_name, 1);
+	}
+	else {
+		FUNCTION_SET_TEXT_ARG(db_name, "main");
+		FUNCTION_GET_TEXT_ARG(context, table_name, 0);
+	}
+
+	if (spatialdb->create_tiles_table == NULL) {
+		error_append(FUNCTION_ERROR, "Tiles tables are not supported in %s mode", spatialdb->name);
+		goto exit;
+	}
+
+	FUNCTION_START_TRANSACTION(__create_tiles_table);
+
+	FUNCTION_RESULT = spatialdb->init_meta(FUNCTION_DB_HANDLE, db_name, FUNCTION_ERROR);
+	if (FUNCTION_RESULT == SQLITE_OK) {
+		FUNCTION_RESULT = spatialdb->create_tiles_table(FUNCTION_DB_HANDLE, db_name, table_name, FUNCTION_ERROR);
+	}
+
+	FUNCTION_END_TRANSACTION(__create_tiles_table);
+
+	if (FUNCTION_RESULT == SQLITE_OK) {
+		sqlite3_result_null(context);
+	}
+
+	FUNCTION_END(context);
+
+	FUNCTION_FREE_TEXT_ARG(db_name);
+	FUNCTION_FREE_TEXT_ARG(table_name);
+}
+
+static void GPKG_CreateSpatialIndex(sqlite3_context *context, int nbArgs, sqlite3_value **args) {
+	spatialdb_t *spatialdb;
+	FUNCTION_TEXT_ARG(db_name);
+	FUNCTION_TEXT_ARG(table_name);
+	FUNCTION_TEXT_ARG(geometry_column_name);
+	FUNCTION_TEXT_ARG(id_column_name);
+	FUNCTION_START(context);
+
+	spatialdb = (spatialdb_t *)sqlite3_user_data(context);
+	if (nbArgs == 4) {
+		FUNCTION_GET_TEXT_ARG(context, db_name, 0);
+		FUNCTION_GET_TEXT_ARG(context, table_name, 1);
+		FUNCTION_GET_TEXT_ARG(context, geometry_column_name, 2);
+		FUNCTION_GET_TEXT_ARG(context, id_column_name, 3);
+	}
+	else {
+		FUNCTION_SET_TEXT_ARG(db_name, "main");
+		FUNCTION_GET_TEXT_ARG(context, table_name, 0);
+		FUNCTION_GET_TEXT_ARG(context, geometry_column_name, 1);
+		FUNCTION_GET_TEXT_ARG(context, id_column_name, 2);
+	}
+
+	if (spatialdb->create_spatial_index == NULL) {
+		error_append(FUNCTION_ERROR, "Spatial indexes are not supported in %s mode", spatialdb->name);
+		goto exit;
+	}
+
+	FUNCTION_START_TRANSACTION(__create_spatial_index);
+
+	FUNCTION_RESULT = spatialdb->init_meta(FUNCTION_DB_HANDLE, db_name, FUNCTION_ERROR);
+	if (FUNCTION_RESULT == SQLITE_OK) {
+		FUNCTION_RESULT = spatialdb->create_spatial_index(FUNCTION_DB_HANDLE, db_name, table_name, geometry_column_name, id_column_name, 0, FUNCTION_ERROR);
+	}
+
+	FUNCTION_END_TRANSACTION(__create_spatial_index);
+
+	if (FUNCTION_RESULT == SQLITE_OK) {
+		sqlite3_result_null(context);
+	}
+
+	FUNCTION_END(context);
+
+	FUNCTION_FREE_TEXT_ARG(db_name);
+	FUNCTION_FREE_TEXT_ARG(table_name);
+	FUNCTION_FREE_TEXT_ARG(geometry_column_name);
+	FUNCTION_FREE_TEXT_ARG(id_column_name);
+}
+
+static int spatial_index_flags(const char *dimensions, int *index_flags) {
+	if (sqlite3_stricmp(dimensions, "xy") == 0) {
+		*index_flags = 0;
+	}
+	else if (sqlite3_stricmp(dimensions, "xyz") == 0) {
+		*index_flags = SPATIAL_INDEX_Z;
+	}
+	else if (sqlite3_stricmp(dimensions, "xym") == 0) {
+		*index_flags = SPATIAL_INDEX_M;
+	}
+	else if (sqlite3_stricmp(dimensions, "xyzm") == 0) {
+		*index_flags = SPATIAL_INDEX_Z | SPATIAL_INDEX_M;
+	}
+	else {
+		return SQLITE_ERROR;
+	}
+	return SQLITE_OK;
+}
+
+/*
+** GPKG_CreateSpatialIndexZM([db,] table, geometry, id, dimensions) creates a spatial index that
+** also covers the Z and/or M range of each geometry. dimensions is one of 'XY', 'XYZ', 'XYM' or 'XYZM'.
+*/
+static void GPKG_CreateSpatialIndexZM(sqlite3_context *context, int nbArgs, sqlite3_value **args) {
+	spatialdb_t *spatialdb;
+	int index_flags = 0;
+	FUNCTION_TEXT_ARG(db_name);
+	FUNCTION_TEXT_ARG(table_name);
+	FUNCTION_TEXT_ARG(geometry_column_name);
+	FUNCTION_TEXT_ARG(id_column_name);
+	FUNCTION_TEXT_ARG(dimensions);
+	FUNCTION_START(context);
+
+	spatialdb = (spatialdb_t *)sqlite3_user_data(context);
+	if (nbArgs == 5) {
+		FUNCTION_GET_TEXT_ARG(context, db_name, 0);
+		FUNCTION_GET_TEXT_ARG(context, table_name, 1);
+		FUNCTION_GET_TEXT_ARG(context, geometry_column_name, 2);
+		FUNCTION_GET_TEXT_ARG(context, id_column_name, 3);
+		FUNCTION_GET_TEXT_ARG(context, dimensions, 4);
+	}
+	else {
+		FUNCTION_SET_TEXT_ARG(db_name, "main");
+		FUNCTION_GET_TEXT_ARG(context, table_name, 0);
+		FUNCTION_GET_TEXT_ARG(context, geometry_column_name, 1);
+		FUNCTION_GET_TEXT_ARG(context, id_column_name, 2);
+		FUNCTION_GET_TEXT_ARG(context, dimensions, 3);
+	}
+
+	if (spatial_index_flags(dimensions, &index_flags) != SQLITE_OK) {
+		error_append(FUNCTION_ERROR, "Unsupported spatial index dimension: %s", dimensions);
+		goto exit;
+	}
+
+	if (spatialdb->create_spatial_index == NULL) {
+		error_append(FUNCTION_ERROR, "Spatial indexes are not supported in %s mode", spatialdb->name);
+		goto exit;
+	}
+
+	FUNCTION_START_TRANSACTION(__create_spatial_index);
+
+	FUNCTION_RESULT = spatialdb->init_meta(FUNCTION_DB_HANDLE, db_name, FUNCTION_ERROR);
+	if (FUNCTION_RESULT == SQLITE_OK) {
+		FUNCTION_RESULT = spatialdb->create_spatial_index(FUNCTION_DB_HANDLE, db_name, table_name, geometry_column_name, id_column_name, index_flags, FUNCTION_ERROR);
+	}
+
+	FUNCTION_END_TRANSACTION(__create_spatial_index);
+
+	if (FUNCTION_RESULT == SQLITE_OK) {
+		sqlite3_result_null(context);
+	}
+
+	FUNCTION_END(context);
+
+	FUNCTION_FREE_TEXT_ARG(db_name);
+	FUNCTION_FREE_TEXT_ARG(table_name);
+	FUNCTION_FREE_TEXT_ARG(geometry_column_name);
+	FUNCTION_FREE_TEXT_ARG(id_column_name);
+	FUNCTION_FREE_TEXT_ARG(dimensions);
+}
+
+/*
+** GPKG_CreateSpatialIndexStep([db,] table, geometry, id, batch_size [, dimensions]) builds a spatial index
+** incrementally: each call indexes at most batch_size rows in its own transaction and returns 1 while more calls
+** are needed or 0 once the index is complete. Progress survives interruption and is reported by
+** GPKG_SpatialIndexProgress.
+*/
+static void GPKG_CreateSpatialIndexStep(sqlite3_context *context, int nbArgs, sqlite3_value **args) {
+	spatialdb_t *spatialdb;
+	int first_arg = 0;
+	int batch_size = 0;
+	int index_flags = 0;
+	double progress = 0.0;
+	FUNCTION_TEXT_ARG(db_name);
+	FUNCTION_TEXT_ARG(table_name);
+	FUNCTION_TEXT_ARG(geometry_column_name);
+	FUNCTION_TEXT_ARG(id_column_name);
+	FUNCTION_TEXT_ARG(dimensions);
+	FUNCTION_START(context);
+
+	spatialdb = (spatialdb_t *)sqlite3_user_data(context);
+	if (nbArgs == 6 || (nbArgs == 5 && sqlite3_value_type(args[3]) != SQLITE_INTEGER)) {
+		FUNCTION_GET_TEXT_ARG(context, db_name, 0);
+		first_arg = 1;
+	}
+	else {
+		FUNCTION_SET_TEXT_ARG(db_name, "main");
+	}
+	FUNCTION_GET_TEXT_ARG(context, table_name, first_arg);
+	FUNCTION_GET_TEXT_ARG(context, geometry_column_name, first_arg + 1);
+	FUNCTION_GET_TEXT_ARG(context, id_column_name, first_arg + 2);
+	batch_size = sqlite3_value_int(args[first_arg + 3]);
+	if (nbArgs > first_arg + 4) {
+		FUNCTION_GET_TEXT_ARG(context, dimensions, first_arg + 4);
+		if (spatial_index_flags(dimensions, &index_flags) != SQLITE_OK) {
+			error_append(FUNCTION_ERROR, "Unsupported spatial index dimension: %s", dimensions);
+			goto exit;
+		}
+	}
+
+	if (batch_size <= 0) {
+		error_append(FUNCTION_ERROR, "Batch size must be positive");
+		goto exit;
+	}
+
+	if (spatialdb->create_spatial_index_step == NULL) {
+		error_append(FUNCTION_ERROR, "Incremental spatial index builds are not supported in %s mode", spatialdb->name);
+		goto exit;
+	}
+
+	FUNCTION_START_TRANSACTION(__create_spatial_index_step);
+
+	FUNCTION_RESULT = spatialdb->init_meta(FUNCTION_DB_HANDLE, db_name, FUNCTION_ERROR);
+	if (FUNCTION_RESULT == SQLITE_OK) {
+		FUNCTION_RESULT = spatialdb->create_spatial_index_step(FUNCTION_DB_HANDLE, db_name, table_name, geometry_column_name, id_column_name, index_flags, batch_size, &progress, FUNCTION_ERROR);
+	}
+
+	FUNCTION_END_TRANSACTION(__create_spatial_index_step);
+
+	if (FUNCTION_RESULT == SQLITE_OK) {
+		sqlite3_result_int(context, progress < 1.0);
+	}
+
+	FUNCTION_END(context);
+
+	FUNCTION_FREE_TEXT_ARG(db_name);
+	FUNCTION_FREE_TEXT_ARG(table_name);
+	FUNCTION_FREE_TEXT_ARG(geometry_column_name);
+	FUNCTION_FREE_TEXT_ARG(id_column_name);
+	FUNCTION_FREE_TEXT_ARG(dimensions);
+}
+
+/*
+** GPKG_SpatialIndexProgress([db,] table, geometry) returns the fraction of rows indexed by an incremental build,
+** 1 if the index is complete or NULL if the column has no spatial index.
+*/
+static void GPKG_SpatialIndexProgress(sqlite3_context *context, int nbArgs, sqlite3_value **args) {
+	spatialdb_t *spatialdb;
+	double progress = -1.0;
+	FUNCTION_TEXT_ARG(db_name);
+	FUNCTION_TEXT_ARG(table_name);
+	FUNCTION_TEXT_ARG(geometry_column_name);
+	FUNCTION_START(context);
+
+	spatialdb = (spatialdb_t *)sqlite3_user_data(context);
+	if (nbArgs == 3) {
+		FUNCTION_GET_TEXT_ARG(context, db_name, 0);
+		FUNCTION_GET_TEXT_ARG(context, table_name, 1);
+		FUNCTION_GET_TEXT_ARG(context, geometry_column_name, 2);
+	}
+	else {
+		FUNCTION_SET_TEXT_ARG(db_name, "main");
+		FUNCTION_GET_TEXT_ARG(context, table_name, 0);
+		FUNCTION_GET_TEXT_ARG(context, geometry_column_name, 1);
+	}
+
+	if (spatialdb->create_spatial_index_step == NULL) {
+		error_append(FUNCTION_ERROR, "Incremental spatial index builds are not supported in %s mode", spatialdb->name);
+		goto exit;
+	}
+
+	FUNCTION_RESULT = spatialdb->create_spatial_index_step(FUNCTION_DB_HANDLE, db_name, table_name, geometry_column_name, NULL, 0, 0, &progress, FUNCTION_ERROR);
+
+	if (FUNCTION_RESULT == SQLITE_OK) {
+		if (progress < 0.0) {
+			sqlite3_result_null(context);
+		}
+		else {
+			sqlite3_result_double(context, progress);
+		}
+	}
+
+	FUNCTION_END(context);
+
+	FUNCTION_FREE_TEXT_ARG(db_name);
+	FUNCTION_FREE_TEXT_ARG(table_name);
+	FUNCTION_FREE_TEXT_ARG(geometry_column_name);
+}
+
+/*
+** udbx_bbox_count([db,] table, geometry, xmin, ymin, xmax, ymax [, tolerance]) returns the number of features whose
+** envelope intersects the box, read from the rtree nodes. A tolerance of 0 (the default) counts exactly; a positive
+** tolerance estimates partially covered nodes up to that fraction of the box area from their covered area. With seven
+** arguments the first one is the database name when the third one, the geometry column, is text.
+*/
+static void udbx_bbox_count(sqlite3_context *context, int nbArgs, sqlite3_value **args) {
+	double bbox[4];
+	double tolerance = 0.0;
+	double count = 0.0;
+	int i;
+	int base;
+	FUNCTION_TEXT_ARG(db_name);
+	FUNCTION_TEXT_ARG(table_name);
+	FUNCTION_TEXT_ARG(geometry_column_name);
+	FUNCTION_START(context);
+
+	base = (nbArgs == 8 || (nbArgs == 7 && sqlite3_value_type(args[2]) == SQLITE_TEXT)) ? 1 : 0;
+	if (base) {
+		FUNCTION_GET_TEXT_ARG(context, db_name, 0);
+	}
+	else {
+		FUNCTION_SET_TEXT_ARG(db_name, "main");
+	}
+	FUNCTION_GET_TEXT_ARG(context, table_name, base);
+	FUNCTION_GET_TEXT_ARG(context, geometry_column_name, base + 1);
+	for (i = 0; i < 4; i++) {
+		bbox[i] = sqlite3_value_double(args[base + 2 + i]);
+	}
+	if (nbArgs > base + 6) {
+		tolerance = sqlite3_value_double(args[base + 6]);
+	}
+
+	if (tolerance < 0.0) {
+		error_append(FUNCTION_ERROR, "Tolerance must not be negative");
+		goto exit;
+	}
+
+	FUNCTION_RESULT = spatial_index_count(FUNCTION_DB_HANDLE, db_name, table_name, geometry_column_name, bbox, tolerance, &count, FUNCTION_ERROR);
+
+	if (FUNCTION_RESULT == SQLITE_OK) {
+		sqlite3_result_int64(context, (sqlite3_int64)floor(count + 0.5));
+	}
+
+	FUNCTION_END(context);
+
+	FUNCTION_FREE_TEXT_ARG(db_name);
+	FUNCTION_FREE_TEXT_ARG(table_name);
+	FUNCTION_FREE_TEXT_ARG(geometry_column_name);
+}
+
+/*
+** GPKG_CreateSpatialIndexCountCache([db,] table, geometry) caches rtree subtree counts for udbx_bbox_count
+*/
+static void GPKG_CreateSpatialIndexCountCache(sqlite3_context *context, int nbArgs, sqlite3_value **args) {
+	FUNCTION_TEXT_ARG(db_name);
+	FUNCTION_TEXT_ARG(table_name);
+	FUNCTION_TEXT_ARG(geometry_column_name);
+	FUNCTION_START(context);
+
+	if (nbArgs == 3) {
+		FUNCTION_GET_TEXT_ARG(context, db_name, 0);
+		FUNCTION_GET_TEXT_ARG(context, table_name, 1);
+		FUNCTION_GET_TEXT_ARG(context, geometry_column_name, 2);
+	}
+	else {
+		FUNCTION_SET_TEXT_ARG(db_name, "main");
+		FUNCTION_GET_TEXT_ARG(context, table_name, 0);
+		FUNCTION_GET_TEXT_ARG(context, geometry_column_name, 1);
+	}
+
+	FUNCTION_START_TRANSACTION(__create_count_cache);
+	FUNCTION_RESULT = spatial_index_count_cache_create(FUNCTION_DB_HANDLE, db_name, table_name, geometry_column_name, FUNCTION_ERROR);
+	FUNCTION_END_TRANSACTION(__create_count_cache);
 
-	sqlite3_result_text(context, spatialdb->name, -1, SQLITE_STATIC);
+	if (FUNCTION_RESULT == SQLITE_OK) {
+		sqlite3_result_null(context);
+	}
 
 	FUNCTION_END(context);
+
+	FUNCTION_FREE_TEXT_ARG(db_name);
+	FUNCTION_FREE_TEXT_ARG(table_name);
+	FUNCTION_FREE_TEXT_ARG(geometry_column_name);
 }
 
-static void GPKG_CheckSpatialMetaData(sqlite3_context *context, int nbArgs, sqlite3_value **args) {
+/*
+** GPKG_CreateSpatialKeyIndex([db,] table, geometry, id [, xmin, ymin, xmax, ymax]) creates a Morton key
+** B-tree index on a point column. Without an explicit extent the current extent of the data is used; points
+** added outside of it later are still found but share the border cells of the grid.
+*/
+static void GPKG_CreateSpatialKeyIndex(sqlite3_context *context, int nbArgs, sqlite3_value **args) {
 	spatialdb_t *spatialdb;
+	double extent[4];
+	int base = (nbArgs == 4 || nbArgs == 8) ? 1 : 0;
+	int i;
 	FUNCTION_TEXT_ARG(db_name);
-	FUNCTION_INT_ARG(check);
-	FUNCTION_INT_ARG(type);
+	FUNCTION_TEXT_ARG(table_name);
+	FUNCTION_TEXT_ARG(geometry_column_name);
+	FUNCTION_TEXT_ARG(id_column_name);
 	FUNCTION_START(context);
 
 	spatialdb = (spatialdb_t *)sqlite3_user_data(context);
-	if (nbArgs == 0) {
-		FUNCTION_SET_TEXT_ARG(db_name, "main");
-		FUNCTION_SET_INT_ARG(check, 0);
-	}
-	else if (nbArgs == 1) {
-		FUNCTION_GET_TYPE(type, 0);
-		if (type == SQLITE_TEXT) {
-			FUNCTION_GET_TEXT_ARG(context, db_name, 0);
-		}
-		else {
-			FUNCTION_SET_TEXT_ARG(db_name, "main");
-			FUNCTION_GET_INT_ARG(check, 0);
-		}
+	if (base) {
+		FUNCTION_GET_TEXT_ARG(context, db_name, 0);
 	}
 	else {
-		FUNCTION_GET_TEXT_ARG(context, db_name, 0);
-		FUNCTION_GET_INT_ARG(check, 1);
+		FUNCTION_SET_TEXT_ARG(db_name, "main");
+	}
+	FUNCTION_GET_TEXT_ARG(context, table_name, base);
+	FUNCTION_GET_TEXT_ARG(context, geometry_column_name, base + 1);
+	FUNCTION_GET_TEXT_ARG(context, id_column_name, base + 2);
+	for (i = 0; i < 4 && base + 3 + i < nbArgs; i++) {
+		extent[i] = sqlite3_value_double(args[base + 3 + i]);
 	}
 
-	if (check != 0) {
-		check = SQL_CHECK_ALL;
+	FUNCTION_START_TRANSACTION(__create_spatial_key_index);
+
+	FUNCTION_RESULT = spatialdb->init_meta(FUNCTION_DB_HANDLE, db_name, FUNCTION_ERROR);
+	if (FUNCTION_RESULT == SQLITE_OK) {
+		FUNCTION_RESULT = spatial_key_index_create(FUNCTION_DB_HANDLE, db_name, table_name, geometry_column_name, id_column_name, base + 3 < nbArgs ? extent : NULL, FUNCTION_ERROR);
 	}
 
-	FUNCTION_RESULT = spatialdb->check_meta(FUNCTION_DB_HANDLE, db_name, check, FUNCTION_ERROR);
+	FUNCTION_END_TRANSACTION(__create_spatial_key_index);
+
 	if (FUNCTION_RESULT == SQLITE_OK) {
 		sqlite3_result_null(context);
 	}
@@ -2035,26 +5093,31 @@ static void GPKG_CheckSpatialMetaData(sqlite3_context *context, int nbArgs, sqli
 	FUNCTION_END(context);
 
 	FUNCTION_FREE_TEXT_ARG(db_name);
-	FUNCTION_FREE_INT_ARG(check);
-	FUNCTION_FREE_INT_ARG(type);
+	FUNCTION_FREE_TEXT_ARG(table_name);
+	FUNCTION_FREE_TEXT_ARG(geometry_column_name);
+	FUNCTION_FREE_TEXT_ARG(id_column_name);
 }
 
-static void GPKG_InitSpatialMetaData(sqlite3_context *context, int nbArgs, sqlite3_value **args) {
-	spatialdb_t *spatialdb;
+static void GPKG_DropSpatialKeyIndex(sqlite3_context *context, int nbArgs, sqlite3_value **args) {
 	FUNCTION_TEXT_ARG(db_name);
-
+	FUNCTION_TEXT_ARG(table_name);
+	FUNCTION_TEXT_ARG(geometry_column_name);
 	FUNCTION_START(context);
-	spatialdb = (spatialdb_t *)sqlite3_user_data(context);
-	if (nbArgs == 0) {
-		FUNCTION_SET_TEXT_ARG(db_name, "main");
+
+	if (nbArgs == 3) {
+		FUNCTION_GET_TEXT_ARG(context, db_name, 0);
+		FUNCTION_GET_TEXT_ARG(context, table_name, 1);
+		FUNCTION_GET_TEXT_ARG(context, geometry_column_name, 2);
 	}
 	else {
-		FUNCTION_GET_TEXT_ARG(context, db_name, 0);
+		FUNCTION_SET_TEXT_ARG(db_name, "main");
+		FUNCTION_GET_TEXT_ARG(context, table_name, 0);
+		FUNCTION_GET_TEXT_ARG(context, geometry_column_name, 1);
 	}
 
-	FUNCTION_START_TRANSACTION(__initspatialdb);
-	FUNCTION_RESULT = spatialdb->init_meta(FUNCTION_DB_HANDLE, db_name, FUNCTION_ERROR);
-	FUNCTION_END_TRANSACTION(__initspatialdb);
+	FUNCTION_START_TRANSACTION(__drop_spatial_key_index);
+	FUNCTION_RESULT = spatial_key_index_drop(FUNCTION_DB_HANDLE, db_name, table_name, geometry_column_name, FUNCTION_ERROR);
+	FUNCTION_END_TRANSACTION(__drop_spatial_key_index);
 
 	if (FUNCTION_RESULT == SQLITE_OK) {
 		sqlite3_result_null(context);
@@ -2063,71 +5126,70 @@ static void GPKG_InitSpatialMetaData(sqlite3_context *context, int nbArgs, sqlit
 	FUNCTION_END(context);
 
 	FUNCTION_FREE_TEXT_ARG(db_name);
+	FUNCTION_FREE_TEXT_ARG(table_name);
+	FUNCTION_FREE_TEXT_ARG(geometry_column_name);
 }
 
 /*
-* Supports the following parameter lists:
-* 4: table, column, type, srid
-* 5: db, table, column, type, srid
-* 6: table, column, type, srid, z, m
-* 7: db, table, column, type, srid, z, m
+** GPKG_CreateClusterIndex([db,] table, geometry, radius, max_zoom) precomputes the point clusters of zoom levels 0
+** to max_zoom for udbx_cluster. The radius is in pixels of 256 pixel tiles and must match the one passed to
+** udbx_cluster for the index to be used.
 */
-static void GPKG_AddGeometryColumn(sqlite3_context *context, int nbArgs, sqlite3_value **args) {
-	spatialdb_t *spatialdb;
+static void GPKG_CreateClusterIndex(sqlite3_context *context, int nbArgs, sqlite3_value **args) {
+	int base = nbArgs == 5 ? 1 : 0;
+	double radius;
+	int max_zoom;
 	FUNCTION_TEXT_ARG(db_name);
 	FUNCTION_TEXT_ARG(table_name);
-	FUNCTION_TEXT_ARG(column_name);
-	FUNCTION_TEXT_ARG(geometry_type);
-	FUNCTION_INT_ARG(srs_id);
-	FUNCTION_INT_ARG(z);
-	FUNCTION_INT_ARG(m);
+	FUNCTION_TEXT_ARG(geometry_column_name);
 	FUNCTION_START(context);
 
-	spatialdb = (spatialdb_t *)sqlite3_user_data(context);
-	if (nbArgs == 4) {
-		FUNCTION_SET_TEXT_ARG(db_name, "main");
-		FUNCTION_GET_TEXT_ARG(context, table_name, 0);
-		FUNCTION_GET_TEXT_ARG(context, column_name, 1);
-		FUNCTION_GET_TEXT_ARG(context, geometry_type, 2);
-		FUNCTION_GET_INT_ARG(srs_id, 3);
-		FUNCTION_SET_INT_ARG(z, 2);
-		FUNCTION_SET_INT_ARG(m, 2);
-	}
-	else if (nbArgs == 5) {
+	if (base) {
 		FUNCTION_GET_TEXT_ARG(context, db_name, 0);
-		FUNCTION_GET_TEXT_ARG(context, table_name, 1);
-		FUNCTION_GET_TEXT_ARG(context, column_name, 2);
-		FUNCTION_GET_TEXT_ARG(context, geometry_type, 3);
-		FUNCTION_GET_INT_ARG(srs_id, 4);
 	}
-	else if (nbArgs == 6) {
+	else {
 		FUNCTION_SET_TEXT_ARG(db_name, "main");
-		FUNCTION_GET_TEXT_ARG(context, table_name, 0);
-		FUNCTION_GET_TEXT_ARG(context, column_name, 1);
-		FUNCTION_GET_TEXT_ARG(context, geometry_type, 2);
-		FUNCTION_GET_INT_ARG(srs_id, 3);
-		FUNCTION_GET_INT_ARG(z, 4);
-		FUNCTION_GET_INT_ARG(m, 5);
 	}
-	else {
-		FUNCTION_GET_TEXT_ARG(context, db_name, 0);
-		FUNCTION_GET_TEXT_ARG(context, table_name, 1);
-		FUNCTION_GET_TEXT_ARG(context, column_name, 2);
-		FUNCTION_GET_TEXT_ARG(context, geometry_type, 3);
-		FUNCTION_GET_INT_ARG(srs_id, 4);
-		FUNCTION_GET_INT_ARG(z, 5);
-		FUNCTION_GET_INT_ARG(m, 6);
+	FUNCTION_GET_TEXT_ARG(context, table_name, base);
+	FUNCTION_GET_TEXT_ARG(context, geometry_column_name, base + 1);
+	radius = sqlite3_value_double(args[base + 2]);
+	FUNCTION_GET_INT_ARG(max_zoom, base + 3);
+
+	FUNCTION_START_TRANSACTION(__create_cluster_index);
+	FUNCTION_RESULT = point_cluster_index_create(FUNCTION_DB_HANDLE, db_name, table_name, geometry_column_name, radius, max_zoom, FUNCTION_ERROR);
+	FUNCTION_END_TRANSACTION(__create_cluster_index);
+
+	if (FUNCTION_RESULT == SQLITE_OK) {
+		sqlite3_result_null(context);
 	}
 
-	FUNCTION_START_TRANSACTION(__add_geom_col);
+	FUNCTION_END(context);
 
-	FUNCTION_RESULT = spatialdb->init_meta(FUNCTION_DB_HANDLE, db_name, FUNCTION_ERROR);
+	FUNCTION_FREE_TEXT_ARG(db_name);
+	FUNCTION_FREE_TEXT_ARG(table_name);
+	FUNCTION_FREE_TEXT_ARG(geometry_column_name);
+}
 
-	if (FUNCTION_RESULT == SQLITE_OK) {
-		FUNCTION_RESULT = spatialdb->add_geometry_column(FUNCTION_DB_HANDLE, db_name, table_name, column_name, geometry_type, srs_id, z, m, FUNCTION_ERROR);
+static void GPKG_DropClusterIndex(sqlite3_context *context, int nbArgs, sqlite3_value **args) {
+	FUNCTION_TEXT_ARG(db_name);
+	FUNCTION_TEXT_ARG(table_name);
+	FUNCTION_TEXT_ARG(geometry_column_name);
+	FUNCTION_START(context);
+
+	if (nbArgs == 3) {
+		FUNCTION_GET_TEXT_ARG(context, db_name, 0);
+		FUNCTION_GET_TEXT_ARG(context, table_name, 1);
+		FUNCTION_GET_TEXT_ARG(context, geometry_column_name, 2);
+	}
+	else {
+		FUNCTION_SET_TEXT_ARG(db_name, "main");
+		FUNCTION_GET_TEXT_ARG(context, table_name, 0);
+		FUNCTION_GET_TEXT_ARG(context, geometry_column_name, 1);
 	}
 
-	FUNCTION_END_TRANSACTION(__add_geom_col);
+	FUNCTION_START_TRANSACTION(__drop_cluster_index);
+	FUNCTION_RESULT = point_cluster_index_drop(FUNCTION_DB_HANDLE, db_name, table_name, geometry_column_name, FUNCTION_ERROR);
+	FUNCTION_END_TRANSACTION(__drop_cluster_index);
 
 	if (FUNCTION_RESULT == SQLITE_OK) {
 		sqlite3_result_null(context);
@@ -2137,42 +5199,47 @@ static void GPKG_AddGeometryColumn(sqlite3_context *context, int nbArgs, sqlite3
 
 	FUNCTION_FREE_TEXT_ARG(db_name);
 	FUNCTION_FREE_TEXT_ARG(table_name);
-	FUNCTION_FREE_TEXT_ARG(column_name);
-	FUNCTION_FREE_TEXT_ARG(geometry_type);
-	FUNCTION_FREE_INT_ARG(srid);
-	FUNCTION_FREE_INT_ARG(z);
-	FUNCTION_FREE_INT_ARG(m);
+	FUNCTION_FREE_TEXT_ARG(geometry_column_name);
 }
 
-static void GPKG_CreateTilesTable(sqlite3_context *context, int nbArgs, sqlite3_value **args) {
+/*
+** GPKG_CreateSummaryPyramid([db,] table, geometry, max_level [, xmin, ymin, xmax, ymax]) creates the quadtree summary
+** pyramid pyramid_<table>_<geometry> holding the feature count and extent of every non-empty cell of levels 0 to
+** max_level. Without an explicit extent the current extent of the data is used.
+*/
+static void GPKG_CreateSummaryPyramid(sqlite3_context *context, int nbArgs, sqlite3_value **args) {
 	spatialdb_t *spatialdb;
+	double extent[4];
+	int base = (nbArgs == 4 || nbArgs == 8) ? 1 : 0;
+	int max_level;
+	int i;
 	FUNCTION_TEXT_ARG(db_name);
 	FUNCTION_TEXT_ARG(table_name);
+	FUNCTION_TEXT_ARG(geometry_column_name);
 	FUNCTION_START(context);
 
 	spatialdb = (spatialdb_t *)sqlite3_user_data(context);
-	if (nbArgs == 2) {
+	if (base) {
 		FUNCTION_GET_TEXT_ARG(context, db_name, 0);
-		FUNCTION_GET_TEXT_ARG(context, table_name, 1);
 	}
 	else {
 		FUNCTION_SET_TEXT_ARG(db_name, "main");
-		FUNCTION_GET_TEXT_ARG(context, table_name, 0);
 	}
-
-	if (spatialdb->create_tiles_table == NULL) {
-		error_append(FUNCTION_ERROR, "Tiles tables are not supported in %s mode", spatialdb->name);
-		goto exit;
+	FUNCTION_GET_TEXT_ARG(context, table_name, base);
+	FUNCTION_GET_TEXT_ARG(context, geometry_column_name, base + 1);
+	FUNCTION_GET_INT_ARG(max_level, base + 2);
+	for (i = 0; i < 4 && base + 3 + i < nbArgs; i++) {
+		extent[i] = sqlite3_value_double(args[base + 3 + i]);
 	}
 
-	FUNCTION_START_TRANSACTION(__create_tiles_table);
+	FUNCTION_START_TRANSACTION(__create_summary_pyramid);
 
 	FUNCTION_RESULT = spatialdb->init_meta(FUNCTION_DB_HANDLE, db_name, FUNCTION_ERROR);
 	if (FUNCTION_RESULT == SQLITE_OK) {
-		FUNCTION_RESULT = spatialdb->create_tiles_table(FUNCTION_DB_HANDLE, db_name, table_name, FUNCTION_ERROR);
+		FUNCTION_RESULT = summary_pyramid_create(FUNCTION_DB_HANDLE, db_name, table_name, geometry_column_name, max_level, base + 3 < nbArgs ? extent : NULL, FUNCTION_ERROR);
 	}
 
-	FUNCTION_END_TRANSACTION(__create_tiles_table);
+	FUNCTION_END_TRANSACTION(__create_summary_pyramid);
 
 	if (FUNCTION_RESULT == SQLITE_OK) {
 		sqlite3_result_null(context);
@@ -2182,46 +5249,78 @@ static void GPKG_CreateTilesTable(sqlite3_context *context, int nbArgs, sqlite3_
 
 	FUNCTION_FREE_TEXT_ARG(db_name);
 	FUNCTION_FREE_TEXT_ARG(table_name);
+	FUNCTION_FREE_TEXT_ARG(geometry_column_name);
 }
 
-static void GPKG_CreateSpatialIndex(sqlite3_context *context, int nbArgs, sqlite3_value **args) {
-	spatialdb_t *spatialdb;
+static void GPKG_DropSummaryPyramid(sqlite3_context *context, int nbArgs, sqlite3_value **args) {
 	FUNCTION_TEXT_ARG(db_name);
 	FUNCTION_TEXT_ARG(table_name);
 	FUNCTION_TEXT_ARG(geometry_column_name);
-	FUNCTION_TEXT_ARG(id_column_name);
 	FUNCTION_START(context);
 
-	spatialdb = (spatialdb_t *)sqlite3_user_data(context);
-	if (nbArgs == 4) {
+	if (nbArgs == 3) {
 		FUNCTION_GET_TEXT_ARG(context, db_name, 0);
 		FUNCTION_GET_TEXT_ARG(context, table_name, 1);
 		FUNCTION_GET_TEXT_ARG(context, geometry_column_name, 2);
-		FUNCTION_GET_TEXT_ARG(context, id_column_name, 3);
 	}
 	else {
 		FUNCTION_SET_TEXT_ARG(db_name, "main");
 		FUNCTION_GET_TEXT_ARG(context, table_name, 0);
 		FUNCTION_GET_TEXT_ARG(context, geometry_column_name, 1);
-		FUNCTION_GET_TEXT_ARG(context, id_column_name, 2);
 	}
 
-	if (spatialdb->create_spatial_index == NULL) {
-		error_append(FUNCTION_ERROR, "Spatial indexes are not supported in %s mode", spatialdb->name);
-		goto exit;
+	FUNCTION_START_TRANSACTION(__drop_summary_pyramid);
+	FUNCTION_RESULT = summary_pyramid_drop(FUNCTION_DB_HANDLE, db_name, table_name, geometry_column_name, FUNCTION_ERROR);
+	FUNCTION_END_TRANSACTION(__drop_summary_pyramid);
+
+	if (FUNCTION_RESULT == SQLITE_OK) {
+		sqlite3_result_null(context);
 	}
 
-	FUNCTION_START_TRANSACTION(__create_spatial_index);
+	FUNCTION_END(context);
 
-	FUNCTION_RESULT = spatialdb->init_meta(FUNCTION_DB_HANDLE, db_name, FUNCTION_ERROR);
-	if (FUNCTION_RESULT == SQLITE_OK) {
-		FUNCTION_RESULT = spatialdb->create_spatial_index(FUNCTION_DB_HANDLE, db_name, table_name, geometry_column_name, id_column_name, FUNCTION_ERROR);
+	FUNCTION_FREE_TEXT_ARG(db_name);
+	FUNCTION_FREE_TEXT_ARG(table_name);
+	FUNCTION_FREE_TEXT_ARG(geometry_column_name);
+}
+
+/*
+** GPKG_ClusterTable([db_name,] table_name, column_name [, batch_size])
+** Performs one step of rewriting a feature table in Hilbert order; returns 1 while more steps are needed and 0 once
+** the table has been clustered. Call it in a loop until it returns 0. Clustering renumbers the primary keys: rows get
+** new keys 1 to n in curve order and the old to new mapping is recorded in udbx_cluster_map. Tables whose keys are
+** referenced are refused, and so are tables that already have a mapping in udbx_cluster_map.
+*/
+static void GPKG_ClusterTable(sqlite3_context *context, int nbArgs, sqlite3_value **args) {
+	spatialdb_t *spatialdb;
+	int first_arg = 0;
+	int batch_size = 10000;
+	int done = 0;
+	FUNCTION_TEXT_ARG(db_name);
+	FUNCTION_TEXT_ARG(table_name);
+	FUNCTION_TEXT_ARG(geometry_column_name);
+	FUNCTION_START(context);
+
+	spatialdb = (spatialdb_t *)sqlite3_user_data(context);
+	if (nbArgs == 4 || (nbArgs == 3 && sqlite3_value_type(args[2]) != SQLITE_INTEGER)) {
+		FUNCTION_GET_TEXT_ARG(context, db_name, 0);
+		first_arg = 1;
+	}
+	else {
+		FUNCTION_SET_TEXT_ARG(db_name, "main");
+	}
+	FUNCTION_GET_TEXT_ARG(context, table_name, first_arg);
+	FUNCTION_GET_TEXT_ARG(context, geometry_column_name, first_arg + 1);
+	if (nbArgs > first_arg + 2) {
+		batch_size = sqlite3_value_int(args[first_arg + 2]);
 	}
 
-	FUNCTION_END_TRANSACTION(__create_spatial_index);
+	FUNCTION_START_TRANSACTION(__cluster_table);
+	FUNCTION_RESULT = cluster_table_step(FUNCTION_DB_HANDLE, spatialdb, db_name, table_name, geometry_column_name, batch_size, &done, FUNCTION_ERROR);
+	FUNCTION_END_TRANSACTION(__cluster_table);
 
 	if (FUNCTION_RESULT == SQLITE_OK) {
-		sqlite3_result_null(context);
+		sqlite3_result_int(context, !done);
 	}
 
 	FUNCTION_END(context);
@@ -2229,7 +5328,6 @@ static void GPKG_CreateSpatialIndex(sqlite3_context *context, int nbArgs, sqlite
 	FUNCTION_FREE_TEXT_ARG(db_name);
 	FUNCTION_FREE_TEXT_ARG(table_name);
 	FUNCTION_FREE_TEXT_ARG(geometry_column_name);
-	FUNCTION_FREE_TEXT_ARG(id_column_name);
 }
 
 static void GPKG_DropSpatialIndex(sqlite3_context *context, int nbArgs, sqlite3_value **args) {
@@ -2323,6 +5421,12 @@ const spatialdb_t *spatialdb_detect_schema(sqlite3 *db) {
     sql_create_function(db, STR(pre##_##name), pre##_##func, args, flags, (void*)spatialdb, NULL, err);                \
   } while (0)
 
+#define SPATIALDB_AGGREGATE(db, pre, name, args, flags, spatialdb, err)                                                \
+  do {                                                                                                                 \
+    sql_create_aggregate(db, STR(name), pre##_##name##_step, pre##_##name##_final, args, flags, (void*)spatialdb, err); \
+    sql_create_aggregate(db, STR(pre##_##name), pre##_##name##_step, pre##_##name##_final, args, flags, (void*)spatialdb, err); \
+  } while (0)
+
 #define FROMTEXT_FUNCTION(db, pre, name, args, flags, ft, err)                                                         \
   do {                                                                                                                 \
     fromtext_acquire(fromtext);                                                                                        \
@@ -2404,6 +5508,8 @@ int RegisterExtensionFunctions(sqlite3 *db) {
 		{ "padc",               2, 0, SQLITE_UTF8,    0, padcFunc },
 		{ "strfilter",          2, 0, SQLITE_UTF8,    0, strfilterFunc },
 
+		{ "approx_count_distinct_estimate", 1, 0, SQLITE_UTF8, 0, approxCountDistinctEstimateFunc },
+
 	};
 	/* Aggregate functions */
 	static const struct FuncDefAgg {
@@ -2420,6 +5526,20 @@ int RegisterExtensionFunctions(sqlite3 *db) {
 		{ "median",           1, 0, 0, modeStep,     medianFinalize },
 		{ "lower_quartile",   1, 0, 0, modeStep,     lower_quartileFinalize },
 		{ "upper_quartile",   1, 0, 0, modeStep,     upper_quartileFinalize },
+		{ "percentile",       2, 0, 0, percentileStep, percentileFinalize },
+		{ "approx_percentile", 2, 0, 0, approxPercentileStep, approxPercentileFinalize },
+		{ "approx_percentile", 3, 0, 0, approxPercentileStep, approxPercentileFinalize },
+		{ "approx_percentile_state", 1, 0, 0, approxPercentileStateStep, approxPercentileStateFinalize },
+		{ "approx_percentile_state", 2, 0, 0, approxPercentileStateStep, approxPercentileStateFinalize },
+		{ "approx_percentile_merge", 1, 0, 0, approxPercentileMergeStep, approxPercentileStateFinalize },
+		{ "approx_percentile_merge", 2, 0, 0, approxPercentileMergeStep, approxPercentileFinalize },
+		{ "approx_topk",      2, 0, 0, approxTopkStep, approxTopkFinalize },
+		{ "approx_topk",      3, 0, 0, approxTopkStep, approxTopkFinalize },
+		{ "approx_count_distinct", 1, 0, 0, approxCountDistinctStep, approxCountDistinctFinalize },
+		{ "approx_count_distinct", 2, 0, 0, approxCountDistinctStep, approxCountDistinctFinalize },
+		{ "approx_count_distinct_state", 1, 0, 0, approxCountDistinctStep, approxCountDistinctStateFinalize },
+		{ "approx_count_distinct_state", 2, 0, 0, approxCountDistinctStep, approxCountDistinctStateFinalize },
+		{ "approx_count_distinct_merge", 1, 0, 0, approxCountDistinctMergeStep, approxCountDistinctStateFinalize },
 	};
 	int i;
 
@@ -2465,6 +5585,35 @@ int RegisterExtensionFunctions(sqlite3 *db) {
 #endif
 	}
 
+#if SQLITE_VERSION_NUMBER >= 3025000
+	/*
+	** With window function support the aggregates that can remove values are registered again with
+	** inverse steps, so sliding frames are updated per row instead of aggregating the whole frame.
+	*/
+	static const struct FuncDefWindow {
+		char *zName;
+		signed char nArg;
+		void(*xStep)(sqlite3_context*, int, sqlite3_value**);
+		void(*xFinalize)(sqlite3_context*);
+		void(*xValue)(sqlite3_context*);
+		void(*xInverse)(sqlite3_context*, int, sqlite3_value**);
+	} aWindows[] = {
+		{ "stdev",            1, varianceStep,   stdevFinalize,          stdevFinalize,          varianceInverse },
+		{ "variance",         1, varianceStep,   varianceFinalize,       varianceFinalize,       varianceInverse },
+		{ "median",           1, modeStep,       medianFinalize,         medianValue,            modeInverse },
+		{ "lower_quartile",   1, modeStep,       lower_quartileFinalize, lower_quartileValue,    modeInverse },
+		{ "upper_quartile",   1, modeStep,       upper_quartileFinalize, upper_quartileValue,    modeInverse },
+		{ "percentile",       2, percentileStep, percentileFinalize,     percentileValue,        modeInverse },
+	};
+
+	if (sqlite3_libversion_number() >= 3025000) {
+		for (i = 0; i<sizeof(aWindows) / sizeof(aWindows[0]); i++) {
+			sqlite3_create_window_function(db, aWindows[i].zName, aWindows[i].nArg, SQLITE_UTF8, 0,
+				aWindows[i].xStep, aWindows[i].xFinalize, aWindows[i].xValue, aWindows[i].xInverse, 0);
+		}
+	}
+#endif
+
 	errorstream_t error;
 	if (error_init(&error) != SQLITE_OK) {
 		return SQLITE_ERROR;
@@ -2486,6 +5635,44 @@ int RegisterExtensionFunctions(sqlite3 *db) {
 	SPATIALDB_FUNCTION(db, ST, MaxZ, 1, SQL_DETERMINISTIC, spatialdb, &error);
 	SPATIALDB_FUNCTION(db, ST, MinM, 1, SQL_DETERMINISTIC, spatialdb, &error);
 	SPATIALDB_FUNCTION(db, ST, MaxM, 1, SQL_DETERMINISTIC, spatialdb, &error);
+	SPATIALDB_AGGREGATE(db, ST, Extent, 1, SQL_DETERMINISTIC, spatialdb, &error);
+	SPATIALDB_AGGREGATE(db, ST, Collect, 1, SQL_DETERMINISTIC, spatialdb, &error);
+	SPATIALDB_AGGREGATE(db, ST, ConvexHullAgg, 1, SQL_DETERMINISTIC, spatialdb, &error);
+	SPATIALDB_FUNCTION(db, ST, MortonKey, 5, SQL_DETERMINISTIC, spatialdb, &error);
+	SPATIALDB_FUNCTION(db, ST, HilbertKey, 5, SQL_DETERMINISTIC, spatialdb, &error);
+	SPATIALDB_FUNCTION(db, ST, SnapToGridKey, 2, SQL_DETERMINISTIC, spatialdb, &error);
+	SPATIALDB_FUNCTION(db, ST, HexbinKey, 2, SQL_DETERMINISTIC, spatialdb, &error);
+	SPATIALDB_FUNCTION(db, ST, EnvIntersects, 2, SQL_DETERMINISTIC, spatialdb, &error);
+	SPATIALDB_FUNCTION(db, ST, EnvIntersects, 5, SQL_DETERMINISTIC, spatialdb, &error);
+	SPATIALDB_FUNCTION(db, ST, Intersects, 2, SQL_DETERMINISTIC, spatialdb, &error);
+	SPATIALDB_FUNCTION(db, ST, Distance, 2, SQL_DETERMINISTIC, spatialdb, &error);
+	SPATIALDB_FUNCTION(db, ST, DWithin, 3, SQL_DETERMINISTIC, spatialdb, &error);
+	SPATIALDB_FUNCTION(db, ST, Area, 1, SQL_DETERMINISTIC, spatialdb, &error);
+	// Only the prefixed name; an unprefixed Length would replace the built-in length()
+	sql_create_function(db, "ST_Length", ST_Length, 1, SQL_DETERMINISTIC, (void*)spatialdb, NULL, &error);
+	SPATIALDB_FUNCTION(db, ST, Perimeter, 1, SQL_DETERMINISTIC, spatialdb, &error);
+	SPATIALDB_FUNCTION(db, ST, Area, 2, SQL_DETERMINISTIC, spatialdb, &error);
+	sql_create_function(db, "ST_Length", ST_Length, 2, SQL_DETERMINISTIC, (void*)spatialdb, NULL, &error);
+	SPATIALDB_FUNCTION(db, ST, Perimeter, 2, SQL_DETERMINISTIC, spatialdb, &error);
+	SPATIALDB_FUNCTION(db, ST, Centroid, 1, SQL_DETERMINISTIC, spatialdb, &error);
+	SPATIALDB_FUNCTION(db, ST, LengthSpheroid, 1, SQL_DETERMINISTIC, spatialdb, &error);
+	SPATIALDB_FUNCTION(db, ST, LengthSphere, 1, SQL_DETERMINISTIC, spatialdb, &error);
+	SPATIALDB_FUNCTION(db, ST, DistanceSphere, 2, SQL_DETERMINISTIC, spatialdb, &error);
+	SPATIALDB_FUNCTION(db, ST, DistanceSpheroid, 2, SQL_DETERMINISTIC, spatialdb, &error);
+	SPATIALDB_FUNCTION(db, ST, Transform, 2, SQL_DETERMINISTIC, spatialdb, &error);
+	SPATIALDB_FUNCTION(db, ST, Affine, 7, SQL_DETERMINISTIC, spatialdb, &error);
+	SPATIALDB_FUNCTION(db, ST, Affine, 13, SQL_DETERMINISTIC, spatialdb, &error);
+	SPATIALDB_FUNCTION(db, ST, Translate, 3, SQL_DETERMINISTIC, spatialdb, &error);
+	SPATIALDB_FUNCTION(db, ST, Translate, 4, SQL_DETERMINISTIC, spatialdb, &error);
+	SPATIALDB_FUNCTION(db, ST, Scale, 3, SQL_DETERMINISTIC, spatialdb, &error);
+	SPATIALDB_FUNCTION(db, ST, Scale, 4, SQL_DETERMINISTIC, spatialdb, &error);
+	SPATIALDB_FUNCTION(db, ST, Simplify, 2, SQL_DETERMINISTIC, spatialdb, &error);
+	SPATIALDB_FUNCTION(db, ST, SimplifyVW, 2, SQL_DETERMINISTIC, spatialdb, &error);
+	SPATIALDB_FUNCTION(db, ST, ClipByBox, 5, SQL_DETERMINISTIC, spatialdb, &error);
+	SPATIALDB_FUNCTION(db, ST, CurveToLine, 2, SQL_DETERMINISTIC, spatialdb, &error);
+	SPATIALDB_FUNCTION(db, ST, ConvexHull, 1, SQL_DETERMINISTIC, spatialdb, &error);
+	SPATIALDB_FUNCTION(db, ST, AsRenderBinary, 4, SQL_DETERMINISTIC, spatialdb, &error);
+	SPATIALDB_FUNCTION(db, ST, AsRenderBinary, 7, SQL_DETERMINISTIC, spatialdb, &error);
 	SPATIALDB_FUNCTION(db, ST, SRID, 1, SQL_DETERMINISTIC, spatialdb, &error);
 	SPATIALDB_FUNCTION(db, ST, SRID, 2, SQL_DETERMINISTIC, spatialdb, &error);
 	SPATIALDB_FUNCTION(db, ST, Is3d, 1, SQL_DETERMINISTIC, spatialdb, &error);
@@ -2538,10 +5725,46 @@ int RegisterExtensionFunctions(sqlite3 *db) {
 	SPATIALDB_FUNCTION(db, GPKG, CreateTilesTable, 2, 0, spatialdb, &error);
 	SPATIALDB_FUNCTION(db, GPKG, CreateSpatialIndex, 3, 0, spatialdb, &error);
 	SPATIALDB_FUNCTION(db, GPKG, CreateSpatialIndex, 4, 0, spatialdb, &error);
+	SPATIALDB_FUNCTION(db, GPKG, CreateSpatialIndexZM, 4, 0, spatialdb, &error);
+	SPATIALDB_FUNCTION(db, GPKG, CreateSpatialIndexZM, 5, 0, spatialdb, &error);
+	SPATIALDB_FUNCTION(db, GPKG, CreateSpatialIndexStep, 4, 0, spatialdb, &error);
+	SPATIALDB_FUNCTION(db, GPKG, CreateSpatialIndexStep, 5, 0, spatialdb, &error);
+	SPATIALDB_FUNCTION(db, GPKG, CreateSpatialIndexStep, 6, 0, spatialdb, &error);
+	SPATIALDB_FUNCTION(db, GPKG, SpatialIndexProgress, 2, 0, spatialdb, &error);
+	SPATIALDB_FUNCTION(db, GPKG, SpatialIndexProgress, 3, 0, spatialdb, &error);
+	SPATIALDB_FUNCTION(db, GPKG, Extent, 2, 0, spatialdb, &error);
+	SPATIALDB_FUNCTION(db, GPKG, Extent, 3, 0, spatialdb, &error);
+	SPATIALDB_FUNCTION(db, GPKG, CreateSpatialIndexCountCache, 2, 0, spatialdb, &error);
+	SPATIALDB_FUNCTION(db, GPKG, CreateSpatialIndexCountCache, 3, 0, spatialdb, &error);
+	sql_create_function(db, "udbx_bbox_count", udbx_bbox_count, 6, 0, (void *)spatialdb, NULL, &error);
+	sql_create_function(db, "udbx_bbox_count", udbx_bbox_count, 7, 0, (void *)spatialdb, NULL, &error);
+	sql_create_function(db, "udbx_bbox_count", udbx_bbox_count, 8, 0, (void *)spatialdb, NULL, &error);
+	SPATIALDB_FUNCTION(db, GPKG, CreateSpatialKeyIndex, 3, 0, spatialdb, &error);
+	SPATIALDB_FUNCTION(db, GPKG, CreateSpatialKeyIndex, 4, 0, spatialdb, &error);
+	SPATIALDB_FUNCTION(db, GPKG, CreateSpatialKeyIndex, 7, 0, spatialdb, &error);
+	SPATIALDB_FUNCTION(db, GPKG, CreateSpatialKeyIndex, 8, 0, spatialdb, &error);
+	SPATIALDB_FUNCTION(db, GPKG, DropSpatialKeyIndex, 2, 0, spatialdb, &error);
+	SPATIALDB_FUNCTION(db, GPKG, DropSpatialKeyIndex, 3, 0, spatialdb, &error);
+	SPATIALDB_FUNCTION(db, GPKG, CreateClusterIndex, 4, 0, spatialdb, &error);
+	SPATIALDB_FUNCTION(db, GPKG, CreateClusterIndex, 5, 0, spatialdb, &error);
+	SPATIALDB_FUNCTION(db, GPKG, DropClusterIndex, 2, 0, spatialdb, &error);
+	SPATIALDB_FUNCTION(db, GPKG, DropClusterIndex, 3, 0, spatialdb, &error);
+	SPATIALDB_FUNCTION(db, GPKG, CreateSummaryPyramid, 3, 0, spatialdb, &error);
+	SPATIALDB_FUNCTION(db, GPKG, CreateSummaryPyramid, 4, 0, spatialdb, &error);
+	SPATIALDB_FUNCTION(db, GPKG, CreateSummaryPyramid, 7, 0, spatialdb, &error);
+	SPATIALDB_FUNCTION(db, GPKG, CreateSummaryPyramid, 8, 0, spatialdb, &error);
+	SPATIALDB_FUNCTION(db, GPKG, DropSummaryPyramid, 2, 0, spatialdb, &error);
+	SPATIALDB_FUNCTION(db, GPKG, DropSummaryPyramid, 3, 0, spatialdb, &error);
+	SPATIALDB_FUNCTION(db, GPKG, ClusterTable, 2, 0, spatialdb, &error);
+	SPATIALDB_FUNCTION(db, GPKG, ClusterTable, 3, 0, spatialdb, &error);
+	SPATIALDB_FUNCTION(db, GPKG, ClusterTable, 4, 0, spatialdb, &error);
 	SPATIALDB_FUNCTION(db, GPKG, DropSpatialIndex, 2, 0, spatialdb, &error);
 	SPATIALDB_FUNCTION(db, GPKG, DropSpatialIndex, 3, 0, spatialdb, &error);
 	SPATIALDB_FUNCTION(db, GPKG, SpatialDBType, 0, 0, spatialdb, &error);
 
+	spatial_index_query_init(db, &error);
+	point_cluster_init(db, &error);
+
 	int result;
 	if (error_count(&error) == 0) {
 		result = SQLITE_OK;
@@ -2566,105 +5789,3 @@ int sqlite3_extension_init(
 }
 #endif /* COMPILE_SQLITE_EXTENSIONS_AS_LOADABLE_MODULE */
 
-map map_make(cmp_func cmp)
-{
-  map r;
-  r.cmp=cmp;
-  r.base = 0;
-  return r;
-}
-
-void* xcalloc(size_t nmemb, size_t size, char* s){
-  void* ret = calloc(nmemb, size);
-  return ret;
-}
-
-void xfree(void* p){
-  free(p);
-}
-
-void node_insert(node** n, cmp_func cmp, void *e){
-  int c;
-  node* nn;
-  if(*n==0){
-    nn = (node*)xcalloc(1,sizeof(node), "for node");
-    nn->data = e;
-    nn->count = 1;
-    *n=nn;
-  }else{
-    c=cmp((*n)->data,e);
-    if(0==c){
-      ++((*n)->count);
-      xfree(e);
-    }else if(c>0){
-      /* put it right here */
-      node_insert(&((*n)->l), cmp, e);
-    }else{
-      node_insert(&((*n)->r), cmp, e);
-    }
-  }
-}
-
-void map_insert(map *m, void *e){
-  node_insert(&(m->base), m->cmp, e);
-}
-
-void node_iterate(node *n, map_iterator iter, void* p){
-  if(n){
-    if(n->l)
-      node_iterate(n->l, iter, p);
-    iter(n->data, n->count, p);
-    if(n->r)
-      node_iterate(n->r, iter, p);
-  }
-}
-
-void map_iterate(map *m, map_iterator iter, void* p){
-  node_iterate(m->base, iter, p);
-}
-
-void node_destroy(node *n){
-  if(0!=n){
-    xfree(n->data);
-    if(n->l)
-      node_destroy(n->l);
-    if(n->r)
-      node_destroy(n->r);
-
-    xfree(n);
-  }
-}
-
-void map_destroy(map *m){
-  node_destroy(m->base);
-}
-
-int int_cmp(const void *a, const void *b){
-  int64_t aa = *(int64_t *)(a);
-  int64_t bb = *(int64_t *)(b);
-  /* printf("cmp %d <=> %d\n",aa,bb); */
-  if(aa==bb)
-    return 0;
-  else if(aa<bb)
-    return -1;
-  else
-    return 1;
-}
-
-int double_cmp(const void *a, const void *b){
-  double aa = *(double *)(a);
-  double bb = *(double *)(b);
-  /* printf("cmp %d <=> %d\n",aa,bb); */
-  if(aa==bb)
-    return 0;
-  else if(aa<bb)
-    return -1;
-  else
-    return 1;
-}
-
-void print_elem(void *e, int64_t c, void* p){
-  int ee = *(int*)(e);
-  printf("%d => %lld\n", ee,c);
-}
-